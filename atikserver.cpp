@@ -19,19 +19,23 @@
 #include <signal.h>
 
 #include <atikccdusb.h>
-
-#ifdef __cplusplus
-extern "C"
-{
-#endif
-#include <jpeglib.h>
-#ifdef __cplusplus
-}
-#endif
-
-#ifndef SO_REUSEPORT
-#define SO_REUSEPORT 15
-#endif
+#include <histogram.h>
+#include <exposure.h>
+#include <frame_stats.h>
+#include <exposure_control.h>
+#include <frame_stack.h>
+#include <calib_fits.h>
+#include <bin_control.h>
+#include <frame_queue.h>
+#include <comic_net.h>
+#include <frame_server.h>
+#include <jpeg_image.h>
+#include <jpeg_parallel.h>
+#include <downscale.h>
+#include <raw_codec.h>
+#include <fits_writer.h>
+#include <flight_recorder.h>
+#include <sim_camera.h>
 
 #define eprintf(...) fprintf(stderr, __VA_ARGS__);
 
@@ -87,433 +91,807 @@ public:
     }
 };
 
-/**
- * @brief Class to store average and standard deviation of a data series
- * 
- */
-class statseries
-{
-public:
-    /**
-     * @brief Average of the series
-     * 
-     */
-    double avg = 0;
-    /**
-     * @brief Standard deviation (sigma) of the series
-     * 
-     */
-    double stdev = 0;
-    /**
-     * @brief Length of the series
-     * 
-     */
-    unsigned long long int n = 0;
-    /**
-     * @brief Add new point to the series
-     * 
-     * @param val Data point
-     */
-    void add(double val)
-    {
-        double avg = this->avg;
-        double stdev = this->stdev;
-        unsigned long long int n = this->n;
-        avg = (avg * n) + val;
-        stdev = (stdev * stdev * n) + val * val;
-        n += 1;
-        avg /= n;
-        stdev = sqrt(stdev / n);
-        this->avg = avg;
-        this->stdev = stdev;
-        this->n = n;
-    }
-};
-
 typedef struct
 {
     unsigned short *data;
     unsigned width;
     unsigned height;
+    unsigned x; // origin on the sensor
+    unsigned y;
+    bool subframe; // hardware readout of a region of interest
+    unsigned bin;  // sensor pixels summed along each axis of a pixel
+    net_roi roi;   // subframe: the region asked for, in sensor pixels
+    unsigned format; // payload type wanted for the subframe, NET_FORMAT_*
     float temp;
     float exposure;
     unsigned long long tstamp;
+    uint64_t t_exposure; // CLOCK_MONOTONIC ns, exposure started
+    uint64_t t_readout;  // CLOCK_MONOTONIC ns, pixels read out
+    unsigned stacked;    // frames co-added into data by the analysis stage, 1 for a live frame
+    frame_stats stats;   // computed by the analysis stage
 } comic_image;
 
-class jpeg_image
-{
-private:
-    unsigned char *data;
-    int sz;
+#ifndef FITS_QUEUE_DEPTH
+#define FITS_QUEUE_DEPTH 4 // frames waiting to be written before saves are dropped
+#endif
 
-public:
-    static int jpeg_quality;
-    void convert_jpeg_image(unsigned short *data, unsigned width, unsigned height)
-    {
-        // convert grayscale data first
-        unsigned char *gr_data = (unsigned char *)malloc(width * height);
-        this->data = (unsigned char *)malloc(1024 * 1024 * 4); // allocate 4M
-        for (unsigned long long i = 0; i < width * height; i++)
-        {
-            gr_data[i] = data[i] / 256; // convert to 8 bit grayscale
-        }
-        struct jpeg_compress_struct cinfo;
-        struct jpeg_error_mgr jerr;
-        JSAMPROW row_pointer[1]; /* line pointer */
-        int row_stride;          /* Row span (how many bytes are needed for a row in the image) */
-        cinfo.err = jpeg_std_error(&jerr);
-        jpeg_create_compress(&cinfo);
-        unsigned long img_sz = 0;
-        jpeg_mem_dest(&cinfo, &(this->data), &(img_sz));
-        cinfo.image_width = width;
-        cinfo.image_height = height;
-        cinfo.scale_denom = 1;
-        cinfo.scale_num = 1;
-        cinfo.input_components = 1;
-        cinfo.in_color_space = JCS_GRAYSCALE;
-        jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, jpeg_quality, TRUE);
-        jpeg_start_compress(&cinfo, TRUE);
-        row_stride = width; // unsigned char
-        while (cinfo.next_scanline < height)
-        {
-            row_pointer[0] = &(gr_data[cinfo.next_scanline * row_stride]);
-            (void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-        jpeg_finish_compress(&cinfo);
-        jpeg_destroy_compress(&cinfo);
-        free(gr_data);
-        this->sz = (int)img_sz;
-    }
-    int copy_image(unsigned char *buf)
-    {
-#ifdef TEST_JPEG_IMG
-        static int imgnum = 0;
-        char fname[30];
-        snprintf(fname, 30, "testimg/i%d.jpg", imgnum++);
-        unlink(fname);
-        FILE *fp = fopen(fname, "wb");
-        if (this->sz > 0)
-            fwrite(this->data, 1, this->sz, fp);
-        fclose(fp);
-#endif //TEST_JPEG_IMG
-        if (this->sz > 0)
-            memcpy(buf, this->data, this->sz);
-        free(this->data);
-        return this->sz;
-    }
-    static void set_jpeg_quality(int q)
-    {
-        if (q < 0)
-            q = 70;
-        else if (q > 100)
-            q = 100;
-        jpeg_quality = q;
-    }
-};
+#ifndef FITS_BATCH_FRAMES
+#define FITS_BATCH_FRAMES 1 // frames per file, > 1 writes cubes with a FRAMES table
+#endif
 
-int jpeg_image::jpeg_quality = 70;
+#ifndef FITS_RICE
+#define FITS_RICE 0 // Rice tile compression of saved frames
+#endif
 
-typedef struct __attribute__((packed))
-{
-    unsigned width;
-    unsigned height;
-    float temp;
-    float exposure;
-    uint64_t tstamp;
-    int size;
-} net_meta;
+fits_writer *fits_out = NULL; // background writer, created once the sensor size is known
+std::atomic<unsigned> fits_pending(0); // frames still to save, set by CMD_SAVE_FITS
 
-pthread_mutex_t net_img_lock;
+calib_library calib; // masters, loaded before the pipeline starts, used by the analysis stage only
 
-typedef struct
-{
-    net_meta *metadata;
-    pthread_mutex_t lock;
-    unsigned char *data;
-} net_image;
+bin_controller *binning = NULL; // binning of the readouts, created once the camera's maximum is known
 
-void saveFits(const char *fileName, comic_image *image)
-{
-    fitsfile *fptr;
-    int status = 0, bitpix = USHORT_IMG, naxis = 2;
-    int bzero = 32768, bscale = 1;
-    long naxes[2] = {(long)(image->width), (long)(image->height)};
-    unlink(fileName);
-    if (!fits_create_file(&fptr, fileName, &status))
-    {
-        fits_create_img(fptr, bitpix, naxis, naxes, &status);
-        fits_write_key(fptr, TSTRING, "PROGRAM", (void *)"atik_ccd_test", NULL, &status);
-        fits_write_key(fptr, TUSHORT, "BZERO", &bzero, NULL, &status);
-        fits_write_key(fptr, TUSHORT, "BSCALE", &bscale, NULL, &status);
-        fits_write_key(fptr, TFLOAT, "SENSOR TEMP", &(image->temp), NULL, &status);
-        long fpixel[] = {1, 1};
-        fits_write_pix(fptr, TUSHORT, fpixel, (image->width) * (image->height), image->data, &status);
-        fits_close_file(fptr, &status);
-        cerr << endl
-             << "saved to " << fileName << endl
-             << endl;
-    }
-}
+#ifndef RECORDER_FILE
+#define RECORDER_FILE "flight.rec" // circular file of the last raw frames
+#endif
 
-bool checkSaturation(unsigned short *img, unsigned int size)
+#ifndef RECORDER_FRAMES
+#define RECORDER_FRAMES 120 // most frames kept by the flight recorder
+#endif
+
+#ifndef RECORDER_MB
+#define RECORDER_MB 0 // size of the flight recorder file in MiB, 0 to disable it; COMIC_RECORDER_MB overrides it
+#endif
+
+flight_recorder recorder;
+std::atomic<bool> recorder_exporting(false);
+
+/**
+ * @brief Freeze the flight recorder, write its frames to FITS (runs of
+ * frames of the same size and binning go to one cube named after the
+ * first frame, XBINNING/YBINNING in its header)
+ * and resume recording
+ *
+ */
+void *recorder_export_fcn(void *arg)
 {
-    int count = size * 0.9; // 90% pixels are not saturated
-    for (unsigned int i = 0; i < size; i++)
+    recorder.freeze(); // waits for a frame being appended
+    const flight_rec_hdr **recs = new const flight_rec_hdr *[recorder.capacity()];
+    unsigned long long n = recorder.records(recs);
+    if (n > 0)
     {
-        if (img[i] == 65535) // saturated
-            count--;         // reduce counts from 90%
+        fits_writer writer(FITS_QUEUE_DEPTH, recs[0]->width * recs[0]->height, FITS_CUBE, n, FITS_RICE);
+        for (unsigned long long i = 0; i < n; i++)
+        {
+            char fname[256];
+            snprintf(fname, sizeof(fname), "flight_%llu.fit", (unsigned long long)recs[i]->seq);
+            writer.submit(fname, flight_recorder::pixels(recs[i]), recs[i]->width, recs[i]->height, recs[i]->temp, recs[i]->exposure, recs[i]->tstamp, recs[i]->bin);
+        }
+        writer.flush();
+        writer.report(stderr);
     }
-    if (count < 0) // more than 90% pixels are saturated
-        return true;
-    return false;
+    eprintf("%s: exported %llu frames\n", __func__, n);
+    delete[] recs;
+    recorder.thaw();
+    recorder_exporting = false;
+    return NULL;
 }
 
-bool checkDark(unsigned short *img, unsigned int size)
+/**
+ * @brief Queue a frame for the FITS writer thread. Never blocks: if the
+ * writer is behind, the frame is dropped and counted.
+ *
+ */
+void saveFits(const char *fileName, comic_image *image)
 {
-    int count = size * 0.3; // 30% pixels are not dark
-    for (unsigned int i = 0; i < size; i++)
+    if (fits_out == NULL)
+        return;
+    if (!fits_out->submit(fileName, image->data, image->width, image->height, image->temp, image->exposure, image->tstamp, image->bin, false))
     {
-        if (img[i] < 2000) // dark
-            count--;       // reduce counts from 30%
+        eprintf("%s: writer busy, %s not saved\n", __func__, fileName);
     }
-    if (count < 0) // more than 30% pixels are dark
-        return true;
-    return false;
 }
 
-/* Sorting */
-int compare(const void *a, const void *b)
+volatile sig_atomic_t done = 0;
+void sig_handler(int in)
 {
-    return (*((unsigned short *)a) - *((unsigned short *)b));
+    done = 1;
+    eprintf("%s: Received signal %d\n", __func__, in);
 }
+#define PORT 12395
 
-#define MAX_ALLOWED_EXPOSURE 10.0 // 10 seconds
+unsigned sensor_width = 0; // full frame size, for region requests
+unsigned sensor_height = 0;
 
-double find_optimum_exposure(unsigned short *picdata, unsigned int imgsize, double exposure)
+/* payload of a command of a fixed size, false when the length differs */
+static inline bool cmd_payload(const net_cmd_hdr *hdr, const void *payload, void *out, size_t size)
 {
-//#define SK_DEBUG
-#ifdef SK_DEBUG
-    cerr << __FUNCTION__ << " : Received exposure: " << exposure << endl;
-#endif
-    double result = exposure;
-    double val;
-    qsort(picdata, imgsize, sizeof(unsigned short), compare);
+    if (hdr->len != size)
+        return false;
+    memcpy(out, payload, size); // unaligned in the receive buffer
+    return true;
+}
 
-#ifdef MEDIAN
-    if (imgsize && 0x01)
-        val = (picdata[imgsize / 2] + picdata[imgsize / 2 + 1]) * 0.5;
-    else
-        val = picdata[imgsize / 2];
-#endif //MEDIAN
-
-#ifndef MEDIAN
-#ifndef PERCENTILE
-#define PERCENTILE 90.0
-    bool direction;
-    if (picdata[0] < picdata[imgsize - 1])
-        direction = true;
-    else
-        direction = false;
+/**
+ * @brief Apply a command from a client, binary or translated from text, on
+ * the event loop
+ *
+ * @return int NET_ACK_* status sent back to binary clients
+ */
+int cmd_apply(frame_server *server, net_client *client, const net_cmd_hdr *hdr, const void *payload)
+{
+    switch (hdr->type)
+    {
+    case NET_CMD_PING:
+        return NET_ACK_OK;
+    case NET_CMD_JPEG_QUALITY:
+    {
+        int32_t quality;
+        if (!cmd_payload(hdr, payload, &quality, sizeof(quality)) || quality < 0 || quality > 100)
+            return NET_ACK_INVALID;
+        jpeg_image::set_jpeg_quality(quality);
+        eprintf("jpeg quality: %d\n", quality);
+        return NET_ACK_OK;
+    }
+    case NET_CMD_STRETCH:
+    {
+        net_cmd_stretch cmd;
+        if (!cmd_payload(hdr, payload, &cmd, sizeof(cmd)) || cmd.mode < 0 || cmd.mode >= STRETCH_MAX || !isfinite(cmd.lo_pct) || !isfinite(cmd.hi_pct) || !isfinite(cmd.param))
+            return NET_ACK_INVALID;
+        stretch_cfg cfg = tone_map::get_stretch();
+        cfg.mode = (stretch_mode)cmd.mode;
+        cfg.lo_pct = cmd.lo_pct;
+        cfg.hi_pct = cmd.hi_pct;
+        cfg.param = cmd.param;
+        tone_map::set_stretch(cfg);
+        cfg = tone_map::get_stretch();
+        eprintf("stretch: mode %d, %.2f%% to %.2f%%, parameter %.3f\n", cfg.mode, cfg.lo_pct, cfg.hi_pct, cfg.param);
+        return NET_ACK_OK;
+    }
+    case NET_CMD_PREVIEW_WIDTH:
+    {
+        // smallest preview at least as wide as requested, 0 for full resolution
+        int32_t width;
+        if (!cmd_payload(hdr, payload, &width, sizeof(width)) || width < 0)
+            return NET_ACK_INVALID;
+        unsigned scale = server->set_client_preview_width(client, width);
+        eprintf("preview width: %d, sending 1/%u scale\n", width, net_scale_factor(scale));
+        return NET_ACK_OK;
+    }
+    case NET_CMD_SET_ROI:
+    {
+        net_roi roi;
+        if (!cmd_payload(hdr, payload, &roi, sizeof(roi)))
+            return NET_ACK_INVALID;
+        if (roi.x >= sensor_width || roi.y >= sensor_height)
+            roi.width = roi.height = 0;
+        if (roi.width > sensor_width - roi.x)
+            roi.width = sensor_width - roi.x;
+        if (roi.height > sensor_height - roi.y)
+            roi.height = sensor_height - roi.y;
+        if (!net_roi_valid(&roi))
+            memset(&roi, 0x0, sizeof(roi));
+        server->set_client_roi(client, &roi);
+        eprintf("region of interest: %u x %u at (%u, %u)\n", roi.width, roi.height, roi.x, roi.y);
+        return NET_ACK_OK;
+    }
+    case NET_CMD_SAVE_FITS:
+    {
+        uint32_t n;
+        if (!cmd_payload(hdr, payload, &n, sizeof(n)))
+            return NET_ACK_INVALID;
+        fits_pending = n;
+        eprintf("save request: %u frames\n", n);
+        return NET_ACK_OK;
+    }
+    case NET_CMD_RECORDER_EXPORT:
+    {
+        bool busy = false;
+        if (!recorder.is_open())
+        {
+            eprintf("flight recorder disabled\n");
+            return NET_ACK_UNAVAILABLE;
+        }
+        if (!recorder_exporting.compare_exchange_strong(busy, true))
+        {
+            eprintf("flight recorder export already running\n");
+            return NET_ACK_BUSY;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, recorder_export_fcn, NULL) != 0)
+        {
+            recorder_exporting = false;
+            return NET_ACK_UNAVAILABLE;
+        }
+        pthread_detach(thread);
+        eprintf("exporting flight recorder\n");
+        return NET_ACK_OK;
+    }
+    case NET_CMD_SET_FORMAT:
+    {
+        uint32_t format;
+        if (!cmd_payload(hdr, payload, &format, sizeof(format)) || format >= NET_NUM_FORMATS)
+            return NET_ACK_INVALID;
+        server->set_client_format(client, format);
+        eprintf("payload format: %s\n", format == NET_FORMAT_RAW16 ? "raw 16 bit" : "JPEG");
+        return NET_ACK_OK;
+    }
+    case NET_CMD_STACK:
+    {
+        net_cmd_stack cmd;
+        if (!cmd_payload(hdr, payload, &cmd, sizeof(cmd)) || cmd.mode < 0 || cmd.mode >= STACK_MAX || !isfinite(cmd.clip_sigma))
+            return NET_ACK_INVALID;
+        // the window is kept in memory, at full frame size
+        if (cmd.mode == STACK_SLIDING && cmd.window > frame_stack::max_window((size_t)sensor_width * sensor_height))
+            return NET_ACK_INVALID;
+        stack_cfg cfg = frame_stack::get_config();
+        cfg.mode = (stack_mode)cmd.mode;
+        cfg.window = cmd.window;
+        cfg.clip_sigma = cmd.clip_sigma;
+        frame_stack::set_config(cfg);
+        cfg = frame_stack::get_config();
+        eprintf("stacking: mode %d, window %u, clip %.1f sigma\n", cfg.mode, cfg.window, cfg.clip_sigma);
+        return NET_ACK_OK;
+    }
+    case NET_CMD_CALIB:
+    {
+        int32_t mode;
+        if (!cmd_payload(hdr, payload, &mode, sizeof(mode)) || mode < CALIB_OFF || mode >= CALIB_NUM_MODES)
+            return NET_ACK_INVALID;
+        calib_library::set_mode((calib_mode)mode);
+        eprintf("calibration: mode %d\n", calib_library::get_mode());
+        return NET_ACK_OK;
+    }
+    case NET_CMD_BIN:
+    {
+        net_cmd_bin cmd;
+        if (!cmd_payload(hdr, payload, &cmd, sizeof(cmd)) || !isfinite(cmd.value) || binning == NULL || !binning->set(cmd.mode, cmd.value))
+            return NET_ACK_INVALID;
+        eprintf("binning: %s %g\n", bin_mode_names[cmd.mode], cmd.value);
+        return NET_ACK_OK;
+    }
+    default:
+        return NET_ACK_UNKNOWN;
+    }
+}
 
-    unsigned int coord = floor((PERCENTILE * (imgsize - 1) / 100.0));
-    if (direction)
-        val = picdata[coord];
+/* apply a text command through cmd_apply, text commands are not acknowledged */
+static inline void cmd_apply_text(frame_server *server, net_client *client, uint16_t type, const void *payload, uint32_t len)
+{
+    net_cmd_hdr hdr;
+    memset(&hdr, 0x0, sizeof(hdr));
+    hdr.type = type;
+    hdr.len = len;
+    int status = cmd_apply(server, client, &hdr, payload);
+    if (status != NET_ACK_OK)
+    {
+        eprintf("command %u failed: %d\n", type, status);
+    }
+}
+
+/**
+ * @brief Old text commands from clients that do not send binary ones,
+ * translated into their binary payload
+ *
+ */
+void cmd_rcv_fcn(frame_server *server, net_client *client, char *buffer, ssize_t sz)
+{
+    eprintf("Received command: %s, ", buffer);
+    if (strstr(buffer, "CMD_JPEG_SET_QUALITY") != NULL)
+    {
+        int32_t tmp = strtol(&buffer[20], NULL, 10);
+        if (tmp > 100)
+            tmp = 100;
+        else if (tmp < 0)
+            tmp = 70;
+        cmd_apply_text(server, client, NET_CMD_JPEG_QUALITY, &tmp, sizeof(tmp));
+    }
+    else if (strstr(buffer, "CMD_STRETCH_SET") != NULL)
+    {
+        // CMD_STRETCH_SET<mode> [lo percentile] [hi percentile] [gamma or asinh softening]
+        stretch_cfg cfg = tone_map::get_stretch();
+        char *ptr = strstr(buffer, "CMD_STRETCH_SET") + 15, *end;
+        int32_t mode = strtol(ptr, &end, 10);
+        float *params[] = {&cfg.lo_pct, &cfg.hi_pct, &cfg.param};
+        for (int i = 0; i < 3 && end != ptr; i++)
+        {
+            ptr = end;
+            float val = strtof(ptr, &end);
+            if (end != ptr)
+                *(params[i]) = val;
+        }
+        net_cmd_stretch cmd = {mode, cfg.lo_pct, cfg.hi_pct, cfg.param};
+        cmd_apply_text(server, client, NET_CMD_STRETCH, &cmd, sizeof(cmd));
+    }
+    else if (strstr(buffer, "CMD_PREVIEW_WIDTH") != NULL)
+    {
+        int32_t tmp = strtol(strstr(buffer, "CMD_PREVIEW_WIDTH") + 17, NULL, 10);
+        tmp = tmp < 0 ? 0 : tmp;
+        cmd_apply_text(server, client, NET_CMD_PREVIEW_WIDTH, &tmp, sizeof(tmp));
+    }
+    else if (strstr(buffer, "CMD_SET_ROI") != NULL)
+    {
+        // CMD_SET_ROI<x> <y> <width> <height>, no size (or 0) for the whole frame
+        net_roi roi = {0, 0, 0, 0};
+        sscanf(strstr(buffer, "CMD_SET_ROI") + 11, "%u %u %u %u", &roi.x, &roi.y, &roi.width, &roi.height);
+        cmd_apply_text(server, client, NET_CMD_SET_ROI, &roi, sizeof(roi));
+    }
+    else if (strstr(buffer, "CMD_SAVE_FITS") != NULL)
+    {
+        // CMD_SAVE_FITS<n>: save the next n frames
+        uint32_t n = strtoul(strstr(buffer, "CMD_SAVE_FITS") + 13, NULL, 10);
+        cmd_apply_text(server, client, NET_CMD_SAVE_FITS, &n, sizeof(n));
+    }
+    else if (strstr(buffer, "CMD_RECORDER_EXPORT") != NULL)
+        cmd_apply_text(server, client, NET_CMD_RECORDER_EXPORT, NULL, 0);
+    else if (strstr(buffer, "CMD_SET_FORMAT") != NULL)
+    {
+        // CMD_SET_FORMAT<n>: 0 JPEG, 1 lossless 16 bit
+        uint32_t format = strtoul(strstr(buffer, "CMD_SET_FORMAT") + 14, NULL, 10);
+        if (format >= NET_NUM_FORMATS)
+            format = NET_FORMAT_JPEG;
+        cmd_apply_text(server, client, NET_CMD_SET_FORMAT, &format, sizeof(format));
+    }
+    else if (strstr(buffer, "CMD_STACK") != NULL)
+    {
+        // CMD_STACK<mode> [window] [clip sigma]: 0 off, 1 sliding window, 2 cumulative
+        stack_cfg cfg = frame_stack::get_config();
+        net_cmd_stack cmd = {0, cfg.window, cfg.clip_sigma};
+        char *ptr = strstr(buffer, "CMD_STACK") + 9, *end;
+        cmd.mode = strtol(ptr, &end, 10);
+        if (end != ptr)
+        {
+            ptr = end;
+            unsigned window = strtoul(ptr, &end, 10);
+            if (end != ptr)
+                cmd.window = window;
+        }
+        if (end != ptr)
+        {
+            ptr = end;
+            float sigma = strtof(ptr, &end);
+            if (end != ptr)
+                cmd.clip_sigma = sigma;
+        }
+        cmd_apply_text(server, client, NET_CMD_STACK, &cmd, sizeof(cmd));
+    }
+    else if (strstr(buffer, "CMD_CALIB") != NULL)
+    {
+        // CMD_CALIB<mode>: 0 off, 1 nearest dark, 2 interpolated dark
+        int32_t mode = strtol(strstr(buffer, "CMD_CALIB") + 9, NULL, 10);
+        cmd_apply_text(server, client, NET_CMD_CALIB, &mode, sizeof(mode));
+    }
+    else if (strstr(buffer, "CMD_BIN") != NULL)
+    {
+        // CMD_BIN<mode> <value>: 0 fixed binning, 1 target frames per second, 2 maximum latency (ms)
+        char *ptr = strstr(buffer, "CMD_BIN") + 7, *end;
+        net_cmd_bin cmd;
+        cmd.mode = strtol(ptr, &end, 10);
+        cmd.value = strtod(end, NULL);
+        cmd_apply_text(server, client, NET_CMD_BIN, &cmd, sizeof(cmd));
+    }
     else
     {
-        if (coord == 0)
-            coord = 1;
-        val = picdata[imgsize - coord];
+        eprintf("unknown\n");
     }
+}
 
-#ifdef SK_DEBUG
-    cerr << "Info: " << __FUNCTION__ << "Direction: " << direction << ", Coordinate: " << coord << endl;
-    cerr << "Info: " << __FUNCTION__ << "10 values around the coordinate: " << endl;
-    unsigned int lim2 = imgsize - coord > 3 ? coord + 4 : imgsize - 1;
-    unsigned int lim1 = lim2 - 10;
-    for (int i = lim1; i < lim2; i++)
-        cerr << picdata[i] << " ";
-    cerr << endl;
-#endif
+void *cmd_fcn(void *server)
+{
+    ((frame_server *)server)->run();
+    return NULL;
+}
 
-#endif //PERCENTILE
-#endif //MEDIAN
-#ifdef SK_DEBUG
-    cerr << "In " << __FUNCTION__ << ": Median: " << val << endl;
-#endif
-#ifndef PIX_MEDIAN
-#define PIX_MEDIAN 40000.0
+#ifndef PIPE_DEPTH
+#define PIPE_DEPTH 2 // frames that can wait between two pipeline stages
 #endif
 
-#ifndef PIX_GIVE
-#define PIX_GIVE 5000.0
+#ifndef JPEG_THREADS
+#define JPEG_THREADS 0 // threads encoding strips of a frame, 0: one per online CPU
 #endif
 
-    if (val > PIX_MEDIAN - PIX_GIVE && val < PIX_MEDIAN + PIX_GIVE /* && PIX_MEDIAN - PIX_GIVE > 0 && PIX_MEDIAN + PIX_GIVE < 65535 */)
-        return result;
-
-    /** If calculated median pixel is within PIX_MEDIAN +/- PIX_GIVE, return current exposure **/
-
-    result = ((double)PIX_MEDIAN) * exposure / ((double)val);
-
-#ifdef SK_DEBUG
-    cerr << __FUNCTION__ << " : Determined exposure from median " << val << ": " << result << endl;
+#ifndef PIPE_REPORT_INTERVAL
+#define PIPE_REPORT_INTERVAL 5 // seconds between pipeline statistics reports
 #endif
 
-    if (result > MAX_ALLOWED_EXPOSURE)
-        result = MAX_ALLOWED_EXPOSURE;
-    // round to 1 ms
-    result = ((int)(result * 1000))/1000.0; 
-    return result;
-    //#undef SK_DEBUG
-}
-
-volatile sig_atomic_t done = 0;
-void sig_handler(int in)
+/**
+ * @brief Acquisition pipeline: capture (main thread) -> analysis and exposure
+ * control -> JPEG encoding. Frames move between the stages as pointers to
+ * preallocated slots over single-producer/single-consumer queues. No stage
+ * ever waits on the next one: if a queue is full the frame is dropped and
+ * counted, so the next readout starts as soon as getImage returns.
+ *
+ */
+class acq_pipeline
 {
-    done = 1;
-    eprintf("%s: Received signal %d\n", __func__, in);
-}
-#define PORT 12395
+public:
+    /**
+     * @brief Frame slots: one held by each stage plus a full queue between
+     * each pair, so capture always finds a free slot
+     *
+     */
+    static const unsigned nslots = 2 * PIPE_DEPTH + 3;
+    comic_image slots[nslots];
+    spsc_queue<comic_image *> analysis_q; // capture -> analysis
+    spsc_queue<comic_image *> encode_q;   // analysis -> encode
+    spsc_queue<comic_image *> free_ana_q; // analysis -> capture, frames dropped at encode_q
+    spsc_queue<comic_image *> free_enc_q; // encode -> capture
+    stage_stats capture;
+    stage_stats analysis;
+    stage_stats encode;
+    /**
+     * @brief Downscale + encode work and output bytes at each preview scale
+     * and for the raw frame, the last entry is for regions of interest
+     *
+     */
+    stage_stats encode_scale[NET_NUM_STREAMS + 1];
+    std::atomic<unsigned long long> encode_bytes[NET_NUM_STREAMS + 1];
+    unsigned max_pixels;
+    /**
+     * @brief Exposure of the next frame, updated by the analysis stage
+     *
+     */
+    std::atomic<double> exposure;
+    double min_exposure;
+    /**
+     * @brief Auto-exposure controller (analysis only), and the readout
+     * overhead it is told about, averaged over the last frames
+     *
+     */
+    exposure_controller *exposure_ctl;
+    double readout;
+    /**
+     * @brief Live stack (analysis only), and the cost of adding a frame to
+     * it and writing out its mean
+     *
+     */
+    frame_stack stack;
+    stage_stats stacking;
+    /**
+     * @brief Cost of the dark and flat correction
+     *
+     */
+    stage_stats calibration;
+    frame_pool *pool;
+    frame_server *server;
 
-void *cmd_rcv_fcn(void *sock)
-{
-    char buffer[1024] = {0};
-    while (!done)
+    acq_pipeline(unsigned max_pixels, frame_pool *pool, frame_server *server, double exposure, double min_exposure) : analysis_q(PIPE_DEPTH), encode_q(PIPE_DEPTH), free_ana_q(nslots), free_enc_q(nslots)
     {
-        if (*(int *)sock > 0)
+        for (unsigned i = 0; i < nslots; i++)
         {
-            int sz = recv(*(int *)sock, buffer, sizeof(buffer), MSG_NOSIGNAL);
-            if (sz > 0)
-            {
-                eprintf("Received command: %s, ", buffer);
-                if (strstr(buffer, "CMD_JPEG_SET_QUALITY") != NULL)
-                {
-                    int tmp = strtol(&buffer[20], NULL, 10);
-                    if (tmp > 100)
-                        tmp = 100;
-                    else if (tmp < 0)
-                        tmp = 70;
-                    eprintf("decoded jpeg quality: %d\n", tmp);
-                    jpeg_image::set_jpeg_quality(tmp);
-                }
-            }
-            memset(buffer, 0x0, 1024);
+            memset(&slots[i], 0x0, sizeof(comic_image));
+            slots[i].data = new unsigned short[max_pixels];
+            free_enc_q.push(&slots[i]); // threads are not running yet
+        }
+        for (unsigned i = 0; i <= NET_NUM_STREAMS; i++)
+            encode_bytes[i] = 0;
+        this->max_pixels = max_pixels;
+        this->pool = pool;
+        this->server = server;
+        this->exposure = exposure;
+        this->min_exposure = min_exposure;
+        exposure_cfg cfg = exposure_cfg_default();
+        cfg.min_exposure = min_exposure;
+        const char *ctl = getenv("COMIC_EXPOSURE_CONTROL");
+        exposure_ctl = exposure_controller_create(ctl != NULL ? ctl : EXPOSURE_CONTROLLER, cfg);
+        if (exposure_ctl == NULL)
+        {
+            eprintf("acq_pipeline: Unknown exposure controller %s, using %s\n", ctl, EXPOSURE_CONTROLLER);
+            exposure_ctl = exposure_controller_create(EXPOSURE_CONTROLLER, cfg);
         }
-        usleep(1000000 / 60); // receive a command at 60 Hz
+        readout = 0;
+        last.now();
     }
-    return NULL;
-}
-
-void *cmd_fcn(void *img)
-{
-    int server_fd, new_socket = -1, valread;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
-
-    net_image *jpg = (net_image *)img;
-    // Creating socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    ~acq_pipeline()
     {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+        for (unsigned i = 0; i < nslots; i++)
+            delete[] slots[i].data;
+        delete exposure_ctl;
     }
-
-    // Forcefully attaching socket to the port 8080
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR,
-                   &opt, sizeof(opt)))
+    /**
+     * @brief Get an empty slot to read the next frame into (capture only)
+     *
+     * @return comic_image* Free frame slot
+     */
+    comic_image *get_free_slot()
     {
-        perror("setsockopt");
-        printf("%s: %d\n", __func__, __LINE__);
-        fflush(stdout);
-        exit(EXIT_FAILURE);
+        comic_image *frame = NULL;
+        while (!free_ana_q.pop(frame) && !free_enc_q.pop_wait(frame, 100000))
+            ;
+        return frame;
     }
-
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT,
-                   &opt, sizeof(opt)))
+    /**
+     * @brief Print per-stage rate, load, queue occupancy and drops, at most
+     * once every PIPE_REPORT_INTERVAL seconds (capture only)
+     *
+     */
+    void report()
     {
-        perror("setsockopt");
-        printf("%s: %d\n", __func__, __LINE__);
-        fflush(stdout);
-        exit(EXIT_FAILURE);
+        systime now;
+        double dt = (now.usec() - last.usec()) * 1e-6;
+        if (dt < PIPE_REPORT_INTERVAL)
+            return;
+        unsigned long long frames[3] = {capture.frames, analysis.frames, encode.frames};
+        unsigned long long busy[3] = {capture.busy_us, analysis.busy_us, encode.busy_us};
+        double fps[3], load[3];
+        for (int i = 0; i < 3; i++)
+        {
+            fps[i] = (frames[i] - last_frames[i]) / dt;
+            load[i] = (busy[i] - last_busy[i]) * 1e-4 / dt;
+            last_frames[i] = frames[i];
+            last_busy[i] = busy[i];
+        }
+        last = now;
+        eprintf("pipeline: capture %.2f fps (busy %.0f%%) | analysis %.2f fps (busy %.0f%%), queue %.2f/%u (max %u), dropped %llu | encode %.2f fps (busy %.0f%%), queue %.2f/%u (max %u), dropped %llu\n",
+                fps[0], load[0],
+                fps[1], load[1], analysis_q.avg_depth(), analysis_q.capacity(), analysis_q.depth_max.load(), analysis_q.dropped.load(),
+                fps[2], load[2], encode_q.avg_depth(), encode_q.capacity(), encode_q.depth_max.load(), encode_q.dropped.load());
+        for (unsigned i = 0; i <= NET_NUM_STREAMS; i++)
+        {
+            unsigned long long n = encode_scale[i].frames;
+            if (n == 0)
+                continue;
+            if (i < NET_NUM_SCALES)
+            {
+                eprintf("pipeline: scale 1/%u: %llu frames, encode %.2f ms/frame, %.1f kB/frame\n", net_scale_factor(i), n, encode_scale[i].busy_us * 1e-3 / n, encode_bytes[i] * 1e-3 / n);
+            }
+            else if (i == NET_STREAM_RAW)
+            {
+                eprintf("pipeline: raw: %llu frames, encode %.2f ms/frame, %.1f kB/frame (%.2f bits/pixel)\n", n, encode_scale[i].busy_us * 1e-3 / n, encode_bytes[i] * 1e-3 / n, encode_bytes[i] * 8.0 / ((double)n * max_pixels));
+            }
+            else
+            {
+                eprintf("pipeline: regions of interest: %llu frames, encode %.2f ms/frame, %.1f kB/frame\n", n, encode_scale[i].busy_us * 1e-3 / n, encode_bytes[i] * 1e-3 / n);
+            }
+        }
+        server->report(stderr);
+        if (fits_out != NULL && fits_out->submitted > 0)
+            fits_out->report(stderr);
+        if (recorder.is_open())
+            recorder.report(stderr);
+        if (stacking.frames > 0)
+        {
+            eprintf("stack: %u frames, %llu added, %llu skipped, %llu restarts, %llu pixels clipped, %.2f ms/frame\n",
+                    stack.frames(), stack.added.load(), stack.skipped.load(), stack.restarts.load(), stack.clipped.load(), stacking.busy_us * 1e-3 / stacking.frames);
+        }
+        if (calibration.frames > 0)
+        {
+            eprintf("calib: %llu frames corrected, %.2f ms/frame\n", calibration.frames.load(), calibration.busy_us * 1e-3 / calibration.frames);
+        }
+        binning->report(stderr);
     }
-    int flags = fcntl(server_fd, F_GETFL, 0);
-    assert(flags != -1);
-    fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+private:
+    systime last;
+    unsigned long long last_frames[3] = {0, 0, 0};
+    unsigned long long last_busy[3] = {0, 0, 0};
+};
+
+/**
+ * @brief Dark and flat correction of the data of a frame, in place
+ *
+ * @return false No master for the frame, left as it is
+ */
+bool calibrate(acq_pipeline *pipe, comic_image *frame)
+{
+    if (calib.size() == 0)
+        return false;
+    systime tstart;
+    bool ok = calib.prepare(frame->bin, frame->exposure, frame->temp) && calib.apply(frame->data, frame->width, frame->height, frame->x / frame->bin, frame->y / frame->bin);
+    systime tend;
+    if (ok)
+        pipe->calibration.add(tend.usec() - tstart.usec());
+    return ok;
+}
 
-    // Forcefully attaching socket to the port 8080
-    if (bind(server_fd, (struct sockaddr *)&address,
-             sizeof(address)) < 0)
-    {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
-    }
-    if (listen(server_fd, 3) < 0)
+void *analysis_fcn(void *_pipe)
+{
+    acq_pipeline *pipe = (acq_pipeline *)_pipe;
+    comic_image *frame;
+    unsigned last_bin = 1;
+    while (!done)
     {
-        perror("listen");
-        exit(EXIT_FAILURE);
+        if (!pipe->analysis_q.pop_wait(frame, 100000))
+            continue;
+        systime tstart;
+        if (frame->bin != last_bin) // the levels jump by the change of pixel area, not a trend
+            pipe->exposure_ctl->reset();
+        last_bin = frame->bin;
+        // saved and stacked raw, like the recorder, and corrected after that
+        unsigned pending = fits_pending;
+        if (pending > 0 && fits_pending.compare_exchange_strong(pending, pending - 1))
+        {
+            char fname[256];
+            snprintf(fname, sizeof(fname), "comic_%llu.fit", frame->tstamp);
+            saveFits(fname, frame); // copied, written on the writer thread
+        }
+        bool stacking = !frame->subframe && pipe->stack.update(), stacked = false;
+        uint64_t stack_us = 0;
+        if (stacking)
+        {
+            systime tstack;
+            stacked = pipe->stack.add(frame->data, frame->width, frame->height, frame->exposure);
+            systime tend;
+            stack_us = tend.usec() - tstack.usec();
+        }
+        bool calibrated = calibrate(pipe, frame);
+        frame_stats_compute(frame->data, (size_t)frame->width * frame->height, &frame->stats); // one pass, reused by the encoder
+        double readout = (frame->t_readout - frame->t_exposure) * 1e-9 - frame->exposure;
+        if (readout > 0)
+        {
+            pipe->readout = pipe->readout > 0 ? 0.9 * pipe->readout + 0.1 * readout : readout;
+            pipe->exposure_ctl->set_readout(pipe->readout);
+        }
+        pipe->exposure_ctl->set_offset(calibrated ? CALIB_PEDESTAL : EXPOSURE_OFFSET);
+        // as its 1x1 equivalent: capture divides it by the area of the binning it reads at
+        pipe->exposure = pipe->exposure_ctl->next(&frame->stats, frame->exposure, frame->t_exposure * 1e-9) * frame->bin * frame->bin;
+        frame->stacked = 1;
+        if (stacked)
+        {
+            systime tmean;
+            // published instead of the live frame (the mean of raw frames of one exposure,
+            // corrected as one of them), stretched on its own statistics
+            pipe->stack.mean(frame->data);
+            frame->stacked = pipe->stack.frames();
+            systime tend;
+            stack_us += tend.usec() - tmean.usec();
+            if (calibrated)
+                calibrate(pipe, frame);
+            frame_stats_compute(frame->data, (size_t)frame->width * frame->height, &frame->stats);
+        }
+        if (stacking)
+            pipe->stacking.add(stack_us);
+        systime tend;
+        pipe->analysis.add(tend.usec() - tstart.usec());
+        if (!frame->subframe)
+            binning->add_analysis(frame->bin, (tend.usec() - tstart.usec()) * 1e-6);
+        if (!pipe->encode_q.push(frame)) // encoder busy, skip this frame
+            pipe->free_ana_q.push(frame);
     }
+    return NULL;
+}
 
-    int counter = 0;
-
-    pthread_t rcv_thread;
-
-    int rc = pthread_create(&rcv_thread, NULL, cmd_rcv_fcn, (void *)&new_socket);
-    if (rc < 0)
+/**
+ * @brief Encode one image of a frame (a scale or a region) into a pooled
+ * frame, as JPEG or lossless 16 bit data
+ *
+ * @param st Statistics to stretch the image with, NULL to measure them (crops)
+ * @return encoded_frame* Encoded frame, NULL if out of memory
+ */
+encoded_frame *encode_image(jpeg_parallel *jpeg, raw16_codec *raw, frame_pool *pool, comic_image *frame, const unsigned short *data, unsigned width, unsigned height, const net_roi *roi, unsigned format, const frame_stats *st)
+{
+    encoded_frame *out = pool->get();
+    if (out == NULL)
+        return NULL;
+    int sz;
+    if (format == NET_FORMAT_RAW16)
+        sz = raw->encode(data, width, height, &(out->data), &(out->alloc));
+    else
+        sz = jpeg->encode(data, width, height, &(out->data), &(out->alloc), st);
+    if (sz < 0)
     {
-        eprintf("Could not create receive thread, exiting...\b");
-        close(new_socket);
-        return 0;
+        out->release();
+        return NULL;
     }
+    net_meta *meta = out->meta();
+    meta->temp = frame->temp;
+    meta->tstamp = frame->tstamp;
+    meta->height = height;
+    meta->width = width;
+    meta->x = roi != NULL ? roi->x : 0;
+    meta->y = roi != NULL ? roi->y : 0;
+    if (roi != NULL)
+        out->roi = *roi;
+    else
+        memset(&out->roi, 0x0, sizeof(out->roi)); // the frame may be recycled
+    meta->exposure = frame->exposure;
+    meta->format = format;
+    meta->clock_offset = net_clock_offset();
+    memset(&meta->stamps, 0x0, sizeof(net_stamps)); // the frame may be recycled
+    meta->stamps.exposure = frame->t_exposure;
+    meta->stamps.readout = frame->t_readout;
+    meta->stamps.encode = net_clock_ns(CLOCK_MONOTONIC);
+    meta->pix_min = frame->stats.min;
+    meta->pix_max = frame->stats.max;
+    meta->pix_mean = frame->stats.mean;
+    meta->pix_stdev = frame_stats_stdev(&frame->stats);
+    meta->pix_saturated = frame->stats.saturated;
+    meta->stacked = frame->stacked;
+    meta->bin = frame->bin;
+    out->set_size(sz);
+    return out;
+}
 
+void *encode_fcn(void *_pipe)
+{
+    acq_pipeline *pipe = (acq_pipeline *)_pipe;
+    comic_image *frame;
+    jpeg_parallel jpeg(JPEG_THREADS); // compressors, workers and scratch rows live as long as the thread
+    raw16_codec raw;
+    unsigned short *small = new unsigned short[pipe->max_pixels / 4]; // downscaled preview
+    unsigned short *crop = new unsigned short[pipe->max_pixels];      // region of interest
     while (!done)
     {
-        pthread_mutex_lock(&net_img_lock);
-        // cout << "Img: " << jpg->metadata->size << " bytes, metadata: " << sizeof(net_meta) << " bytes" << endl;
-        int sz = 0;
-        int32_t out_sz = jpg->metadata->size + sizeof(net_meta) + 18; // total size = size of metadata + size of image + FBEGIN + FEND
-        unsigned char *buf = (unsigned char *)malloc(out_sz);         // image size + image data area
-        memcpy(buf, "SIZE", 4);
-        memcpy(buf + 4, &out_sz, 4);
-        memcpy(buf + 8, "FBEGIN", 6);                                         // copy FBEGIN
-        memcpy(buf + 14, jpg->metadata, sizeof(net_meta));                    // copy metadata
-        memcpy(buf + 14 + sizeof(net_meta), jpg->data, jpg->metadata->size);  // copy jpeg data
-        memcpy(buf + 14 + sizeof(net_meta) + jpg->metadata->size, "FEND", 4); // copy FEND
-        pthread_mutex_unlock(&net_img_lock);
-        if (jpg->metadata->size > 0)
+        if (!pipe->encode_q.pop_wait(frame, 100000))
+            continue;
+        systime tstart;
+        encoded_frame *out[NET_NUM_STREAMS];
+        encoded_frame *roi_out[NET_MAX_ROIS];
+        unsigned nroi = 0;
+        bool any = false;
+        if (frame->subframe) // the readout is the one region everybody watches
         {
-            sz = send(new_socket, buf, out_sz, MSG_NOSIGNAL);
-            if (sz > 0)
-                cout << "Sent: " << sz << " bytes of " << out_sz << " bytes, image: " << jpg->metadata->size << " bytes" << endl;
+            systime troi;
+            roi_out[0] = encode_image(&jpeg, &raw, pipe->pool, frame, frame->data, frame->width, frame->height, &frame->roi, frame->format, &frame->stats);
+            nroi = roi_out[0] != NULL;
+            any = nroi > 0;
+            if (any)
+            {
+                systime tend;
+                pipe->encode_scale[NET_NUM_STREAMS].add(tend.usec() - troi.usec());
+                pipe->encode_bytes[NET_NUM_STREAMS] += roi_out[0]->wire_size();
+            }
         }
         else
-            sz = -1;
-        // eprintf("%s: Sent %d bytes: %s", __func__, sz, hello);
-        if (sz < 0 && !done)
         {
-            if ((new_socket = accept(server_fd, (struct sockaddr *)&address,
-                                     (socklen_t *)&addrlen)) < 0)
+            // encode every scale and region a client asked for, once, and publish them together
+            unsigned wanted = pipe->server->wanted_scales();
+            for (unsigned i = 0; i < NET_NUM_STREAMS; i++)
             {
-#ifdef SERVER_DEBUG
-                perror("accept");
-#else
-                sz = -1;
-#endif
+                out[i] = NULL;
+                if (!(wanted & (1u << i)))
+                    continue;
+                systime tscale;
+                unsigned factor = i == NET_STREAM_RAW ? 1 : net_scale_factor(i);
+                const unsigned short *data = frame->data;
+                if (factor > 1)
+                {
+                    downscale(frame->data, frame->width, frame->height, factor, small);
+                    data = small;
+                }
+                out[i] = encode_image(&jpeg, &raw, pipe->pool, frame, data, frame->width / factor, frame->height / factor, NULL, i == NET_STREAM_RAW ? NET_FORMAT_RAW16 : NET_FORMAT_JPEG, &frame->stats);
+                if (out[i] == NULL) // out of memory, skip this scale
+                    continue;
+                any = true;
+                systime tend;
+                pipe->encode_scale[i].add(tend.usec() - tscale.usec());
+                pipe->encode_bytes[i] += out[i]->wire_size();
+            }
+            net_roi rois[NET_MAX_ROIS];
+            unsigned formats[NET_MAX_ROIS];
+            unsigned n = pipe->server->wanted_rois(rois, formats);
+            for (unsigned i = 0; i < n; i++)
+            {
+                net_roi *roi = &rois[i];
+                unsigned bin = frame->bin; // regions are in sensor pixels
+                if (roi->x + roi->width > frame->x + frame->width * bin || roi->y + roi->height > frame->y + frame->height * bin || roi->x < frame->x || roi->y < frame->y)
+                    continue;
+                unsigned width = roi->width / bin, height = roi->height / bin;
+                if (width == 0 || height == 0)
+                    continue;
+                systime troi;
+                const unsigned short *src = frame->data + (size_t)((roi->y - frame->y) / bin) * frame->width + (roi->x - frame->x) / bin;
+                for (unsigned row = 0; row < height; row++)
+                    memcpy(crop + (size_t)row * width, src + (size_t)row * frame->width, width * sizeof(unsigned short));
+                roi_out[nroi] = encode_image(&jpeg, &raw, pipe->pool, frame, crop, width, height, roi, formats[i], NULL);
+                if (roi_out[nroi] == NULL)
+                    continue;
+                systime tend;
+                pipe->encode_scale[NET_NUM_STREAMS].add(tend.usec() - troi.usec());
+                pipe->encode_bytes[NET_NUM_STREAMS] += roi_out[nroi]->wire_size();
+                nroi++;
+                any = true;
             }
         }
-        free(buf);
-        usleep(1000000 / 2); // 30 Hz
+        if (any)
+            pipe->server->publish(frame->subframe ? NULL : out, roi_out, nroi);
+        systime tend;
+        pipe->encode.add(tend.usec() - tstart.usec());
+        if (!frame->subframe)
+            binning->add_encode(frame->bin, (tend.usec() - tstart.usec()) * 1e-6);
+        pipe->free_enc_q.push(frame);
     }
-
-    pthread_join(rcv_thread, NULL);
-
-    close(new_socket);
-
+    delete[] small;
+    delete[] crop;
     return NULL;
 }
 
@@ -521,7 +899,7 @@ int main(int argc, char *argv[])
 {
     signal(SIGINT, sig_handler);
     static AtikCamera *devices[1];
-    int count = AtikCamera::list(devices, 1);
+    int count = camera_list(devices, 1); // COMIC_CAMERA selects a simulated camera, see sim_camera.h
     AtikCamera *device = devices[0];
     cout << "open " << device->getName() << endl;
 
@@ -566,111 +944,168 @@ int main(int argc, char *argv[])
 
     cout << "Max Pixel Bin: " << maxPixBin << endl;
 
-    maxPixBin = 4;
+    binning = new bin_controller(maxPixBin);
+
+    frame_pool *pool = new frame_pool(1024 * 1024 * 4); // 4 MiB frames
+    sensor_width = pixelCX;
+    sensor_height = pixelCY;
+    frame_server *server = new frame_server();
+    server->cmd_fcn = cmd_rcv_fcn;
+    server->bin_cmd_fcn = cmd_apply;
+    if (!server->open(PORT))
+        exit(EXIT_FAILURE);
 
-    unsigned short tmp[pixelCX * pixelCY];
+    fits_out = new fits_writer(FITS_QUEUE_DEPTH, pixelCX * pixelCY, FITS_BATCH_FRAMES > 1 ? FITS_CUBE : FITS_SINGLE, FITS_BATCH_FRAMES, FITS_RICE);
+    {
+        const char *env = getenv("COMIC_RECORDER_MB");
+        unsigned long long mb = env != NULL ? strtoull(env, NULL, 10) : RECORDER_MB;
+        uint64_t nframes = flight_recorder::slots_for(mb << 20, pixelCX * pixelCY);
+        nframes = nframes > RECORDER_FRAMES ? RECORDER_FRAMES : nframes;
+        if (mb > 0 && nframes == 0)
+        {
+            eprintf("main: %llu MiB do not hold a frame, flight recorder disabled\n", mb);
+        }
+        else if (nframes > 0 && !recorder.open(RECORDER_FILE, nframes, pixelCX * pixelCY))
+        {
+            eprintf("main: Could not open flight recorder %s, recording disabled\n", RECORDER_FILE);
+        }
+        else if (nframes > 0)
+        {
+            eprintf("main: Flight recorder %s keeps the last %llu frames\n", RECORDER_FILE, (unsigned long long)nframes);
+        }
+    }
+    if (calib_load(&calib) > 0)
+        calib.report(stderr);
+    else
+    {
+        eprintf("main: No calibration masters, frames are not corrected\n");
+    }
+    acq_pipeline *pipe = new acq_pipeline(pixelCX * pixelCY, pool, server, exposure, minShortExp);
+    cout << "Exposure control: " << pipe->exposure_ctl->name() << endl;
+    comic_image *frame = pipe->get_free_slot();
 
     success = device->readCCD(0, 0, pixelCX, pixelCY, 1, 1, 0.001);
 
     int rc = 0;
 
-    net_image *ext_img = (net_image *)malloc(sizeof(net_image));
-    ext_img->data = (unsigned char *)malloc(1024 * 1024 * 4); // 4 MiB
-
     systime tnow;
-    if (ext_img == NULL)
+    if (success)
+        success = device->getImage(frame->data, pixelCX * pixelCY);
+    else
     {
-        eprintf("main: Error malloc: ");
-        perror("ext_img");
+        cout << "Could not get first exposure" << endl;
         goto end;
     }
-    ext_img->metadata = (net_meta *)malloc(sizeof(net_meta));
-    if (ext_img->metadata == NULL)
+
+    pthread_t cmd_thread, analysis_thread, encode_thread;
+    rc = pthread_create(&cmd_thread, NULL, &cmd_fcn, (void *)server);
+    if (rc != 0)
     {
-        eprintf("main: Error malloc: ");
-        perror("ext_img->metadata");
+        eprintf("main: Failed to create comm thread, exiting...");
         goto end;
     }
-    memset(ext_img->metadata, 0x0, sizeof(net_meta));
-    if (success)
-        success = device->getImage(tmp, pixelCX * pixelCY);
-    else
+    rc = pthread_create(&analysis_thread, NULL, &analysis_fcn, (void *)pipe);
+    if (rc != 0)
     {
-        cout << "Could not get first exposure" << endl;
+        eprintf("main: Failed to create analysis thread, exiting...");
+        done = 1;
+        server->stop();
+        pthread_join(cmd_thread, NULL);
         goto end;
     }
-
-    pthread_t cmd_thread;
-    rc = pthread_create(&cmd_thread, NULL, &cmd_fcn, (void *)ext_img);
+    rc = pthread_create(&encode_thread, NULL, &encode_fcn, (void *)pipe);
     if (rc != 0)
     {
-        eprintf("main: Failed to create comm thread, exiting...");
+        eprintf("main: Failed to create encoder thread, exiting...");
+        done = 1;
+        server->stop();
+        pthread_join(cmd_thread, NULL);
+        pthread_join(analysis_thread, NULL);
         goto end;
     }
+    // capture stage
     while (!done)
     {
-        unsigned width = device->imageWidth(pixelCX, 1);
-        unsigned height = device->imageWidth(pixelCY, 1);
+        // read out only the region of interest when every viewer watches the same one
+        net_roi rois[NET_MAX_ROIS];
+        unsigned formats[NET_MAX_ROIS];
+        net_roi readout = {0, 0, pixelCX, pixelCY};
+        bool subframe = server->wanted_rois(rois, formats) == 1 && server->wanted_scales() == 0;
+        if (subframe)
+            readout = rois[0];
+        // binning changes between two readouts, every frame carries its own
+        unsigned bin = binning->next(pipe->exposure);
+        unsigned width = device->imageWidth(readout.width, bin);
+        unsigned height = device->imageHeight(readout.height, bin);
+        exposure = pipe->exposure / (bin * bin);
+        exposure = exposure < minShortExp ? minShortExp : (exposure > MAX_ALLOWED_EXPOSURE ? MAX_ALLOWED_EXPOSURE : exposure);
+        systime tstart;
+        uint64_t t_exposure = net_clock_ns(CLOCK_MONOTONIC); // short exposures start inside readCCD
         if (exposure > maxShortExp)
         {
             success = device->startExposure(false);
             if (!success || done)
             {
                 cout << "Failed to start long exposure" << endl;
-                return -1;
+                break;
             }
             long delay = device->delay(exposure);
             cout << "Exposure delay: " << delay << " us" << endl;
             usleep(delay);
-            success = device->readCCD(0, 0, pixelCX, pixelCY, 1, 1);
+            success = device->readCCD(readout.x, readout.y, readout.width, readout.height, bin, bin);
         }
         else
-            success = device->readCCD(0, 0, pixelCX, pixelCY, 1, 1, exposure);
+            success = device->readCCD(readout.x, readout.y, readout.width, readout.height, bin, bin, exposure);
         tnow.now();
         if (success && (!done))
-            success = device->getImage(tmp, width * height);
+            success = device->getImage(frame->data, width * height);
         if (!success)
         {
             eprintf("main: Error reading CCD\n");
             break;
         }
-        cout << "Obtained exposure" << endl;
+        frame->t_exposure = t_exposure;
+        frame->t_readout = net_clock_ns(CLOCK_MONOTONIC);
         float temp = 0;
         if (!done)
             success = device->getTemperatureSensorStatus(1, &temp);
-        cout << "temp measured" << endl;
-        jpeg_image img;
-        img.convert_jpeg_image(tmp, width, height);
-        cout << "jpeg created" << endl;
-        pthread_mutex_lock(&net_img_lock);
-        cout << "mutex lock" << endl;
-        ext_img->metadata->temp = temp;
-        cout << "CCD temp: " << ext_img->metadata->temp << " C" << endl;
-        ext_img->metadata->tstamp = tnow.usec();
-        cout << "Tstamp: " << ext_img->metadata->tstamp << endl;
-        ext_img->metadata->height = height;
-        cout << "Height: " << ext_img->metadata->height << endl;
-        ext_img->metadata->width = width;
-        cout << "Width: " << ext_img->metadata->width << endl;
-        ext_img->metadata->exposure = exposure;
-        cout << "Exposure: " << ext_img->metadata->exposure << endl;
-        ext_img->metadata->size = img.copy_image(ext_img->data);
-        cout << "Size: " << ext_img->metadata->size << endl;
-        pthread_mutex_unlock(&net_img_lock);
-        if (!done)
-            exposure = find_optimum_exposure(tmp, width * height, exposure);
-        if (exposure < minShortExp)
-            exposure = minShortExp;
-        if (exposure > MAX_ALLOWED_EXPOSURE)
-            exposure = MAX_ALLOWED_EXPOSURE;
+        frame->width = width;
+        frame->height = height;
+        frame->x = readout.x;
+        frame->y = readout.y;
+        frame->subframe = subframe;
+        frame->roi = readout;
+        frame->bin = bin;
+        frame->format = subframe ? formats[0] : NET_FORMAT_JPEG;
+        frame->temp = temp;
+        frame->exposure = exposure;
+        frame->tstamp = tnow.usec();
+        recorder.append(frame->data, width, height, frame->x, frame->y, bin, temp, exposure, frame->tstamp); // memcpy into the mapping
+        systime tend;
+        pipe->capture.add(tend.usec() - tstart.usec());
+        if (!subframe)
+            binning->add_readout(bin, (frame->t_readout - frame->t_exposure) * 1e-9 - exposure);
+        if (pipe->analysis_q.push(frame)) // otherwise analysis is behind, reuse the slot
+            frame = pipe->get_free_slot();
+        pipe->report();
     }
     cout << "main: Out of loop" << endl
          << flush;
     done = 1;
+    rc = pthread_join(encode_thread, NULL);
+    rc = pthread_join(analysis_thread, NULL);
+    server->stop();
     rc = pthread_join(cmd_thread, NULL);
 end:
-    free(ext_img->metadata);
-    free(ext_img);
+    delete fits_out; // writes out the frames still queued
+    fits_out = NULL;
+    while (recorder_exporting)
+        usleep(10000);
+    recorder.close();
+    delete pipe;
+    delete server; // releases the published frame and frames in flight
+    delete pool;
+    delete binning;
     delete devcap;
     device->close();
     return 0;
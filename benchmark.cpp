@@ -0,0 +1,1895 @@
+/**
+ * @file benchmark.cpp
+ * @brief Benchmarks for the per-frame kernels used by atikserver
+ *
+ * Usage: ./bench.out [section ...], runs every section if none is given.
+ *
+ * The "kernels" section times the server and client hot paths at several
+ * sensor sizes and writes one CSV line per kernel and size to BENCH_OUT
+ * (default bench_kernels.csv). Point BENCH_BASELINE at the file of an
+ * earlier run to flag regressions.
+ *
+ * The "exposure" section replays sky brightness ramps through each
+ * auto-exposure controller and reports frames to converge and the
+ * exposure time wasted on frames off target.
+ *
+ * The "stack" section checks the live stack against a direct sum of the
+ * window and times a frame update for several window lengths.
+ *
+ * The "calib" section times the median combine of masters against the
+ * number of threads, and the dark and flat correction of a frame.
+ *
+ * The "cmd" section sends binary commands to a frame server on loopback,
+ * one at a time and in bursts, idle and while frames stream, and checks
+ * every one is acknowledged once and in order. It reports the time from
+ * sending to applying and to the acknowledgement.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sched.h>
+#include <algorithm>
+
+#include <histogram.h>
+#include <comic_net.h>
+#include <frame_server.h>
+#include <net_cmd.h>
+#include <frame_parser.h>
+#include <jpeg_image.h>
+#include <tone_map.h>
+#include <jpeg_parallel.h>
+#include <downscale.h>
+#include <raw_codec.h>
+#include <flight_recorder.h>
+#include <exposure.h>
+#include <frame_decode.h>
+#include <frame_stats.h>
+#include <exposure_control.h>
+#include <frame_stack.h>
+#include <calib.h>
+
+#ifdef __GLIBC__
+/* Count heap allocations made by the process, including inside libjpeg */
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+static std::atomic<unsigned long long> bench_allocs(0);
+extern "C" void *malloc(size_t size)
+{
+    bench_allocs++;
+    return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t n, size_t size)
+{
+    bench_allocs++;
+    return __libc_calloc(n, size);
+}
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return __libc_realloc(ptr, size);
+}
+#define BENCH_COUNTS_ALLOCS 1
+#else
+static std::atomic<unsigned long long> bench_allocs(0);
+#define BENCH_COUNTS_ALLOCS 0
+#endif
+
+/**
+ * @brief Monotonic time in seconds
+ *
+ */
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Fill a buffer with a synthetic sky frame: noisy background and a
+ * sprinkling of bright (some saturated) stars
+ *
+ * @param data Frame buffer
+ * @param size Number of pixels
+ * @param bkg Mean background level
+ * @param seed Random seed
+ */
+static void make_sky_frame(unsigned short *data, unsigned long long size, unsigned bkg, unsigned seed)
+{
+    uint32_t s = seed * 2654435761u + 1;
+    for (unsigned long long i = 0; i < size; i++)
+    {
+        s = s * 1664525u + 1013904223u;
+        int noise = (int)((s >> 16) & 0x3ff) - 512 + (int)((s >> 6) & 0x3ff) - 512; // triangular noise
+        int v = (int)bkg + noise / 4;
+        if (((s >> 8) & 0xfff) == 0) // ~1 in 4096 pixels is a star
+            v += (s >> 12) & 0xffff;
+        data[i] = v < 0 ? 0 : (v > 65535 ? 65535 : v);
+    }
+}
+
+/* Reference: sort the frame, as find_optimum_exposure used to */
+static int compare(const void *a, const void *b)
+{
+    return (*((unsigned short *)a) - *((unsigned short *)b));
+}
+
+static void bench_hist()
+{
+    const unsigned sizes_mp[] = {1, 4, 16};
+    const double pct = 90.0;
+    printf("\n== find_optimum_exposure percentile: qsort vs histogram ==\n");
+    printf("%6s %12s %12s %12s %12s %8s %18s\n", "MP", "qsort (ms)", "hist (ms)", "hist/16 (ms)", "speedup", "match", "hist/16 p90 [lo,hi]");
+    for (unsigned n = 0; n < sizeof(sizes_mp) / sizeof(sizes_mp[0]); n++)
+    {
+        unsigned long long size = sizes_mp[n] * 1024ULL * 1024ULL;
+        unsigned short *frame = (unsigned short *)malloc(size * sizeof(unsigned short));
+        unsigned short *sorted = (unsigned short *)malloc(size * sizeof(unsigned short));
+        make_sky_frame(frame, size, 20000, n);
+        unsigned long long coord = floor(pct * (size - 1) / 100.0);
+        int reps = sizes_mp[n] > 4 ? 3 : 5;
+
+        double t_qsort = 0;
+        unsigned short ref = 0;
+        for (int r = 0; r < reps; r++)
+        {
+            memcpy(sorted, frame, size * sizeof(unsigned short));
+            double t0 = bench_now();
+            qsort(sorted, size, sizeof(unsigned short), compare);
+            ref = sorted[coord];
+            t_qsort += bench_now() - t0;
+        }
+        t_qsort /= reps;
+
+        pixel_histogram hist;
+        double t_hist = 0;
+        unsigned short val = 0;
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = bench_now();
+            hist.compute(frame, size);
+            val = hist.at(coord);
+            t_hist += bench_now() - t0;
+        }
+        t_hist /= reps;
+        // exact histogram must reproduce every order statistic of the sorted frame
+        bool match = (val == ref) && (hist.at(0) == sorted[0]) && (hist.at(size - 1) == sorted[size - 1]) && (hist.at(size / 2) == sorted[size / 2]);
+
+        double t_sub = 0;
+        unsigned short lo = 0, hi = 0;
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = bench_now();
+            hist.compute(frame, size, 16);
+            val = hist.percentile(pct);
+            t_sub += bench_now() - t0;
+        }
+        t_sub /= reps;
+        hist.percentile_bounds(pct, &lo, &hi);
+        if (ref < lo || ref > hi)
+            match = false;
+
+        char bounds[32];
+        snprintf(bounds, sizeof(bounds), "%u [%u,%u]", val, lo, hi);
+        printf("%6u %12.3f %12.3f %12.3f %11.1fx %8s %18s\n", sizes_mp[n], t_qsort * 1e3, t_hist * 1e3, t_sub * 1e3, t_qsort / t_hist, match ? "yes" : "NO", bounds);
+        free(frame);
+        free(sorted);
+    }
+}
+
+#define BENCH_PORT 12396
+
+/**
+ * @brief Loopback viewer: connects to the server, counts whole frames and
+ * checks that no frame (tagged by the publisher in net_meta.tstamp) arrives
+ * twice
+ *
+ */
+typedef struct
+{
+    pthread_t thread;
+    volatile bool *stop;
+    unsigned long long frames;
+    unsigned long long bytes;
+    unsigned long long duplicates;
+    uint64_t last_tag;
+    bool connected;
+} bench_client;
+
+static bool recv_all(int sock, unsigned char *buf, size_t len, volatile bool *stop)
+{
+    size_t got = 0;
+    while (got < len && !*stop)
+    {
+        ssize_t sz = recv(sock, buf + got, len - got, 0);
+        if (sz == 0)
+            return false;
+        if (sz < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            return false;
+        }
+        got += sz;
+    }
+    return got == len;
+}
+
+static void *bench_client_fcn(void *_client)
+{
+    bench_client *client = (bench_client *)_client;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        close(sock);
+        return NULL;
+    }
+    client->connected = true;
+    struct timeval tv = {0, 100000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    unsigned char *buf = (unsigned char *)malloc(16 * 1024 * 1024);
+    while (!*client->stop)
+    {
+        if (!recv_all(sock, buf, 8, client->stop) || memcmp(buf, NET_FRAME_HDR, 4) != 0)
+            break;
+        int32_t out_sz;
+        memcpy(&out_sz, buf + 4, sizeof(out_sz));
+        if (out_sz < 8 || out_sz > 16 * 1024 * 1024 || !recv_all(sock, buf + 8, out_sz - 8, client->stop))
+            break;
+        net_meta meta;
+        memcpy(&meta, buf + 14, sizeof(net_meta));
+        if (meta.tstamp <= client->last_tag)
+            client->duplicates++;
+        client->last_tag = meta.tstamp;
+        client->frames++;
+        client->bytes += out_sz;
+    }
+    free(buf);
+    close(sock);
+    return NULL;
+}
+
+static void *bench_server_fcn(void *server)
+{
+    ((frame_server *)server)->run();
+    return NULL;
+}
+
+/**
+ * @brief Stands in for the encoder: publishes a new frame at a fixed rate
+ *
+ */
+typedef struct
+{
+    frame_server *server;
+    frame_pool *pool;
+    int frame_sz;
+    long interval_us;
+    volatile bool stop;
+} bench_publisher;
+
+static void *bench_publisher_fcn(void *_pub)
+{
+    bench_publisher *pub = (bench_publisher *)_pub;
+    uint64_t tag = 0;
+    while (!pub->stop)
+    {
+        encoded_frame *frame = pub->pool->get();
+        if (frame != NULL)
+        {
+            frame->meta()->tstamp = ++tag;
+            frame->set_size(pub->frame_sz);
+            pub->server->publish(frame);
+        }
+        usleep(pub->interval_us);
+    }
+    return NULL;
+}
+
+static double thread_cpu_time(pthread_t thread)
+{
+    clockid_t cid;
+    struct timespec ts;
+    if (pthread_getcpuclockid(thread, &cid) != 0 || clock_gettime(cid, &ts) != 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench_net()
+{
+    const unsigned nclients[] = {1, 8, 32};
+    const long interval_us = 10000; // 100 frames/s
+    const int frame_sz = 256 * 1024;
+    const double duration = 2.0;
+    printf("\n== frame_server: loopback delivery, %d KiB frames published every %ld ms ==\n", frame_sz / 1024, interval_us / 1000);
+    printf("%8s %14s %16s %6s %8s %10s %12s %12s %14s %18s\n", "clients", "frames/s/cli", "sent/published", "dups", "skipped", "MB/s", "lat avg (ms)", "lat max (ms)", "CPU/cli (%)", "CPU/cli/frame (us)");
+    for (unsigned n = 0; n < sizeof(nclients) / sizeof(nclients[0]); n++)
+    {
+        frame_pool pool(frame_sz);
+        frame_server *server = new frame_server();
+        if (!server->open(BENCH_PORT))
+        {
+            delete server;
+            return;
+        }
+        pthread_t server_thread;
+        pthread_create(&server_thread, NULL, bench_server_fcn, server);
+
+        volatile bool stop = false;
+        bench_client *clients = new bench_client[nclients[n]];
+        for (unsigned i = 0; i < nclients[n]; i++)
+        {
+            memset(&clients[i], 0x0, sizeof(bench_client));
+            clients[i].stop = &stop;
+            pthread_create(&clients[i].thread, NULL, bench_client_fcn, &clients[i]);
+        }
+        usleep(200000); // let everyone connect
+
+        bench_publisher pub;
+        pub.server = server;
+        pub.pool = &pool;
+        pub.frame_sz = frame_sz;
+        pub.interval_us = interval_us;
+        pub.stop = false;
+        pthread_t pub_thread;
+        pthread_create(&pub_thread, NULL, bench_publisher_fcn, &pub);
+        usleep(100000); // warm up
+
+        unsigned long long frames0 = 0, bytes0 = 0;
+        for (unsigned i = 0; i < nclients[n]; i++)
+        {
+            frames0 += clients[i].frames;
+            bytes0 += clients[i].bytes;
+        }
+        unsigned long long published0 = server->frames_published, skipped0 = server->frames_skipped;
+        server->latency_sum_ns = 0;
+        server->latency_n = 0;
+        server->latency_max_ns = 0;
+        double cpu0 = thread_cpu_time(server_thread);
+        double t0 = bench_now();
+        usleep(duration * 1e6);
+        double t1 = bench_now();
+        double cpu1 = thread_cpu_time(server_thread);
+        unsigned long long frames1 = 0, bytes1 = 0, dups = 0;
+        for (unsigned i = 0; i < nclients[n]; i++)
+        {
+            frames1 += clients[i].frames;
+            bytes1 += clients[i].bytes;
+        }
+        unsigned long long published = server->frames_published - published0, skipped = server->frames_skipped - skipped0;
+        double lat_avg = server->latency_n ? server->latency_sum_ns * 1e-6 / server->latency_n : 0;
+        double lat_max = server->latency_max_ns * 1e-6;
+        pub.stop = true;
+        pthread_join(pub_thread, NULL);
+        stop = true;
+        for (unsigned i = 0; i < nclients[n]; i++)
+        {
+            pthread_join(clients[i].thread, NULL);
+            dups += clients[i].duplicates;
+        }
+        server->stop();
+        pthread_join(server_thread, NULL);
+        delete server;
+        delete[] clients;
+
+        double dt = t1 - t0;
+        double frames = frames1 - frames0;
+        char sent[32];
+        snprintf(sent, sizeof(sent), "%.0f/%llu", frames, published * nclients[n]);
+        printf("%8u %14.1f %16s %6llu %8llu %10.1f %12.3f %12.3f %14.2f %18.1f\n", nclients[n], frames / nclients[n] / dt, sent, dups, skipped,
+               (bytes1 - bytes0) / dt / 1e6, lat_avg, lat_max, (cpu1 - cpu0) / dt * 100 / nclients[n], frames > 0 ? (cpu1 - cpu0) * 1e6 / frames : 0);
+    }
+}
+
+/**
+ * @brief Record a frame stream as the server would send it. Every 25th frame
+ * is preceded by garbage and every 40th frame is cut short, to exercise
+ * resynchronization.
+ *
+ * @param nframes Frames to generate
+ * @param len Stream length
+ * @param intact Frames that can be recovered
+ * @return unsigned char* Stream, free() when done
+ */
+static unsigned char *record_stream(unsigned nframes, size_t *len, unsigned *intact)
+{
+    size_t alloc = nframes * (256 * 1024 + 256);
+    unsigned char *stream = (unsigned char *)malloc(alloc);
+    size_t pos = 0;
+    uint32_t s = 12345;
+    *intact = 0;
+    for (unsigned i = 0; i < nframes; i++)
+    {
+        s = s * 1664525u + 1013904223u;
+        int size = 1024 + (s >> 8) % (255 * 1024);
+        if (i % 25 == 24)
+        {
+            for (int j = 0; j < 37; j++)
+                stream[pos++] = "SIZEgarbage"[j % 11];
+        }
+        net_frame_prefix prefix;
+        memcpy(prefix.hdr, NET_FRAME_HDR, 4);
+        memcpy(prefix.begin, NET_FRAME_BEGIN, 6);
+        net_meta_init(&prefix.meta);
+        prefix.meta.tstamp = i;
+        prefix.meta.size = size;
+        prefix.out_sz = size + sizeof(net_meta) + NET_FRAME_OVERHEAD;
+        memcpy(stream + pos, &prefix, sizeof(prefix));
+        pos += sizeof(prefix);
+        for (int j = 0; j < size; j++)
+            stream[pos++] = (unsigned char)(i * 31 + j * 7);
+        memcpy(stream + pos, NET_FRAME_END, 4);
+        pos += 4;
+        if (i % 40 == 39)
+            pos -= 100; // lost bytes
+        else
+            (*intact)++;
+    }
+    *len = pos;
+    return stream;
+}
+
+static bool check_rx_frame(const rx_frame *frame)
+{
+    unsigned i = frame->meta.tstamp;
+    const unsigned char *p = frame->payload();
+    for (int j = 0; j < frame->meta.size; j += 97)
+        if (p[j] != (unsigned char)(i * 31 + j * 7))
+            return false;
+    return true;
+}
+
+static void bench_parser()
+{
+    const unsigned nframes = 400;
+    const size_t max_chunk[] = {64, 1460, 65536, 1024 * 1024};
+    size_t len;
+    unsigned intact;
+    unsigned char *stream = record_stream(nframes, &len, &intact);
+    printf("\n== frame_parser: %.1f MB recorded stream, %u frames (%u recoverable), random chunk sizes ==\n", len / 1e6, nframes, intact);
+    printf("%12s %10s %10s %10s %10s %12s\n", "max chunk", "frames", "resyncs", "bad", "MB/s", "ns/byte");
+    for (unsigned n = 0; n < sizeof(max_chunk) / sizeof(max_chunk[0]); n++)
+    {
+        frame_parser parser;
+        uint32_t s = 777 + n;
+        size_t pos = 0;
+        unsigned bad = 0;
+        double t = 0;
+        while (pos < len)
+        {
+            s = s * 1664525u + 1013904223u;
+            size_t chunk = 1 + (s >> 4) % max_chunk[n];
+            if (chunk > len - pos)
+                chunk = len - pos;
+            double t0 = bench_now();
+            parser.feed(stream + pos, chunk);
+            t += bench_now() - t0;
+            pos += chunk;
+            bool is_new;
+            rx_frame *frame = parser.latest(&is_new);
+            if (is_new && !check_rx_frame(frame))
+                bad++;
+        }
+        printf("%12zu %6llu/%-3u %10llu %10u %10.1f %12.3f\n", max_chunk[n], parser.frames_ok.load(), intact, parser.resyncs.load(), bad, len / t / 1e6, t * 1e9 / len);
+    }
+    free(stream);
+}
+
+/* Reference: the per-frame encoder atikserver used before jpeg_image was made persistent */
+static int jpeg_reference(const unsigned short *data, unsigned width, unsigned height, unsigned char *buf, int quality)
+{
+    unsigned char *gr_data = (unsigned char *)malloc(width * height);
+    unsigned char *out = (unsigned char *)malloc(1024 * 1024 * 4);
+    for (unsigned long long i = 0; i < width * height; i++)
+        gr_data[i] = data[i] / 256;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    unsigned long img_sz = 1024 * 1024 * 4;
+    jpeg_mem_dest(&cinfo, &out, &img_sz);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 1;
+    cinfo.in_color_space = JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < height)
+    {
+        row_pointer[0] = &(gr_data[cinfo.next_scanline * width]);
+        (void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(gr_data);
+    memcpy(buf, out, img_sz);
+    free(out);
+    return (int)img_sz;
+}
+
+static void bench_jpeg()
+{
+    const unsigned dims[][2] = {{1024, 1024}, {2048, 2048}, {3326, 2504}};
+    const int reps = 10;
+    printf("\n== JPEG encode (quality 70): per-frame setup + memcpy vs persistent jpeg_image ==\n");
+    if (!BENCH_COUNTS_ALLOCS)
+        printf("(allocation counting needs glibc, allocs/frame not measured)\n");
+    printf("%12s %12s %12s %12s %12s %12s %10s %10s\n", "size", "old (ms)", "new (ms)", "speedup", "old allocs", "new allocs", "bytes", "same");
+    for (unsigned n = 0; n < sizeof(dims) / sizeof(dims[0]); n++)
+    {
+        unsigned width = dims[n][0], height = dims[n][1];
+        unsigned long long size = (unsigned long long)width * height;
+        unsigned short *frame = (unsigned short *)malloc(size * sizeof(unsigned short));
+        make_sky_frame(frame, size, 20000, n);
+        unsigned char *ref = (unsigned char *)malloc(1024 * 1024 * 4);
+        jpeg_image::set_jpeg_quality(70);
+
+        int ref_sz = 0;
+        unsigned long long a0 = bench_allocs;
+        double t0 = bench_now();
+        for (int r = 0; r < reps; r++)
+            ref_sz = jpeg_reference(frame, width, height, ref, 70);
+        double t_old = (bench_now() - t0) / reps;
+        double allocs_old = (double)(bench_allocs - a0) / reps;
+
+        // first frame sizes the buffers, steady state is what the server sees
+        frame_pool pool(1024 * 1024);
+        jpeg_image jpeg;
+        encoded_frame *out = pool.get();
+        int sz = jpeg.encode(frame, width, height, &(out->data), &(out->alloc));
+        out->release();
+        a0 = bench_allocs;
+        t0 = bench_now();
+        for (int r = 0; r < reps; r++)
+        {
+            out = pool.get();
+            sz = jpeg.encode(frame, width, height, &(out->data), &(out->alloc));
+            out->set_size(sz);
+            out->release();
+        }
+        double t_new = (bench_now() - t0) / reps;
+        double allocs_new = (double)(bench_allocs - a0) / reps;
+        bool same = sz == ref_sz && memcmp(out->data, ref, sz) == 0;
+
+        char dim[24];
+        snprintf(dim, sizeof(dim), "%ux%u", width, height);
+        printf("%12s %12.3f %12.3f %11.2fx %12.1f %12.1f %10d %10s\n", dim, t_old * 1e3, t_new * 1e3, t_old / t_new, allocs_old, allocs_new, sz, same ? "yes" : "NO");
+        free(ref);
+        free(frame);
+    }
+}
+
+/* Decode to RGBA the way LoadTextureFromMem in guimain.cpp does, and
+ * count the warnings libjpeg raises on corrupt data (e.g. bad RST markers) */
+static bool bench_jpeg_decode(const unsigned char *jpeg, size_t len, unsigned char *out, size_t max_size, unsigned *width, unsigned *height, long *warnings)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, jpeg, len);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_EXT_RGBA;
+    (void)jpeg_start_decompress(&cinfo);
+    size_t row_stride = cinfo.output_width * cinfo.output_components;
+    bool ret = row_stride * cinfo.output_height <= max_size;
+    while (ret && cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW row = out + cinfo.output_scanline * row_stride;
+        (void)jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    if (ret)
+        (void)jpeg_finish_decompress(&cinfo);
+    *warnings = jerr.num_warnings;
+    jpeg_destroy_decompress(&cinfo);
+    return ret;
+}
+
+static void bench_pjpeg()
+{
+    const unsigned dims[][2] = {{3326, 2504}, {4096, 4096}};
+    const int reps = 10;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned max_threads = ncpu > 4 ? ncpu : 4;
+    printf("\n== parallel strip JPEG encode (quality 70), %ld online CPUs ==\n", ncpu);
+    printf("%12s %8s %12s %10s %10s %10s %10s %10s\n", "size", "threads", "encode (ms)", "speedup", "fps", "bytes", "warnings", "same");
+    for (unsigned n = 0; n < sizeof(dims) / sizeof(dims[0]); n++)
+    {
+        unsigned width = dims[n][0], height = dims[n][1];
+        unsigned long long size = (unsigned long long)width * height;
+        unsigned short *frame = (unsigned short *)malloc(size * sizeof(unsigned short));
+        make_sky_frame(frame, size, 20000, n);
+        size_t rgba_size = size * 4;
+        unsigned char *ref = (unsigned char *)malloc(rgba_size);
+        unsigned char *rgba = (unsigned char *)malloc(rgba_size);
+        jpeg_image::set_jpeg_quality(70);
+        double t_one = 0;
+        for (unsigned nthr = 1; nthr <= max_threads; nthr *= 2)
+        {
+            jpeg_parallel jpeg(nthr);
+            unsigned char *buf = NULL;
+            size_t alloc = 0;
+            int sz = jpeg.encode(frame, width, height, &buf, &alloc);
+            double t0 = bench_now();
+            for (int r = 0; r < reps; r++)
+                sz = jpeg.encode(frame, width, height, &buf, &alloc);
+            double t = (bench_now() - t0) / reps;
+            if (nthr == 1)
+                t_one = t;
+            unsigned w = 0, h = 0;
+            long warnings = -1;
+            bool ok = sz > 0 && bench_jpeg_decode(buf, sz, rgba, rgba_size, &w, &h, &warnings) && w == width && h == height;
+            const char *same = "-";
+            if (nthr == 1)
+                memcpy(ref, rgba, rgba_size); // strips must decode to the pixels of the single piece image
+            else
+                same = ok && memcmp(ref, rgba, rgba_size) == 0 ? "yes" : "NO";
+            char dim[24];
+            snprintf(dim, sizeof(dim), "%ux%u", width, height);
+            printf("%12s %8u %12.3f %9.2fx %10.1f %10d %10ld %10s\n", dim, jpeg.threads_used(), t * 1e3, t_one / t, 1.0 / t, sz, warnings, ok ? same : "BAD");
+            free(buf);
+        }
+        free(frame);
+        free(ref);
+        free(rgba);
+    }
+}
+
+static void bench_scale()
+{
+    const unsigned width = 3326, height = 2504;
+    const int reps = 10;
+    unsigned long long size = (unsigned long long)width * height;
+    unsigned short *frame = (unsigned short *)malloc(size * sizeof(unsigned short));
+    unsigned short *ref = (unsigned short *)malloc(size / 4 * sizeof(unsigned short));
+    unsigned short *small = (unsigned short *)malloc(size / 4 * sizeof(unsigned short));
+    make_sky_frame(frame, size, 20000, 9);
+    jpeg_image::set_jpeg_quality(70);
+    frame_pool pool(1024 * 1024);
+    jpeg_image jpeg;
+    printf("\n== preview scales of a %ux%u frame: area average downscale + JPEG encode ==\n", width, height);
+    printf("%8s %12s %14s %14s %10s %8s %12s %14s %12s\n", "scale", "size", "scalar (ms)", "simd (ms)", "speedup", "same", "encode (ms)", "wire (bytes)", "total (ms)");
+    for (unsigned i = 0; i < NET_NUM_SCALES; i++)
+    {
+        unsigned factor = net_scale_factor(i);
+        unsigned ow = width / factor, oh = height / factor;
+        const unsigned short *data = frame;
+        double t_scalar = 0, t_simd = 0;
+        const char *same = "-";
+        if (factor > 1)
+        {
+            double t0 = bench_now();
+            for (int r = 0; r < reps; r++)
+                downscale(frame, width, height, factor, ref, false);
+            t_scalar = (bench_now() - t0) / reps;
+            t0 = bench_now();
+            for (int r = 0; r < reps; r++)
+                downscale(frame, width, height, factor, small);
+            t_simd = (bench_now() - t0) / reps;
+            same = memcmp(ref, small, (size_t)ow * oh * sizeof(unsigned short)) == 0 ? "yes" : "NO";
+            data = small;
+        }
+        encoded_frame *out = pool.get();
+        int sz = jpeg.encode(data, ow, oh, &(out->data), &(out->alloc));
+        double t0 = bench_now();
+        for (int r = 0; r < reps; r++)
+            sz = jpeg.encode(data, ow, oh, &(out->data), &(out->alloc));
+        double t_enc = (bench_now() - t0) / reps;
+        out->set_size(sz);
+        char dim[24];
+        snprintf(dim, sizeof(dim), "%ux%u", ow, oh);
+        printf("%7s%u %12s %14.3f %14.3f %9.1fx %8s %12.3f %14zu %12.3f\n", "1/", factor, dim, t_scalar * 1e3, t_simd * 1e3, t_simd > 0 ? t_scalar / t_simd : 1, same, t_enc * 1e3, out->wire_size(), (t_simd + t_enc) * 1e3);
+        out->release();
+    }
+    free(frame);
+    free(ref);
+    free(small);
+}
+
+/**
+ * @brief Read an uncompressed 16 bit FITS image (as written by getcalib and
+ * saveFits) without cfitsio: primary HDU only, BITPIX 16, BZERO applied
+ *
+ * @return unsigned short* Pixels (malloc'd), NULL if the file is not supported
+ */
+static unsigned short *load_fits16(const char *fname, unsigned *width, unsigned *height)
+{
+    FILE *fp = fopen(fname, "rb");
+    if (fp == NULL)
+        return NULL;
+    char card[81] = {0};
+    int bitpix = 0, naxis = 0;
+    long naxis1 = 0, naxis2 = 0;
+    double bzero = 0;
+    bool end = false;
+    unsigned long ncards = 0;
+    while (!end && fread(card, 1, 80, fp) == 80)
+    {
+        ncards++;
+        if (strncmp(card, "END     ", 8) == 0)
+            end = true;
+        else if (strncmp(card, "BITPIX  =", 9) == 0)
+            bitpix = atoi(card + 10);
+        else if (strncmp(card, "NAXIS   =", 9) == 0)
+            naxis = atoi(card + 10);
+        else if (strncmp(card, "NAXIS1  =", 9) == 0)
+            naxis1 = atol(card + 10);
+        else if (strncmp(card, "NAXIS2  =", 9) == 0)
+            naxis2 = atol(card + 10);
+        else if (strncmp(card, "BZERO   =", 9) == 0)
+            bzero = atof(card + 10);
+    }
+    unsigned short *data = NULL;
+    size_t n = (size_t)naxis1 * naxis2;
+    if (end && bitpix == 16 && naxis == 2 && n > 0 && fseek(fp, (ncards + 35) / 36 * 2880, SEEK_SET) == 0)
+    {
+        data = (unsigned short *)malloc(n * sizeof(unsigned short));
+        if (data != NULL && fread(data, sizeof(unsigned short), n, fp) == n)
+        {
+            int zero = (int)bzero;
+            for (size_t i = 0; i < n; i++)
+            {
+                int v = (int16_t)((data[i] >> 8) | (data[i] << 8)) + zero; // big endian, signed
+                data[i] = v < 0 ? 0 : (v > 65535 ? 65535 : v);
+            }
+            *width = naxis1;
+            *height = naxis2;
+        }
+        else
+        {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(fp);
+    return data;
+}
+
+static void bench_raw_frame(const char *name, const unsigned short *frame, unsigned width, unsigned height)
+{
+    const int reps = 5;
+    size_t size = (size_t)width * height, bytes = size * sizeof(unsigned short);
+    unsigned short *out = (unsigned short *)malloc(bytes);
+    unsigned char *buf = NULL;
+    size_t alloc = 0;
+    raw16_codec codec;
+    double t_enc[2], t_dec[2];
+    int sz = 0;
+    bool same = true;
+    for (int simd = 0; simd < 2; simd++)
+    {
+        sz = codec.encode(frame, width, height, &buf, &alloc, simd);
+        double t0 = bench_now();
+        for (int r = 0; r < reps; r++)
+            sz = codec.encode(frame, width, height, &buf, &alloc, simd);
+        t_enc[simd] = (bench_now() - t0) / reps;
+        unsigned w = 0, h = 0;
+        t0 = bench_now();
+        for (int r = 0; r < reps; r++)
+            same &= raw16_codec::decode(buf, sz, out, size, &w, &h, simd);
+        t_dec[simd] = (bench_now() - t0) / reps;
+        same &= w == width && h == height && memcmp(out, frame, bytes) == 0;
+    }
+    char dim[24];
+    snprintf(dim, sizeof(dim), "%ux%u", width, height);
+    printf("%-24.24s %12s %8.2f %8.2f %10.0f %10.0f %10.0f %10.0f %8.1f %6s\n", name, dim, (double)bytes / sz, sz * 8.0 / size,
+           bytes / t_enc[0] * 1e-6, bytes / t_enc[1] * 1e-6, bytes / t_dec[0] * 1e-6, bytes / t_dec[1] * 1e-6, 1 / t_enc[1], same ? "yes" : "NO");
+    free(buf);
+    free(out);
+}
+
+static void bench_raw()
+{
+    const unsigned width = 3326, height = 2504;
+    unsigned long long size = (unsigned long long)width * height;
+    printf("\n== lossless 16 bit raw stream: delta + zigzag + block bit packing (MB/s of 16 bit input, one core) ==\n");
+    printf("%-24s %12s %8s %8s %10s %10s %10s %10s %8s %6s\n", "frame", "size", "ratio", "bits/px", "enc scal", "enc simd", "dec scal", "dec simd", "enc fps", "same");
+    unsigned short *frame = (unsigned short *)malloc(size * sizeof(unsigned short));
+    const unsigned bkgs[] = {1000, 20000, 60000};
+    for (unsigned i = 0; i < sizeof(bkgs) / sizeof(bkgs[0]); i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "synthetic bkg %u", bkgs[i]);
+        make_sky_frame(frame, size, bkgs[i], i);
+        bench_raw_frame(name, frame, width, height);
+    }
+    memset(frame, 0x0, size * sizeof(unsigned short));
+    for (unsigned long long i = 0; i < size; i++)
+        frame[i] = 1000 + (i * 2654435761u >> 28); // bias-like, 4 bits of noise
+    bench_raw_frame("synthetic bias", frame, width, height);
+    free(frame);
+    // real frames, e.g. BENCH_FITS=calib/bin1_exp100_0.fit:calib/bin1_exp1000_0.fit
+    const char *env = getenv("BENCH_FITS");
+    if (env == NULL)
+    {
+        printf("(set BENCH_FITS to a colon separated list of 16 bit FITS frames to add real sky frames)\n");
+        return;
+    }
+    char *list = strdup(env), *save = NULL;
+    for (char *fname = strtok_r(list, ":", &save); fname != NULL; fname = strtok_r(NULL, ":", &save))
+    {
+        unsigned w, h;
+        unsigned short *data = load_fits16(fname, &w, &h);
+        if (data == NULL)
+        {
+            printf("%-24.24s unsupported or unreadable (needs an uncompressed BITPIX 16 image)\n", fname);
+            continue;
+        }
+        const char *base = strrchr(fname, '/');
+        bench_raw_frame(base != NULL ? base + 1 : fname, data, w, h);
+        free(data);
+    }
+    free(list);
+}
+
+static double percentile_sorted(double *v, unsigned n, double pct)
+{
+    qsort(v, n, sizeof(double), [](const void *a, const void *b) -> int
+          { double d = *(const double *)a - *(const double *)b; return d < 0 ? -1 : d > 0; });
+    return v[(unsigned)(pct / 100.0 * (n - 1))];
+}
+
+/* Paced capture loop: "read out" a frame (memcpy from the sensor buffer),
+ * optionally record it, sleep until the next period. Returns the lateness
+ * of every frame start against the schedule, in ms. */
+static void recorder_capture_loop(flight_recorder *rec, const unsigned short *sensor, unsigned short *frame, unsigned width, unsigned height, double period, unsigned nframes, double *late)
+{
+    double t0 = bench_now();
+    for (unsigned i = 0; i < nframes; i++)
+    {
+        double due = t0 + i * period, now = bench_now();
+        if (now < due)
+        {
+            usleep((due - now) * 1e6);
+            now = bench_now();
+        }
+        late[i] = (now - due) * 1e3;
+        memcpy(frame, sensor, (size_t)width * height * sizeof(unsigned short));
+        if (rec != NULL)
+            rec->append(frame, width, height, 0, 0, 1, -10, 0.1, i);
+    }
+}
+
+static void bench_recorder()
+{
+    const unsigned width = 3326, height = 2504, nslots = 16, nframes = 3 * nslots;
+    const char *env = getenv("BENCH_RECORDER_FILE");
+    const char *fname = env != NULL ? env : "/tmp/bench_flight.rec";
+    size_t size = (size_t)width * height, bytes = size * sizeof(unsigned short);
+    unsigned short *sensor = (unsigned short *)malloc(bytes);
+    unsigned short *frame = (unsigned short *)malloc(bytes);
+    make_sky_frame(sensor, size, 20000, 3);
+    unlink(fname);
+    printf("\n== flight recorder: %u slots of %ux%u in %s ==\n", nslots, width, height, fname);
+    double t0 = bench_now();
+    flight_recorder rec;
+    if (!rec.open(fname, nslots, size))
+    {
+        printf("could not create %s\n", fname);
+        free(sensor);
+        free(frame);
+        return;
+    }
+    printf("create %.1f MB: %.1f ms\n", (nslots * (bytes + FLIGHT_PAGE) + FLIGHT_PAGE) * 1e-6, (bench_now() - t0) * 1e3);
+    double *lat = (double *)malloc(nframes * sizeof(double));
+    t0 = bench_now();
+    for (unsigned i = 0; i < nframes; i++)
+    {
+        sensor[0] = i; // tell the frames apart
+        double ta = bench_now();
+        rec.append(sensor, width, height, 0, 0, 1, -10, 0.1, i);
+        lat[i] = (bench_now() - ta) * 1e3;
+    }
+    double dt = bench_now() - t0;
+    double p50 = percentile_sorted(lat, nframes, 50), p99 = percentile_sorted(lat, nframes, 99);
+    printf("append: %.0f MB/s sustained over %u frames (%.1f GB), per frame median %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           nframes * bytes / dt * 1e-6, nframes, nframes * bytes * 1e-9, p50, p99, lat[nframes - 1]);
+    free(lat);
+
+    // reopen as after a crash: the newest nslots frames must be there, in order and intact
+    rec.close();
+    flight_recorder again;
+    const flight_rec_hdr **recs = new const flight_rec_hdr *[nslots];
+    unsigned long long n = again.open(fname, nslots, size) ? again.records(recs) : 0;
+    bool intact = n == nslots;
+    for (unsigned long long i = 0; intact && i < n; i++)
+    {
+        unsigned k = nframes - nslots + i;
+        sensor[0] = k;
+        intact = recs[i]->seq == k + 1 && recs[i]->tstamp == k && memcmp(flight_recorder::pixels(recs[i]), sensor, bytes) == 0;
+    }
+    printf("reopen: %llu records recovered, %s\n", n, intact ? "newest frames intact and in order" : "MISMATCH");
+    delete[] recs;
+
+    // capture pacing with and without recording
+    const double period = 0.05;
+    const unsigned npaced = 60;
+    double *late = (double *)malloc(npaced * sizeof(double));
+    printf("%-12s %14s %14s %14s\n", "capture", "late p50 (ms)", "late p99 (ms)", "late max (ms)");
+    for (int on = 0; on < 2; on++)
+    {
+        recorder_capture_loop(on ? &again : NULL, sensor, frame, width, height, period, npaced, late);
+        p50 = percentile_sorted(late, npaced, 50);
+        p99 = percentile_sorted(late, npaced, 99);
+        printf("%-12s %14.3f %14.3f %14.3f\n", on ? "recording" : "no recorder", p50, p99, late[npaced - 1]);
+    }
+    again.report(stdout);
+    free(late);
+    again.close();
+    unlink(fname);
+    free(sensor);
+    free(frame);
+}
+
+#define BENCH_MIN_REPS 21
+#define BENCH_MAX_REPS 1000
+#define BENCH_KERNEL_TIME 1.0 // s per kernel and size
+#define BENCH_REGRESSION 1.10 // median slower than the baseline by this factor is flagged
+
+typedef struct
+{
+    char kernel[64];
+    unsigned width, height;
+    double median_ms;
+} bench_result;
+
+static FILE *bench_csv = NULL;
+static bench_result *bench_baseline = NULL;
+static unsigned bench_baseline_n = 0;
+static unsigned bench_regressions = 0;
+
+/**
+ * @brief Load the results of an earlier run, written by bench_kernel()
+ *
+ */
+static void load_baseline(const char *fname)
+{
+    FILE *fp = fopen(fname, "r");
+    if (fp == NULL)
+    {
+        printf("baseline %s: %s\n", fname, strerror(errno));
+        return;
+    }
+    char line[256];
+    unsigned alloc = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        bench_result r;
+        char arch[32];
+        unsigned reps;
+        if (sscanf(line, "%31[^,],%63[^,],%u,%u,%u,%lf", arch, r.kernel, &r.width, &r.height, &reps, &r.median_ms) != 6)
+            continue; // header
+        if (bench_baseline_n == alloc)
+        {
+            alloc = alloc ? alloc * 2 : 64;
+            bench_baseline = (bench_result *)realloc(bench_baseline, alloc * sizeof(bench_result));
+        }
+        bench_baseline[bench_baseline_n++] = r;
+    }
+    fclose(fp);
+    printf("baseline %s: %u results\n", fname, bench_baseline_n);
+}
+
+static const bench_result *find_baseline(const char *kernel, unsigned width, unsigned height)
+{
+    for (unsigned i = 0; i < bench_baseline_n; i++)
+        if (strcmp(bench_baseline[i].kernel, kernel) == 0 && bench_baseline[i].width == width && bench_baseline[i].height == height)
+            return &bench_baseline[i];
+    return NULL;
+}
+
+/**
+ * @brief Time a kernel: one warm up call, then at least BENCH_MIN_REPS
+ * calls or BENCH_KERNEL_TIME seconds. Reports the median and 99th
+ * percentile of the call times, and pixels per second at the median.
+ *
+ * @param kernel Name, as written to the CSV file
+ * @param width Frame width
+ * @param height Frame height
+ * @param fcn Kernel, called with no arguments
+ */
+template <class F>
+static void bench_kernel(const char *kernel, unsigned width, unsigned height, F fcn)
+{
+    static double t[BENCH_MAX_REPS];
+    fcn();
+    unsigned reps = 0;
+    double tstart = bench_now();
+    while (reps < BENCH_MAX_REPS && (reps < BENCH_MIN_REPS || bench_now() - tstart < BENCH_KERNEL_TIME))
+    {
+        double t0 = bench_now();
+        fcn();
+        t[reps++] = (bench_now() - t0) * 1e3;
+    }
+    double median = percentile_sorted(t, reps, 50), p99 = percentile_sorted(t, reps, 99);
+    double mpix = (double)width * height / median * 1e-3;
+    static struct utsname host;
+    if (host.machine[0] == '\0')
+        uname(&host);
+    printf("%-28s %5ux%-5u %6u %11.3f %11.3f %10.1f", kernel, width, height, reps, median, p99, mpix);
+    const bench_result *base = find_baseline(kernel, width, height);
+    if (base != NULL)
+    {
+        double ratio = median / base->median_ms;
+        printf(" %8.2fx%s", ratio, ratio > BENCH_REGRESSION ? " SLOWER" : "");
+        if (ratio > BENCH_REGRESSION)
+            bench_regressions++;
+    }
+    printf("\n");
+    if (bench_csv != NULL)
+        fprintf(bench_csv, "%s,%s,%u,%u,%u,%.4f,%.4f,%.2f\n", host.machine, kernel, width, height, reps, median, p99, mpix);
+}
+
+/**
+ * @brief Wrap a payload in the wire framing, as frame_server sends it
+ *
+ */
+static size_t frame_on_wire(const unsigned char *payload, int size, unsigned char *out)
+{
+    net_frame_prefix prefix;
+    memcpy(prefix.hdr, NET_FRAME_HDR, 4);
+    memcpy(prefix.begin, NET_FRAME_BEGIN, 6);
+    net_meta_init(&prefix.meta);
+    prefix.meta.size = size;
+    prefix.out_sz = size + sizeof(net_meta) + NET_FRAME_OVERHEAD;
+    memcpy(out, &prefix, sizeof(prefix));
+    memcpy(out + sizeof(prefix), payload, size);
+    memcpy(out + sizeof(prefix) + size, NET_FRAME_END, 4);
+    return sizeof(prefix) + size + 4;
+}
+
+static void bench_kernels()
+{
+    const unsigned sizes[][2] = {{640, 480}, {1600, 1200}, {3326, 2504}}; // up to the full Atik sensor
+    const size_t chunk = 64 * 1024; // recv() size of the client
+    const char *out = getenv("BENCH_OUT");
+    if (out == NULL)
+        out = "bench_kernels.csv";
+    bench_csv = fopen(out, "w");
+    if (bench_csv != NULL)
+        fprintf(bench_csv, "arch,kernel,width,height,reps,median_ms,p99_ms,mpix_per_s\n");
+    const char *base = getenv("BENCH_BASELINE");
+    if (base != NULL)
+        load_baseline(base);
+    bench_regressions = 0;
+    printf("\n== per-frame kernels: median and p99 of each call, results in %s ==\n", bench_csv != NULL ? out : "(not written)");
+    printf("%-28s %11s %6s %11s %11s %10s%s\n", "kernel", "size", "reps", "median (ms)", "p99 (ms)", "Mpix/s", base != NULL ? "  vs base" : "");
+    for (unsigned n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+    {
+        unsigned width = sizes[n][0], height = sizes[n][1];
+        size_t size = (size_t)width * height;
+        unsigned short *frame = (unsigned short *)malloc(size * sizeof(unsigned short));
+        make_sky_frame(frame, size, 20000, n);
+        volatile double sink = 0; // keeps the results alive
+
+        jpeg_image jpeg;
+        unsigned char *jbuf = NULL;
+        size_t jalloc = 0;
+        int jsize = 0;
+        bench_kernel("jpeg_image::encode", width, height, [&]()
+                     { jsize = jpeg.encode(frame, width, height, &jbuf, &jalloc); });
+        bench_kernel("find_optimum_exposure", width, height, [&]()
+                     { sink = find_optimum_exposure(frame, size, 0.1); });
+        bench_kernel("checkSaturation", width, height, [&]()
+                     { sink = checkSaturation(frame, size); });
+        bench_kernel("checkDark", width, height, [&]()
+                     { sink = checkDark(frame, size); });
+        frame_stats st;
+        bench_kernel("frame_stats_compute", width, height, [&]()
+                     { frame_stats_compute(frame, size, &st); sink = st.mean; });
+        uint32_t *acc = (uint32_t *)calloc(size, sizeof(uint32_t));
+        bench_kernel("stack_add (add + subtract)", width, height, [&]()
+                     { stack_add(acc, frame, frame, size); sink = acc[0]; });
+        bench_kernel("stack_mean", width, height, [&]()
+                     { stack_mean(acc, size, 1.0f / 16, frame); sink = frame[0]; });
+        make_sky_frame(frame, size, 20000, n);
+        free(acc);
+        unsigned short *dark = (unsigned short *)malloc(size * sizeof(unsigned short));
+        float *gain = (float *)malloc(size * sizeof(float));
+        for (size_t i = 0; i < size; i++)
+        {
+            dark[i] = 300 + (i % 7);
+            gain[i] = 1.0f + (i % 13) * 0.01f;
+        }
+        bench_kernel("calib_apply (dark + flat)", width, height, [&]()
+                     { calib_apply(frame, dark, gain, size, 0.0f); sink = frame[0]; });
+        make_sky_frame(frame, size, 20000, n);
+        free(dark);
+        free(gain);
+        bench_kernel("statseries::add", width, height, [&]() // one point per pixel
+                     {
+                         statseries st;
+                         for (size_t i = 0; i < size; i++)
+                             st.add(frame[i]);
+                         sink = st.stdev; });
+
+        // client: reassemble a frame from recv() sized chunks (the lossless
+        // stream, the largest payload), then decode it
+        raw16_codec raw;
+        unsigned char *rbuf = NULL;
+        size_t ralloc = 0;
+        int rsize = raw.encode(frame, width, height, &rbuf, &ralloc);
+        unsigned char *wire = (unsigned char *)malloc(rsize + sizeof(net_frame_prefix) + 4);
+        size_t wire_len = frame_on_wire(rbuf, rsize, wire);
+        frame_parser parser;
+        bench_kernel("frame_parser::feed", width, height, [&]()
+                     {
+                         for (size_t pos = 0; pos < wire_len; pos += chunk)
+                             parser.feed(wire + pos, wire_len - pos < chunk ? wire_len - pos : chunk);
+                         sink = parser.latest()->meta.size; });
+        imagedata image;
+        image.max_size = size * 4;
+        image.data = (unsigned char *)malloc(image.max_size);
+        bench_kernel("LoadTextureFromMem", width, height, [&]()
+                     { sink = LoadTextureFromMem(jbuf, jsize, &image); });
+        bench_kernel("LoadRawFromMem", width, height, [&]()
+                     { sink = LoadRawFromMem(rbuf, rsize, &image); });
+        (void)sink;
+        free(rbuf);
+        free(image.data);
+        free(wire);
+        free(jbuf);
+        free(frame);
+    }
+    if (base != NULL)
+        printf("%u kernels more than %.0f%% slower than %s\n", bench_regressions, (BENCH_REGRESSION - 1) * 100, base);
+    if (bench_csv != NULL)
+        fclose(bench_csv);
+    bench_csv = NULL;
+    free(bench_baseline);
+    bench_baseline = NULL;
+    bench_baseline_n = 0;
+}
+
+/* Read bandwidth reference: sum every 64 bit word of the frame */
+static uint64_t read_all(const unsigned short *data, size_t n)
+{
+    const uint64_t *p = (const uint64_t *)data;
+    uint64_t a = 0, b = 0, c = 0, d = 0;
+    size_t words = n / 4, i = 0;
+    for (; i + 4 <= words; i += 4)
+    {
+        a += p[i];
+        b += p[i + 1];
+        c += p[i + 2];
+        d += p[i + 3];
+    }
+    for (; i < words; i++)
+        a += p[i];
+    return a + b + c + d;
+}
+
+static void bench_stats()
+{
+    const unsigned sizes[][2] = {{640, 480}, {1600, 1200}, {3326, 2504}};
+    const int reps = 20;
+    printf("\n== frame_stats: one fused pass vs the separate passes it replaces ==\n");
+    printf("(separate: checkSaturation + checkDark + tone_minmax + exact histogram + mean/variance loop)\n");
+    printf("(p50/p99 err: sampled histogram percentiles against the exact ones, ADU)\n");
+    printf("%11s %12s %12s %12s %12s %12s %8s %14s\n", "size", "read (GB/s)", "separate", "fused scalar", "fused SIMD", "ms (SIMD)", "match", "p50/p99 err");
+    for (unsigned n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+    {
+        size_t size = (size_t)sizes[n][0] * sizes[n][1];
+        unsigned short *frame = (unsigned short *)malloc(size * sizeof(unsigned short));
+        make_sky_frame(frame, size, 20000, n);
+        double bytes = size * sizeof(unsigned short);
+        volatile uint64_t sink = 0;
+        double t_read = 0, t_sep = 0, t_scalar = 0, t_simd = 0;
+        frame_stats a, b;
+        pixel_histogram hist;
+        for (int r = 0; r < reps; r++)
+        {
+            double t0 = bench_now();
+            sink = read_all(frame, size);
+            double t1 = bench_now();
+            bool sat = checkSaturation(frame, size), dark = checkDark(frame, size);
+            unsigned short mn, mx;
+            tone_minmax(frame, size, &mn, &mx);
+            hist.compute(frame, size);
+            double sum = 0, sumsq = 0;
+            for (size_t i = 0; i < size; i++)
+            {
+                sum += frame[i];
+                sumsq += (double)frame[i] * frame[i];
+            }
+            sink = sat + dark + mn + mx + (uint64_t)(sum + sumsq);
+            double t2 = bench_now();
+            frame_stats_compute(frame, size, &a, FRAME_STATS_DARK, false);
+            double t3 = bench_now();
+            frame_stats_compute(frame, size, &b, FRAME_STATS_DARK, true);
+            double t4 = bench_now();
+            t_read += t1 - t0;
+            t_sep += t2 - t1;
+            t_scalar += t3 - t2;
+            t_simd += t4 - t3;
+        }
+        bool match = a.min == b.min && a.max == b.max && a.saturated == b.saturated && a.dark == b.dark && fabs(a.mean - b.mean) < 1e-6 && fabs(a.var - b.var) < 1e-3 && memcmp(a.hist, b.hist, sizeof(a.hist)) == 0;
+        double err50 = fabs(frame_stats_percentile(&b, 50) - hist.percentile(50));
+        double err99 = fabs(frame_stats_percentile(&b, 99) - hist.percentile(99));
+        char label[32], err[32];
+        snprintf(label, sizeof(label), "%ux%u", sizes[n][0], sizes[n][1]);
+        snprintf(err, sizeof(err), "%.0f/%.0f", err50, err99);
+        printf("%11s %12.2f %12.2f %12.2f %12.2f %12.3f %8s %14s\n", label, bytes * reps / t_read * 1e-9, bytes * reps / t_sep * 1e-9, bytes * reps / t_scalar * 1e-9, bytes * reps / t_simd * 1e-9, t_simd / reps * 1e3, match ? "yes" : "NO", err);
+        (void)sink;
+        free(frame);
+    }
+}
+
+static void bench_tone()
+{
+    const unsigned long long size = 4 * 1024 * 1024;
+    const int reps = 20;
+    unsigned short *frame = (unsigned short *)malloc(size * sizeof(unsigned short));
+    unsigned char *ref = (unsigned char *)malloc(size);
+    unsigned char *out = (unsigned char *)malloc(size);
+    make_sky_frame(frame, size, 3000, 5); // dim frame, what / 256 flattens
+    typedef struct
+    {
+        const char *name;
+        tone_linear_fcn fcn;
+    } kernel;
+    const kernel kernels[] = {
+        {"scalar", tone_linear_scalar},
+#ifdef TONE_MAP_X86
+        {"sse2", tone_linear_sse2},
+        {"avx2", __builtin_cpu_supports("avx2") ? tone_linear_avx2 : NULL},
+#endif
+#ifdef TONE_MAP_NEON
+        {"neon", tone_linear_neon},
+#endif
+    };
+    const char *modes[] = {"none", "linear", "percentile", "gamma", "asinh"};
+    printf("\n== tone_map: 16 to 8 bit stretch, %llu MP dim frame ==\n", size / (1024 * 1024));
+
+    double t0 = bench_now();
+    for (int r = 0; r < reps; r++)
+        for (unsigned long long i = 0; i < size; i++)
+            ref[i] = frame[i] / 256;
+    double t_div = (bench_now() - t0) / reps;
+    printf("%-12s %-8s %12s %12s %10s %10s %8s %14s\n", "stretch", "kernel", "prepare (ms)", "apply (ms)", "Mpix/s", "vs /256", "same", "black..white");
+    printf("%-12s %-8s %12s %12.3f %10.0f %10s %8s %14s\n", "/ 256", "scalar", "-", t_div * 1e3, size / t_div / 1e6, "1.00x", "-", "-");
+
+    for (int m = STRETCH_NONE; m < STRETCH_MAX; m++)
+    {
+        stretch_cfg cfg = {(stretch_mode)m, 0.5f, 99.5f, m == STRETCH_GAMMA ? 2.2f : 10.0f};
+        tone_map::set_stretch(cfg);
+        unsigned nk = (m == STRETCH_GAMMA || m == STRETCH_ASINH) ? 1 : sizeof(kernels) / sizeof(kernels[0]);
+        for (unsigned k = 0; k < nk; k++)
+        {
+            if (kernels[k].fcn == NULL)
+                continue;
+            tone_map tmap;
+            tmap.set_kernel(kernels[k].fcn);
+            double t_prep = 0, t_apply = 0;
+            for (int r = 0; r < reps; r++)
+            {
+                t0 = bench_now();
+                tmap.prepare(frame, size);
+                t_prep += bench_now() - t0;
+                t0 = bench_now();
+                tmap.apply(frame, out, size);
+                t_apply += bench_now() - t0;
+            }
+            t_prep /= reps;
+            t_apply /= reps;
+            const char *same = "-";
+            if (k == 0)
+                memcpy(ref, out, size); // scalar result is the reference for the SIMD kernels
+            else
+                same = memcmp(ref, out, size) == 0 ? "yes" : "NO";
+            if (m == STRETCH_NONE && k == 0)
+            {
+                same = "yes";
+                for (unsigned long long i = 0; i < size; i++)
+                    if (out[i] != frame[i] / 256)
+                        same = "NO";
+            }
+            char range[24];
+            snprintf(range, sizeof(range), "%u..%u", tmap.black, tmap.white);
+            printf("%-12s %-8s %12.3f %12.3f %10.0f %9.2fx %8s %14s\n", modes[m], (m == STRETCH_GAMMA || m == STRETCH_ASINH) ? "lut" : kernels[k].name, t_prep * 1e3, t_apply * 1e3, size / t_apply / 1e6, t_div / t_apply, same, range);
+        }
+    }
+    stretch_cfg cfg = {STRETCH_NONE, 0.5f, 99.5f, 2.2f};
+    tone_map::set_stretch(cfg);
+    free(frame);
+    free(ref);
+    free(out);
+}
+
+/* Auto-exposure simulation. The sky rate (ADU/s above the offset at the
+ * 90th percentile) follows a scenario; every frame is a small synthetic
+ * frame of that rate times the exposure, with shot and read noise,
+ * clipped at 65535. A frame starts as soon as the previous one is read
+ * out, so the exposure computed from frame k applies to frame k + 2, as in
+ * atikserver's pipeline. */
+#define EXP_SIM_SIZE (128 * 128)
+#define EXP_SIM_READOUT 0.25 // s
+
+typedef struct
+{
+    const char *name;
+    const char *desc;
+    double duration; // s
+    double start;    // exposure of the first frame, s
+    double (*rate)(double t);
+} exp_scenario;
+
+static double exp_rate_dusk(double t) { return 4e6 * exp(-t / 260.0); } // 10 ms to 10 s in 30 min
+static double exp_rate_dawn(double t) { return 4e3 * exp(t / 260.0); }
+static double exp_rate_clouds(double t) { return fmod(t, 30.0) < 20.0 ? 4e5 : 4e4; }
+static double exp_rate_bright(double t) { return 4e6; }
+static double exp_rate_dark(double t) { return 8e3; }
+static double exp_rate_flicker(double t) { return 4e5 * (1 + 0.3 * sin(t * 2 * M_PI / 7.0)); }
+
+static const exp_scenario exp_scenarios[] = {
+    {"dusk", "exponential fade, 10^3 in 30 min", 1800, 0.01, exp_rate_dusk},
+    {"dawn", "exponential rise, 10^3 in 30 min", 1800, 10.0, exp_rate_dawn},
+    {"clouds", "x0.1 steps, 10 s every 30 s", 300, 0.1, exp_rate_clouds},
+    {"bright", "cold start fully saturated", 60, 10.0, exp_rate_bright},
+    {"dark", "cold start underexposed", 300, 0.001, exp_rate_dark},
+    {"flicker", "+-30% with a 7 s period", 300, 0.1, exp_rate_flicker},
+};
+
+static void exp_sim_frame(const float *weight, unsigned short *frame, double rate, double exposure, uint32_t *seed)
+{
+    for (unsigned i = 0; i < EXP_SIM_SIZE; i++)
+    {
+        double signal = rate * weight[i] * exposure;
+        *seed = *seed * 1664525u + 1013904223u;
+        double u = ((*seed >> 8) & 0xffff) / 65536.0 - 0.5; // uniform, sigma 0.29
+        double v = EXPOSURE_OFFSET + signal + u * 3.46 * sqrt(100 + signal);
+        frame[i] = v < 0 ? 0 : (v > 65535 ? 65535 : (unsigned short)v);
+    }
+}
+
+static void bench_exposure()
+{
+    // pixel weights: graded sky, 0.1 % stars; the 90th percentile is 1
+    float *weight = new float[EXP_SIM_SIZE];
+    unsigned short *frame = new unsigned short[EXP_SIM_SIZE];
+    uint32_t s = 12345;
+    for (unsigned i = 0; i < EXP_SIM_SIZE; i++)
+    {
+        s = s * 1664525u + 1013904223u;
+        weight[i] = 0.6f + 0.4f * (i % 128) / 127.0f;
+        if (((s >> 8) & 0x3ff) == 0)
+            weight[i] *= 2 + ((s >> 18) & 0x3f);
+    }
+    float *tmp = new float[EXP_SIM_SIZE];
+    memcpy(tmp, weight, EXP_SIM_SIZE * sizeof(float));
+    std::nth_element(tmp, tmp + EXP_SIM_SIZE * 9 / 10, tmp + EXP_SIM_SIZE);
+    float p90 = tmp[EXP_SIM_SIZE * 9 / 10];
+    for (unsigned i = 0; i < EXP_SIM_SIZE; i++)
+        weight[i] /= p90;
+    delete[] tmp;
+
+    const char *names[] = {"legacy", "predictive", "pid"};
+    exposure_cfg cfg = exposure_cfg_default();
+    cfg.readout = EXP_SIM_READOUT;
+    printf("\n== auto-exposure: brightness ramps, target %.0f +- %.0f ADU at the %.0fth percentile, readout %.2f s ==\n", cfg.target, cfg.give, cfg.percentile, EXP_SIM_READOUT);
+    printf("(converge: frames until the first on target; longest: longest off target run after that;\n");
+    printf(" wasted: exposure + readout of off target frames, also as a share of the run)\n");
+    for (unsigned sc = 0; sc < sizeof(exp_scenarios) / sizeof(exp_scenarios[0]); sc++)
+    {
+        const exp_scenario *scn = &exp_scenarios[sc];
+        printf("\n%s: %s, %.0f s\n", scn->name, scn->desc, scn->duration);
+        printf("%-11s %7s %9s %8s %10s %10s %8s %9s\n", "controller", "frames", "converge", "longest", "on target", "wasted s", "wasted", "saturated");
+        for (unsigned c = 0; c < sizeof(names) / sizeof(names[0]); c++)
+        {
+            exposure_controller *ctl = exposure_controller_create(names[c], cfg);
+            uint32_t seed = 777 + sc;
+            double t = 0, wasted = 0;
+            double cmd[2] = {scn->start, scn->start}; // exposures of the next two frames
+            unsigned frames = 0, on = 0, saturated = 0, run = 0, longest = 0;
+            int converge = -1;
+            frame_stats st;
+            while (t < scn->duration)
+            {
+                double exposure = cmd[0];
+                exp_sim_frame(weight, frame, scn->rate(t + exposure / 2), exposure, &seed);
+                frame_stats_compute(frame, EXP_SIM_SIZE, &st);
+                cmd[0] = cmd[1];
+                cmd[1] = ctl->next(&st, exposure, t);
+                bool hit = ctl->on_target(&st);
+                if (hit)
+                {
+                    on++;
+                    if (converge < 0)
+                        converge = frames;
+                    run = 0;
+                }
+                else
+                {
+                    wasted += exposure + EXP_SIM_READOUT;
+                    if (converge >= 0 && ++run > longest)
+                        longest = run;
+                }
+                if (st.saturated > cfg.max_saturated * st.n)
+                    saturated++;
+                frames++;
+                t += exposure + EXP_SIM_READOUT;
+            }
+            char conv[16];
+            if (converge < 0)
+                snprintf(conv, sizeof(conv), "never");
+            else
+                snprintf(conv, sizeof(conv), "%d", converge);
+            printf("%-11s %7u %9s %8u %9.1f%% %10.1f %7.1f%% %9u\n", ctl->name(), frames, conv, longest, 100.0 * on / frames, wasted, 100.0 * wasted / t, saturated);
+            delete ctl;
+        }
+    }
+    delete[] weight;
+    delete[] frame;
+}
+
+/* Live stack. Frame seq of the sequence is frames[seq % STACK_BENCH_FRAMES],
+ * with cosmic rays and a satellite trail on frames 10 to 19. */
+#define STACK_BENCH_FRAMES 8
+
+static const unsigned short *stack_bench_frame(unsigned short **frames, unsigned short *ray, unsigned width, size_t size, uint64_t seq, unsigned long long *rays)
+{
+    const unsigned short *data = frames[seq % STACK_BENCH_FRAMES];
+    if (seq < 10 || seq >= 20)
+        return data;
+    memcpy(ray, data, size * sizeof(unsigned short));
+    for (size_t i = seq * 7919; i < size; i += 4099, (*rays)++)
+        ray[i] = 60000;
+    for (unsigned x = 0; x < width; x++, (*rays)++)
+        ray[(size_t)(100 + seq) * width + x] = 50000;
+    return ray;
+}
+
+static void bench_stack()
+{
+    const unsigned width = 1600, height = 1200;
+    const size_t size = (size_t)width * height;
+    // one sky, and frames of it with independent noise (+-32 ADU)
+    unsigned short *frames[STACK_BENCH_FRAMES];
+    unsigned short *sky = (unsigned short *)malloc(size * sizeof(unsigned short));
+    make_sky_frame(sky, size, 2000, 100);
+    for (unsigned i = 0; i < STACK_BENCH_FRAMES; i++)
+    {
+        frames[i] = (unsigned short *)malloc(size * sizeof(unsigned short));
+        uint32_t s = i * 2654435761u + 7;
+        for (size_t k = 0; k < size; k++)
+        {
+            s = s * 1664525u + 1013904223u;
+            int v = sky[k] + (int)((s >> 16) & 0x3f) - 32;
+            frames[i][k] = v < 0 ? 0 : (v > 65535 ? 65535 : v);
+        }
+    }
+    free(sky);
+    unsigned short *out = (unsigned short *)malloc(size * sizeof(unsigned short));
+    unsigned short *ray = (unsigned short *)malloc(size * sizeof(unsigned short));
+    uint32_t *ref = (uint32_t *)malloc(size * sizeof(uint32_t));
+    printf("\n== live stack: %ux%u ==\n", width, height);
+
+    // correctness: sliding window against a direct sum of the frames in it,
+    // scalar and SIMD, without clipping and after clipped frames left the window
+    const unsigned window = 32, total = 100;
+    for (int clip = 0; clip < 2; clip++)
+        for (int simd = 0; simd < 2; simd++)
+        {
+            frame_stack stack;
+            stack_cfg cfg = {STACK_SLIDING, window, clip ? 5.0f : 0.0f};
+            frame_stack::set_config(cfg);
+            stack.update();
+            unsigned long long rays = 0;
+            for (uint64_t seq = 1; seq <= total; seq++)
+                stack.add(stack_bench_frame(frames, ray, width, size, seq, &rays), width, height, 1.0f, simd);
+            // no rays in the window any more: the sum is that of the plain frames
+            memset(ref, 0x0, size * sizeof(uint32_t));
+            for (uint64_t seq = total - window + 1; seq <= total; seq++)
+                stack_add_scalar(ref, frames[seq % STACK_BENCH_FRAMES], NULL, size);
+            stack.mean(out, simd);
+            size_t bad = 0;
+            for (size_t i = 0; i < size; i++)
+            {
+                float v = ref[i] / (float)window;
+                bad += fabs(out[i] - v) > 0.51f;
+            }
+            printf("sliding %u of %u frames, %s, clip %s: %s (%llu outliers injected, %llu clipped, %zu pixels off)\n",
+                   window, total, simd ? "SIMD  " : "scalar", clip ? "5 sigma" : "off    ", bad == 0 && stack.frames() == window ? "exact" : "MISMATCH", rays, stack.clipped.load(), bad);
+        }
+
+    // cost per frame against the window length, window full
+    printf("\n%8s %6s %18s %18s %14s %14s\n", "window", "clip", "add+sub (ms)", "mean (ms)", "Mpix/s", "memory (MB)");
+    const unsigned windows[] = {8, 64, 256};
+    for (unsigned w = 0; w < sizeof(windows) / sizeof(windows[0]); w++)
+        for (int clip = 0; clip < 2; clip++)
+        {
+            frame_stack stack;
+            stack_cfg cfg = {STACK_SLIDING, windows[w], clip ? 3.0f : 0.0f};
+            frame_stack::set_config(cfg);
+            stack.update();
+            uint64_t seq = 1;
+            // fill the window without timing it, then time steady state updates
+            for (; seq <= windows[w]; seq++)
+                stack.add(frames[seq % STACK_BENCH_FRAMES], width, height, 1.0f);
+            const unsigned reps = 40;
+            double t_add[reps], t_mean[reps];
+            for (unsigned r = 0; r < reps; r++, seq++)
+            {
+                double t0 = bench_now();
+                stack.add(frames[seq % STACK_BENCH_FRAMES], width, height, 1.0f);
+                double t1 = bench_now();
+                stack.mean(out);
+                double t2 = bench_now();
+                t_add[r] = (t1 - t0) * 1e3;
+                t_mean[r] = (t2 - t1) * 1e3;
+            }
+            double add_ms = percentile_sorted(t_add, reps, 50), mean_ms = percentile_sorted(t_mean, reps, 50);
+            double mem = size * sizeof(uint32_t) + windows[w] * (size * sizeof(unsigned short) + 16.0) + (clip ? STACK_CLIP_POOL * sizeof(stack_clip) : 0);
+            printf("%8u %6s %18.3f %18.3f %14.1f %14.1f\n", windows[w], clip ? "3 sig" : "off", add_ms, mean_ms, size / add_ms * 1e-3, mem / 1048576.0);
+        }
+    stack_cfg off = {STACK_OFF, 16, 0};
+    frame_stack::set_config(off);
+    for (unsigned i = 0; i < STACK_BENCH_FRAMES; i++)
+        free(frames[i]);
+    free(out);
+    free(ray);
+    free(ref);
+}
+
+#define CALIB_BENCH_FRAMES 16
+
+static void bench_calib()
+{
+    const unsigned width = 1600, height = 1200;
+    const size_t size = (size_t)width * height;
+    unsigned short *frames[CALIB_BENCH_FRAMES];
+    for (unsigned i = 0; i < CALIB_BENCH_FRAMES; i++)
+    {
+        frames[i] = (unsigned short *)malloc(size * sizeof(unsigned short));
+        make_sky_frame(frames[i], size, 300, i);
+    }
+    float *med = (float *)malloc(size * sizeof(float));
+    printf("\n== calibration: median of %u frames of %ux%u ==\n", CALIB_BENCH_FRAMES, width, height);
+    printf("%8s %12s %10s\n", "threads", "time (ms)", "speedup");
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    double t1 = 0;
+    for (unsigned threads = 1; threads <= (unsigned)(ncpu > 0 ? ncpu : 1); threads *= 2)
+    {
+        double t[5];
+        for (unsigned r = 0; r < 5; r++)
+        {
+            double t0 = bench_now();
+            calib_median(frames, CALIB_BENCH_FRAMES, size, med, threads);
+            t[r] = (bench_now() - t0) * 1e3;
+        }
+        double ms = percentile_sorted(t, 5, 50);
+        if (threads == 1)
+            t1 = ms;
+        printf("%8u %12.1f %10.2f\n", threads, ms, t1 / ms);
+    }
+
+    // a sweep of one temperature: bias, darks, a flat
+    calib_library lib;
+    const unsigned exposures[] = {1, 5, 25, 125, 625, 3125};
+    for (unsigned e = 0; e < sizeof(exposures) / sizeof(exposures[0]); e++)
+    {
+        for (unsigned i = 0; i < 4; i++)
+            make_sky_frame(frames[i], size, 300 + exposures[e] / 100, e * 4 + i);
+        lib.combine(CALIB_DARK, 1, width, height, exposures[e] * 0.001f, -20.0f, 0, frames, 4);
+    }
+    for (unsigned i = 0; i < 4; i++)
+        make_sky_frame(frames[i], size, 25000, 100 + i);
+    lib.combine(CALIB_FLAT, 1, width, height, 0.025f, -20.0f, 0, frames, 4);
+    lib.report(stdout);
+
+    unsigned short *frame = (unsigned short *)malloc(size * sizeof(unsigned short));
+    unsigned short *ref = (unsigned short *)malloc(size * sizeof(unsigned short));
+    make_sky_frame(frame, size, 2000, 200);
+    printf("\n%-30s %12s %12s %10s\n", "correction of a frame", "median (ms)", "p99 (ms)", "Mpix/s");
+    const unsigned reps = 40;
+    double t[reps];
+    for (int simd = 0; simd < 2; simd++)
+    {
+        for (unsigned r = 0; r < reps; r++)
+        {
+            memcpy(frame, frames[r % CALIB_BENCH_FRAMES], size * sizeof(unsigned short));
+            double t0 = bench_now();
+            lib.prepare(1, 2.0f, -20.0f);
+            lib.apply(frame, width, height, 0, 0, simd);
+            t[r] = (bench_now() - t0) * 1e3;
+        }
+        double p50 = percentile_sorted(t, reps, 50), p99 = percentile_sorted(t, reps, 99);
+        printf("%-30s %12.3f %12.3f %10.1f\n", simd ? "dark + flat, SIMD" : "dark + flat, scalar", p50, p99, size / p50 * 1e-3);
+        if (!simd) // same input as the last SIMD run
+            memcpy(ref, frame, size * sizeof(unsigned short));
+    }
+    printf("SIMD %s scalar\n", memcmp(ref, frame, size * sizeof(unsigned short)) == 0 ? "matches" : "DOES NOT MATCH");
+    // a new exposure every frame (auto exposure ramping): the dark is remade each time
+    for (unsigned r = 0; r < reps; r++)
+    {
+        memcpy(frame, frames[r % CALIB_BENCH_FRAMES], size * sizeof(unsigned short));
+        double t0 = bench_now();
+        lib.prepare(1, 0.1f + r * 0.01f, -20.0f);
+        lib.apply(frame, width, height, 0, 0);
+        t[r] = (bench_now() - t0) * 1e3;
+    }
+    double p50 = percentile_sorted(t, reps, 50);
+    printf("%-30s %12.3f %12.3f %10.1f\n", "new exposure, dark remade", p50, percentile_sorted(t, reps, 99), size / p50 * 1e-3);
+    for (unsigned i = 0; i < CALIB_BENCH_FRAMES; i++)
+        free(frames[i]);
+    free(med);
+    free(frame);
+    free(ref);
+}
+
+#define CMD_BENCH_MAX 65536 // commands of the section, by id
+
+/* send and apply time of every command, ns */
+static uint64_t cmd_t_send[CMD_BENCH_MAX];
+static uint64_t cmd_t_apply[CMD_BENCH_MAX];
+static uint64_t cmd_t_ack[CMD_BENCH_MAX];
+
+static int bench_cmd_apply(frame_server *server, net_client *client, const net_cmd_hdr *hdr, const void *payload)
+{
+    if (hdr->id < CMD_BENCH_MAX)
+        cmd_t_apply[hdr->id] = net_clock_ns(CLOCK_MONOTONIC);
+    return hdr->type == NET_CMD_PING ? NET_ACK_OK : NET_ACK_UNKNOWN;
+}
+
+/**
+ * @brief Receive side of the command client: frames and acknowledgements
+ * through the frame parser, as the GUI does
+ *
+ */
+typedef struct
+{
+    int sock;
+    pthread_t thread;
+    volatile bool stop;
+    frame_parser parser;
+    std::atomic<unsigned> acks; // received
+    uint32_t next_id;           // expected next
+    unsigned out_of_order;
+    unsigned wrong_status;
+} cmd_bench_client;
+
+static void *cmd_bench_rcv_fcn(void *_client)
+{
+    cmd_bench_client *client = (cmd_bench_client *)_client;
+    while (!client->stop)
+    {
+        unsigned char *ptr;
+        size_t len = client->parser.want(&ptr);
+        ssize_t sz = recv(client->sock, ptr, len, 0);
+        if (sz <= 0)
+        {
+            if (sz == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                break;
+            continue;
+        }
+        client->parser.commit(sz);
+        net_cmd_ack ack;
+        while (client->parser.pop_ack(&ack))
+        {
+            uint64_t t = net_clock_ns(CLOCK_MONOTONIC);
+            if (ack.id != client->next_id)
+                client->out_of_order++;
+            client->next_id = ack.id + 1;
+            if (ack.id < CMD_BENCH_MAX)
+                cmd_t_ack[ack.id] = t;
+            if (ack.status != (ack.type == NET_CMD_PING ? NET_ACK_OK : NET_ACK_UNKNOWN))
+                client->wrong_status++;
+            client->acks++;
+        }
+    }
+    return NULL;
+}
+
+/* wait up to timeout s for n acknowledgements in total */
+static bool cmd_bench_wait(cmd_bench_client *client, unsigned n, double timeout)
+{
+    double t0 = bench_now();
+    while (client->acks < n)
+    {
+        if (bench_now() - t0 > timeout)
+            return false;
+        sched_yield();
+    }
+    return true;
+}
+
+/**
+ * @brief Send count commands from id first, one at a time (each waits for its
+ * acknowledgement, gap_us apart) or back to back, every 100th of an unknown
+ * type, and print their apply and round trip times
+ *
+ */
+static void cmd_bench_run(cmd_bench_client *client, const char *name, uint32_t first, unsigned count, bool burst, long gap_us)
+{
+    unsigned ooo0 = client->out_of_order, wrong0 = client->wrong_status;
+    double t0 = bench_now();
+    for (uint32_t id = first; id < first + count; id++)
+    {
+        uint16_t type = id % 100 == 99 ? NET_NUM_CMDS : NET_CMD_PING;
+        cmd_t_send[id] = net_clock_ns(CLOCK_MONOTONIC);
+        if (!net_cmd_send(client->sock, type, id))
+        {
+            perror("send");
+            return;
+        }
+        if (!burst)
+        {
+            cmd_bench_wait(client, id + 1, 1.0);
+            if (gap_us > 0)
+                usleep(gap_us);
+        }
+    }
+    bool all = cmd_bench_wait(client, first + count, 5.0);
+    double dt = bench_now() - t0;
+    unsigned acked = client->acks - first;
+    double *apply = new double[count], *rtt = new double[count];
+    unsigned n = 0;
+    for (uint32_t id = first; id < first + count; id++)
+        if (cmd_t_ack[id] > 0 && cmd_t_apply[id] > 0)
+        {
+            apply[n] = (cmd_t_apply[id] - cmd_t_send[id]) * 1e-3;
+            rtt[n] = (cmd_t_ack[id] - cmd_t_send[id]) * 1e-3;
+            n++;
+        }
+    double apply50 = 0, apply99 = 0, rtt50 = 0, rtt99 = 0, rtt_max = 0;
+    if (n > 0)
+    {
+        apply50 = percentile_sorted(apply, n, 50);
+        apply99 = percentile_sorted(apply, n, 99);
+        rtt50 = percentile_sorted(rtt, n, 50);
+        rtt99 = percentile_sorted(rtt, n, 99);
+        rtt_max = rtt[n - 1];
+    }
+    printf("%-26s %8u %8u %6u %6u %6u %11.1f %11.1f %11.1f %11.1f %11.1f %11.0f\n", name, count, acked, count - acked, client->out_of_order - ooo0, client->wrong_status - wrong0,
+           apply50, apply99, rtt50, rtt99, rtt_max, acked / dt);
+    if (!all)
+        printf("  %u acknowledgements missing after 5 s\n", count - acked);
+    delete[] apply;
+    delete[] rtt;
+}
+
+static void bench_cmd()
+{
+    const long interval_us = 10000; // 100 frames/s
+    const int frame_sz = 256 * 1024;
+    const unsigned sequential = 2000, burst = 10000;
+    printf("\n== commands: loopback, %d KiB frames every %ld ms while streaming, every 100th command unknown ==\n", frame_sz / 1024, interval_us / 1000);
+    frame_pool pool(frame_sz);
+    frame_server *server = new frame_server();
+    server->bin_cmd_fcn = bench_cmd_apply;
+    if (!server->open(BENCH_PORT))
+    {
+        delete server;
+        return;
+    }
+    pthread_t server_thread;
+    pthread_create(&server_thread, NULL, bench_server_fcn, server);
+
+    cmd_bench_client *client = new cmd_bench_client;
+    client->sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(client->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        close(client->sock);
+        delete client;
+        server->stop();
+        pthread_join(server_thread, NULL);
+        delete server;
+        return;
+    }
+    int one = 1;
+    setsockopt(client->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = {0, 100000};
+    setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    client->stop = false;
+    client->acks = 0;
+    client->next_id = 0;
+    client->out_of_order = client->wrong_status = 0;
+    memset(cmd_t_apply, 0x0, sizeof(cmd_t_apply));
+    memset(cmd_t_ack, 0x0, sizeof(cmd_t_ack));
+    pthread_create(&client->thread, NULL, cmd_bench_rcv_fcn, client);
+    usleep(100000); // let it connect
+
+    printf("%-26s %8s %8s %6s %6s %6s %11s %11s %11s %11s %11s %11s\n", "", "sent", "acked", "lost", "order", "status", "apply p50", "apply p99", "rtt p50", "rtt p99", "rtt max", "cmds/s");
+    printf("%-26s %8s %8s %6s %6s %6s %11s %11s %11s %11s %11s %11s\n", "", "", "", "", "", "", "(us)", "(us)", "(us)", "(us)", "(us)", "");
+    uint32_t id = 0;
+    cmd_bench_run(client, "idle, one at a time", id, sequential, false, 0);
+    id += sequential;
+    cmd_bench_run(client, "idle, burst", id, burst, true, 0);
+    id += burst;
+
+    bench_publisher pub;
+    pub.server = server;
+    pub.pool = &pool;
+    pub.frame_sz = frame_sz;
+    pub.interval_us = interval_us;
+    pub.stop = false;
+    pthread_t pub_thread;
+    pthread_create(&pub_thread, NULL, bench_publisher_fcn, &pub);
+    usleep(100000); // warm up
+    unsigned long long frames0 = client->parser.frames_ok;
+    cmd_bench_run(client, "streaming, one at a time", id, sequential, false, 500);
+    id += sequential;
+    cmd_bench_run(client, "streaming, burst", id, burst, true, 0);
+    id += burst;
+    unsigned long long frames = client->parser.frames_ok - frames0;
+    pub.stop = true;
+    pthread_join(pub_thread, NULL);
+
+    client->stop = true;
+    pthread_join(client->thread, NULL);
+    printf("%llu frames received meanwhile, %llu resyncs, %llu acknowledgements dropped by the parser, %llu acknowledged by the server\n",
+           frames, client->parser.resyncs.load(), client->parser.acks_dropped.load(), server->commands.load());
+    close(client->sock);
+    delete client;
+    server->stop();
+    pthread_join(server_thread, NULL);
+    delete server;
+}
+
+typedef struct
+{
+    const char *name;
+    void (*fcn)();
+} bench_section;
+
+static const bench_section sections[] = {
+    {"hist", bench_hist},
+    {"net", bench_net},
+    {"parser", bench_parser},
+    {"jpeg", bench_jpeg},
+    {"tone", bench_tone},
+    {"pjpeg", bench_pjpeg},
+    {"scale", bench_scale},
+    {"raw", bench_raw},
+    {"recorder", bench_recorder},
+    {"kernels", bench_kernels},
+    {"stats", bench_stats},
+    {"exposure", bench_exposure},
+    {"stack", bench_stack},
+    {"calib", bench_calib},
+    {"cmd", bench_cmd},
+};
+
+int main(int argc, char *argv[])
+{
+    unsigned nsec = sizeof(sections) / sizeof(sections[0]);
+    for (unsigned i = 0; i < nsec; i++)
+    {
+        bool run = argc < 2;
+        for (int j = 1; j < argc; j++)
+            if (strcmp(argv[j], sections[i].name) == 0)
+                run = true;
+        if (run)
+            sections[i].fcn();
+    }
+    return 0;
+}
@@ -0,0 +1,458 @@
+/**
+ * @file fitsstat.cpp
+ * @brief Statistics of calibration directories (getcalib output) read in
+ * place from memory mapped FITS files, without cfitsio
+ *
+ * Usage: ./fitsstat.out [-j threads] [-k sigma] [-o dir] [-c csv] [-s] path ...
+ *
+ * Every path is a FITS file or a directory of them. The frames (planes of
+ * cubes included) are grouped by kind (flat_ prefix or dark), binning (from
+ * the getcalib file name), size and EXPOSURE, and each group is read once
+ * by a pool of threads, every thread owning a band of rows of every frame,
+ * into per pixel sum and sum of square maps. That gives
+ *
+ *   per frame    mean, standard deviation, min, max, saturated pixels
+ *   per group    mean and temporal variance maps, hot pixels (mean above
+ *                the median of the mean map by k robust sigma)
+ *   per binning  linearity: the mean of each exposure against a straight
+ *                line fitted below FITSSTAT_LINEAR_MAX of the range
+ *
+ * and the throughput, to compare with the disk bandwidth. -o writes the
+ * maps of every group as float FITS files, -c the frame statistics as CSV.
+ * Compressed and multi-extension files (getcalib -z, -m) are skipped.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <fits_map.h>
+
+#ifndef FITSSTAT_HOT_SIGMA
+#define FITSSTAT_HOT_SIGMA 5.0 // robust sigmas above the median of the mean map of a hot pixel
+#endif
+#ifndef FITSSTAT_LINEAR_MAX
+#define FITSSTAT_LINEAR_MAX 0.7 // fraction of 65535 the linearity is fitted below
+#endif
+#ifndef FITSSTAT_SAMPLE
+#define FITSSTAT_SAMPLE 7 // every n-th pixel of a map sampled for its median
+#endif
+#ifndef FITSSTAT_MIN_SIGNAL
+#define FITSSTAT_MIN_SIGNAL 100.0 // ADU above the offset below which the relative deviation is not shown
+#endif
+#define FITSSTAT_MAX_FRAMES 65536 // frames of a group, 32 bit sums
+
+typedef struct
+{
+    std::string file;
+    size_t plane;
+    float temp;
+    fits_pix_stats st;
+} fs_frame;
+
+typedef struct
+{
+    bool flat;
+    unsigned bin; // 0 if not in the file name
+    float exposure;
+    unsigned width, height;
+    std::vector<std::string> files;
+    std::vector<fs_frame> frames;
+    double mean;     // ADU, all frames
+    double var;      // ADU^2, median of the temporal variance map
+    double median;   // ADU, of the mean map
+    double sigma;    // ADU, robust spread of the mean map
+    size_t hot;      // pixels
+    double saturated; // fraction of the pixels
+} fs_group;
+
+/* one group read by the pool */
+typedef struct
+{
+    fs_group *grp;
+    std::vector<fits_map *> maps;
+    std::vector<const std::string *> names; // of the maps
+    uint32_t *sum;
+    uint64_t *sumsq;
+    unsigned threads;
+    bool simd;
+    std::vector<fits_pix_stats> stats; // [frame][thread]
+} fs_job;
+
+typedef struct
+{
+    fs_job *job;
+    unsigned id;
+} fs_worker;
+
+static double sysclock_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void *worker_fcn(void *_w)
+{
+    fs_worker *w = (fs_worker *)_w;
+    fs_job *job = w->job;
+    unsigned width = job->grp->width, height = job->grp->height;
+    size_t r0 = (size_t)height * w->id / job->threads, r1 = (size_t)height * (w->id + 1) / job->threads;
+    size_t start = r0 * width, n = (r1 - r0) * width;
+    size_t frame = 0;
+    for (size_t f = 0; f < job->maps.size(); f++)
+    {
+        if (w->id == 0 && f + 2 < job->maps.size())
+            job->maps[f + 2]->prefetch();
+        const fits_map *m = job->maps[f];
+        for (size_t p = 0; p < m->planes; p++, frame++)
+        {
+            fits_pix_stats *st = &job->stats[frame * job->threads + w->id];
+            fits_pix_stats_init(st);
+            m->accumulate(p, start, n, job->sum + start, job->sumsq + start, st, job->simd);
+        }
+    }
+    return NULL;
+}
+
+/* median and robust sigma (1.4826 MAD) of every FITSSTAT_SAMPLE-th value */
+static void robust_stats(const std::vector<float> &v, double *median, double *sigma)
+{
+    std::vector<float> s;
+    for (size_t i = 0; i < v.size(); i += FITSSTAT_SAMPLE)
+        s.push_back(v[i]);
+    if (s.empty())
+    {
+        *median = *sigma = 0;
+        return;
+    }
+    std::nth_element(s.begin(), s.begin() + s.size() / 2, s.end());
+    *median = s[s.size() / 2];
+    for (size_t i = 0; i < s.size(); i++)
+        s[i] = fabsf(s[i] - (float)*median);
+    std::nth_element(s.begin(), s.begin() + s.size() / 2, s.end());
+    *sigma = 1.4826 * s[s.size() / 2];
+}
+
+static void add_file(std::vector<fs_group> &groups, const std::string &path)
+{
+    fits_map m;
+    if (!m.open(path.c_str()))
+    {
+        fprintf(stderr, "fitsstat: %s: %s, skipped\n", path.c_str(), m.error);
+        return;
+    }
+    const char *name = strrchr(path.c_str(), '/');
+    name = name != NULL ? name + 1 : path.c_str();
+    bool flat = strncmp(name, "flat_", 5) == 0;
+    unsigned bin = 0;
+    if (sscanf(flat ? name + 5 : name, "bin%u_", &bin) != 1)
+        bin = 0;
+    size_t g = 0;
+    for (; g < groups.size(); g++)
+        if (groups[g].flat == flat && groups[g].bin == bin && groups[g].exposure == m.exposure && groups[g].width == m.naxes[0] && groups[g].height == m.naxes[1])
+            break;
+    if (g == groups.size())
+    {
+        fs_group grp;
+        grp.flat = flat;
+        grp.bin = bin;
+        grp.exposure = m.exposure;
+        grp.width = m.naxes[0];
+        grp.height = m.naxes[1];
+        groups.push_back(grp);
+    }
+    groups[g].files.push_back(path);
+}
+
+static void add_path(std::vector<fs_group> &groups, const char *path)
+{
+    struct stat sb;
+    if (stat(path, &sb) != 0)
+    {
+        fprintf(stderr, "fitsstat: Could not open %s\n", path);
+        return;
+    }
+    if (!S_ISDIR(sb.st_mode))
+        return add_file(groups, path);
+    DIR *d = opendir(path);
+    if (d == NULL)
+    {
+        fprintf(stderr, "fitsstat: Could not open directory %s\n", path);
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        const char *ext = strrchr(ent->d_name, '.');
+        if (ext != NULL && (strcmp(ext, ".fit") == 0 || strcmp(ext, ".fits") == 0))
+            add_file(groups, std::string(path) + "/" + ent->d_name);
+    }
+    closedir(d);
+}
+
+/**
+ * @brief Read the frames of a group on the pool and reduce its maps
+ *
+ * @param k Robust sigmas above the median of a hot pixel
+ * @return size_t Bytes of pixel data read
+ */
+static size_t process_group(fs_group *grp, unsigned threads, bool simd, double k, const char *outdir)
+{
+    fs_job job;
+    job.grp = grp;
+    job.simd = simd;
+    std::sort(grp->files.begin(), grp->files.end());
+    size_t frames = 0, bytes = 0;
+    for (size_t f = 0; f < grp->files.size(); f++)
+    {
+        fits_map *m = new fits_map;
+        if (!m->open(grp->files[f].c_str()) || frames + m->planes > FITSSTAT_MAX_FRAMES)
+        {
+            fprintf(stderr, "fitsstat: %s: %s, skipped\n", grp->files[f].c_str(), m->error != NULL ? m->error : "too many frames");
+            delete m;
+            continue;
+        }
+        frames += m->planes;
+        bytes += m->data_bytes();
+        job.maps.push_back(m);
+        job.names.push_back(&grp->files[f]);
+    }
+    for (size_t f = 0; f < 2 && f < job.maps.size(); f++)
+        job.maps[f]->prefetch();
+    size_t npix = (size_t)grp->width * grp->height;
+    std::vector<uint32_t> sum(npix, 0);
+    std::vector<uint64_t> sumsq(npix, 0);
+    job.sum = sum.data();
+    job.sumsq = sumsq.data();
+    job.threads = threads > grp->height ? grp->height : threads;
+    job.stats.resize(frames * job.threads);
+    std::vector<pthread_t> tids(job.threads);
+    std::vector<fs_worker> workers(job.threads);
+    for (unsigned t = 0; t < job.threads; t++)
+    {
+        workers[t].job = &job;
+        workers[t].id = t;
+        pthread_create(&tids[t], NULL, worker_fcn, &workers[t]);
+    }
+    for (unsigned t = 0; t < job.threads; t++)
+        pthread_join(tids[t], NULL);
+    // frames, their bands merged
+    fits_pix_stats all;
+    fits_pix_stats_init(&all);
+    size_t frame = 0;
+    for (size_t f = 0; f < job.maps.size(); f++)
+        for (size_t p = 0; p < job.maps[f]->planes; p++, frame++)
+        {
+            fs_frame fr;
+            fr.file = *job.names[f];
+            fr.plane = p;
+            fr.temp = job.maps[f]->temp;
+            fits_pix_stats_init(&fr.st);
+            for (unsigned t = 0; t < job.threads; t++)
+                fits_pix_stats_merge(&fr.st, &job.stats[frame * job.threads + t]);
+            fits_pix_stats_merge(&all, &fr.st);
+            grp->frames.push_back(fr);
+        }
+    for (size_t f = 0; f < job.maps.size(); f++)
+        delete job.maps[f];
+    grp->mean = all.n ? (double)all.sum / all.n : 0;
+    grp->saturated = all.n ? (double)all.saturated / all.n : 0;
+    grp->var = grp->median = grp->sigma = 0;
+    grp->hot = 0;
+    if (frames == 0)
+        return 0;
+    // maps
+    std::vector<float> mean(npix), var(npix);
+    for (size_t i = 0; i < npix; i++)
+    {
+        double m = (double)sum[i] / frames;
+        double v = frames > 1 ? ((double)sumsq[i] - m * sum[i]) / (frames - 1) : 0;
+        mean[i] = m;
+        var[i] = v > 0 ? v : 0;
+    }
+    double dummy;
+    robust_stats(var, &grp->var, &dummy);
+    robust_stats(mean, &grp->median, &grp->sigma);
+    float threshold = grp->median + k * grp->sigma;
+    std::vector<float> hot(outdir != NULL ? npix : 0);
+    for (size_t i = 0; i < npix; i++)
+    {
+        bool h = mean[i] > threshold;
+        grp->hot += h;
+        if (outdir != NULL)
+            hot[i] = h;
+    }
+    if (outdir != NULL)
+    {
+        char fname[1024];
+        const char *maps[] = {"mean", "var", "hot"};
+        const float *data[] = {mean.data(), var.data(), hot.data()};
+        for (int k = 0; k < 3; k++)
+        {
+            snprintf(fname, sizeof(fname), "%s/%s_%sbin%u_exp%u.fits", outdir, maps[k], grp->flat ? "flat_" : "", grp->bin, (unsigned)lround(grp->exposure * 1000));
+            if (!fits_write_float(fname, data[k], grp->width, grp->height))
+                fprintf(stderr, "fitsstat: Could not write %s\n", fname);
+        }
+    }
+    return bytes;
+}
+
+/* linearity of the groups of a kind and binning, by exposure */
+static void linearity(const std::vector<fs_group> &groups, bool flat, unsigned bin)
+{
+    std::vector<const fs_group *> pts;
+    for (size_t g = 0; g < groups.size(); g++)
+        if (groups[g].flat == flat && groups[g].bin == bin && !groups[g].frames.empty())
+            pts.push_back(&groups[g]);
+    if (pts.size() < 3)
+        return;
+    std::sort(pts.begin(), pts.end(), [](const fs_group *a, const fs_group *b)
+              { return a->exposure < b->exposure; });
+    // mean = offset + rate * exposure, on the unsaturated points in range
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (size_t i = 0; i < pts.size(); i++)
+    {
+        if (pts[i]->mean > FITSSTAT_LINEAR_MAX * 65535 || pts[i]->saturated > 0)
+            continue;
+        n++;
+        sx += pts[i]->exposure;
+        sy += pts[i]->mean;
+        sxx += pts[i]->exposure * pts[i]->exposure;
+        sxy += pts[i]->exposure * pts[i]->mean;
+    }
+    double det = n * sxx - sx * sx;
+    if (n < 2 || det <= 0)
+    {
+        printf("%s bin %u: not enough points in range for linearity\n", flat ? "flat" : "dark", bin);
+        return;
+    }
+    double rate = (n * sxy - sx * sy) / det, offset = (sy - rate * sx) / n;
+    printf("%s bin %u: %.1f ADU + %.2f ADU/s, %.0f points\n", flat ? "flat" : "dark", bin, offset, rate, n);
+    printf("%12s %12s %12s %10s %10s\n", "exposure (s)", "mean (ADU)", "fit (ADU)", "deviation", "of signal");
+    for (size_t i = 0; i < pts.size(); i++)
+    {
+        double fit = offset + rate * pts[i]->exposure;
+        double signal = fit - offset;
+        printf("%12.3f %12.1f %12.1f %10.1f", pts[i]->exposure, pts[i]->mean, fit, pts[i]->mean - fit);
+        if (signal >= FITSSTAT_MIN_SIGNAL)
+            printf(" %9.2f%%\n", (pts[i]->mean - fit) / signal * 100);
+        else
+            printf(" %10s\n", "-");
+    }
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-k sigma] [-o dir] [-c csv] [-s] path ...\n"
+                    "  -j  threads, default one per CPU\n"
+                    "  -k  sigmas above the median of a hot pixel, default %.1f\n"
+                    "  -o  write the mean, variance and hot pixel maps of every group to dir\n"
+                    "  -c  write the statistics of every frame to a CSV file\n"
+                    "  -s  scalar kernels only\n"
+                    "  path  FITS file or directory of them\n",
+            prog, FITSSTAT_HOT_SIGMA);
+}
+
+int main(int argc, char *argv[])
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = ncpu > 0 ? ncpu : 1;
+    double k = FITSSTAT_HOT_SIGMA;
+    const char *outdir = NULL, *csv = NULL;
+    bool simd = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:k:o:c:sh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            threads = threads > 0 ? threads : 1;
+            break;
+        case 'k':
+            k = atof(optarg);
+            break;
+        case 'o':
+            outdir = optarg;
+            break;
+        case 'c':
+            csv = optarg;
+            break;
+        case 's':
+            simd = false;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    double t0 = sysclock_s();
+    std::vector<fs_group> groups;
+    for (int i = optind; i < argc; i++)
+        add_path(groups, argv[i]);
+    std::sort(groups.begin(), groups.end(), [](const fs_group &a, const fs_group &b)
+              { return a.flat != b.flat ? b.flat : (a.bin != b.bin ? a.bin < b.bin : a.exposure < b.exposure); });
+    double t1 = sysclock_s();
+    size_t bytes = 0, frames = 0, files = 0;
+    printf("%5s %4s %11s %9s %7s %11s %11s %11s %9s %9s\n", "kind", "bin", "size", "exp (s)", "frames", "mean (ADU)", "median", "temp. var", "hot", "saturated");
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        fs_group *grp = &groups[g];
+        bytes += process_group(grp, threads, simd, k, outdir);
+        frames += grp->frames.size();
+        files += grp->files.size();
+        if (grp->frames.empty())
+            continue;
+        char size[32];
+        snprintf(size, sizeof(size), "%ux%u", grp->width, grp->height);
+        printf("%5s %4u %11s %9.3f %7zu %11.1f %11.1f %11.1f %9zu %8.4f%%\n", grp->flat ? "flat" : "dark", grp->bin, size, grp->exposure, grp->frames.size(), grp->mean, grp->median, grp->var, grp->hot, grp->saturated * 100);
+    }
+    double t2 = sysclock_s();
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        bool first = true;
+        for (size_t h = 0; h < g; h++)
+            first &= groups[h].flat != groups[g].flat || groups[h].bin != groups[g].bin;
+        if (first)
+            linearity(groups, groups[g].flat, groups[g].bin);
+    }
+    if (csv != NULL)
+    {
+        FILE *fp = fopen(csv, "w");
+        if (fp == NULL)
+            fprintf(stderr, "fitsstat: Could not write %s\n", csv);
+        else
+        {
+            fprintf(fp, "file,plane,kind,bin,exposure_s,temp_c,mean_adu,stdev_adu,min,max,saturated\n");
+            for (size_t g = 0; g < groups.size(); g++)
+                for (size_t f = 0; f < groups[g].frames.size(); f++)
+                {
+                    const fs_frame *fr = &groups[g].frames[f];
+                    double mean = fr->st.n ? (double)fr->st.sum / fr->st.n : 0;
+                    double var = fr->st.n ? (double)fr->st.sumsq / fr->st.n - mean * mean : 0;
+                    fprintf(fp, "%s,%zu,%s,%u,%.4f,%.2f,%.3f,%.3f,%u,%u,%llu\n", fr->file.c_str(), fr->plane, groups[g].flat ? "flat" : "dark", groups[g].bin, groups[g].exposure,
+                            fr->temp, mean, sqrt(var > 0 ? var : 0), fr->st.min, fr->st.max, (unsigned long long)fr->st.saturated);
+                }
+            fclose(fp);
+        }
+    }
+    printf("%zu files, %zu frames, %.1f MB in %.3f s (headers %.3f s): %.1f MB/s on %u threads%s\n", files, frames, bytes / 1e6, t2 - t0, t1 - t0,
+           t2 > t1 ? bytes / 1e6 / (t2 - t1) : 0.0, threads, simd ? "" : ", scalar");
+    return frames > 0 ? 0 : -1;
+}
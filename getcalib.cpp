@@ -1,169 +1,309 @@
-#include <iostream>
-#include <unistd.h>
-#include <string.h>
-#include <fitsio.h>
-#include <signal.h>
-
-#include <atikccdusb.h>
-
-#define MAX 10
-#define SIZE 100
-
-using namespace std;
-
-static AtikCamera *devices[MAX];
-
-void save(const char *fileName, unsigned short *data, unsigned width, unsigned height, float temp)
-{
-    fitsfile *fptr;
-    int status = 0, bitpix = USHORT_IMG, naxis = 2;
-    int bzero = 32768, bscale = 1;
-    long naxes[2] = {(long)width, (long)height};
-    unlink(fileName);
-    if (!fits_create_file(&fptr, fileName, &status))
-    {
-        fits_create_img(fptr, bitpix, naxis, naxes, &status);
-        fits_write_key(fptr, TSTRING, "PROGRAM", (void *)"atik_ccd_test", NULL, &status);
-        fits_write_key(fptr, TUSHORT, "BZERO", &bzero, NULL, &status);
-        fits_write_key(fptr, TUSHORT, "BSCALE", &bscale, NULL, &status);
-        fits_write_key(fptr, TFLOAT, "SENSOR TEMP", &temp, NULL, &status);
-        long fpixel[] = {1, 1};
-        fits_write_pix(fptr, TUSHORT, fpixel, width * height, data, &status);
-        fits_close_file(fptr, &status);
-        cerr << endl
-             << "saved to " << fileName << endl
-             << endl;
-    }
-}
-
-bool checkSaturation(unsigned short *img, unsigned int size)
-{
-    int count = size * 0.9; // 90% pixels are not saturated
-    for (unsigned int i = 0; i < size; i++)
-    {
-        if (img[i] == 65535) // saturated
-            count--;         // reduce counts from 90%
-    }
-    if (count < 0) // more than 90% pixels are saturated
-        return true;
-    return false;
-}
-
-volatile sig_atomic_t done = 0;
-
-void sighandler(int sig)
-{
-    done = 1;
-}
-
-int main(int argc, char *argv[])
-{
-    struct sigaction sa;
-    sa.sa_handler = &sighandler;
-    sigaction(SIGINT, &sa, NULL);
-    int count = AtikCamera::list(devices, MAX);
-    for (int i = 0; i < count; i++)
-    {
-        AtikCamera *device = devices[i];
-        cout << "open " << device->getName() << endl;
-
-        bool success = device->open();
-
-        if (success)
-            cout << "getting capabilities: " << endl;
-        AtikCapabilities *devcap = new AtikCapabilities;
-        const char *devname;
-        CAMERA_TYPE type;
-        success = device->getCapabilities(&devname, &type, devcap);
-
-        if (!success)
-        {
-            cout << "Could not get capabilites" << endl;
-            return -1;
-        }
-
-        unsigned pixelCX = devcap->pixelCountX;
-        unsigned pixelCY = devcap->pixelCountY;
-
-        unsigned pixelSX = devcap->pixelSizeX;
-        unsigned pixelSY = devcap->pixelSizeY;
-
-        unsigned maxBinX = devcap->maxBinX;
-        unsigned maxBinY = devcap->maxBinY;
-
-        unsigned tempSensorCount = devcap->tempSensorCount;
-
-        int offsetX = devcap->offsetX;
-        int offsetY = devcap->offsetY;
-
-        bool longExpMode = devcap->supportsLongExposure;
-
-        double minShortExp = devcap->minShortExposure;
-        double maxShortExp = devcap->maxShortExposure;
-
-        unsigned maxPixBin = maxBinX > maxBinY ? maxBinY : maxBinX;
-
-        cout << "Max Pixel Bin: " << maxPixBin << endl;
-
-        maxPixBin = 4;
-
-        unsigned short tmp[pixelCX * pixelCY];
-
-        success = device->readCCD(0, 0, pixelCX, pixelCY, 1, 1, 0.001);
-        if (success)
-            success = device->getImage(tmp, pixelCX * pixelCY);
-        else
-        {
-            cout << "Could not get first exposure" << endl;
-            return -1;
-        }
-
-        for (unsigned pixBin = 1; pixBin <= maxPixBin; pixBin *= 2) // bin loop
-        {
-            unsigned width = device->imageWidth(pixelCX, pixBin);
-            unsigned height = device->imageWidth(pixelCY, pixBin);
-            unsigned short *picData = new unsigned short[width * height];
-            // exposure loop
-            for (unsigned expTimeMs = 1; expTimeMs <= maxShortExp * 1000 * 10; expTimeMs *= 5)
-            {
-                for (int j = 0; j < MAX_IMAGES; j++)
-                {
-                    if (expTimeMs > maxShortExp * 1000)
-                    {
-                        success = device->startExposure(false);
-                        if (!success || done)
-                        {
-                            cout << "Failed to start long exposure" << endl;
-                            return -1;
-                        }
-                        long delay = device->delay(expTimeMs * 0.001d);
-                        // cout << "Exposure delay: " << delay << " us" << endl;
-                        usleep(delay);
-                        success = device->readCCD(0, 0, pixelCX, pixelCY, pixBin, pixBin);
-                    }
-                    else
-                        success = device->readCCD(0, 0, pixelCX, pixelCY, pixBin, pixBin, (double)expTimeMs * 0.0010d);
-                    if (success && (!done))
-                        success = device->getImage(picData, width * height);
-                    else
-                    {
-                        cout << "Error reading CCD" << endl;
-                        return -1;
-                    }
-
-                    float temp = -70;
-                    success = device->getTemperatureSensorStatus(1, &temp);
-                    char fname[256];
-                    snprintf(fname, 256, "bin%u_exp%u_%d.fit", pixBin, expTimeMs, j);
-                    save(fname, picData, width, height, temp);
-                    if (checkSaturation(picData, width * height))
-                        expTimeMs = maxShortExp * 1000 * 1000; // break the loop
-                }
-            }
-            delete picData;
-        }
-        delete devcap;
-        device->close();
-    }
-    return 0;
+#include <iostream>
+#include <unistd.h>
+#include <string.h>
+#include <fitsio.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <atikccdusb.h>
+#include <exposure.h>
+#include <frame_stats.h>
+#include <frame_queue.h>
+#include <photon_transfer.h>
+#include <fits_writer.h>
+#include <calib_fits.h>
+#include <sim_camera.h>
+
+#define MAX 10
+#define SIZE 100
+
+using namespace std;
+
+static AtikCamera *devices[MAX];
+
+#define FITS_QUEUE_DEPTH 8 // frames read out while the writer catches up
+#define SWEEP_SLOTS 4       // frames read out while the analysis catches up
+
+/**
+ * @brief Queue a frame for the background writer. Calibration frames are
+ * never dropped: if the writer is behind, this waits for a free slot.
+ *
+ */
+void save(fits_writer *writer, const char *fileName, unsigned short *data, unsigned width, unsigned height, unsigned bin, float temp, float exposure)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (writer->submit(fileName, data, width, height, temp, exposure, tv.tv_sec * 1000000ULL + tv.tv_usec, bin))
+        cerr << "queued " << fileName << endl;
+}
+
+static double sysclock_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+volatile sig_atomic_t done = 0;
+
+void sighandler(int sig)
+{
+    done = 1;
+}
+
+typedef struct
+{
+    unsigned short *data;
+    unsigned width, height;
+    unsigned bin;
+    unsigned exp_ms;
+} sweep_frame;
+
+/**
+ * @brief Analysis stage, behind the camera: statistics, saturation and
+ * photon transfer of every frame read out
+ *
+ */
+typedef struct
+{
+    spsc_queue<sweep_frame *> *in;  // from the capture loop
+    spsc_queue<sweep_frame *> *out; // slots back to it
+    photon_transfer ptc;
+    std::atomic<unsigned long long> analysed;
+    std::atomic<unsigned> saturated_ms; // shortest exposure saturated in this binning, 0 if none
+    std::atomic<bool> quit;
+} sweep_analysis;
+
+void *analysis_fcn(void *_ana)
+{
+    sweep_analysis *ana = (sweep_analysis *)_ana;
+    sweep_frame *frame;
+    while (!ana->quit)
+    {
+        if (!ana->in->pop_wait(frame, 100000))
+            continue;
+        size_t n = (size_t)frame->width * frame->height;
+        frame_stats st;
+        frame_stats_compute(frame->data, n, &st);
+        ana->ptc.add(frame->data, n, frame->bin, frame->exp_ms * 0.001f, &st);
+        if (checkSaturation(&st) && (ana->saturated_ms == 0 || frame->exp_ms < ana->saturated_ms))
+            ana->saturated_ms = frame->exp_ms;
+        ana->out->push(frame);
+        ana->analysed++;
+    }
+    return NULL;
+}
+
+void usage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [-n frames per file] [-m] [-z] [-f] [-d dir] [-c dirs]" << endl
+         << "  -n N  write the frames of every exposure N to a file, as a data cube" << endl
+         << "  -m    write batches as multi-extension files instead of cubes" << endl
+         << "  -z    Rice tile compression" << endl
+         << "  -f    flat field sweep (flat_bin*), with the camera on an evenly lit field" << endl
+         << "  -d    directory to write the sweep to, one per temperature" << endl
+         << "  -c    build the masters of sweep directories (':' separated) and list them, no camera" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned batch = 1;
+    fits_batch_mode mode = FITS_CUBE;
+    bool compress = false;
+    const char *prefix = "";
+    const char *dir = ".";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:mzfd:c:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            mode = FITS_MEF;
+            break;
+        case 'z':
+            compress = true;
+            break;
+        case 'f':
+            prefix = "flat_";
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'c':
+        {
+            calib_library lib;
+            double t0 = sysclock_s();
+            unsigned n = calib_load(&lib, optarg);
+            lib.report(stderr);
+            cerr << n << " masters in " << sysclock_s() - t0 << " s" << endl;
+            return n > 0 ? 0 : -1;
+        }
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (batch <= 1)
+        mode = FITS_SINGLE;
+    struct sigaction sa;
+    sa.sa_handler = &sighandler;
+    sigaction(SIGINT, &sa, NULL);
+    int count = camera_list(devices, MAX); // COMIC_CAMERA selects a simulated camera, see sim_camera.h
+    for (int i = 0; i < count; i++)
+    {
+        AtikCamera *device = devices[i];
+        cout << "open " << device->getName() << endl;
+
+        bool success = device->open();
+
+        if (success)
+            cout << "getting capabilities: " << endl;
+        AtikCapabilities *devcap = new AtikCapabilities;
+        const char *devname;
+        CAMERA_TYPE type;
+        success = device->getCapabilities(&devname, &type, devcap);
+
+        if (!success)
+        {
+            cout << "Could not get capabilites" << endl;
+            return -1;
+        }
+
+        unsigned pixelCX = devcap->pixelCountX;
+        unsigned pixelCY = devcap->pixelCountY;
+
+        unsigned pixelSX = devcap->pixelSizeX;
+        unsigned pixelSY = devcap->pixelSizeY;
+
+        unsigned maxBinX = devcap->maxBinX;
+        unsigned maxBinY = devcap->maxBinY;
+
+        unsigned tempSensorCount = devcap->tempSensorCount;
+
+        int offsetX = devcap->offsetX;
+        int offsetY = devcap->offsetY;
+
+        bool longExpMode = devcap->supportsLongExposure;
+
+        double minShortExp = devcap->minShortExposure;
+        double maxShortExp = devcap->maxShortExposure;
+
+        unsigned maxPixBin = maxBinX > maxBinY ? maxBinY : maxBinX;
+
+        cout << "Max Pixel Bin: " << maxPixBin << endl;
+
+        maxPixBin = 4;
+
+        fits_writer *writer = new fits_writer(FITS_QUEUE_DEPTH, pixelCX * pixelCY, mode, batch, compress);
+        spsc_queue<sweep_frame *> analysis_q(SWEEP_SLOTS), free_q(SWEEP_SLOTS);
+        sweep_frame slots[SWEEP_SLOTS];
+        for (unsigned k = 0; k < SWEEP_SLOTS; k++)
+        {
+            slots[k].data = new unsigned short[pixelCX * pixelCY];
+            free_q.push(&slots[k]); // the analysis is not running yet
+        }
+        sweep_analysis *ana = new sweep_analysis;
+        ana->in = &analysis_q;
+        ana->out = &free_q;
+        ana->analysed = 0;
+        ana->saturated_ms = 0;
+        ana->quit = false;
+
+        success = device->readCCD(0, 0, pixelCX, pixelCY, 1, 1, 0.001);
+        if (success)
+            success = device->getImage(slots[0].data, pixelCX * pixelCY);
+        else
+        {
+            cout << "Could not get first exposure" << endl;
+            return -1;
+        }
+        pthread_t analysis_thread;
+        if (pthread_create(&analysis_thread, NULL, analysis_fcn, ana) != 0)
+        {
+            cout << "Could not start the analysis thread" << endl;
+            return -1;
+        }
+
+        unsigned long long captured = 0;
+        double exposed = 0, tstart = sysclock_s();
+        for (unsigned pixBin = 1; pixBin <= maxPixBin && !done; pixBin *= 2) // bin loop
+        {
+            unsigned width = device->imageWidth(pixelCX, pixBin);
+            unsigned height = device->imageHeight(pixelCY, pixBin);
+            ana->saturated_ms = 0;
+            // exposure loop: the camera reads out the next frame while the
+            // writer and the analysis work on the previous ones
+            for (unsigned expTimeMs = 1; expTimeMs <= maxShortExp * 1000 * 10 && !done; expTimeMs *= 5)
+            {
+                for (int j = 0; j < MAX_IMAGES && !done; j++)
+                {
+                    sweep_frame *frame;
+                    while (!free_q.pop_wait(frame, 100000)) // the analysis is SWEEP_SLOTS frames behind
+                        ;
+                    if (expTimeMs > maxShortExp * 1000)
+                    {
+                        success = device->startExposure(false);
+                        if (!success || done)
+                        {
+                            cout << "Failed to start long exposure" << endl;
+                            return -1;
+                        }
+                        long delay = device->delay(expTimeMs * 0.001d);
+                        // cout << "Exposure delay: " << delay << " us" << endl;
+                        usleep(delay);
+                        success = device->readCCD(0, 0, pixelCX, pixelCY, pixBin, pixBin);
+                    }
+                    else
+                        success = device->readCCD(0, 0, pixelCX, pixelCY, pixBin, pixBin, (double)expTimeMs * 0.0010d);
+                    if (success && (!done))
+                        success = device->getImage(frame->data, width * height);
+                    else
+                    {
+                        cout << "Error reading CCD" << endl;
+                        return -1;
+                    }
+
+                    float temp = -70;
+                    success = device->getTemperatureSensorStatus(1, &temp);
+                    char fname[256];
+                    snprintf(fname, 256, "%s/%sbin%u_exp%u_%d.fit", dir, prefix, pixBin, expTimeMs, j);
+                    save(writer, fname, frame->data, width, height, pixBin, temp, expTimeMs * 0.001); // copied
+                    frame->width = width;
+                    frame->height = height;
+                    frame->bin = pixBin;
+                    frame->exp_ms = expTimeMs;
+                    analysis_q.push(frame); // never full: there are as many slots
+                    captured++;
+                    exposed += expTimeMs * 0.001;
+                }
+                writer->end_batch(); // one file per exposure
+                // the next exposure depends on the saturation of this one
+                while (ana->analysed < captured)
+                    usleep(1000);
+                if (ana->saturated_ms > 0)
+                    break;
+            }
+        }
+        ana->quit = true;
+        pthread_join(analysis_thread, NULL);
+        double elapsed = sysclock_s() - tstart;
+        cerr << "sweep: " << captured << " frames, " << exposed << " s exposed in " << elapsed << " s" << endl;
+        ana->ptc.report(stdout);
+        char fname[256];
+        snprintf(fname, 256, "%s/%sptc.csv", dir, prefix);
+        if (ana->ptc.write_csv(fname))
+            cout << "photon transfer points in " << fname << endl;
+        delete ana;
+        for (unsigned k = 0; k < SWEEP_SLOTS; k++)
+            delete[] slots[k].data;
+        writer->flush();
+        writer->report(stderr);
+        delete writer;
+        delete devcap;
+        device->close();
+    }
+    return 0;
 }
\ No newline at end of file
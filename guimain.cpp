@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -155,258 +156,109 @@ void AssignTexture(GLuint &image_texture, unsigned char *data, unsigned image_wi
 }
 
 #include <jpeglib.h>
+#include <comic_net.h>
+#include <net_cmd.h>
+#include <frame_parser.h>
+#include <frame_decode.h>
+#include <frame_latency.h>
 
 pthread_mutex_t texture_lock;
 
 GLuint my_image_texture;
 int my_image_width, my_image_height;
 
-typedef struct
-{
-    unsigned char *data;
-    unsigned max_size;
-    unsigned width;
-    unsigned height;
-} imagedata;
-
-bool LoadTextureFromMem(const unsigned char *in_jpeg, ssize_t len, imagedata *image)
-{
-    if (len <= 0 || in_jpeg == NULL || image->data == NULL || image->max_size == 0)
-    {
-        return false;
-    }
-    // Load from file
-    int image_width = 0;
-    int image_height = 0;
-    unsigned char *image_data = image->data;
-
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    /* More stuff */
-    JSAMPARRAY buffer; /* Output row buffer */
-    int row_stride;    /* physical row width in output buffer */
-
-    /* In this example we want to open the input file before doing anything else,
-   * so that the setjmp() error recovery below can assume the file is open.
-   * VERY IMPORTANT: use "b" option to fopen() if you are on a machine that
-   * requires it in order to read binary files.
-   */
-    cinfo.err = jpeg_std_error(&jerr);
-    /* Step 1: allocate and initialize JPEG decompression object */
-    jpeg_create_decompress(&cinfo);
-    /* Step 2: specify data source (eg, a file) */
-
-    jpeg_mem_src(&cinfo, in_jpeg, len);
-    /* Step 3: read file parameters with jpeg_read_header() */
-
-    jpeg_read_header(&cinfo, TRUE);
-    /* We can ignore the return value from jpeg_read_header since
-   *   (a) suspension is not possible with the stdio data source, and
-   *   (b) we passed TRUE to reject a tables-only JPEG file as an error.
-   * See libjpeg.txt for more info.
-   */
-    /* Step 4: set parameters for decompression */
-
-    /* In this example, we don't need to change any of the defaults set by
-   * jpeg_read_header(), so we do nothing here.
-   */
-
-    /* Step 5: Start decompressor */
-    cinfo.out_color_space = JCS_EXT_RGBA;
-    // cinfo.scale_num = 640; // scale to 480p
-    // cinfo.scale_denom = cinfo.image_width;
-    (void)jpeg_start_decompress(&cinfo);
-    /* We may need to do some setup of our own at this point before reading
-   * the data.  After jpeg_start_decompress() we have the correct scaled
-   * output image dimensions available, as well as the output colormap
-   * if we asked for color quantization.
-   * In this example, we need to make an output work buffer of the right size.
-   */
-    /* JSAMPLEs per row in output buffer */
-    row_stride = cinfo.output_width * cinfo.output_components;
-    /* Make a one-row-high sample array that will go away when done with image */
-    buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, row_stride, 1);
-
-    /* Step 6: while (scan lines remain to be read) */
-    /*           jpeg_read_scanlines(...); */
-
-    /* Here we use the library's state variable cinfo.output_scanline as the
-   * loop counter, so that we don't have to keep track ourselves.
-   */
-    int loc = 0;
-    if (image->max_size < row_stride * cinfo.output_height)
-    {
-        printf("%s: Required memory for raw image: %u, allocated: %u\n", __func__, row_stride * cinfo.output_height, image->max_size);
-        goto jpeg_end;
-    }
-    image_height = cinfo.output_height;
-    image_width = cinfo.output_width;
-    while (cinfo.output_scanline < cinfo.output_height)
-    {
-        /* jpeg_read_scanlines expects an array of pointers to scanlines.
-     * Here the array is only one element long, but you could ask for
-     * more than one scanline at a time if that's more convenient.
-     */
-        (void)jpeg_read_scanlines(&cinfo, buffer, 1);
-        /* Assume put_scanline_someplace wants a pointer and sample count. */
-        memcpy(&(image_data[loc]), buffer[0], row_stride);
-        loc += row_stride;
-    }
-
-    /* Step 7: Finish decompression */
-jpeg_end:
-    (void)jpeg_finish_decompress(&cinfo);
-    /* We can ignore the return value since suspension is not possible
-   * with the stdio data source.
-   */
-
-    /* Step 8: Release JPEG decompression object */
-
-    /* This is an important step since it will release a good deal of memory. */
-    jpeg_destroy_decompress(&cinfo);
-    /* After finish_decompress, we can close the input file.
-   * Here we postpone it until after no more JPEG errors are possible,
-   * so as to simplify the setjmp error logic above.  (Actually, I don't
-   * think that jpeg_destroy can do an error exit, but why assume anything...)
-   */
-
-    image->height = image_height;
-    image->width = image_width;
-    return true;
-}
-
 volatile bool conn_rdy = false;
 
-typedef struct __attribute__((packed))
-{
-    unsigned width;
-    unsigned height;
-    float temp;
-    float exposure;
-    uint64_t tstamp;
-    int size;
-} net_meta;
+frame_parser parser;
+frame_latency latency; // display thread only
+
+#define CMD_LOG 256 // commands whose send time is kept for the round trip
 
+/**
+ * @brief Commands sent and their acknowledgements (display thread only)
+ *
+ */
 typedef struct
 {
-    net_meta *metadata;
-    pthread_mutex_t lock;
-    unsigned char *data;
-} net_image;
-
-net_image img;
-
-static char rcv_buf[1024 * 1024];
+    uint32_t next_id;
+    uint64_t t_sent[CMD_LOG]; // by id % CMD_LOG
+    unsigned long long sent, acked, failed;
+    double last_rtt_ms;
+    int last_status;
+    uint16_t last_type;
+} command_log;
+
+command_log cmds;
+
+/* send a command with the next id, keeping its send time */
+static void send_cmd(int sock, uint16_t type, const void *payload = NULL, uint32_t len = 0)
+{
+    uint32_t id = cmds.next_id++;
+    cmds.t_sent[id % CMD_LOG] = net_clock_ns(CLOCK_MONOTONIC);
+    if (net_cmd_send(sock, type, id, payload, len))
+        cmds.sent++;
+    else
+        cmds.t_sent[id % CMD_LOG] = 0;
+}
 
-char *find_match(char *buf1, ssize_t len1, char *buf2, ssize_t len2)
+/* acknowledgements received since the last call */
+static void poll_acks()
 {
-    // fprintf(stderr, "%s: ", __func__);
-    // for (int i = 0; i < len2; i++)
-    //     fprintf(stderr, "%c", buf2[i]);
-    // fprintf(stderr, "\n");
-    bool matched = false;
-    ssize_t i = 0;
-    do
+    net_cmd_ack ack;
+    while (parser.pop_ack(&ack))
     {
-        if (buf1[i] == buf2[0])
+        cmds.acked++;
+        uint64_t t = cmds.t_sent[ack.id % CMD_LOG];
+        if (t > 0 && cmds.next_id - ack.id <= CMD_LOG)
+            cmds.last_rtt_ms = (net_clock_ns(CLOCK_MONOTONIC) - t) * 1e-6;
+        if (ack.status != NET_ACK_OK)
         {
-            matched = true;
-            for (ssize_t j = 1; j < len2; j++)
-            {
-                // fprintf(stderr, "%s: %c %c\n", __func__, buf1[i + j], buf2[j]);
-                if (buf1[i + j] != buf2[j])
-                {
-                    matched = false;
-                    break;
-                }
-            }
+            cmds.failed++;
+            cmds.last_status = ack.status;
+            cmds.last_type = ack.type;
         }
-        if (++i >= len1)
-            break;
-    } while (!matched);
-    i--;
-    // fprintf(stderr, "%s: matched: %d, idx: %ld, string: ", __func__, matched, i);
-    // for (ssize_t j = 0; j < len2; j++)
-    //     fprintf(stderr, "%c", buf1[i+j]);
-    // fprintf(stderr, "\n");
-    if (matched)
-        return &(buf1[i]);
-    return NULL;
+    }
 }
 
-pthread_mutex_t lock;
+/**
+ * @brief Stamps of the frame decoded last, completed once it is on screen
+ *
+ */
+typedef struct
+{
+    bool pending;
+    net_meta meta;
+    uint64_t t_receive;
+    uint64_t t_receive_real;
+    uint64_t t_decode;
+} latency_sample;
+
 void *rcv_thr(void *sock)
 {
-    img.metadata = (net_meta *)malloc(sizeof(net_meta));
-    img.data = (unsigned char *)malloc(1024 * 1024 * 4);
-    memset(rcv_buf, 0x0, sizeof(rcv_buf));
+    int last_sock = -1;
     while (!done)
     {
-        memset(rcv_buf, 0x0, sizeof(rcv_buf));
-        usleep(1000 * 1000 / 30); // receive at 120 Hz
-        if (conn_rdy)
+        if (!conn_rdy)
         {
-            // char tmp_buf[8];
-            // ssize_t sz = recv(*(int *)sock, tmp_buf, sizeof(tmp_buf), 0);
-            // if (sz <= 0)
-            //     continue; // did not receive anything
-            // else
-            //     fprintf(stderr, "Received: %ld bytes\n", sz);
-            // fprintf(stderr, "Received: %c%c%c%c%d", tmp_buf[0], tmp_buf[1], tmp_buf[2], tmp_buf[3], *(int *)(&tmp_buf[4]));
-            // if (tmp_buf[0] == 'H' && tmp_buf[1] == 'E' && tmp_buf[2] == 'A' && tmp_buf[3] == 'D')
-            // {
-            //     sz = *(int32_t *)(&tmp_buf[4]);
-            //     fprintf(stderr, "Data to receive: %ld bytes\n", sz);
-            // }
-            // else
-            //     continue;
-            int offset = 0;
-            char *head = NULL, *tail = NULL;
-            do
-            {
-                int sz = recv(*(int *)sock, rcv_buf + offset, sizeof(rcv_buf) - offset, 0);
-                if (sz < 0)
-                    continue;
-                offset += sz;
-                head = find_match(rcv_buf, sizeof(rcv_buf), (char *)"FBEGIN", 6);
-                if (head != NULL)
-                    tail = find_match(head, sizeof(rcv_buf) - (head - rcv_buf), (char *)"FEND", 4);
-                // fprintf(stderr, "received: total %d bytes, head: %p, tail: %p\n", offset, (void *)(head), (void *)(tail));
-                // for (int i = 0; i < offset; i++)
-                //     fprintf(stderr, "%c", rcv_buf[i]);
-                // fprintf(stderr, "\n");
-                if (head != NULL && tail != NULL)
-                    break;
-            } while (conn_rdy);
-            if (head != NULL)
-            {
-                // fprintf(stderr, "%s: Head found at 0x%p\n", __func__, (void *)head);
-                if (tail != NULL && tail > head)
-                {
-                    // fprintf(stderr, "%s: Tail found at 0x%p\n", __func__, (void *)tail);
-                    pthread_mutex_lock(&lock);
-                    memcpy(img.metadata, head + 6, sizeof(net_meta));
-                    fprintf(stderr, "Tstamp: %lu\n", img.metadata->tstamp);
-                    fprintf(stderr, "Width: %u\n", img.metadata->width);
-                    fprintf(stderr, "Hidth: %u\n", img.metadata->height);
-                    fprintf(stderr, "Temp: %f\n", img.metadata->temp);
-                    fprintf(stderr, "Exposure: %f s\n", img.metadata->exposure);
-                    fprintf(stderr, "JPEG Size: %d\n", img.metadata->size);
-                    if (img.metadata->size > 0)
-                    {
-                        memcpy(img.data, head + 6 + sizeof(net_meta), img.metadata->size);
-                    }
-                    pthread_mutex_unlock(&lock);
-                    if (head + 6 + sizeof(net_meta) + img.metadata->size != tail)
-                    {
-                        fprintf(stderr, "Head + data does not match tail: 0x%p and 0x%p\n", (void *)(head + 6 + sizeof(net_meta) + img.metadata->size), (void *)tail);
-                    }
-                }
-            }
+            usleep(1000 * 1000 / 60);
+            continue;
+        }
+        int fd = *(int *)sock;
+        if (fd != last_sock) // new connection, drop any partial frame
+        {
+            parser.reset();
+            last_sock = fd;
+        }
+        unsigned char *ptr;
+        size_t len = parser.want(&ptr);
+        ssize_t sz = recv(fd, ptr, len, 0);
+        if (sz <= 0)
+        {
+            usleep(1000 * 1000 / 60); // disconnected or no data
+            continue;
         }
+        parser.commit(sz);
     }
-    free(img.metadata);
-    free(img.data);
     return NULL;
 }
 
@@ -480,6 +332,8 @@ int main(int, char **)
     // Our state
     ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
     bool show_readout_win = true;
+    latency_sample shown = {false};
+    imagedata live_image = {NULL, 0, 0, 0}; // decoded RGBA, grown to the largest frame shown
 
     static int jpg_qty = 70;
 
@@ -544,6 +398,8 @@ int main(int, char **)
                     }
                     else
                     {
+                        int one = 1; // commands go out at once, not behind Nagle
+                        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
                         conn_rdy = true;
                     }
                 }
@@ -562,33 +418,160 @@ int main(int, char **)
             {
                 if (ImGui::InputInt("JPEG Quality", &jpg_qty, 1, 10))
                 {
-                    static char msg[1024];
-                    int sz = snprintf(msg, 1024, "CMD_JPEG_SET_QUALITY%d", jpg_qty);
-                    send(sock, msg, sz, 0);
+                    int32_t quality = jpg_qty < 0 ? 0 : (jpg_qty > 100 ? 100 : jpg_qty);
+                    send_cmd(sock, NET_CMD_JPEG_QUALITY, &quality, sizeof(quality));
+                }
+                static int preview_width = 0;
+                if (ImGui::InputInt("Preview width (0: full)", &preview_width, 64, 256))
+                {
+                    if (preview_width < 0)
+                        preview_width = 0;
+                    int32_t width = preview_width;
+                    send_cmd(sock, NET_CMD_PREVIEW_WIDTH, &width, sizeof(width));
+                }
+                static int roi[4] = {0, 0, 0, 0}; // x, y, width, height
+                ImGui::InputInt4("ROI (x, y, w, h)", roi);
+                bool set_roi = ImGui::Button("Set ROI");
+                ImGui::SameLine();
+                if (ImGui::Button("Full frame"))
+                {
+                    memset(roi, 0x0, sizeof(roi));
+                    set_roi = true;
+                }
+                if (set_roi)
+                {
+                    for (int i = 0; i < 4; i++)
+                        roi[i] = roi[i] < 0 ? 0 : roi[i];
+                    net_roi r = {(uint32_t)roi[0], (uint32_t)roi[1], (uint32_t)roi[2], (uint32_t)roi[3]};
+                    send_cmd(sock, NET_CMD_SET_ROI, &r, sizeof(r));
+                }
+                static bool raw = false;
+                if (ImGui::Checkbox("Lossless 16 bit", &raw))
+                {
+                    uint32_t format = raw ? NET_FORMAT_RAW16 : NET_FORMAT_JPEG;
+                    send_cmd(sock, NET_CMD_SET_FORMAT, &format, sizeof(format));
+                }
+                static int stretch = 0;
+                static float stretch_lo = 0.5, stretch_hi = 99.5, stretch_param = 2.2;
+                bool changed = ImGui::Combo("Stretch", &stretch, "None\0Min/Max\0Percentile\0Gamma\0Asinh\0");
+                if (stretch >= 2)
+                    changed |= ImGui::DragFloatRange2("Clip (%)", &stretch_lo, &stretch_hi, 0.1f, 0.0f, 100.0f);
+                if (stretch >= 3)
+                    changed |= ImGui::InputFloat(stretch == 3 ? "Gamma" : "Softening", &stretch_param, 0.1f, 1.0f);
+                if (changed)
+                {
+                    net_cmd_stretch cmd = {stretch, stretch_lo, stretch_hi, stretch_param};
+                    send_cmd(sock, NET_CMD_STRETCH, &cmd, sizeof(cmd));
+                    stretch_cfg cfg = {(stretch_mode)stretch, stretch_lo, stretch_hi, stretch_param};
+                    tone_map::set_stretch(cfg); // raw frames are stretched here
+                }
+                static int stack = 0, stack_window = 16;
+                static float stack_sigma = 0;
+                bool stack_changed = ImGui::Combo("Stack", &stack, "Off\0Sliding window\0Cumulative\0");
+                if (stack == 1)
+                    stack_changed |= ImGui::InputInt("Window (frames)", &stack_window, 1, 16);
+                if (stack > 0)
+                    stack_changed |= ImGui::InputFloat("Clip (sigma, 0: off)", &stack_sigma, 0.5f, 1.0f);
+                if (stack_changed)
+                {
+                    if (stack_window < 1)
+                        stack_window = 1;
+                    net_cmd_stack cmd = {stack, (uint32_t)stack_window, stack_sigma};
+                    send_cmd(sock, NET_CMD_STACK, &cmd, sizeof(cmd));
+                }
+                static int calib = 2;
+                if (ImGui::Combo("Calibration", &calib, "Off\0Nearest dark\0Interpolated dark\0"))
+                {
+                    int32_t mode = calib;
+                    send_cmd(sock, NET_CMD_CALIB, &mode, sizeof(mode));
                 }
+                static int bin_mode = 0, bin = 0;
+                static float bin_fps = 5, bin_latency = 200;
+                bool bin_changed = ImGui::Combo("Binning", &bin_mode, "Fixed\0Auto: frame rate\0Auto: latency\0");
+                if (bin_mode == 0)
+                    bin_changed |= ImGui::Combo("Bin", &bin, "1x1\0" "2x2\0" "4x4\0");
+                else if (bin_mode == 1)
+                    bin_changed |= ImGui::InputFloat("Target (fps)", &bin_fps, 0.5f, 5.0f);
+                else
+                    bin_changed |= ImGui::InputFloat("Max latency (ms)", &bin_latency, 10.0f, 100.0f);
+                if (bin_changed)
+                {
+                    bin_fps = bin_fps < 0.1f ? 0.1f : bin_fps;
+                    bin_latency = bin_latency < 1 ? 1 : bin_latency;
+                    net_cmd_bin cmd = {bin_mode, bin_mode == 0 ? (float)(1 << bin) : (bin_mode == 1 ? bin_fps : bin_latency)};
+                    send_cmd(sock, NET_CMD_BIN, &cmd, sizeof(cmd));
+                }
+                poll_acks();
+                ImGui::Text("Commands: %llu sent, %llu acknowledged, last in %.2f ms", cmds.sent, cmds.acked, cmds.last_rtt_ms);
+                if (cmds.failed > 0)
+                    ImGui::Text("%llu commands refused, last: command %u, status %d", cmds.failed, cmds.last_type, cmds.last_status);
             }
             if (conn_rdy && sock > 0)
             {
+                static unsigned live_width = 0, live_height = 0;
+                bool is_new = false;
+                rx_frame *frame = parser.latest(&is_new); // valid until the next call
                 pthread_mutex_lock(&texture_lock);
-                struct timeval tstamp;
-                tstamp.tv_sec = img.metadata->tstamp / (uint64_t)1000000;
-                tstamp.tv_usec = (img.metadata->tstamp % 1000000);
-                struct tm ts;
-                char buf[80];
-
-                // Format time, "ddd yyyy-mm-dd hh:mm:ss zzz"
-                ts = *localtime(&tstamp.tv_sec);
-                strftime(buf, sizeof(buf), "%a %Y-%m-%d %H:%M:%S %Z", &ts);
-                ImGui::Text(u8"Timestamp: %s | Exposure: %.3f s | CCD Temp: %.2f °C", buf, img.metadata->exposure, img.metadata->temp);
-                imagedata live_image;
-                live_image.max_size = 1024*1024*4*2;
-                live_image.data = (unsigned char *)malloc(live_image.max_size);
-                LoadTextureFromMem(img.data, (img.metadata->size), &live_image);
-                float w = ImGui::GetContentRegionAvailWidth();
-                float h = w * (live_image.height * 1.0 / live_image.width);
-                AssignTexture(my_image_texture, live_image.data, live_image.width, live_image.height);
-                free(live_image.data);
-                ImGui::Image((void *)(intptr_t)my_image_texture, ImVec2(w, h));
+                if (frame != NULL)
+                {
+                    struct timeval tstamp;
+                    tstamp.tv_sec = frame->meta.tstamp / (uint64_t)1000000;
+                    tstamp.tv_usec = (frame->meta.tstamp % 1000000);
+                    struct tm ts;
+                    char buf[80];
+
+                    // Format time, "ddd yyyy-mm-dd hh:mm:ss zzz"
+                    ts = *localtime(&tstamp.tv_sec);
+                    strftime(buf, sizeof(buf), "%a %Y-%m-%d %H:%M:%S %Z", &ts);
+                    ImGui::Text(u8"Timestamp: %s | Exposure: %.3f s | CCD Temp: %.2f °C", buf, frame->meta.exposure, frame->meta.temp);
+                    ImGui::Text("Pixels: min %u, max %u, mean %.1f, stdev %.1f, %u saturated", frame->meta.pix_min, frame->meta.pix_max, frame->meta.pix_mean, frame->meta.pix_stdev, frame->meta.pix_saturated);
+                    if (frame->meta.stacked > 1)
+                        ImGui::Text("Stack: mean of %u frames", frame->meta.stacked);
+                    if (frame->meta.x > 0 || frame->meta.y > 0)
+                        ImGui::Text("Region: %u x %u at (%u, %u)", frame->meta.width, frame->meta.height, frame->meta.x, frame->meta.y);
+                    if (frame->meta.bin > 1)
+                        ImGui::Text("Binning: %u x %u", frame->meta.bin, frame->meta.bin);
+                    ImGui::Text("Frames: %llu received, %llu not displayed, %llu resyncs", parser.frames_ok.load(), parser.frames_dropped.load(), parser.resyncs.load());
+                }
+                if (ImGui::CollapsingHeader("Latency"))
+                {
+                    ImGui::Text("Last %u of %llu frames, ms:  p50  p90  p99  max", LATENCY_WINDOW, latency.frames);
+                    for (int i = 0; i < LAT_NUM_STAGES; i++)
+                    {
+                        double p50, p90, p99, max;
+                        if (latency.percentiles(i, &p50, &p90, &p99, &max))
+                            ImGui::Text("%-20s %8.2f %8.2f %8.2f %8.2f", latency_stage_names[i], p50, p90, p99, max);
+                    }
+                    if (ImGui::Button("Reset latency"))
+                        latency.reset();
+                }
+                if (frame != NULL && is_new) // decode only when a new frame came in
+                {
+                    bool ok = imagedata_reserve(&live_image, frame->meta.width, frame->meta.height); // raw frames come at full scale
+                    if (!ok)
+                        printf("Out of memory for a %u x %u frame\n", frame->meta.width, frame->meta.height);
+                    else if (frame->meta.format == NET_FORMAT_RAW16)
+                        ok = LoadRawFromMem(frame->payload(), frame->meta.size, &live_image);
+                    else
+                        ok = LoadTextureFromMem(frame->payload(), frame->meta.size, &live_image);
+                    if (ok)
+                    {
+                        AssignTexture(my_image_texture, live_image.data, live_image.width, live_image.height);
+                        live_width = live_image.width;
+                        live_height = live_image.height;
+                        shown.pending = true;
+                        shown.meta = frame->meta;
+                        shown.t_receive = frame->t_receive;
+                        shown.t_receive_real = frame->t_receive_real;
+                        shown.t_decode = net_clock_ns(CLOCK_MONOTONIC);
+                    }
+                }
+                if (live_width > 0)
+                {
+                    float w = ImGui::GetContentRegionAvailWidth();
+                    float h = w * (live_height * 1.0 / live_width);
+                    ImGui::Image((void *)(intptr_t)my_image_texture, ImVec2(w, h));
+                }
                 pthread_mutex_unlock(&texture_lock);
             }
             ImGui::End();
@@ -622,10 +605,16 @@ int main(int, char **)
         }
 
         glfwSwapBuffers(window);
+        if (shown.pending) // the decoded frame is on screen now
+        {
+            latency.add(&shown.meta, shown.t_receive, shown.t_receive_real, shown.t_decode, net_clock_ns(CLOCK_MONOTONIC));
+            shown.pending = false;
+        }
     }
 end:
     done = 1;
     close(sock);
+    free(live_image.data);
     // Cleanup
     ImGui_ImplOpenGL2_Shutdown();
     ImGui_ImplGlfw_Shutdown();
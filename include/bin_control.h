@@ -0,0 +1,207 @@
+/**
+ * @file bin_control.h
+ * @brief Binning of the next readout: fixed, or the finest one that reaches a
+ * frame rate or stays under a latency, from the measured stage times
+ *
+ * Binning b sums b x b pixels, so the same level takes 1/b^2 of the
+ * exposure: exposures are passed around as their 1x1 equivalent. The
+ * pipeline stages report their time per frame at each binning (1, 2 and 4,
+ * up to the camera's maximum), smoothed. A binning not measured yet is
+ * estimated from the nearest measured one, scaled by its number of pixels.
+ * Then
+ *
+ *   period  = max(exposure / b^2 + readout, analysis, encode)
+ *   latency = exposure / b^2 + readout + analysis + encode
+ *
+ * A binning is held for BIN_HOLD_FRAMES frames after a change so it gets
+ * measured, and a finer one is only taken with BIN_MARGIN of headroom, so
+ * the choice does not flap at the edge of the target.
+ *
+ */
+#ifndef BIN_CONTROL_H_
+#define BIN_CONTROL_H_
+
+#include <stdio.h>
+#include <atomic>
+
+#ifndef BIN_HOLD_FRAMES
+#define BIN_HOLD_FRAMES 8 // frames read at a binning before it may change again
+#endif
+#ifndef BIN_MARGIN
+#define BIN_MARGIN 0.2 // headroom on the target needed to move to a finer binning
+#endif
+#define BIN_LEVELS 3 // binning 1, 2 and 4
+
+typedef enum
+{
+    BIN_FIXED = 0,   // target is the binning
+    BIN_FPS = 1,     // target is frames per second
+    BIN_LATENCY = 2, // target is ms from exposure start to publication
+    BIN_NUM_MODES
+} bin_mode;
+
+static const char *bin_mode_names[] = {"fixed", "frame rate", "latency"};
+
+class bin_controller
+{
+private:
+    std::atomic<int> mode;
+    std::atomic<double> target;
+    unsigned max_level;
+    // s per frame, 0 until measured, one writer each
+    std::atomic<double> readout[BIN_LEVELS];  // capture
+    std::atomic<double> analysis[BIN_LEVELS]; // analysis
+    std::atomic<double> encode[BIN_LEVELS];   // encode
+    unsigned level; // of the next readout, capture only
+    unsigned hold;
+
+    static unsigned level_of(unsigned bin)
+    {
+        return bin >= 4 ? 2 : (bin >= 2 ? 1 : 0);
+    }
+    static void smooth(std::atomic<double> &avg, double s)
+    {
+        double v = avg;
+        avg = v > 0 ? 0.8 * v + 0.2 * s : s;
+    }
+    /* time of a stage at a level, from the nearest level measured */
+    static double estimate(const std::atomic<double> *t, unsigned l)
+    {
+        for (unsigned d = 0; d < BIN_LEVELS; d++)
+        {
+            if (l >= d && t[l - d] > 0)
+                return t[l - d] / (1 << (2 * d)); // coarser: 1/4 the pixels per level
+            if (l + d < BIN_LEVELS && t[l + d] > 0)
+                return t[l + d] * (1 << (2 * d));
+        }
+        return 0;
+    }
+
+public:
+    std::atomic<unsigned long long> changes;
+
+    /**
+     * @param max_bin Largest binning of the camera
+     */
+    bin_controller(unsigned max_bin)
+    {
+        max_level = level_of(max_bin);
+        mode = BIN_FIXED;
+        target = 1;
+        for (unsigned l = 0; l < BIN_LEVELS; l++)
+            readout[l] = analysis[l] = encode[l] = 0;
+        level = 0;
+        hold = 0;
+        changes = 0;
+    }
+    /**
+     * @brief Change the policy (any thread)
+     *
+     * @param value Binning, frames per second or ms, see bin_mode
+     * @return false Unknown mode or a target out of range, unchanged
+     */
+    bool set(int mode, double value)
+    {
+        if (mode < 0 || mode >= BIN_NUM_MODES || !(value > 0))
+            return false;
+        target = value;
+        this->mode = mode;
+        return true;
+    }
+    int get_mode() const
+    {
+        return mode;
+    }
+    static unsigned bin_of(unsigned level)
+    {
+        return 1u << level;
+    }
+    /**
+     * @brief Per frame times of the stages at a binning, s
+     *
+     */
+    void add_readout(unsigned bin, double s)
+    {
+        smooth(readout[level_of(bin)], s);
+    }
+    void add_analysis(unsigned bin, double s)
+    {
+        smooth(analysis[level_of(bin)], s);
+    }
+    void add_encode(unsigned bin, double s)
+    {
+        smooth(encode[level_of(bin)], s);
+    }
+    /**
+     * @brief Predicted frame period and latency at a binning, s
+     *
+     * @param exposure 1x1 equivalent exposure, s
+     */
+    double period(unsigned bin, double exposure) const
+    {
+        unsigned l = level_of(bin);
+        double capture = exposure / (bin * bin) + estimate(readout, l);
+        double a = estimate(analysis, l), e = estimate(encode, l);
+        double p = capture > a ? capture : a;
+        return p > e ? p : e;
+    }
+    double latency(unsigned bin, double exposure) const
+    {
+        unsigned l = level_of(bin);
+        return exposure / (bin * bin) + estimate(readout, l) + estimate(analysis, l) + estimate(encode, l);
+    }
+    /**
+     * @brief Binning of the next readout (capture only)
+     *
+     * @param exposure 1x1 equivalent exposure it will take, s
+     */
+    unsigned next(double exposure)
+    {
+        int m = mode;
+        unsigned want = level;
+        if (m == BIN_FIXED)
+        {
+            want = level_of((unsigned)target);
+            want = want > max_level ? max_level : want;
+        }
+        else if (hold > 0)
+            hold--;
+        else if (readout[0] > 0 || readout[1] > 0 || readout[2] > 0)
+        {
+            double goal = m == BIN_FPS ? 1.0 / target : target * 1e-3;
+            want = max_level; // none reaches the target: the fastest
+            for (unsigned l = 0; l <= max_level; l++)
+            {
+                double t = m == BIN_FPS ? period(bin_of(l), exposure) : latency(bin_of(l), exposure);
+                if (t * (l < level ? 1 + BIN_MARGIN : 1) <= goal)
+                {
+                    want = l;
+                    break;
+                }
+            }
+        }
+        if (want != level)
+        {
+            level = want;
+            hold = BIN_HOLD_FRAMES;
+            changes++;
+        }
+        return bin_of(level);
+    }
+    void report(FILE *fp) const
+    {
+        int m = mode;
+        fprintf(fp, "binning: %s", bin_mode_names[m]);
+        if (m == BIN_FPS)
+            fprintf(fp, " %.2f fps", target.load());
+        else if (m == BIN_LATENCY)
+            fprintf(fp, " %.0f ms", target.load());
+        fprintf(fp, ", %llu changes", changes.load());
+        for (unsigned l = 0; l <= max_level; l++)
+            if (readout[l] > 0)
+                fprintf(fp, " | %ux%u: readout %.1f ms, analysis %.1f ms, encode %.1f ms", bin_of(l), bin_of(l), readout[l] * 1e3, analysis[l] * 1e3, encode[l] * 1e3);
+        fprintf(fp, "\n");
+    }
+};
+
+#endif // BIN_CONTROL_H_
@@ -0,0 +1,549 @@
+/**
+ * @file calib.h
+ * @brief Master calibration frames and their correction of live frames
+ *
+ * A library of masters built from the getcalib sweeps (see calib_fits.h),
+ * kept in memory and indexed by binning, exposure and CCD temperature:
+ *
+ *   bias  the shortest dark of a sweep
+ *   dark  median of the frames of one exposure of a sweep, ADU
+ *   flat  mean / (median of a flat exposure - its dark), one per binning
+ *
+ * Every sweep (directory) is one temperature. The dark of a frame is made
+ * from the sweep nearest its temperature, either its nearest exposure or
+ * interpolated linearly in exposure between the two around it (dark
+ * current above the bias extrapolated from the longest one), then the dark
+ * current scaled by 2^(dT / CALIB_DARK_DOUBLING) for the temperature
+ * difference. That dark is cached until the binning, exposure or
+ * temperature (to CALIB_TEMP_STEP) changes, so a frame costs one pass:
+ *
+ *   out = (raw - dark) * gain + CALIB_PEDESTAL
+ *
+ * with SSE2/NEON, the pedestal keeping the noise of the sky free of
+ * clipping at 0.
+ *
+ * Medians are combined over CALIB_THREADS threads, each a band of pixels.
+ *
+ */
+#ifndef CALIB_H_
+#define CALIB_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define CALIB_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CALIB_NEON 1
+#endif
+
+#ifndef CALIB_PEDESTAL
+#define CALIB_PEDESTAL 100.0f // ADU added to corrected frames
+#endif
+#ifndef CALIB_DARK_DOUBLING
+#define CALIB_DARK_DOUBLING 6.3 // C for the dark current to double, typical of CCDs
+#endif
+#ifndef CALIB_TEMP_STEP
+#define CALIB_TEMP_STEP 1.0 // C the temperature moves before the dark is remade
+#endif
+#ifndef CALIB_THREADS
+#define CALIB_THREADS 0 // threads of the median combine, 0: one per online CPU
+#endif
+#ifndef CALIB_MAX_FRAMES
+#define CALIB_MAX_FRAMES 64 // frames combined into a master at most
+#endif
+#ifndef CALIB_FLAT_LEVEL
+#define CALIB_FLAT_LEVEL 25000.0 // ADU above the dark the flat of a binning is picked closest to
+#endif
+#ifndef CALIB_FLAT_MAX_LEVEL
+#define CALIB_FLAT_MAX_LEVEL 50000.0 // ADU, brighter flats are near saturation
+#endif
+#ifndef CALIB_FLAT_MIN_LEVEL
+#define CALIB_FLAT_MIN_LEVEL 2000.0 // ADU above the dark, fainter flats are mostly noise
+#endif
+#ifndef CALIB_FLAT_MAX_GAIN
+#define CALIB_FLAT_MAX_GAIN 4.0f // larger corrections are dead pixels, left alone
+#endif
+
+typedef enum
+{
+    CALIB_BIAS = 0,
+    CALIB_DARK,
+    CALIB_FLAT,
+    CALIB_NUM_KINDS
+} calib_kind;
+
+static const char *const calib_kind_names[CALIB_NUM_KINDS] = {"bias", "dark", "flat"};
+
+typedef enum
+{
+    CALIB_OFF = 0,
+    CALIB_NEAREST,     // dark of the nearest exposure
+    CALIB_INTERPOLATE, // dark interpolated in exposure
+    CALIB_NUM_MODES
+} calib_mode;
+
+typedef struct
+{
+    calib_kind kind;
+    unsigned bin;
+    unsigned width, height;
+    float exposure;  // s
+    float temp;      // C, mean of the frames, NAN if unknown
+    unsigned frames; // combined
+    unsigned sweep;  // masters of one sweep share a bias and a temperature
+    float signal;    // flat: mean ADU above the dark
+    std::vector<unsigned short> level; // bias and dark, ADU
+    std::vector<float> gain;           // flat, per pixel
+} calib_master;
+
+/* data = (data - dark) * gain + pedestal, rounded and clamped to 16 bits; gain may be NULL */
+static inline void calib_apply_scalar(unsigned short *data, const unsigned short *dark, const float *gain, size_t n, float pedestal)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float v = ((float)data[i] - dark[i]) * (gain != NULL ? gain[i] : 1.0f) + pedestal + 0.5f;
+        data[i] = v <= 0 ? 0 : (v >= 65535.0f ? 65535 : (unsigned short)v);
+    }
+}
+
+#ifdef CALIB_X86
+static inline void calib_apply_sse2(unsigned short *data, const unsigned short *dark, const float *gain, size_t n, float pedestal)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 ped = _mm_set1_ps(pedestal + 0.5f), one = _mm_set1_ps(1.0f), fzero = _mm_setzero_ps();
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dark + i));
+        __m128 lo = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_unpacklo_epi16(v, zero), _mm_unpacklo_epi16(d, zero)));
+        __m128 hi = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_unpackhi_epi16(v, zero), _mm_unpackhi_epi16(d, zero)));
+        __m128 g0 = gain != NULL ? _mm_loadu_ps(gain + i) : one, g1 = gain != NULL ? _mm_loadu_ps(gain + i + 4) : one;
+        // truncation of values made positive rounds as the scalar code
+        __m128i a = _mm_cvttps_epi32(_mm_max_ps(_mm_add_ps(_mm_mul_ps(lo, g0), ped), fzero));
+        __m128i b = _mm_cvttps_epi32(_mm_max_ps(_mm_add_ps(_mm_mul_ps(hi, g1), ped), fzero));
+        __m128i p = _mm_packs_epi32(_mm_sub_epi32(a, bias), _mm_sub_epi32(b, bias));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(p, flip));
+    }
+    calib_apply_scalar(data + i, dark + i, gain != NULL ? gain + i : NULL, n - i, pedestal);
+}
+#endif // CALIB_X86
+
+#ifdef CALIB_NEON
+static inline void calib_apply_neon(unsigned short *data, const unsigned short *dark, const float *gain, size_t n, float pedestal)
+{
+    const float32x4_t ped = vdupq_n_f32(pedestal + 0.5f), one = vdupq_n_f32(1.0f), fzero = vdupq_n_f32(0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(data + i), d = vld1q_u16(dark + i);
+        int32x4_t lo = vreinterpretq_s32_u32(vsubl_u16(vget_low_u16(v), vget_low_u16(d)));
+        int32x4_t hi = vreinterpretq_s32_u32(vsubl_u16(vget_high_u16(v), vget_high_u16(d)));
+        float32x4_t g0 = gain != NULL ? vld1q_f32(gain + i) : one, g1 = gain != NULL ? vld1q_f32(gain + i + 4) : one;
+        uint32x4_t a = vcvtq_u32_f32(vmaxq_f32(vmlaq_f32(ped, vcvtq_f32_s32(lo), g0), fzero));
+        uint32x4_t b = vcvtq_u32_f32(vmaxq_f32(vmlaq_f32(ped, vcvtq_f32_s32(hi), g1), fzero));
+        vst1q_u16(data + i, vcombine_u16(vqmovn_u32(a), vqmovn_u32(b)));
+    }
+    calib_apply_scalar(data + i, dark + i, gain != NULL ? gain + i : NULL, n - i, pedestal);
+}
+#endif // CALIB_NEON
+
+static inline void calib_apply(unsigned short *data, const unsigned short *dark, const float *gain, size_t n, float pedestal, bool simd = true)
+{
+#if defined(CALIB_X86)
+    if (simd)
+        return calib_apply_sse2(data, dark, gain, n, pedestal);
+#elif defined(CALIB_NEON)
+    if (simd)
+        return calib_apply_neon(data, dark, gain, n, pedestal);
+#endif
+    calib_apply_scalar(data, dark, gain, n, pedestal);
+}
+
+typedef struct
+{
+    const unsigned short *const *frames;
+    unsigned n;
+    size_t start, end;
+    float *out;
+} calib_median_job;
+
+static void *calib_median_fcn(void *_job)
+{
+    calib_median_job *job = (calib_median_job *)_job;
+    unsigned short v[CALIB_MAX_FRAMES];
+    unsigned n = job->n;
+    for (size_t i = job->start; i < job->end; i++)
+    {
+        for (unsigned k = 0; k < n; k++) // insertion sort, n is small
+        {
+            unsigned short x = job->frames[k][i];
+            unsigned j = k;
+            for (; j > 0 && v[j - 1] > x; j--)
+                v[j] = v[j - 1];
+            v[j] = x;
+        }
+        job->out[i] = n & 1 ? v[n / 2] : 0.5f * (v[n / 2 - 1] + v[n / 2]);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Per pixel median of n frames, over threads each taking a band of
+ * the frame
+ *
+ * @param frames n frames of npix pixels, n at most CALIB_MAX_FRAMES
+ * @param out Median, npix pixels
+ * @param threads Threads to use, 0 for CALIB_THREADS
+ */
+static inline void calib_median(const unsigned short *const *frames, unsigned n, size_t npix, float *out, unsigned threads = 0)
+{
+    if (n == 0 || n > CALIB_MAX_FRAMES)
+        return;
+    if (threads == 0)
+        threads = CALIB_THREADS;
+    if (threads == 0)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = ncpu > 0 ? ncpu : 1;
+    }
+    if (threads > npix / 4096 + 1) // not worth a thread
+        threads = npix / 4096 + 1;
+    std::vector<calib_median_job> jobs(threads);
+    std::vector<pthread_t> tids(threads);
+    std::vector<bool> started(threads, false);
+    for (unsigned t = 0; t < threads; t++)
+    {
+        calib_median_job job = {frames, n, npix * t / threads, npix * (t + 1) / threads, out};
+        jobs[t] = job;
+        if (t > 0)
+            started[t] = pthread_create(&tids[t], NULL, calib_median_fcn, &jobs[t]) == 0;
+    }
+    calib_median_fcn(&jobs[0]);
+    for (unsigned t = 1; t < threads; t++)
+    {
+        if (started[t])
+            pthread_join(tids[t], NULL);
+        else // no thread for it, do it here
+            calib_median_fcn(&jobs[t]);
+    }
+}
+
+class calib_library
+{
+private:
+    std::vector<calib_master *> masters;
+    // dark and flat of the frames being corrected
+    std::vector<unsigned short> dark;
+    const calib_master *flat;
+    unsigned cur_bin, cur_width, cur_height;
+    long cur_exposure, cur_temp; // ms, CALIB_TEMP_STEP
+    int cur_mode;
+    bool cur_ok;
+
+    static std::atomic<int> &shared_mode()
+    {
+        static std::atomic<int> mode(CALIB_INTERPOLATE);
+        return mode;
+    }
+
+    /* the sweep of darks of a binning nearest a temperature, -1 if none */
+    int nearest_sweep(unsigned bin, float temp) const
+    {
+        int best = -1;
+        double dist = INFINITY;
+        for (size_t i = 0; i < masters.size(); i++)
+        {
+            const calib_master *m = masters[i];
+            if (m->bin != bin || m->kind == CALIB_FLAT)
+                continue;
+            double d = isnan(temp) || isnan(m->temp) ? 0 : fabs(temp - m->temp);
+            if (best < 0 || d < dist)
+            {
+                best = m->sweep;
+                dist = d;
+            }
+        }
+        return best;
+    }
+
+    /**
+     * @brief Make the dark of a binning, exposure and temperature, see the
+     * file description
+     *
+     * @return false No dark or bias for the binning
+     */
+    bool make_dark(unsigned bin, float exposure, float temp, int mode)
+    {
+        int sweep = nearest_sweep(bin, temp);
+        if (sweep < 0)
+            return false;
+        const calib_master *bias = NULL, *a = NULL, *b = NULL; // a, b: darks around the exposure
+        for (size_t i = 0; i < masters.size(); i++)
+        {
+            const calib_master *m = masters[i];
+            if (m->kind == CALIB_FLAT || m->bin != bin || (int)m->sweep != sweep)
+                continue;
+            if (m->kind == CALIB_BIAS)
+                bias = m;
+            if (m->exposure <= exposure && (a == NULL || m->exposure > a->exposure))
+                a = m;
+            if (m->exposure >= exposure && (b == NULL || m->exposure < b->exposure))
+                b = m;
+        }
+        if (bias == NULL)
+            return false;
+        // dark = bias + s * (ca * (a - bias) + cb * (b - bias))
+        float ca = 0, cb = 0;
+        if (a == NULL) // shorter than the bias
+            a = bias;
+        else if (b == NULL) // longer than the longest dark: the dark current grows with the exposure
+            ca = a == bias ? 0 : (exposure - bias->exposure) / (a->exposure - bias->exposure);
+        else if (a == b)
+            ca = 1;
+        else if (mode == CALIB_NEAREST)
+        {
+            if (log(exposure / a->exposure) < log(b->exposure / exposure))
+                ca = 1;
+            else
+                cb = 1;
+        }
+        else
+        {
+            cb = (exposure - a->exposure) / (b->exposure - a->exposure);
+            ca = 1 - cb;
+        }
+        if (b == NULL)
+            b = a;
+        float s = isnan(temp) || isnan(bias->temp) ? 1 : exp2((temp - bias->temp) / CALIB_DARK_DOUBLING);
+        ca *= s;
+        cb *= s;
+        size_t npix = bias->level.size();
+        dark.resize(npix);
+        const unsigned short *pb = bias->level.data(), *pa = a->level.data(), *pc = b->level.data();
+        for (size_t i = 0; i < npix; i++)
+        {
+            float v = pb[i] + ca * ((float)pa[i] - pb[i]) + cb * ((float)pc[i] - pb[i]) + 0.5f;
+            dark[i] = v <= 0 ? 0 : (v >= 65535.0f ? 65535 : (unsigned short)v);
+        }
+        cur_width = bias->width;
+        cur_height = bias->height;
+        return true;
+    }
+
+public:
+    calib_library()
+    {
+        flat = NULL;
+        cur_bin = cur_width = cur_height = 0;
+        cur_exposure = cur_temp = -1;
+        cur_mode = CALIB_OFF;
+        cur_ok = false;
+    }
+    ~calib_library()
+    {
+        clear();
+    }
+    calib_library(const calib_library &) = delete;
+    calib_library &operator=(const calib_library &) = delete;
+    /**
+     * @brief Correction of every calib_library from its next frame on
+     *
+     */
+    static void set_mode(calib_mode mode)
+    {
+        shared_mode() = mode >= CALIB_OFF && mode < CALIB_NUM_MODES ? mode : CALIB_OFF;
+    }
+    static calib_mode get_mode()
+    {
+        return (calib_mode)shared_mode().load();
+    }
+    void clear()
+    {
+        for (size_t i = 0; i < masters.size(); i++)
+            delete masters[i];
+        masters.clear();
+        flat = NULL;
+        cur_mode = CALIB_OFF; // remake the dark
+    }
+    /**
+     * @brief Add a master, taking it over
+     *
+     */
+    void add(calib_master *m)
+    {
+        masters.push_back(m);
+        cur_mode = CALIB_OFF;
+    }
+    /**
+     * @brief Build a master from a group of frames of one binning, exposure
+     * and sweep (median combined). Darks: the shortest one of each sweep and
+     * binning is its bias. Flats: their dark is made from the darks already
+     * in the library, so add flats last; only the flat closest to
+     * CALIB_FLAT_LEVEL is kept per binning.
+     *
+     * @return calib_master* Master, in the library, NULL if the frames are
+     * no use (a flat out of range, too many frames)
+     */
+    const calib_master *combine(calib_kind kind, unsigned bin, unsigned width, unsigned height, float exposure, float temp, unsigned sweep, const unsigned short *const *frames, unsigned n, unsigned threads = 0)
+    {
+        size_t npix = (size_t)width * height;
+        if (n == 0 || n > CALIB_MAX_FRAMES || npix == 0)
+            return NULL;
+        std::vector<float> med(npix);
+        calib_median(frames, n, npix, med.data(), threads);
+        calib_master *m = new calib_master;
+        m->kind = kind;
+        m->bin = bin;
+        m->width = width;
+        m->height = height;
+        m->exposure = exposure;
+        m->temp = temp;
+        m->frames = n;
+        m->sweep = sweep;
+        m->signal = 0;
+        if (kind != CALIB_FLAT)
+        {
+            m->level.resize(npix);
+            for (size_t i = 0; i < npix; i++)
+                m->level[i] = (unsigned short)(med[i] + 0.5f);
+            // the shortest exposure of the sweep is its bias
+            calib_master *bias = NULL;
+            for (size_t i = 0; i < masters.size(); i++)
+                if (masters[i]->kind == CALIB_BIAS && masters[i]->bin == bin && masters[i]->sweep == sweep)
+                    bias = masters[i];
+            if (bias == NULL || exposure < bias->exposure)
+            {
+                m->kind = CALIB_BIAS;
+                if (bias != NULL)
+                    bias->kind = CALIB_DARK;
+            }
+            else
+                m->kind = CALIB_DARK;
+            add(m);
+            return m;
+        }
+        // flat: subtract its dark, normalize to the mean
+        bool dark_ok = make_dark(bin, exposure, temp, CALIB_INTERPOLATE) && cur_width == width && cur_height == height;
+        cur_mode = CALIB_OFF; // the dark was for the flat
+        double sum = 0;
+        for (size_t i = 0; i < npix; i++)
+        {
+            med[i] -= dark_ok ? dark[i] : 0;
+            sum += med[i];
+        }
+        m->signal = sum / npix;
+        size_t old = masters.size();
+        for (size_t i = 0; i < masters.size(); i++)
+            if (masters[i]->kind == CALIB_FLAT && masters[i]->bin == bin)
+                old = i;
+        if (m->signal < CALIB_FLAT_MIN_LEVEL || m->signal > CALIB_FLAT_MAX_LEVEL ||
+            (old < masters.size() && fabs(masters[old]->signal - CALIB_FLAT_LEVEL) <= fabs(m->signal - CALIB_FLAT_LEVEL)))
+        {
+            delete m;
+            return NULL;
+        }
+        m->gain.resize(npix);
+        for (size_t i = 0; i < npix; i++)
+        {
+            float g = med[i] > 0 ? (float)(m->signal / med[i]) : 0;
+            m->gain[i] = g > 0 && g < CALIB_FLAT_MAX_GAIN ? g : 1.0f;
+        }
+        if (old < masters.size())
+        {
+            delete masters[old];
+            masters.erase(masters.begin() + old);
+        }
+        add(m);
+        return m;
+    }
+    size_t size() const
+    {
+        return masters.size();
+    }
+    const calib_master *master(size_t i) const
+    {
+        return masters[i];
+    }
+    /**
+     * @brief Bytes held by the masters
+     *
+     */
+    size_t memory() const
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < masters.size(); i++)
+            bytes += masters[i]->level.size() * sizeof(unsigned short) + masters[i]->gain.size() * sizeof(float);
+        return bytes;
+    }
+    void report(FILE *fp) const
+    {
+        for (size_t i = 0; i < masters.size(); i++)
+        {
+            const calib_master *m = masters[i];
+            fprintf(fp, "calib: %s bin %u %ux%u, %.3f s, %.1f C, %u frames, sweep %u\n", calib_kind_names[m->kind], m->bin, m->width, m->height, m->exposure, m->temp, m->frames, m->sweep);
+        }
+        fprintf(fp, "calib: %zu masters, %.1f MB\n", masters.size(), memory() / 1048576.0);
+    }
+    /**
+     * @brief Select the dark and flat for frames of a binning, exposure and
+     * temperature, remade only if one of them changed. Not thread safe: one
+     * thread corrects the frames.
+     *
+     * @return true There is a dark for the frames
+     */
+    bool prepare(unsigned bin, float exposure, float temp)
+    {
+        int mode = get_mode();
+        long ms = lround(exposure * 1000);
+        long t = isnan(temp) ? 0 : lround(temp / CALIB_TEMP_STEP);
+        if (mode == cur_mode && bin == cur_bin && ms == cur_exposure && t == cur_temp)
+            return cur_ok;
+        cur_mode = mode;
+        cur_bin = bin;
+        cur_exposure = ms;
+        cur_temp = t;
+        cur_ok = mode != CALIB_OFF && make_dark(bin, exposure, isnan(temp) ? temp : t * CALIB_TEMP_STEP, mode);
+        flat = NULL;
+        for (size_t i = 0; cur_ok && i < masters.size(); i++)
+            if (masters[i]->kind == CALIB_FLAT && masters[i]->bin == bin && masters[i]->width == cur_width && masters[i]->height == cur_height)
+                flat = masters[i];
+        return cur_ok;
+    }
+    /**
+     * @brief Correct a frame in place, after prepare()
+     *
+     * @param x, y Origin of the frame on the (binned) sensor
+     * @return false Not corrected: no dark, or the frame is not inside the masters
+     */
+    bool apply(unsigned short *data, unsigned width, unsigned height, unsigned x, unsigned y, bool simd = true)
+    {
+        if (!cur_ok || x + width > cur_width || y + height > cur_height)
+            return false;
+        for (unsigned row = 0; row < height; row++)
+        {
+            size_t off = (size_t)(y + row) * cur_width + x;
+            calib_apply(data + (size_t)row * width, dark.data() + off, flat != NULL ? flat->gain.data() + off : NULL, width, CALIB_PEDESTAL, simd);
+        }
+        return true;
+    }
+    bool has_flat() const
+    {
+        return flat != NULL;
+    }
+};
+
+#endif // CALIB_H_
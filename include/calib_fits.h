@@ -0,0 +1,181 @@
+/**
+ * @file calib_fits.h
+ * @brief Build a calib_library from the FITS files of getcalib sweeps
+ *
+ * Every directory holds one sweep: darks named bin<b>_exp<ms>_<n>.fit and
+ * flats flat_bin<b>_exp<ms>_<n>.fit, as single frames, cubes or
+ * multi-extension files (getcalib -n, -m). The frames of one binning and
+ * exposure are median combined into a master, darks first so flats can
+ * have their dark subtracted.
+ *
+ */
+#ifndef CALIB_FITS_H_
+#define CALIB_FITS_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fitsio.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <calib.h>
+
+#ifndef CALIB_DIR
+#define CALIB_DIR "calib" // sweep directories, ':' separated, COMIC_CALIB_DIR overrides it
+#endif
+
+typedef struct
+{
+    calib_kind kind; // CALIB_DARK or CALIB_FLAT
+    unsigned bin;
+    unsigned exp_ms;
+    unsigned sweep; // directory
+    std::vector<std::string> files;
+} calib_group;
+
+/**
+ * @brief Append the frames of a file (every image plane of every HDU) that
+ * have the size of the first one
+ *
+ * @param temp Sum of the sensor temperatures of the frames, NAN if one has none
+ */
+static inline void calib_read_frames(const char *fname, std::vector<std::vector<unsigned short>> &frames, unsigned *width, unsigned *height, double *temp)
+{
+    fitsfile *fptr;
+    int status = 0, nhdu = 0;
+    if (fits_open_file(&fptr, fname, READONLY, &status))
+    {
+        fprintf(stderr, "calib: Could not open %s\n", fname);
+        return;
+    }
+    fits_get_num_hdus(fptr, &nhdu, &status);
+    for (int k = 1; k <= nhdu && status == 0 && frames.size() < CALIB_MAX_FRAMES; k++)
+    {
+        int type, naxis = 0;
+        long naxes[3] = {0, 0, 1};
+        fits_movabs_hdu(fptr, k, &type, &status);
+        if (status != 0 || type != IMAGE_HDU)
+            break;
+        fits_get_img_dim(fptr, &naxis, &status);
+        fits_get_img_size(fptr, 3, naxes, &status);
+        if (status != 0 || naxis < 2 || naxis > 3)
+            continue; // empty primary of a multi-extension file
+        if (naxis == 2)
+            naxes[2] = 1;
+        if (*width == 0)
+        {
+            *width = naxes[0];
+            *height = naxes[1];
+        }
+        if (naxes[0] != (long)*width || naxes[1] != (long)*height)
+        {
+            fprintf(stderr, "calib: %s HDU %d is %ldx%ld, not %ux%u, skipped\n", fname, k, naxes[0], naxes[1], *width, *height);
+            continue;
+        }
+        float t = NAN;
+        if (fits_read_key(fptr, TFLOAT, "SENSOR TEMP", &t, NULL, &status))
+        {
+            status = 0; // a cube has it in its only HDU, extensions in each
+            t = NAN;
+        }
+        size_t npix = (size_t)*width * *height;
+        for (long p = 0; p < naxes[2] && frames.size() < CALIB_MAX_FRAMES; p++)
+        {
+            long fpixel[3] = {1, 1, p + 1};
+            frames.push_back(std::vector<unsigned short>(npix));
+            if (fits_read_pix(fptr, TUSHORT, fpixel, (long long)npix, NULL, frames.back().data(), NULL, &status))
+            {
+                frames.pop_back();
+                break;
+            }
+            *temp += t;
+        }
+    }
+    if (status != 0)
+        fits_report_error(stderr, status);
+    status = 0;
+    fits_close_file(fptr, &status);
+}
+
+/**
+ * @brief Load the sweeps of a list of directories into a library
+ *
+ * @param dirs ':' separated directories, NULL for COMIC_CALIB_DIR or CALIB_DIR
+ * @param threads Threads of the median combine, 0 for CALIB_THREADS
+ * @return unsigned Masters in the library
+ */
+static inline unsigned calib_load(calib_library *lib, const char *dirs = NULL, unsigned threads = 0)
+{
+    if (dirs == NULL)
+        dirs = getenv("COMIC_CALIB_DIR");
+    if (dirs == NULL)
+        dirs = CALIB_DIR;
+    std::string list(dirs);
+    std::vector<calib_group> groups;
+    unsigned sweep = 0;
+    for (size_t pos = 0; pos <= list.size(); sweep++)
+    {
+        size_t end = list.find(':', pos);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string dir = list.substr(pos, end - pos);
+        pos = end + 1;
+        DIR *d = opendir(dir.c_str());
+        if (d == NULL)
+        {
+            fprintf(stderr, "calib: Could not open directory %s\n", dir.c_str());
+            continue;
+        }
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL)
+        {
+            unsigned bin, exp_ms;
+            int idx, len = 0;
+            const char *name = ent->d_name;
+            calib_kind kind = strncmp(name, "flat_", 5) == 0 ? CALIB_FLAT : CALIB_DARK;
+            if (kind == CALIB_FLAT)
+                name += 5;
+            if (sscanf(name, "bin%u_exp%u_%d.fit%n", &bin, &exp_ms, &idx, &len) != 3 || len == 0 || name[len] != '\0')
+                continue;
+            size_t g = 0;
+            for (; g < groups.size(); g++)
+                if (groups[g].kind == kind && groups[g].bin == bin && groups[g].exp_ms == exp_ms && groups[g].sweep == sweep)
+                    break;
+            if (g == groups.size())
+            {
+                calib_group grp;
+                grp.kind = kind;
+                grp.bin = bin;
+                grp.exp_ms = exp_ms;
+                grp.sweep = sweep;
+                groups.push_back(grp);
+            }
+            groups[g].files.push_back(dir + "/" + ent->d_name);
+        }
+        closedir(d);
+    }
+    for (int kind = CALIB_DARK; kind <= CALIB_FLAT; kind++) // flats once every dark is in
+        for (size_t g = 0; g < groups.size(); g++)
+        {
+            if (groups[g].kind != kind)
+                continue;
+            std::sort(groups[g].files.begin(), groups[g].files.end());
+            std::vector<std::vector<unsigned short>> frames;
+            unsigned width = 0, height = 0;
+            double temp = 0;
+            for (size_t f = 0; f < groups[g].files.size(); f++)
+                calib_read_frames(groups[g].files[f].c_str(), frames, &width, &height, &temp);
+            if (frames.empty())
+                continue;
+            std::vector<const unsigned short *> ptrs;
+            for (size_t f = 0; f < frames.size(); f++)
+                ptrs.push_back(frames[f].data());
+            lib->combine(groups[g].kind, groups[g].bin, width, height, groups[g].exp_ms * 0.001f, temp / frames.size(), groups[g].sweep, ptrs.data(), ptrs.size(), threads);
+        }
+    return lib->size();
+}
+
+#endif // CALIB_FITS_H_
@@ -0,0 +1,446 @@
+/**
+ * @file comic_net.h
+ * @brief Frame wire format shared by the camera server and its clients, and
+ * reference counted encoded frames that are sent without copying
+ *
+ * A frame on the wire is
+ *   "SIZE" int32 total_size "FBEGIN" net_meta payload[net_meta.size] "FEND"
+ * where total_size counts every byte from "SIZE" to "FEND" inclusive. The
+ * metadata starts with its version and length, so receivers skip fields
+ * added by newer senders.
+ *
+ */
+#ifndef COMIC_NET_H_
+#define COMIC_NET_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <atomic>
+
+/**
+ * @brief Server side stage stamps of a frame, CLOCK_MONOTONIC nanoseconds of
+ * the server, 0 when not reached (yet)
+ *
+ */
+typedef struct __attribute__((packed))
+{
+    uint64_t exposure; // exposure started
+    uint64_t readout;  // readout done, pixels in memory
+    uint64_t encode;   // payload encoded
+    uint64_t enqueue;  // published to the network thread
+    uint64_t send;     // first byte handed to a socket (first client)
+} net_stamps;
+
+#define NET_META_VERSION 5
+
+typedef struct __attribute__((packed))
+{
+    uint16_t version;  // NET_META_VERSION of the sender
+    uint16_t meta_len; // sizeof(net_meta) of the sender: later versions only append fields, the payload starts after meta_len bytes
+    uint64_t seq;      // readout sequence number, shared by every stream of a readout
+    unsigned width;
+    unsigned height;
+    unsigned x; // origin of the image on the sensor, non zero for regions of interest
+    unsigned y;
+    float temp;
+    float exposure;
+    uint64_t tstamp;
+    int size;
+    unsigned format; // payload type, NET_FORMAT_*
+    int64_t clock_offset; // server CLOCK_REALTIME - CLOCK_MONOTONIC in ns, puts the stamps on the wall clock
+    net_stamps stamps;
+    // version 3: statistics of the whole readout the image was taken from
+    uint16_t pix_min;
+    uint16_t pix_max;
+    float pix_mean;
+    float pix_stdev;
+    uint32_t pix_saturated; // pixels at 65535
+    // version 4
+    uint32_t stacked; // frames co-added into the image, 1 for a live frame (0 from older servers)
+    // version 5
+    uint32_t bin; // sensor pixels summed along each axis of an image pixel (0 from older servers: 1); x and y stay in sensor pixels
+} net_meta;
+
+/**
+ * @brief Shortest metadata a receiver accepts, version 2
+ *
+ */
+#define NET_META_MIN_LEN offsetof(net_meta, pix_min)
+
+static inline uint64_t net_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief CLOCK_REALTIME - CLOCK_MONOTONIC, in ns
+ *
+ */
+static inline int64_t net_clock_offset()
+{
+    uint64_t mono = net_clock_ns(CLOCK_MONOTONIC);
+    return (int64_t)(net_clock_ns(CLOCK_REALTIME) - mono);
+}
+
+static inline void net_meta_init(net_meta *meta)
+{
+    memset(meta, 0x0, sizeof(net_meta));
+    meta->version = NET_META_VERSION;
+    meta->meta_len = sizeof(net_meta);
+    meta->stacked = 1;
+    meta->bin = 1;
+}
+
+#define NET_FORMAT_JPEG 0  // 8 bit stretched grayscale JPEG
+#define NET_FORMAT_RAW16 1 // original 16 bit pixels, lossless, see raw_codec.h
+#define NET_NUM_FORMATS 2
+
+#define NET_FRAME_HDR "SIZE"
+#define NET_FRAME_BEGIN "FBEGIN"
+#define NET_FRAME_END "FEND"
+#define NET_FRAME_OVERHEAD 18 // SIZE + int32 + FBEGIN + FEND
+
+#define NET_NUM_SCALES 3 // preview scales: full, 1/2 and 1/4 of the sensor
+#define NET_STREAM_RAW NET_NUM_SCALES // whole frame in NET_FORMAT_RAW16, next to the JPEG scales
+#define NET_NUM_STREAMS (NET_NUM_SCALES + 1)
+
+#define NET_MAX_ROIS 8 // distinct regions of interest streamed at once
+
+/**
+ * @brief Region of interest on the sensor, in unbinned pixels. A width or
+ * height of 0 means no region (full frame).
+ *
+ */
+typedef struct
+{
+    unsigned x;
+    unsigned y;
+    unsigned width;
+    unsigned height;
+} net_roi;
+
+static inline bool net_roi_valid(const net_roi *roi)
+{
+    return roi->width > 0 && roi->height > 0;
+}
+
+static inline bool net_roi_equal(const net_roi *a, const net_roi *b)
+{
+    return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+}
+
+/**
+ * @brief Downscaling factor of a preview scale
+ *
+ */
+static inline unsigned net_scale_factor(unsigned scale)
+{
+    return 1u << scale;
+}
+
+/**
+ * @brief Everything that precedes the payload on the wire, laid out so it
+ * can go out as a single iovec
+ *
+ */
+typedef struct __attribute__((packed))
+{
+    char hdr[4];     // "SIZE"
+    int32_t out_sz;  // total bytes of the frame on the wire
+    char begin[6];   // "FBEGIN"
+    net_meta meta;
+} net_frame_prefix;
+
+class frame_pool;
+
+/**
+ * @brief An encoded frame ready to be sent. Senders take a reference with
+ * acquire() and point their iovecs straight at the frame; the frame goes
+ * back to its pool when the last reference is released.
+ *
+ */
+class encoded_frame
+{
+public:
+    net_frame_prefix prefix;
+    /**
+     * @brief Payload (JPEG or raw) buffer, allocated with malloc. Encoders may grow
+     * it with realloc, the pool shrinks it back when recycled, see frame_pool.
+     *
+     */
+    unsigned char *data;
+    /**
+     * @brief Allocated size of the payload buffer
+     *
+     */
+    size_t alloc;
+    std::atomic<int> refs;
+    frame_pool *pool;
+    /**
+     * @brief Sequence number, assigned when the frame is published
+     *
+     */
+    uint64_t seq;
+    /**
+     * @brief CLOCK_MONOTONIC time of publication, in nanoseconds
+     *
+     */
+    uint64_t t_publish;
+    /**
+     * @brief Preview scale of the image, see net_scale_factor(),
+     * NET_STREAM_RAW for the raw frame or NET_NUM_STREAMS for a region of
+     * interest
+     *
+     */
+    unsigned scale;
+    /**
+     * @brief Region of interest the frame was encoded for, as clients ask
+     * for it (sensor pixels, whatever the binning), zero size for a whole
+     * frame
+     *
+     */
+    net_roi roi;
+
+    encoded_frame(size_t alloc, frame_pool *pool)
+    {
+        seq = 0;
+        scale = 0;
+        memset(&roi, 0x0, sizeof(roi));
+        t_publish = 0;
+        memset(&prefix, 0x0, sizeof(prefix));
+        memcpy(prefix.hdr, NET_FRAME_HDR, sizeof(prefix.hdr));
+        memcpy(prefix.begin, NET_FRAME_BEGIN, sizeof(prefix.begin));
+        net_meta_init(&prefix.meta);
+        data = (unsigned char *)malloc(alloc);
+        this->alloc = data == NULL ? 0 : alloc;
+        refs = 0;
+        this->pool = pool;
+    }
+    ~encoded_frame()
+    {
+        free(data);
+    }
+    encoded_frame(const encoded_frame &) = delete;
+    encoded_frame &operator=(const encoded_frame &) = delete;
+    /**
+     * @brief Metadata sent with the frame
+     *
+     */
+    net_meta *meta()
+    {
+        return &prefix.meta;
+    }
+    /**
+     * @brief Set the payload size once data has been filled in, and update
+     * the size field of the header
+     *
+     * @param size Payload size in bytes
+     */
+    void set_size(int size)
+    {
+        prefix.meta.size = size;
+        prefix.out_sz = size + sizeof(net_meta) + NET_FRAME_OVERHEAD;
+    }
+    /**
+     * @brief Total number of bytes of the frame on the wire
+     *
+     */
+    size_t wire_size() const
+    {
+        return prefix.out_sz;
+    }
+    void acquire()
+    {
+        refs++;
+    }
+    inline void release();
+    /**
+     * @brief Send the frame, or what is left of it, using scatter-gather I/O
+     * straight from the frame buffers
+     *
+     * @param sock Socket
+     * @param offset Bytes of the frame already sent
+     * @param flags Flags for sendmsg (MSG_NOSIGNAL is always added)
+     * @return ssize_t Bytes sent by this call, or -1 on error (errno set)
+     */
+    ssize_t send(int sock, size_t offset = 0, int flags = 0)
+    {
+        struct iovec iov[3];
+        size_t lens[3] = {sizeof(net_frame_prefix), (size_t)prefix.meta.size, 4};
+        void *bufs[3] = {&prefix, data, (void *)NET_FRAME_END};
+        int niov = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            if (offset >= lens[i])
+            {
+                offset -= lens[i];
+                continue;
+            }
+            iov[niov].iov_base = (char *)bufs[i] + offset;
+            iov[niov].iov_len = lens[i] - offset;
+            offset = 0;
+            niov++;
+        }
+        if (niov == 0)
+            return 0;
+        struct msghdr msg;
+        memset(&msg, 0x0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        return sendmsg(sock, &msg, flags | MSG_NOSIGNAL);
+    }
+    /**
+     * @brief Send the whole frame on a blocking socket
+     *
+     * @param sock Socket
+     * @return ssize_t Bytes sent, or -1 on error
+     */
+    ssize_t send_all(int sock)
+    {
+        size_t sent = 0;
+        while (sent < wire_size())
+        {
+            ssize_t sz = send(sock, sent);
+            if (sz < 0 && errno == EINTR)
+                continue;
+            if (sz <= 0)
+                return -1;
+            sent += sz;
+        }
+        return sent;
+    }
+};
+
+/**
+ * @brief Recycles encoded frames so that steady state streaming does not
+ * allocate. A frame is taken with get(), which returns it holding one
+ * reference, and comes back when its last reference is released. Only
+ * max_large idle frames keep a buffer grown past alloc (a raw stream
+ * reuses them), the others are shrunk back to alloc when they come back.
+ *
+ */
+class frame_pool
+{
+private:
+    pthread_mutex_t lock;
+    encoded_frame **free_list;
+    unsigned nfree;
+    unsigned max_free;
+    unsigned nlarge; // idle frames with more than alloc
+    unsigned max_large;
+    size_t alloc;
+
+public:
+    /**
+     * @brief Frames allocated over the lifetime of the pool
+     *
+     */
+    std::atomic<unsigned> allocated;
+
+    /**
+     * @brief Construct a new frame pool
+     *
+     * @param alloc Payload buffer size of new frames
+     * @param max_free Number of idle frames to keep around for reuse
+     * @param max_large Number of them that may keep a larger buffer
+     */
+    frame_pool(size_t alloc, unsigned max_free = 16, unsigned max_large = 2)
+    {
+        pthread_mutex_init(&lock, NULL);
+        this->alloc = alloc;
+        this->max_free = max_free;
+        this->max_large = max_large;
+        free_list = new encoded_frame *[max_free];
+        nfree = 0;
+        nlarge = 0;
+        allocated = 0;
+    }
+    ~frame_pool()
+    {
+        for (unsigned i = 0; i < nfree; i++)
+            delete free_list[i];
+        delete[] free_list;
+        pthread_mutex_destroy(&lock);
+    }
+    frame_pool(const frame_pool &) = delete;
+    frame_pool &operator=(const frame_pool &) = delete;
+    /**
+     * @brief Get a frame to encode into, with one reference held by the caller
+     *
+     * @return encoded_frame* Frame, NULL if out of memory
+     */
+    encoded_frame *get()
+    {
+        encoded_frame *frame = NULL;
+        pthread_mutex_lock(&lock);
+        if (nfree > 0)
+        {
+            frame = free_list[--nfree];
+            if (frame->alloc > alloc)
+                nlarge--;
+        }
+        pthread_mutex_unlock(&lock);
+        if (frame == NULL)
+        {
+            frame = new encoded_frame(alloc, this);
+            if (frame->data == NULL)
+            {
+                delete frame;
+                return NULL;
+            }
+            allocated++;
+        }
+        frame->refs = 1;
+        return frame;
+    }
+    /**
+     * @brief Return a frame whose last reference was released
+     *
+     * @param frame Frame
+     */
+    void put(encoded_frame *frame)
+    {
+        pthread_mutex_lock(&lock);
+        if (nfree < max_free)
+        {
+            if (frame->alloc > alloc && nlarge >= max_large)
+            {
+                unsigned char *tmp = (unsigned char *)realloc(frame->data, alloc);
+                if (tmp != NULL)
+                {
+                    frame->data = tmp;
+                    frame->alloc = alloc;
+                }
+            }
+            if (frame->alloc > alloc)
+                nlarge++;
+            free_list[nfree++] = frame;
+            frame = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+        delete frame; // pool full
+    }
+};
+
+inline void encoded_frame::release()
+{
+    if (--refs == 0)
+    {
+        if (pool != NULL)
+            pool->put(this);
+        else
+            delete this;
+    }
+}
+
+#endif // COMIC_NET_H_
@@ -0,0 +1,171 @@
+/**
+ * @file downscale.h
+ * @brief Area average (box filter) downscaling of 16 bit frames by 2 or 4,
+ * for previews that are encoded and sent smaller than the sensor
+ *
+ * Every output pixel is the rounded mean of a factor x factor block;
+ * rows and columns that do not fill a whole block are dropped. The sums
+ * are exact (32 bit), so the SSE2 and NEON kernels match the scalar one
+ * bit for bit.
+ *
+ */
+#ifndef DOWNSCALE_H_
+#define DOWNSCALE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define DOWNSCALE_SSE2 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DOWNSCALE_NEON 1
+#endif
+
+/* Scalar reference, also used for the columns left over by the SIMD kernels */
+static inline void downscale_row_scalar(const unsigned short *src, size_t stride, unsigned factor, unsigned short *dst, unsigned start, unsigned owidth)
+{
+    unsigned half = factor * factor / 2;
+    for (unsigned x = start; x < owidth; x++)
+    {
+        unsigned sum = half;
+        for (unsigned j = 0; j < factor; j++)
+            for (unsigned i = 0; i < factor; i++)
+                sum += src[j * stride + x * factor + i];
+        dst[x] = sum / (factor * factor);
+    }
+}
+
+#ifdef DOWNSCALE_SSE2
+/* Sum of adjacent pixel pairs as 32 bit integers: madd works on signed
+ * words, so the pixels are biased by -32768 and each sum by -65536 */
+static inline __m128i downscale_pairs_sse2(const unsigned short *src)
+{
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i ones = _mm_set1_epi16(1);
+    return _mm_madd_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i *)src), bias), ones);
+}
+
+/* Back from 32 bit results in [0, 65535] to unsigned words, through the signed pack */
+static inline __m128i downscale_pack_sse2(__m128i a, __m128i b)
+{
+    const __m128i off = _mm_set1_epi32(32768);
+    return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(a, off), _mm_sub_epi32(b, off)), _mm_set1_epi16((short)0x8000));
+}
+
+static inline unsigned downscale_row2_sse2(const unsigned short *src, size_t stride, unsigned short *dst, unsigned owidth)
+{
+    const __m128i fix = _mm_set1_epi32(2 * 65536 + 2); // undo the bias, round
+    unsigned x = 0;
+    for (; x + 8 <= owidth; x += 8)
+    {
+        const unsigned short *r0 = src + 2 * x, *r1 = r0 + stride;
+        __m128i a = _mm_add_epi32(_mm_add_epi32(downscale_pairs_sse2(r0), downscale_pairs_sse2(r1)), fix);
+        __m128i b = _mm_add_epi32(_mm_add_epi32(downscale_pairs_sse2(r0 + 8), downscale_pairs_sse2(r1 + 8)), fix);
+        _mm_storeu_si128((__m128i *)(dst + x), downscale_pack_sse2(_mm_srli_epi32(a, 2), _mm_srli_epi32(b, 2)));
+    }
+    return x;
+}
+
+/* Four output pixels from 16 columns of four rows */
+static inline __m128i downscale_block4_sse2(const unsigned short *src, size_t stride)
+{
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    for (int j = 0; j < 4; j++)
+    {
+        lo = _mm_add_epi32(lo, downscale_pairs_sse2(src + j * stride));
+        hi = _mm_add_epi32(hi, downscale_pairs_sse2(src + j * stride + 8));
+    }
+    // add neighbouring pairs: evens + odds of lo:hi
+    __m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1)));
+    const __m128i fix = _mm_set1_epi32(8 * 65536 + 8);
+    return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(even, odd), fix), 4);
+}
+
+static inline unsigned downscale_row4_sse2(const unsigned short *src, size_t stride, unsigned short *dst, unsigned owidth)
+{
+    unsigned x = 0;
+    for (; x + 8 <= owidth; x += 8)
+        _mm_storeu_si128((__m128i *)(dst + x), downscale_pack_sse2(downscale_block4_sse2(src + 4 * x, stride), downscale_block4_sse2(src + 4 * x + 16, stride)));
+    return x;
+}
+#endif // DOWNSCALE_SSE2
+
+#ifdef DOWNSCALE_NEON
+static inline unsigned downscale_row2_neon(const unsigned short *src, size_t stride, unsigned short *dst, unsigned owidth)
+{
+    unsigned x = 0;
+    for (; x + 8 <= owidth; x += 8)
+    {
+        const unsigned short *r0 = src + 2 * x, *r1 = r0 + stride;
+        uint32x4_t a = vpadalq_u16(vpaddlq_u16(vld1q_u16(r0)), vld1q_u16(r1));
+        uint32x4_t b = vpadalq_u16(vpaddlq_u16(vld1q_u16(r0 + 8)), vld1q_u16(r1 + 8));
+        vst1q_u16(dst + x, vcombine_u16(vrshrn_n_u32(a, 2), vrshrn_n_u32(b, 2)));
+    }
+    return x;
+}
+
+static inline uint16x4_t downscale_block4_neon(const unsigned short *src, size_t stride)
+{
+    uint32x4_t lo = vpaddlq_u16(vld1q_u16(src));
+    uint32x4_t hi = vpaddlq_u16(vld1q_u16(src + 8));
+    for (int j = 1; j < 4; j++)
+    {
+        lo = vpadalq_u16(lo, vld1q_u16(src + j * stride));
+        hi = vpadalq_u16(hi, vld1q_u16(src + j * stride + 8));
+    }
+    uint32x4_t sum = vcombine_u32(vpadd_u32(vget_low_u32(lo), vget_high_u32(lo)), vpadd_u32(vget_low_u32(hi), vget_high_u32(hi)));
+    return vrshrn_n_u32(sum, 4);
+}
+
+static inline unsigned downscale_row4_neon(const unsigned short *src, size_t stride, unsigned short *dst, unsigned owidth)
+{
+    unsigned x = 0;
+    for (; x + 8 <= owidth; x += 8)
+        vst1q_u16(dst + x, vcombine_u16(downscale_block4_neon(src + 4 * x, stride), downscale_block4_neon(src + 4 * x + 16, stride)));
+    return x;
+}
+#endif // DOWNSCALE_NEON
+
+/**
+ * @brief Downscale a frame by averaging factor x factor blocks
+ *
+ * @param src Frame, row major
+ * @param width Frame width
+ * @param height Frame height
+ * @param factor 1, 2 or 4 use the vector kernels, any other value the scalar code
+ * @param dst Output, (width / factor) x (height / factor) pixels
+ * @param simd Use the vector kernels when available
+ */
+static inline void downscale(const unsigned short *src, unsigned width, unsigned height, unsigned factor, unsigned short *dst, bool simd = true)
+{
+    if (factor == 0)
+        factor = 1;
+    unsigned owidth = width / factor, oheight = height / factor;
+    for (unsigned y = 0; y < oheight; y++)
+    {
+        const unsigned short *row = src + (size_t)y * factor * width;
+        unsigned short *out = dst + (size_t)y * owidth;
+        unsigned x = 0;
+        if (simd)
+        {
+#if defined(DOWNSCALE_SSE2)
+            if (factor == 2)
+                x = downscale_row2_sse2(row, width, out, owidth);
+            else if (factor == 4)
+                x = downscale_row4_sse2(row, width, out, owidth);
+#elif defined(DOWNSCALE_NEON)
+            if (factor == 2)
+                x = downscale_row2_neon(row, width, out, owidth);
+            else if (factor == 4)
+                x = downscale_row4_neon(row, width, out, owidth);
+#endif
+        }
+        downscale_row_scalar(row, width, factor, out, x, owidth);
+    }
+}
+
+#endif // DOWNSCALE_H_
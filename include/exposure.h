@@ -0,0 +1,199 @@
+/**
+ * @file exposure.h
+ * @brief Per-frame exposure kernels of atikserver: saturation and dark
+ * checks, the exposure controller and the running statistics, in a header
+ * so getcalib and the benchmarks use the same code
+ *
+ */
+#ifndef EXPOSURE_H_
+#define EXPOSURE_H_
+
+#include <math.h>
+#include <iostream>
+
+#include <histogram.h>
+#include <frame_stats.h>
+
+/**
+ * @brief Class to store average and standard deviation of a data series
+ * 
+ */
+class statseries
+{
+public:
+    /**
+     * @brief Average of the series
+     * 
+     */
+    double avg = 0;
+    /**
+     * @brief Standard deviation (sigma) of the series
+     * 
+     */
+    double stdev = 0;
+    /**
+     * @brief Length of the series
+     * 
+     */
+    unsigned long long int n = 0;
+    /**
+     * @brief Add new point to the series
+     * 
+     * @param val Data point
+     */
+    void add(double val)
+    {
+        double avg = this->avg;
+        double stdev = this->stdev;
+        unsigned long long int n = this->n;
+        avg = (avg * n) + val;
+        stdev = (stdev * stdev * n) + val * val;
+        n += 1;
+        avg /= n;
+        stdev = sqrt(stdev / n);
+        this->avg = avg;
+        this->stdev = stdev;
+        this->n = n;
+    }
+};
+
+static inline bool checkSaturation(const unsigned short *img, unsigned int size)
+{
+    int count = size * 0.9; // 90% pixels are not saturated
+    for (unsigned int i = 0; i < size; i++)
+    {
+        if (img[i] == 65535) // saturated
+            count--;         // reduce counts from 90%
+    }
+    if (count < 0) // more than 90% pixels are saturated
+        return true;
+    return false;
+}
+
+static inline bool checkDark(const unsigned short *img, unsigned int size)
+{
+    int count = size * 0.3; // 30% pixels are not dark
+    for (unsigned int i = 0; i < size; i++)
+    {
+        if (img[i] < 2000) // dark
+            count--;       // reduce counts from 30%
+    }
+    if (count < 0) // more than 30% pixels are dark
+        return true;
+    return false;
+}
+
+/**
+ * @brief checkSaturation() from precomputed frame statistics
+ *
+ */
+static inline bool checkSaturation(const frame_stats *st)
+{
+    return st->saturated > (unsigned long long)(st->n * 0.9);
+}
+
+/**
+ * @brief checkDark() from precomputed frame statistics
+ *
+ */
+static inline bool checkDark(const frame_stats *st)
+{
+    return st->dark > (unsigned long long)(st->n * 0.3);
+}
+
+#define MAX_ALLOWED_EXPOSURE 10.0 // 10 seconds
+
+#ifndef PIX_MEDIAN
+#define PIX_MEDIAN 40000.0
+#endif
+
+#ifndef PIX_GIVE
+#define PIX_GIVE 5000.0
+#endif
+
+#ifndef PIX_HIST_STRIDE
+#define PIX_HIST_STRIDE 1 // count every pixel, set > 1 to estimate from a subsample
+#endif
+
+/**
+ * @brief Exposure that brings the measured level to PIX_MEDIAN, the
+ * current one if it is within PIX_GIVE already
+ *
+ * @param val Measured percentile (or median) of the frame
+ * @param exposure Exposure of the frame
+ */
+static inline double exposure_for_level(double val, double exposure)
+{
+    double result = exposure;
+    if (val > PIX_MEDIAN - PIX_GIVE && val < PIX_MEDIAN + PIX_GIVE /* && PIX_MEDIAN - PIX_GIVE > 0 && PIX_MEDIAN + PIX_GIVE < 65535 */)
+        return result;
+
+    /** If calculated median pixel is within PIX_MEDIAN +/- PIX_GIVE, return current exposure **/
+
+    result = ((double)PIX_MEDIAN) * exposure / ((double)val);
+
+#ifdef SK_DEBUG
+    std::cerr << __FUNCTION__ << " : Determined exposure from median " << val << ": " << result << std::endl;
+#endif
+
+    if (result > MAX_ALLOWED_EXPOSURE)
+        result = MAX_ALLOWED_EXPOSURE;
+    // round to 1 ms
+    result = ((int)(result * 1000))/1000.0; 
+    return result;
+}
+
+static inline double find_optimum_exposure(const unsigned short *picdata, unsigned int imgsize, double exposure)
+{
+//#define SK_DEBUG
+#ifdef SK_DEBUG
+    std::cerr << __FUNCTION__ << " : Received exposure: " << exposure << std::endl;
+#endif
+    double val;
+    static pixel_histogram hist;
+    hist.compute(picdata, imgsize, PIX_HIST_STRIDE); // picdata[k] of the sorted frame is hist.at(k)
+
+#ifdef MEDIAN
+    if (imgsize && 0x01)
+        val = (hist.at(imgsize / 2) + hist.at(imgsize / 2 + 1)) * 0.5;
+    else
+        val = hist.at(imgsize / 2);
+#endif //MEDIAN
+
+#ifndef MEDIAN
+#ifndef PERCENTILE
+#define PERCENTILE 90.0
+    unsigned int coord = floor((PERCENTILE * (imgsize - 1) / 100.0));
+    val = hist.at(coord);
+
+#ifdef SK_DEBUG
+    unsigned short lo, hi;
+    hist.percentile_bounds(PERCENTILE, &lo, &hi);
+    std::cerr << "Info: " << __FUNCTION__ << "Coordinate: " << coord << ", stride: " << hist.stride << ", bounds: [" << lo << ", " << hi << "]" << std::endl;
+#endif
+
+#endif //PERCENTILE
+#endif //MEDIAN
+#ifdef SK_DEBUG
+    std::cerr << "In " << __FUNCTION__ << ": Median: " << val << std::endl;
+#endif
+    return exposure_for_level(val, exposure);
+    //#undef SK_DEBUG
+}
+
+/**
+ * @brief find_optimum_exposure() on the statistics of the frame, the
+ * percentile read from the coarse histogram (to 64 ADU, well inside PIX_GIVE)
+ *
+ */
+static inline double find_optimum_exposure(const frame_stats *st, double exposure)
+{
+#ifdef MEDIAN
+    double val = frame_stats_percentile(st, 50);
+#else
+    double val = frame_stats_percentile(st, PERCENTILE);
+#endif
+    return exposure_for_level(val, exposure);
+}
+
+#endif // EXPOSURE_H_
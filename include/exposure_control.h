@@ -0,0 +1,333 @@
+/**
+ * @file exposure_control.h
+ * @brief Pluggable auto-exposure controllers, fed with the statistics of
+ * each frame by the analysis stage
+ *
+ *   legacy      exposure * PIX_MEDIAN / level, as find_optimum_exposure()
+ *   predictive  the sky rate (ADU/s above the offset) from the histogram,
+ *               its trend extrapolated over the EXPOSURE_LAG frame periods
+ *               (exposure + readout overhead) until the new exposure takes
+ *               effect
+ *   pid         damped PID on the log of the level
+ *
+ * The level is the PERCENTILE-th percentile of the frame. When that is
+ * saturated, or too much of the frame is, the predictive and PID
+ * controllers estimate how far over the frame is from the saturated
+ * fraction instead of trusting the clipped level, and then limit the step
+ * to a factor of EXPOSURE_MAX_STEP, as they do for a level lost in the noise.
+ *
+ */
+#ifndef EXPOSURE_CONTROL_H_
+#define EXPOSURE_CONTROL_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <exposure.h>
+#include <frame_stats.h>
+
+#ifndef EXPOSURE_CONTROLLER
+#define EXPOSURE_CONTROLLER "predictive" // default controller, COMIC_EXPOSURE_CONTROL overrides it
+#endif
+#ifndef EXPOSURE_OFFSET
+#define EXPOSURE_OFFSET 300.0 // ADU of a zero exposure (bias), not proportional to the exposure
+#endif
+#ifndef EXPOSURE_MAX_STEP
+#define EXPOSURE_MAX_STEP 16.0 // largest change of exposure on an estimated level
+#endif
+#ifndef EXPOSURE_MAX_SATURATED
+#define EXPOSURE_MAX_SATURATED 0.01 // fraction of saturated pixels tolerated on target (stars)
+#endif
+#ifndef EXPOSURE_MIN_SIGNAL
+#define EXPOSURE_MIN_SIGNAL 200.0 // ADU above the offset below which the level is mostly noise
+#endif
+#ifndef EXPOSURE_MAX_DRIFT
+#define EXPOSURE_MAX_DRIFT 0.2 // largest log change of the sky rate the trend may predict
+#endif
+#ifndef EXPOSURE_LAG
+#define EXPOSURE_LAG 2 // frames from a frame to the first one exposed with the exposure computed from it
+#endif
+
+typedef struct
+{
+    double target;      // ADU at the percentile
+    double give;        // tolerance around the target, ADU
+    double percentile;  // percentile controlled, 0 to 100
+    double offset;      // ADU of a zero exposure
+    double min_exposure; // s
+    double max_exposure; // s
+    double max_saturated; // fraction of saturated pixels tolerated
+    double readout;     // s, readout overhead of a frame (measured by the caller)
+} exposure_cfg;
+
+static inline exposure_cfg exposure_cfg_default()
+{
+#ifdef MEDIAN
+    double pct = 50;
+#else
+    double pct = PERCENTILE;
+#endif
+    exposure_cfg cfg = {PIX_MEDIAN, PIX_GIVE, pct, EXPOSURE_OFFSET, 0.001, MAX_ALLOWED_EXPOSURE, EXPOSURE_MAX_SATURATED, 0};
+    return cfg;
+}
+
+class exposure_controller
+{
+protected:
+    exposure_cfg cfg;
+
+    double clamp(double exposure) const
+    {
+        if (exposure > cfg.max_exposure)
+            exposure = cfg.max_exposure;
+        if (exposure < cfg.min_exposure)
+            exposure = cfg.min_exposure;
+        double ms = round(exposure * 1000) / 1000.0; // 1 ms steps, as the legacy controller
+        return ms > 0 ? ms : exposure;
+    }
+    /**
+     * @brief Limit an untrusted step to a factor of EXPOSURE_MAX_STEP
+     *
+     */
+    static double limit_step(double exposure, double from)
+    {
+        if (exposure > from * EXPOSURE_MAX_STEP)
+            return from * EXPOSURE_MAX_STEP;
+        if (exposure < from / EXPOSURE_MAX_STEP)
+            return from / EXPOSURE_MAX_STEP;
+        return exposure;
+    }
+    double saturated(const frame_stats *st) const
+    {
+        return st->n ? (double)st->saturated / st->n : 0;
+    }
+    /**
+     * @brief Level of the frame above the offset at the controlled
+     * percentile. A saturated percentile is extrapolated from the saturated
+     * fraction f: the frame is taken to be f / (1 - p/100) times brighter
+     * than the clipping level, EXPOSURE_MAX_STEP times if all of it is
+     * clipped. Never below 1 ADU.
+     *
+     * @param trusted Set if the level was measured, not estimated: not
+     * clipped and at least EXPOSURE_MIN_SIGNAL
+     */
+    double level(const frame_stats *st, bool *trusted) const
+    {
+        double v = frame_stats_percentile(st, cfg.percentile) - cfg.offset;
+        double sat = saturated(st);
+        double tail = 1 - cfg.percentile / 100.0;
+        *trusted = sat <= cfg.max_saturated && v >= EXPOSURE_MIN_SIGNAL;
+        if (sat > tail && sat > cfg.max_saturated)
+            v = (FRAME_STATS_SATURATED - cfg.offset) * (sat >= 1 ? EXPOSURE_MAX_STEP : sat / tail);
+        else if (sat > cfg.max_saturated) // the percentile is fine but too much is clipped
+            v *= 1 + (sat - cfg.max_saturated) / tail;
+        return v < 1 ? 1 : v;
+    }
+
+public:
+    exposure_controller(const exposure_cfg &cfg)
+    {
+        this->cfg = cfg;
+    }
+    virtual ~exposure_controller() {}
+    virtual const char *name() const = 0;
+    /**
+     * @brief Exposure of the next frame to start
+     *
+     * @param st Statistics of the frame
+     * @param exposure Exposure of the frame, s
+     * @param t Start of the frame, s on any monotonic clock
+     * @return double Exposure, s
+     */
+    virtual double next(const frame_stats *st, double exposure, double t) = 0;
+    virtual void reset() {}
+    /**
+     * @brief Readout overhead per frame (exposure start to pixels in memory,
+     * minus the exposure), s
+     *
+     */
+    void set_readout(double readout)
+    {
+        cfg.readout = readout;
+    }
+    /**
+     * @brief ADU of a zero exposure: the bias, or the pedestal of frames
+     * with the bias (dark) subtracted
+     *
+     */
+    void set_offset(double offset)
+    {
+        cfg.offset = offset;
+    }
+    const exposure_cfg *config() const
+    {
+        return &cfg;
+    }
+    /**
+     * @brief Whether a frame is on target: the percentile within give of the
+     * target and no more than max_saturated clipped
+     *
+     */
+    bool on_target(const frame_stats *st) const
+    {
+        return fabs(frame_stats_percentile(st, cfg.percentile) - cfg.target) < cfg.give && saturated(st) <= cfg.max_saturated;
+    }
+};
+
+/**
+ * @brief The original controller, see exposure_for_level()
+ *
+ */
+class legacy_exposure : public exposure_controller
+{
+public:
+    legacy_exposure(const exposure_cfg &cfg) : exposure_controller(cfg) {}
+    const char *name() const
+    {
+        return "legacy";
+    }
+    double next(const frame_stats *st, double exposure, double t)
+    {
+        double result = exposure_for_level(frame_stats_percentile(st, cfg.percentile), exposure);
+        if (result > cfg.max_exposure)
+            result = cfg.max_exposure;
+        if (result < cfg.min_exposure)
+            result = cfg.min_exposure;
+        return result;
+    }
+};
+
+/**
+ * @brief Histogram predictive: the sky rate (level / exposure) of the frame,
+ * its trend over the last frames extrapolated to the middle of the first
+ * frame the new exposure applies to, EXPOSURE_LAG frame periods (exposure +
+ * readout) ahead
+ *
+ */
+class predictive_exposure : public exposure_controller
+{
+private:
+    double last_rate, last_t; // previous trusted measurement, 0 if none
+    double slope;             // d ln(rate) / dt, smoothed
+
+public:
+    predictive_exposure(const exposure_cfg &cfg) : exposure_controller(cfg)
+    {
+        reset();
+    }
+    const char *name() const
+    {
+        return "predictive";
+    }
+    void reset()
+    {
+        last_rate = 0;
+        last_t = 0;
+        slope = 0;
+    }
+    double next(const frame_stats *st, double exposure, double t)
+    {
+        bool trusted;
+        double v = level(st, &trusted);
+        double rate = v / exposure;
+        double tm = t + exposure / 2;
+        double step = trusted && last_rate > 0 && tm > last_t ? log(rate) - log(last_rate) : INFINITY;
+        if (fabs(step) < EXPOSURE_MAX_DRIFT)
+            slope = 0.7 * slope + 0.3 * step / (tm - last_t);
+        else
+            slope = 0; // a jump or an estimate, not a trend
+        last_rate = trusted ? rate : 0;
+        last_t = tm;
+        // the trend only corrects ramps, steps are followed by the measurement itself
+        double drift = slope * EXPOSURE_LAG * (exposure + cfg.readout);
+        drift = drift > EXPOSURE_MAX_DRIFT ? EXPOSURE_MAX_DRIFT : (drift < -EXPOSURE_MAX_DRIFT ? -EXPOSURE_MAX_DRIFT : drift);
+        if (on_target(st) && fabs(drift) < 0.05)
+            return clamp(exposure);
+        double result = (cfg.target - cfg.offset) / (rate * exp(drift));
+        return clamp(trusted ? result : limit_step(result, exposure));
+    }
+};
+
+/**
+ * @brief Damped PID on log(level), in velocity form: the error is
+ * log(target / level), and each frame moves the log of its own exposure by
+ * ki * error + kp * (error - last error) + kd * (change of that). Unlike
+ * the legacy controller there is no dead band: frames on target are still
+ * steered to the middle of it, so slow ramps do not drift out first.
+ * Frames exposed before the previous change took effect only get the
+ * ki term and are left out of the differences, which compare the results
+ * of two different exposures.
+ *
+ * The default gains are tuned on bench.out exposure: with EXPOSURE_LAG
+ * frames of lag the difference terms mostly add the noise of the level,
+ * kp or kd of 0.05 already lose time on the cloud steps and cold starts.
+ *
+ */
+class pid_exposure : public exposure_controller
+{
+private:
+    double kp, ki, kd;
+    double e1, e2;    // previous two errors
+    double commanded; // last exposure returned, 0 before the first frame
+    unsigned stale;   // frames since exposed before it
+
+public:
+    pid_exposure(const exposure_cfg &cfg, double kp = 0, double ki = 1, double kd = 0) : exposure_controller(cfg)
+    {
+        this->kp = kp;
+        this->ki = ki;
+        this->kd = kd;
+        reset();
+    }
+    const char *name() const
+    {
+        return "pid";
+    }
+    void reset()
+    {
+        e1 = e2 = 0;
+        commanded = 0;
+        stale = 0;
+    }
+    double next(const frame_stats *st, double exposure, double t)
+    {
+        bool old = commanded > 0 && fabs(exposure - commanded) > 0.0005 && stale < EXPOSURE_LAG;
+        stale = old ? stale + 1 : 0;
+        bool trusted;
+        double v = level(st, &trusted);
+        double error = log((cfg.target - cfg.offset) / v);
+        double u;
+        if (!trusted) // far off: proportional steps are too slow, jump
+            u = error;
+        else if (old)
+            u = ki * error;
+        else
+            u = ki * error + kp * (error - e1) + kd * (error - 2 * e1 + e2);
+        if (!old)
+        {
+            e2 = e1;
+            e1 = error;
+        }
+        double result = exposure * exp(u);
+        return commanded = clamp(trusted ? result : limit_step(result, exposure));
+    }
+};
+
+/**
+ * @brief Create a controller by name: "legacy", "predictive" or "pid"
+ *
+ * @return exposure_controller* Controller, NULL for an unknown name
+ */
+static inline exposure_controller *exposure_controller_create(const char *name, const exposure_cfg &cfg)
+{
+    if (strcmp(name, "legacy") == 0)
+        return new legacy_exposure(cfg);
+    if (strcmp(name, "predictive") == 0)
+        return new predictive_exposure(cfg);
+    if (strcmp(name, "pid") == 0)
+        return new pid_exposure(cfg);
+    return NULL;
+}
+
+#endif // EXPOSURE_CONTROL_H_
@@ -0,0 +1,449 @@
+/**
+ * @file fits_map.h
+ * @brief Memory mapped uncompressed FITS images, read in place without
+ * cfitsio
+ *
+ * The header of the primary HDU is parsed once (HIERARCH cards included,
+ * as cfitsio writes "SENSOR TEMP"), and the pixels are decoded straight
+ * from the mapping. 16 bit images written by fits_writer store unsigned
+ * pixels as big endian int16 with BZERO 32768: a byte swap and a flip of
+ * the top bit, done with SSE2/NEON by fits_accumulate(), which adds a
+ * stretch of pixels to per pixel sum and sum of square maps and to the
+ * statistics of the frame in the same pass. Other scalings go through the
+ * scalar path.
+ *
+ * Compressed and multi-extension files are not supported (the primary HDU
+ * of those is empty): read them with cfitsio.
+ *
+ */
+#ifndef FITS_MAP_H_
+#define FITS_MAP_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define FITS_MAP_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FITS_MAP_NEON 1
+#endif
+
+#define FITS_BLOCK 2880 // bytes in a header or data block
+#define FITS_CARD 80    // bytes in a header card
+
+/**
+ * @brief Statistics of the pixels of a frame (or of a part of it)
+ *
+ */
+typedef struct
+{
+    uint64_t n;
+    uint64_t sum;
+    uint64_t sumsq;
+    uint64_t saturated; // at 65535
+    unsigned short min, max;
+} fits_pix_stats;
+
+static inline void fits_pix_stats_init(fits_pix_stats *st)
+{
+    memset(st, 0x0, sizeof(fits_pix_stats));
+    st->min = 65535;
+}
+
+static inline void fits_pix_stats_merge(fits_pix_stats *dst, const fits_pix_stats *src)
+{
+    dst->n += src->n;
+    dst->sum += src->sum;
+    dst->sumsq += src->sumsq;
+    dst->saturated += src->saturated;
+    dst->min = src->min < dst->min ? src->min : dst->min;
+    dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+/* BZERO 32768: big endian int16 to unsigned, added to the maps and the statistics */
+static inline void fits_accumulate_scalar(const uint8_t *src, size_t n, uint32_t *sum, uint64_t *sumsq, fits_pix_stats *st)
+{
+    uint64_t s = 0, s2 = 0, sat = 0;
+    unsigned short mn = st->min, mx = st->max;
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned v = ((src[2 * i] << 8) | src[2 * i + 1]) ^ 0x8000;
+        sum[i] += v;
+        sumsq[i] += (uint64_t)v * v;
+        s += v;
+        s2 += (uint64_t)v * v;
+        sat += v == 65535;
+        mn = v < mn ? v : mn;
+        mx = v > mx ? v : mx;
+    }
+    st->n += n;
+    st->sum += s;
+    st->sumsq += s2;
+    st->saturated += sat;
+    st->min = mn;
+    st->max = mx;
+}
+
+/* any BZERO and BSCALE, clamped to 16 bits */
+static inline void fits_accumulate_generic(const uint8_t *src, size_t n, double bzero, double bscale, uint32_t *sum, uint64_t *sumsq, fits_pix_stats *st)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        double x = (int16_t)((src[2 * i] << 8) | src[2 * i + 1]) * bscale + bzero + 0.5;
+        unsigned v = x <= 0 ? 0 : (x >= 65535 ? 65535 : (unsigned)x);
+        sum[i] += v;
+        sumsq[i] += (uint64_t)v * v;
+        st->sum += v;
+        st->sumsq += (uint64_t)v * v;
+        st->saturated += v == 65535;
+        st->min = v < st->min ? v : st->min;
+        st->max = v > st->max ? v : st->max;
+    }
+    st->n += n;
+}
+
+#ifdef FITS_MAP_X86
+static inline void fits_accumulate_sse2(const uint8_t *src, size_t n, uint32_t *sum, uint64_t *sumsq, fits_pix_stats *st)
+{
+    const __m128i zero = _mm_setzero_si128(), flip = _mm_set1_epi16((short)0x8000), ones = _mm_set1_epi16(-1);
+    // min and max on the signed values, before the flip
+    __m128i mn = _mm_set1_epi16((short)((st->min ^ 0x8000) & 0xffff)), mx = _mm_set1_epi16((short)((st->max ^ 0x8000) & 0xffff));
+    uint64_t s = 0, s2 = 0, sat = 0;
+    size_t i = 0;
+    while (i + 8 <= n)
+    {
+        // 32 bit sums and 16 bit counts flushed every 4096 vectors
+        __m128i acc = zero, acc2 = zero, cnt = zero;
+        size_t end = i + 8 * 4096 < n ? i + 8 * 4096 : n;
+        for (; i + 8 <= end; i += 8)
+        {
+            __m128i r = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+            __m128i x = _mm_or_si128(_mm_slli_epi16(r, 8), _mm_srli_epi16(r, 8));
+            mn = _mm_min_epi16(mn, x);
+            mx = _mm_max_epi16(mx, x);
+            __m128i v = _mm_xor_si128(x, flip);
+            cnt = _mm_sub_epi16(cnt, _mm_cmpeq_epi16(v, ones));
+            __m128i lo = _mm_unpacklo_epi16(v, zero), hi = _mm_unpackhi_epi16(v, zero);
+            _mm_storeu_si128((__m128i *)(sum + i), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(sum + i)), lo));
+            _mm_storeu_si128((__m128i *)(sum + i + 4), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(sum + i + 4)), hi));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(lo, hi));
+            // 16 x 16 bit products as 32 bit, then widened for the 64 bit maps
+            __m128i pl = _mm_mullo_epi16(v, v), ph = _mm_mulhi_epu16(v, v);
+            __m128i q0 = _mm_unpacklo_epi16(pl, ph), q1 = _mm_unpackhi_epi16(pl, ph);
+            __m128i w0 = _mm_unpacklo_epi32(q0, zero), w1 = _mm_unpackhi_epi32(q0, zero);
+            __m128i w2 = _mm_unpacklo_epi32(q1, zero), w3 = _mm_unpackhi_epi32(q1, zero);
+            _mm_storeu_si128((__m128i *)(sumsq + i), _mm_add_epi64(_mm_loadu_si128((const __m128i *)(sumsq + i)), w0));
+            _mm_storeu_si128((__m128i *)(sumsq + i + 2), _mm_add_epi64(_mm_loadu_si128((const __m128i *)(sumsq + i + 2)), w1));
+            _mm_storeu_si128((__m128i *)(sumsq + i + 4), _mm_add_epi64(_mm_loadu_si128((const __m128i *)(sumsq + i + 4)), w2));
+            _mm_storeu_si128((__m128i *)(sumsq + i + 6), _mm_add_epi64(_mm_loadu_si128((const __m128i *)(sumsq + i + 6)), w3));
+            acc2 = _mm_add_epi64(acc2, _mm_add_epi64(_mm_add_epi64(w0, w1), _mm_add_epi64(w2, w3)));
+        }
+        uint32_t a[4];
+        uint64_t a2[2];
+        uint16_t c[8];
+        _mm_storeu_si128((__m128i *)a, acc);
+        _mm_storeu_si128((__m128i *)a2, acc2);
+        _mm_storeu_si128((__m128i *)c, cnt);
+        s += (uint64_t)a[0] + a[1] + a[2] + a[3];
+        s2 += a2[0] + a2[1];
+        for (int k = 0; k < 8; k++)
+            sat += c[k];
+    }
+    int16_t m[8], M[8];
+    _mm_storeu_si128((__m128i *)m, mn);
+    _mm_storeu_si128((__m128i *)M, mx);
+    for (int k = 0; k < 8; k++)
+    {
+        unsigned short lo = m[k] ^ 0x8000, hi = M[k] ^ 0x8000;
+        st->min = lo < st->min ? lo : st->min;
+        st->max = hi > st->max ? hi : st->max;
+    }
+    st->n += i;
+    st->sum += s;
+    st->sumsq += s2;
+    st->saturated += sat;
+    fits_accumulate_scalar(src + 2 * i, n - i, sum + i, sumsq + i, st);
+}
+#endif // FITS_MAP_X86
+
+#ifdef FITS_MAP_NEON
+static inline void fits_accumulate_neon(const uint8_t *src, size_t n, uint32_t *sum, uint64_t *sumsq, fits_pix_stats *st)
+{
+    const uint16x8_t flip = vdupq_n_u16(0x8000), ones = vdupq_n_u16(0xffff);
+    uint16x8_t mn = vdupq_n_u16(st->min), mx = vdupq_n_u16(st->max);
+    uint64_t s = 0, s2 = 0, sat = 0;
+    size_t i = 0;
+    while (i + 8 <= n)
+    {
+        uint32x4_t acc = vdupq_n_u32(0);
+        uint64x2_t acc2 = vdupq_n_u64(0);
+        uint16x8_t cnt = vdupq_n_u16(0);
+        size_t end = i + 8 * 4096 < n ? i + 8 * 4096 : n;
+        for (; i + 8 <= end; i += 8)
+        {
+            uint16x8_t v = veorq_u16(vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(src + 2 * i))), flip);
+            mn = vminq_u16(mn, v);
+            mx = vmaxq_u16(mx, v);
+            cnt = vsubq_u16(cnt, vceqq_u16(v, ones));
+            vst1q_u32(sum + i, vaddw_u16(vld1q_u32(sum + i), vget_low_u16(v)));
+            vst1q_u32(sum + i + 4, vaddw_u16(vld1q_u32(sum + i + 4), vget_high_u16(v)));
+            acc = vpadalq_u16(acc, v);
+            uint32x4_t q0 = vmull_u16(vget_low_u16(v), vget_low_u16(v)), q1 = vmull_u16(vget_high_u16(v), vget_high_u16(v));
+            vst1q_u64(sumsq + i, vaddw_u32(vld1q_u64(sumsq + i), vget_low_u32(q0)));
+            vst1q_u64(sumsq + i + 2, vaddw_u32(vld1q_u64(sumsq + i + 2), vget_high_u32(q0)));
+            vst1q_u64(sumsq + i + 4, vaddw_u32(vld1q_u64(sumsq + i + 4), vget_low_u32(q1)));
+            vst1q_u64(sumsq + i + 6, vaddw_u32(vld1q_u64(sumsq + i + 6), vget_high_u32(q1)));
+            acc2 = vpadalq_u32(vpadalq_u32(acc2, q0), q1);
+        }
+        s += vgetq_lane_u32(acc, 0) + (uint64_t)vgetq_lane_u32(acc, 1) + vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+        s2 += vgetq_lane_u64(acc2, 0) + vgetq_lane_u64(acc2, 1);
+        uint16_t c[8];
+        vst1q_u16(c, cnt);
+        for (int k = 0; k < 8; k++)
+            sat += c[k];
+    }
+    uint16_t m[8], M[8];
+    vst1q_u16(m, mn);
+    vst1q_u16(M, mx);
+    for (int k = 0; k < 8; k++)
+    {
+        st->min = m[k] < st->min ? m[k] : st->min;
+        st->max = M[k] > st->max ? M[k] : st->max;
+    }
+    st->n += i;
+    st->sum += s;
+    st->sumsq += s2;
+    st->saturated += sat;
+    fits_accumulate_scalar(src + 2 * i, n - i, sum + i, sumsq + i, st);
+}
+#endif // FITS_MAP_NEON
+
+class fits_map
+{
+private:
+    int fd;
+    uint8_t *base;
+    size_t length;
+
+    /* value of a card as a number, the keyword already matched */
+    static double card_value(const char *card, size_t len)
+    {
+        const char *eq = (const char *)memchr(card, '=', len);
+        return eq != NULL ? atof(eq + 1) : 0;
+    }
+    /* keyword of a card, HIERARCH names included, without trailing blanks */
+    static void card_key(const char *card, char *key, size_t size)
+    {
+        size_t start = 0, end;
+        if (strncmp(card, "HIERARCH ", 9) == 0)
+        {
+            start = 9;
+            const char *eq = (const char *)memchr(card, '=', FITS_CARD);
+            end = eq != NULL ? eq - card : FITS_CARD;
+        }
+        else
+            end = 8;
+        while (end > start && card[end - 1] == ' ')
+            end--;
+        size_t n = end - start < size - 1 ? end - start : size - 1;
+        memcpy(key, card + start, n);
+        key[n] = '\0';
+    }
+
+public:
+    int bitpix;
+    int naxis;
+    long naxes[3];
+    double bzero, bscale;
+    float exposure; // s, 0 if not in the header
+    float temp;     // C, NAN if not in the header
+    const uint8_t *data; // first pixel, in the mapping
+    size_t plane_pixels; // naxes[0] * naxes[1]
+    size_t planes;       // naxes[2] of a cube, 1 for an image
+    const char *error;   // why open() failed
+
+    fits_map()
+    {
+        fd = -1;
+        base = NULL;
+        length = 0;
+        data = NULL;
+        error = NULL;
+    }
+    ~fits_map()
+    {
+        close();
+    }
+    fits_map(const fits_map &) = delete;
+    fits_map &operator=(const fits_map &) = delete;
+    /**
+     * @brief Map a file and parse its primary header
+     *
+     * @return false Not a supported image, see error
+     */
+    bool open(const char *fname)
+    {
+        close();
+        bitpix = naxis = 0;
+        naxes[0] = naxes[1] = naxes[2] = 1;
+        bzero = 0;
+        bscale = 1;
+        exposure = 0;
+        temp = NAN;
+        struct stat sb;
+        fd = ::open(fname, O_RDONLY);
+        if (fd < 0 || fstat(fd, &sb) != 0)
+        {
+            error = "could not open";
+            close();
+            return false;
+        }
+        length = sb.st_size;
+        base = length > 0 ? (uint8_t *)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        if (base == NULL || base == MAP_FAILED)
+        {
+            base = NULL;
+            error = "could not map";
+            close();
+            return false;
+        }
+        size_t pos = 0;
+        bool end = false;
+        char key[72];
+        for (; pos + FITS_CARD <= length && !end; pos += FITS_CARD)
+        {
+            const char *card = (const char *)base + pos;
+            card_key(card, key, sizeof(key));
+            if (strcmp(key, "END") == 0)
+                end = true;
+            else if (strcmp(key, "BITPIX") == 0)
+                bitpix = card_value(card, FITS_CARD);
+            else if (strcmp(key, "NAXIS") == 0)
+                naxis = card_value(card, FITS_CARD);
+            else if (strncmp(key, "NAXIS", 5) == 0 && key[5] >= '1' && key[5] <= '3' && key[6] == '\0')
+                naxes[key[5] - '1'] = card_value(card, FITS_CARD);
+            else if (strcmp(key, "BZERO") == 0)
+                bzero = card_value(card, FITS_CARD);
+            else if (strcmp(key, "BSCALE") == 0)
+                bscale = card_value(card, FITS_CARD);
+            else if (strcmp(key, "EXPOSURE") == 0)
+                exposure = card_value(card, FITS_CARD);
+            else if (strcmp(key, "SENSOR TEMP") == 0)
+                temp = card_value(card, FITS_CARD);
+        }
+        size_t offset = (pos + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+        plane_pixels = (size_t)naxes[0] * naxes[1];
+        planes = naxis == 3 ? naxes[2] : 1;
+        if (!end)
+            error = "no END card";
+        else if (naxis < 2 || naxis > 3)
+            error = "no image in the primary HDU (compressed or multi-extension?)";
+        else if (bitpix != 16)
+            error = "not a 16 bit image";
+        else if (offset + plane_pixels * planes * 2 > length)
+            error = "truncated";
+        else
+        {
+            data = base + offset;
+            madvise(base, length, MADV_SEQUENTIAL);
+            return true;
+        }
+        close();
+        return false;
+    }
+    void close()
+    {
+        if (base != NULL)
+            munmap(base, length);
+        if (fd >= 0)
+            ::close(fd);
+        base = NULL;
+        fd = -1;
+        data = NULL;
+    }
+    /**
+     * @brief Ask the kernel to read the file ahead
+     *
+     */
+    void prefetch() const
+    {
+        if (base != NULL)
+            madvise(base, length, MADV_WILLNEED);
+    }
+    /**
+     * @brief Bytes of pixel data
+     *
+     */
+    size_t data_bytes() const
+    {
+        return plane_pixels * planes * 2;
+    }
+    /**
+     * @brief Add pixels [start, start + n) of a plane to per pixel sum and
+     * sum of square maps (indexed from start) and to st
+     *
+     */
+    void accumulate(size_t plane, size_t start, size_t n, uint32_t *sum, uint64_t *sumsq, fits_pix_stats *st, bool simd = true) const
+    {
+        const uint8_t *src = data + (plane * plane_pixels + start) * 2;
+        if (bzero != 32768.0 || bscale != 1.0)
+            return fits_accumulate_generic(src, n, bzero, bscale, sum, sumsq, st);
+#if defined(FITS_MAP_X86)
+        if (simd)
+            return fits_accumulate_sse2(src, n, sum, sumsq, st);
+#elif defined(FITS_MAP_NEON)
+        if (simd)
+            return fits_accumulate_neon(src, n, sum, sumsq, st);
+#endif
+        fits_accumulate_scalar(src, n, sum, sumsq, st);
+    }
+};
+
+/**
+ * @brief Write a float image as a minimal uncompressed FITS file
+ *
+ * @return false Could not write it
+ */
+static inline bool fits_write_float(const char *fname, const float *data, unsigned width, unsigned height)
+{
+    FILE *fp = fopen(fname, "wb");
+    if (fp == NULL)
+        return false;
+    char hdr[FITS_BLOCK];
+    memset(hdr, ' ', sizeof(hdr));
+    const char *cards[] = {"SIMPLE  =                    T", "BITPIX  =                  -32", "NAXIS   =                    2", NULL, NULL, "END"};
+    char c3[FITS_CARD + 1], c4[FITS_CARD + 1];
+    snprintf(c3, sizeof(c3), "NAXIS1  = %20u", width);
+    snprintf(c4, sizeof(c4), "NAXIS2  = %20u", height);
+    cards[3] = c3;
+    cards[4] = c4;
+    for (int i = 0; i < 6; i++)
+        memcpy(hdr + i * FITS_CARD, cards[i], strlen(cards[i]));
+    bool ok = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr);
+    size_t n = (size_t)width * height;
+    uint32_t buf[1024];
+    for (size_t i = 0; ok && i < n; i += 1024)
+    {
+        size_t m = n - i < 1024 ? n - i : 1024;
+        memcpy(buf, data + i, m * sizeof(float));
+        for (size_t k = 0; k < m; k++) // big endian
+            buf[k] = (buf[k] >> 24) | ((buf[k] >> 8) & 0xff00) | ((buf[k] << 8) & 0xff0000) | (buf[k] << 24);
+        ok = fwrite(buf, sizeof(uint32_t), m, fp) == m;
+    }
+    size_t pad = (FITS_BLOCK - (n * 4) % FITS_BLOCK) % FITS_BLOCK;
+    memset(hdr, 0, pad);
+    ok = ok && fwrite(hdr, 1, pad, fp) == pad;
+    return fclose(fp) == 0 && ok;
+}
+
+#endif // FITS_MAP_H_
@@ -0,0 +1,427 @@
+/**
+ * @file fits_writer.h
+ * @brief Background FITS writer: frames are copied into preallocated slots
+ * and written by a dedicated thread, so slow storage (SD cards) never
+ * stalls acquisition
+ *
+ * Frames can be written one per file, or batched N per file either as a
+ * data cube (NAXIS3 = N) or as a multi-extension file (one image HDU per
+ * frame). Batched files end with a FRAMES binary table holding the
+ * timestamp, exposure and sensor temperature of every frame. Images can be
+ * tile compressed (Rice) by cfitsio; a compressed batch is always written
+ * as a multi-extension file, since cfitsio cannot resize a compressed cube
+ * that is closed early.
+ *
+ */
+#ifndef FITS_WRITER_H_
+#define FITS_WRITER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <atomic>
+
+#include <fitsio.h>
+#include <frame_queue.h>
+
+typedef enum
+{
+    FITS_SINGLE = 0, // one file per frame
+    FITS_CUBE,       // N frames of the same size and binning as NAXIS3 of the primary image
+    FITS_MEF         // N frames as image extensions
+} fits_batch_mode;
+
+class fits_writer
+{
+private:
+    typedef struct
+    {
+        unsigned short *data;
+        size_t alloc; // pixels
+        unsigned width;
+        unsigned height;
+        float temp;
+        float exposure;
+        uint64_t tstamp;
+        unsigned bin;
+        bool close; // not a frame: close the current batch
+        char fname[256];
+    } fits_job;
+
+    fits_job *slots;
+    unsigned nslots;
+    spsc_queue<fits_job *> work_q; // submitter -> writer
+    spsc_queue<fits_job *> free_q; // writer -> submitter
+    pthread_t thread;
+    bool started;
+    volatile bool quit;
+    fits_batch_mode mode;
+    unsigned batch;
+    bool compress;
+
+    // batch being written (writer thread only)
+    fitsfile *fptr;
+    unsigned nframes;
+    unsigned cur_width, cur_height, cur_bin;
+    long long *col_tstamp;
+    float *col_exposure;
+    float *col_temp;
+
+    static uint64_t now_us()
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000ULL + tv.tv_usec;
+    }
+
+    static void write_keys(fitsfile *fptr, const fits_job *job, int *status)
+    {
+        int bzero = 32768, bscale = 1;
+        fits_write_key(fptr, TSTRING, "PROGRAM", (void *)"atik_ccd_test", NULL, status);
+        fits_write_key(fptr, TUSHORT, "BZERO", &bzero, NULL, status);
+        fits_write_key(fptr, TUSHORT, "BSCALE", &bscale, NULL, status);
+        fits_write_key(fptr, TFLOAT, "SENSOR TEMP", (void *)&(job->temp), NULL, status);
+        fits_write_key(fptr, TFLOAT, "EXPOSURE", (void *)&(job->exposure), "s", status);
+        fits_write_key(fptr, TUINT, "XBINNING", (void *)&(job->bin), NULL, status);
+        fits_write_key(fptr, TUINT, "YBINNING", (void *)&(job->bin), NULL, status);
+        long long tstamp = job->tstamp;
+        fits_write_key(fptr, TLONGLONG, "TSTAMP", &tstamp, "us since epoch", status);
+    }
+
+    bool write_single(const fits_job *job)
+    {
+        fitsfile *fp;
+        int status = 0;
+        long naxes[2] = {(long)job->width, (long)job->height};
+        unlink(job->fname);
+        if (fits_create_file(&fp, job->fname, &status))
+            return false;
+        if (compress)
+            fits_set_compression_type(fp, RICE_1, &status);
+        fits_create_img(fp, USHORT_IMG, 2, naxes, &status);
+        write_keys(fp, job, &status);
+        long fpixel[] = {1, 1};
+        fits_write_pix(fp, TUSHORT, fpixel, (long long)job->width * job->height, job->data, &status);
+        fits_close_file(fp, &status);
+        return status == 0;
+    }
+
+    void close_batch()
+    {
+        if (fptr == NULL)
+            return;
+        int status = 0;
+        if (mode == FITS_CUBE && !compress && nframes < batch)
+        {
+            long naxes[3] = {(long)cur_width, (long)cur_height, (long)nframes};
+            fits_movabs_hdu(fptr, 1, NULL, &status);
+            fits_resize_img(fptr, USHORT_IMG, 3, naxes, &status);
+        }
+        char *ttype[] = {(char *)"TSTAMP", (char *)"EXPOSURE", (char *)"TEMP"};
+        char *tform[] = {(char *)"1K", (char *)"1E", (char *)"1E"};
+        char *tunit[] = {(char *)"us", (char *)"s", (char *)"C"};
+        fits_create_tbl(fptr, BINARY_TBL, nframes, 3, ttype, tform, tunit, "FRAMES", &status);
+        fits_write_col(fptr, TLONGLONG, 1, 1, 1, nframes, col_tstamp, &status);
+        fits_write_col(fptr, TFLOAT, 2, 1, 1, nframes, col_exposure, &status);
+        fits_write_col(fptr, TFLOAT, 3, 1, 1, nframes, col_temp, &status);
+        fits_close_file(fptr, &status);
+        if (status)
+        {
+            fits_report_error(stderr, status);
+            failed++;
+        }
+        fptr = NULL;
+        nframes = 0;
+        files++;
+    }
+
+    bool write_batched(const fits_job *job)
+    {
+        if (fptr != NULL && (nframes == batch || job->width != cur_width || job->height != cur_height || job->bin != cur_bin))
+            close_batch();
+        int status = 0;
+        bool cube = mode == FITS_CUBE && !compress;
+        if (fptr == NULL)
+        {
+            unlink(job->fname);
+            if (fits_create_file(&fptr, job->fname, &status))
+            {
+                fptr = NULL;
+                return false;
+            }
+            cur_width = job->width;
+            cur_height = job->height;
+            cur_bin = job->bin;
+            if (cube)
+            {
+                long naxes[3] = {(long)job->width, (long)job->height, (long)batch};
+                fits_create_img(fptr, USHORT_IMG, 3, naxes, &status);
+                write_keys(fptr, job, &status); // of the first frame, the others are in FRAMES
+            }
+            else
+            {
+                fits_create_img(fptr, USHORT_IMG, 0, NULL, &status); // empty primary
+                fits_write_key(fptr, TSTRING, "PROGRAM", (void *)"atik_ccd_test", NULL, &status);
+            }
+        }
+        if (cube)
+        {
+            long fpixel[] = {1, 1, (long)nframes + 1};
+            fits_write_pix(fptr, TUSHORT, fpixel, (long long)job->width * job->height, job->data, &status);
+        }
+        else
+        {
+            long naxes[2] = {(long)job->width, (long)job->height};
+            if (compress)
+                fits_set_compression_type(fptr, RICE_1, &status);
+            fits_create_img(fptr, USHORT_IMG, 2, naxes, &status);
+            write_keys(fptr, job, &status);
+            long fpixel[] = {1, 1};
+            fits_write_pix(fptr, TUSHORT, fpixel, (long long)job->width * job->height, job->data, &status);
+        }
+        col_tstamp[nframes] = job->tstamp;
+        col_exposure[nframes] = job->exposure;
+        col_temp[nframes] = job->temp;
+        nframes++;
+        if (status)
+            fits_report_error(stderr, status);
+        return status == 0;
+    }
+
+    static void *writer_fcn(void *_self)
+    {
+        fits_writer *self = (fits_writer *)_self;
+        fits_job *job;
+        while (true)
+        {
+            if (!self->work_q.pop_wait(job, 100000))
+            {
+                if (self->quit)
+                    break;
+                continue;
+            }
+            if (job->close)
+                self->close_batch();
+            else if (job->width > 0 && job->height > 0)
+            {
+                uint64_t tstart = now_us();
+                bool ok = self->mode == FITS_SINGLE || self->batch <= 1 ? self->write_single(job) : self->write_batched(job);
+                self->write.add(now_us() - tstart);
+                if (ok)
+                    self->bytes += (unsigned long long)job->width * job->height * sizeof(unsigned short);
+                else
+                    self->failed++;
+                if (self->mode == FITS_SINGLE || self->batch <= 1)
+                    self->files++;
+            }
+            self->free_q.push(job);
+        }
+        self->close_batch();
+        return NULL;
+    }
+
+    static unsigned slot_count(unsigned depth)
+    {
+        return (depth > 0 ? depth : 1) + 1; // one more for the end of batch marker
+    }
+
+    fits_job *get_slot(bool block)
+    {
+        fits_job *job = NULL;
+        if (free_q.pop(job))
+            return job;
+        if (!block)
+            return NULL;
+        uint64_t tstart = now_us();
+        while (!free_q.pop_wait(job, 100000))
+            ;
+        uint64_t waited = now_us() - tstart;
+        wait_us += waited;
+        waits++;
+        if (waited > max_wait_us)
+            max_wait_us = waited;
+        return job;
+    }
+
+public:
+    /**
+     * @brief Frames written (or attempted) and time spent writing them
+     *
+     */
+    stage_stats write;
+    std::atomic<unsigned long long> submitted;
+    /**
+     * @brief Frames rejected by a non-blocking submit() with every slot in use
+     *
+     */
+    std::atomic<unsigned long long> dropped;
+    /**
+     * @brief Times a blocking submit() had to wait for a slot, and for how long
+     *
+     */
+    std::atomic<unsigned long long> waits;
+    std::atomic<unsigned long long> wait_us;
+    std::atomic<unsigned long long> max_wait_us;
+    std::atomic<unsigned long long> failed;
+    std::atomic<unsigned long long> files;
+    std::atomic<unsigned long long> bytes;
+
+    /**
+     * @brief Start a writer thread
+     *
+     * @param depth Frames that can wait to be written
+     * @param max_pixels Pixels of the largest frame, slots grow if a frame is larger
+     * @param mode One file per frame, cubes or multi-extension files
+     * @param batch Frames per file in FITS_CUBE and FITS_MEF modes
+     * @param compress Rice tile compression of the images
+     */
+    fits_writer(unsigned depth, size_t max_pixels, fits_batch_mode mode = FITS_SINGLE, unsigned batch = 1, bool compress = false) : work_q(slot_count(depth)), free_q(slot_count(depth))
+    {
+        if (batch == 0)
+            batch = 1;
+        nslots = slot_count(depth);
+        slots = new fits_job[nslots];
+        for (unsigned i = 0; i < nslots; i++)
+        {
+            memset(&slots[i], 0x0, sizeof(fits_job));
+            slots[i].data = (unsigned short *)malloc(max_pixels * sizeof(unsigned short));
+            slots[i].alloc = slots[i].data == NULL ? 0 : max_pixels;
+            free_q.push(&slots[i]);
+        }
+        this->mode = mode;
+        this->batch = batch;
+        this->compress = compress;
+        fptr = NULL;
+        nframes = 0;
+        cur_width = 0;
+        cur_height = 0;
+        cur_bin = 0;
+        col_tstamp = new long long[batch];
+        col_exposure = new float[batch];
+        col_temp = new float[batch];
+        submitted = 0;
+        dropped = 0;
+        waits = 0;
+        wait_us = 0;
+        max_wait_us = 0;
+        failed = 0;
+        files = 0;
+        bytes = 0;
+        quit = false;
+        started = pthread_create(&thread, NULL, writer_fcn, this) == 0;
+    }
+    /**
+     * @brief Write out every queued frame, close the open batch and stop the thread
+     *
+     */
+    ~fits_writer()
+    {
+        quit = true;
+        if (started)
+            pthread_join(thread, NULL);
+        for (unsigned i = 0; i < nslots; i++)
+            free(slots[i].data);
+        delete[] slots;
+        delete[] col_tstamp;
+        delete[] col_exposure;
+        delete[] col_temp;
+    }
+    fits_writer(const fits_writer &) = delete;
+    fits_writer &operator=(const fits_writer &) = delete;
+    /**
+     * @brief Queue a copy of a frame for writing. Only one thread may submit.
+     *
+     * @param fname File name; in batch modes, the name of the file the batch starts
+     * @param data 16 bit pixels, row major
+     * @param width Frame width
+     * @param height Frame height
+     * @param temp Sensor temperature
+     * @param exposure Exposure in seconds
+     * @param tstamp Timestamp in microseconds since the epoch
+     * @param bin Sensor pixels summed along each axis of a pixel
+     * @param block Wait for a free slot if the writer is behind, otherwise drop the frame
+     * @return true Frame queued
+     * @return false Frame dropped, or out of memory
+     */
+    bool submit(const char *fname, const unsigned short *data, unsigned width, unsigned height, float temp, float exposure, uint64_t tstamp, unsigned bin, bool block = true)
+    {
+        if (!started)
+            return false;
+        fits_job *job = get_slot(block);
+        if (job == NULL)
+        {
+            dropped++;
+            return false;
+        }
+        size_t n = (size_t)width * height;
+        if (n > job->alloc)
+        {
+            unsigned short *tmp = (unsigned short *)realloc(job->data, n * sizeof(unsigned short));
+            if (tmp == NULL)
+            {
+                job->close = false;
+                job->width = job->height = 0; // nothing to write, the writer returns the slot
+                work_q.push(job);
+                dropped++;
+                return false;
+            }
+            job->data = tmp;
+            job->alloc = n;
+        }
+        memcpy(job->data, data, n * sizeof(unsigned short));
+        job->width = width;
+        job->height = height;
+        job->temp = temp;
+        job->exposure = exposure;
+        job->tstamp = tstamp;
+        job->bin = bin;
+        job->close = false;
+        strncpy(job->fname, fname, sizeof(job->fname) - 1);
+        job->fname[sizeof(job->fname) - 1] = '\0';
+        work_q.push(job); // never full, there are as many slots as queue entries
+        submitted++;
+        return true;
+    }
+    /**
+     * @brief End the current batch, the next frame starts a new file
+     * (submitting thread only)
+     *
+     */
+    void end_batch()
+    {
+        if (!started)
+            return;
+        fits_job *job = get_slot(true);
+        job->close = true;
+        work_q.push(job);
+    }
+    /**
+     * @brief End the current batch and wait until everything queued is on
+     * disk (submitting thread only)
+     *
+     */
+    void flush()
+    {
+        end_batch();
+        while (started && free_q.size() < nslots)
+            usleep(1000);
+    }
+    /**
+     * @brief Print queue occupancy, backpressure and write throughput
+     *
+     * @param fp Output stream
+     */
+    void report(FILE *fp)
+    {
+        unsigned long long n = write.frames, busy = write.busy_us, w = waits;
+        fprintf(fp, "fits: %llu queued, %llu written to %llu files (%.1f ms/frame, %.1f MB/s), %llu failed | queue %.2f/%u (max %u), %llu dropped, %llu waits (avg %.1f ms, max %.1f ms)\n",
+                submitted.load(), n, files.load(), n ? busy * 1e-3 / n : 0, busy ? bytes.load() / (double)busy : 0, failed.load(),
+                work_q.avg_depth(), work_q.capacity(), work_q.depth_max.load(), dropped.load(), w, w ? wait_us.load() * 1e-3 / w : 0, max_wait_us.load() * 1e-3);
+    }
+};
+
+#endif // FITS_WRITER_H_
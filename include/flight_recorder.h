@@ -0,0 +1,334 @@
+/**
+ * @file flight_recorder.h
+ * @brief Flight recorder: the last N raw frames, kept in a preallocated
+ * memory mapped circular file
+ *
+ * The file is a page sized header followed by nslots fixed size records,
+ * each a page aligned record header and room for max_pixels pixels.
+ * Appending a frame is a memcpy into the mapping, no system call: the
+ * kernel writes the pages back on its own. A record is committed by
+ * storing its sequence number last, after the pixels and metadata, and is
+ * invalidated first when the slot is reused, so after a crash of the
+ * process every record whose commit matches its sequence number is
+ * complete. Nothing orders the writeback to the disk, so a power loss may
+ * leave any record torn. The file survives restarts: reopening a file of
+ * the same geometry keeps its records and continues the sequence.
+ *
+ * Pages are not faulted in when the file is opened, only as frames are
+ * appended, and the file is sized by a byte budget (slots_for()): every
+ * appended frame is written back to the disk.
+ *
+ * File layout:
+ *   flight_file_hdr (FLIGHT_PAGE bytes)
+ *   nslots x { flight_rec_hdr (FLIGHT_PAGE bytes) pixels (max_pixels * 2, page rounded) }
+ *
+ */
+#ifndef FLIGHT_RECORDER_H_
+#define FLIGHT_RECORDER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+
+#define FLIGHT_MAGIC 0x43524643 // "CFRC"
+#define FLIGHT_VERSION 2
+#define FLIGHT_PAGE 4096
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nslots;
+    uint64_t slot_size;  // bytes per record, header included
+    uint64_t max_pixels; // pixels a record can hold
+    std::atomic<uint64_t> head; // sequence number of the newest committed record
+} flight_file_hdr;
+
+typedef struct
+{
+    std::atomic<uint64_t> commit; // == seq once the record is complete, 0 while it is written
+    uint64_t seq;
+    uint64_t tstamp; // us since the epoch
+    uint32_t width;
+    uint32_t height;
+    uint32_t x; // origin on the sensor
+    uint32_t y;
+    uint32_t bin; // sensor pixels summed along each axis of a pixel
+    float temp;
+    float exposure;
+} flight_rec_hdr;
+
+class flight_recorder
+{
+private:
+    int fd;
+    unsigned char *map;
+    size_t map_size;
+    flight_file_hdr *hdr;
+    std::atomic<uint64_t> next_seq; // written by append() only, read by records()
+    std::atomic<bool> appending;    // append() is past its frozen check
+
+    static uint64_t page_round(uint64_t n)
+    {
+        return (n + FLIGHT_PAGE - 1) / FLIGHT_PAGE * FLIGHT_PAGE;
+    }
+
+    flight_rec_hdr *slot(uint64_t idx) const
+    {
+        return (flight_rec_hdr *)(map + FLIGHT_PAGE + idx * hdr->slot_size);
+    }
+
+    static uint64_t monotonic_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+public:
+    /**
+     * @brief Appends refused while frozen
+     *
+     */
+    std::atomic<unsigned long long> skipped;
+    std::atomic<unsigned long long> appended;
+    /**
+     * @brief Time spent in append(), for the bandwidth and the capture jitter it adds
+     *
+     */
+    std::atomic<unsigned long long> append_ns;
+    std::atomic<unsigned long long> append_max_ns;
+    /**
+     * @brief While set, append() leaves the file alone so it can be exported,
+     * see freeze()
+     *
+     */
+    std::atomic<bool> frozen;
+
+    flight_recorder()
+    {
+        fd = -1;
+        map = NULL;
+        map_size = 0;
+        hdr = NULL;
+        next_seq = 1;
+        appending = false;
+        skipped = 0;
+        appended = 0;
+        append_ns = 0;
+        append_max_ns = 0;
+        frozen = false;
+    }
+    ~flight_recorder()
+    {
+        close();
+    }
+    flight_recorder(const flight_recorder &) = delete;
+    flight_recorder &operator=(const flight_recorder &) = delete;
+    /**
+     * @brief Open (or create) the circular file and map it. An existing file
+     * with the same geometry keeps its records, any other is reinitialized.
+     *
+     * @param fname File name
+     * @param nslots Frames kept
+     * @param max_pixels Pixels of the largest frame
+     * @return true File ready
+     */
+    bool open(const char *fname, uint64_t nslots, uint64_t max_pixels)
+    {
+        close();
+        if (nslots == 0 || max_pixels == 0)
+            return false;
+        uint64_t slot_size = FLIGHT_PAGE + page_round(max_pixels * sizeof(uint16_t));
+        if (nslots > (SIZE_MAX - FLIGHT_PAGE) / slot_size) // larger than the address space
+            return false;
+        size_t size = FLIGHT_PAGE + nslots * slot_size;
+        fd = ::open(fname, O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        bool reuse = fstat(fd, &st) == 0 && (size_t)st.st_size == size;
+        // reserve the blocks now, so a full disk fails here and not as SIGBUS in append()
+        int err = posix_fallocate(fd, 0, size);
+        if (err != 0 && err != EOPNOTSUPP && err != EINVAL)
+        {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        if (err != 0 && ftruncate(fd, size) != 0)
+        {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        map = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            map = NULL;
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        map_size = size;
+        hdr = (flight_file_hdr *)map;
+        reuse = reuse && hdr->magic == FLIGHT_MAGIC && hdr->version == FLIGHT_VERSION && hdr->nslots == nslots && hdr->slot_size == slot_size && hdr->max_pixels == max_pixels;
+        if (!reuse)
+        {
+            memset(map, 0x0, FLIGHT_PAGE);
+            for (uint64_t i = 0; i < nslots; i++)
+                memset((void *)(map + FLIGHT_PAGE + i * slot_size), 0x0, sizeof(flight_rec_hdr));
+            hdr->nslots = nslots;
+            hdr->slot_size = slot_size;
+            hdr->max_pixels = max_pixels;
+            hdr->version = FLIGHT_VERSION;
+            hdr->head = 0;
+            hdr->magic = FLIGHT_MAGIC;
+            msync(map, FLIGHT_PAGE, MS_SYNC);
+        }
+        // the newest committed record, head may lag it after a crash
+        uint64_t last = 0;
+        for (uint64_t i = 0; i < nslots; i++)
+        {
+            flight_rec_hdr *rec = slot(i);
+            uint64_t c = rec->commit.load(std::memory_order_acquire);
+            if (c != 0 && c == rec->seq && c > last)
+                last = c;
+        }
+        next_seq = last + 1;
+        return true;
+    }
+    void close()
+    {
+        if (map != NULL)
+        {
+            msync(map, map_size, MS_ASYNC);
+            munmap(map, map_size);
+        }
+        if (fd >= 0)
+            ::close(fd);
+        map = NULL;
+        hdr = NULL;
+        fd = -1;
+        map_size = 0;
+    }
+    bool is_open() const
+    {
+        return map != NULL;
+    }
+    /**
+     * @brief Records of max_pixels pixels that fit in a file of at most bytes
+     *
+     */
+    static uint64_t slots_for(uint64_t bytes, uint64_t max_pixels)
+    {
+        uint64_t slot_size = FLIGHT_PAGE + page_round(max_pixels * sizeof(uint16_t));
+        return bytes > FLIGHT_PAGE ? (bytes - FLIGHT_PAGE) / slot_size : 0;
+    }
+    uint64_t capacity() const
+    {
+        return hdr == NULL ? 0 : hdr->nslots;
+    }
+    /**
+     * @brief Copy a frame into the oldest record (one thread only). No
+     * system call, pages are written back by the kernel.
+     *
+     * @return uint64_t Sequence number of the record, 0 if not open,
+     * frozen or frame too large
+     */
+    uint64_t append(const unsigned short *data, unsigned width, unsigned height, unsigned x, unsigned y, unsigned bin, float temp, float exposure, uint64_t tstamp)
+    {
+        appending = true; // before the check, freeze() looks at it after setting frozen
+        if (map == NULL || frozen || (uint64_t)width * height > hdr->max_pixels)
+        {
+            appending = false;
+            skipped++;
+            return 0;
+        }
+        uint64_t tstart = monotonic_ns();
+        uint64_t seq = next_seq++;
+        flight_rec_hdr *rec = slot(seq % hdr->nslots);
+        rec->commit.store(0, std::memory_order_release); // invalid until rewritten
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy((unsigned char *)rec + FLIGHT_PAGE, data, (size_t)width * height * sizeof(uint16_t));
+        rec->seq = seq;
+        rec->tstamp = tstamp;
+        rec->width = width;
+        rec->height = height;
+        rec->x = x;
+        rec->y = y;
+        rec->bin = bin;
+        rec->temp = temp;
+        rec->exposure = exposure;
+        rec->commit.store(seq, std::memory_order_release);
+        hdr->head.store(seq, std::memory_order_release);
+        appending.store(false, std::memory_order_release);
+        uint64_t dt = monotonic_ns() - tstart;
+        appended++;
+        append_ns += dt;
+        if (dt > append_max_ns)
+            append_max_ns = dt;
+        return seq;
+    }
+    /**
+     * @brief Stop appends (any thread), returns once an append in progress
+     * has finished: the records stay as they are until thaw()
+     *
+     */
+    void freeze()
+    {
+        frozen = true;
+        while (appending)
+            usleep(100);
+    }
+    void thaw()
+    {
+        frozen = false;
+    }
+    /**
+     * @brief Committed records, oldest first. freeze() the recorder first if
+     * frames are still being appended.
+     *
+     * @param recs Output, capacity() entries
+     * @return unsigned long long Number of records
+     */
+    unsigned long long records(const flight_rec_hdr **recs) const
+    {
+        if (map == NULL)
+            return 0;
+        unsigned long long n = 0;
+        uint64_t head = next_seq - 1, nslots = hdr->nslots;
+        uint64_t first = head >= nslots ? head - nslots + 1 : 1;
+        for (uint64_t s = first; s <= head; s++)
+        {
+            const flight_rec_hdr *rec = slot(s % nslots);
+            if (rec->commit.load(std::memory_order_acquire) == s && rec->seq == s)
+                recs[n++] = rec;
+        }
+        return n;
+    }
+    /**
+     * @brief Pixels of a record
+     *
+     */
+    static const unsigned short *pixels(const flight_rec_hdr *rec)
+    {
+        return (const unsigned short *)((const unsigned char *)rec + FLIGHT_PAGE);
+    }
+    void report(FILE *fp)
+    {
+        unsigned long long n = appended;
+        fprintf(fp, "recorder: %llu frames recorded (%llu slots), %llu skipped, append avg %.2f ms, max %.2f ms\n",
+                n, (unsigned long long)capacity(), skipped.load(), n ? append_ns.load() * 1e-6 / n : 0, append_max_ns.load() * 1e-6);
+    }
+};
+
+#endif // FLIGHT_RECORDER_H_
@@ -0,0 +1,199 @@
+/**
+ * @file frame_decode.h
+ * @brief Client side frame decoders: JPEG previews and lossless 16 bit
+ * frames to RGBA, in a header so the benchmarks use the same code
+ *
+ */
+#ifndef FRAME_DECODE_H_
+#define FRAME_DECODE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <jpeglib.h>
+
+#include <raw_codec.h>
+#include <tone_map.h>
+
+typedef struct
+{
+    unsigned char *data;
+    unsigned max_size;
+    unsigned width;
+    unsigned height;
+} imagedata;
+
+/**
+ * @brief Grow an image buffer (malloc'd or NULL) to hold width x height
+ * RGBA pixels, kept when large enough
+ *
+ * @return false Out of memory, the old buffer is kept
+ */
+static inline bool imagedata_reserve(imagedata *image, unsigned width, unsigned height)
+{
+    size_t size = (size_t)width * height * 4;
+    if (size == 0 || size > 0xffffffffu)
+        return false;
+    if (image->data != NULL && size <= image->max_size)
+        return true;
+    unsigned char *tmp = (unsigned char *)realloc(image->data, size);
+    if (tmp == NULL)
+        return false;
+    image->data = tmp;
+    image->max_size = size;
+    return true;
+}
+
+static inline bool LoadTextureFromMem(const unsigned char *in_jpeg, ssize_t len, imagedata *image)
+{
+    if (len <= 0 || in_jpeg == NULL || image->data == NULL || image->max_size == 0)
+    {
+        return false;
+    }
+    // Load from file
+    int image_width = 0;
+    int image_height = 0;
+    unsigned char *image_data = image->data;
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    /* More stuff */
+    JSAMPARRAY buffer; /* Output row buffer */
+    int row_stride;    /* physical row width in output buffer */
+
+    /* In this example we want to open the input file before doing anything else,
+   * so that the setjmp() error recovery below can assume the file is open.
+   * VERY IMPORTANT: use "b" option to fopen() if you are on a machine that
+   * requires it in order to read binary files.
+   */
+    cinfo.err = jpeg_std_error(&jerr);
+    /* Step 1: allocate and initialize JPEG decompression object */
+    jpeg_create_decompress(&cinfo);
+    /* Step 2: specify data source (eg, a file) */
+
+    jpeg_mem_src(&cinfo, in_jpeg, len);
+    /* Step 3: read file parameters with jpeg_read_header() */
+
+    jpeg_read_header(&cinfo, TRUE);
+    /* We can ignore the return value from jpeg_read_header since
+   *   (a) suspension is not possible with the stdio data source, and
+   *   (b) we passed TRUE to reject a tables-only JPEG file as an error.
+   * See libjpeg.txt for more info.
+   */
+    /* Step 4: set parameters for decompression */
+
+    /* In this example, we don't need to change any of the defaults set by
+   * jpeg_read_header(), so we do nothing here.
+   */
+
+    /* Step 5: Start decompressor */
+    cinfo.out_color_space = JCS_EXT_RGBA;
+    // cinfo.scale_num = 640; // scale to 480p
+    // cinfo.scale_denom = cinfo.image_width;
+    (void)jpeg_start_decompress(&cinfo);
+    /* We may need to do some setup of our own at this point before reading
+   * the data.  After jpeg_start_decompress() we have the correct scaled
+   * output image dimensions available, as well as the output colormap
+   * if we asked for color quantization.
+   * In this example, we need to make an output work buffer of the right size.
+   */
+    /* JSAMPLEs per row in output buffer */
+    row_stride = cinfo.output_width * cinfo.output_components;
+    /* Make a one-row-high sample array that will go away when done with image */
+    buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, row_stride, 1);
+
+    /* Step 6: while (scan lines remain to be read) */
+    /*           jpeg_read_scanlines(...); */
+
+    /* Here we use the library's state variable cinfo.output_scanline as the
+   * loop counter, so that we don't have to keep track ourselves.
+   */
+    int loc = 0;
+    if (image->max_size < row_stride * cinfo.output_height)
+    {
+        printf("%s: Required memory for raw image: %u, allocated: %u\n", __func__, row_stride * cinfo.output_height, image->max_size);
+        goto jpeg_end;
+    }
+    image_height = cinfo.output_height;
+    image_width = cinfo.output_width;
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        /* jpeg_read_scanlines expects an array of pointers to scanlines.
+     * Here the array is only one element long, but you could ask for
+     * more than one scanline at a time if that's more convenient.
+     */
+        (void)jpeg_read_scanlines(&cinfo, buffer, 1);
+        /* Assume put_scanline_someplace wants a pointer and sample count. */
+        memcpy(&(image_data[loc]), buffer[0], row_stride);
+        loc += row_stride;
+    }
+
+    /* Step 7: Finish decompression */
+jpeg_end:
+    (void)jpeg_finish_decompress(&cinfo);
+    /* We can ignore the return value since suspension is not possible
+   * with the stdio data source.
+   */
+
+    /* Step 8: Release JPEG decompression object */
+
+    /* This is an important step since it will release a good deal of memory. */
+    jpeg_destroy_decompress(&cinfo);
+    /* After finish_decompress, we can close the input file.
+   * Here we postpone it until after no more JPEG errors are possible,
+   * so as to simplify the setjmp error logic above.  (Actually, I don't
+   * think that jpeg_destroy can do an error exit, but why assume anything...)
+   */
+
+    image->height = image_height;
+    image->width = image_width;
+    return true;
+}
+
+/**
+ * @brief Decode a lossless 16 bit frame and stretch it for display locally,
+ * with the stretch selected in the UI
+ *
+ */
+static inline bool LoadRawFromMem(const unsigned char *in, ssize_t len, imagedata *image)
+{
+    static unsigned short *pixels = NULL; // decoded frame, kept between frames
+    static size_t pixels_alloc = 0;
+    static unsigned char *gray = NULL;
+    static tone_map tmap;
+    unsigned width, height;
+    if (len <= 0 || in == NULL || image->data == NULL || !raw16_codec::dimensions(in, len, &width, &height))
+        return false;
+    size_t n = (size_t)width * height;
+    if (n * 4 > image->max_size)
+    {
+        printf("%s: Required memory for raw image: %zu, allocated: %u\n", __func__, n * 4, image->max_size);
+        return false;
+    }
+    if (n > pixels_alloc)
+    {
+        unsigned short *tmp = (unsigned short *)realloc(pixels, n * sizeof(unsigned short));
+        unsigned char *tmp8 = tmp == NULL ? NULL : (unsigned char *)realloc(gray, n);
+        if (tmp != NULL)
+            pixels = tmp;
+        if (tmp8 == NULL)
+            return false;
+        gray = tmp8;
+        pixels_alloc = n;
+    }
+    if (!raw16_codec::decode(in, len, pixels, pixels_alloc, &width, &height))
+        return false;
+    tmap.prepare(pixels, n);
+    tmap.apply(pixels, gray, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        image->data[4 * i] = image->data[4 * i + 1] = image->data[4 * i + 2] = gray[i];
+        image->data[4 * i + 3] = 0xff;
+    }
+    image->width = width;
+    image->height = height;
+    return true;
+}
+
+#endif // FRAME_DECODE_H_
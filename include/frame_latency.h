@@ -0,0 +1,142 @@
+/**
+ * @file frame_latency.h
+ * @brief Latency breakdown of received frames: the server's stage stamps in
+ * net_meta plus the client's receive, decode and display times, with
+ * percentiles over the last LATENCY_WINDOW frames
+ *
+ * Server stages are differences of the server's CLOCK_MONOTONIC stamps and
+ * client stages of the client's. The network stage and the end to end
+ * ("glass to glass") latency compare the two hosts' CLOCK_REALTIME, using
+ * the clock offset sent with the frame, so they are only as good as the
+ * clock synchronization (NTP/PTP) between the hosts, and can be negative.
+ *
+ */
+#ifndef FRAME_LATENCY_H_
+#define FRAME_LATENCY_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#include <comic_net.h>
+
+#ifndef LATENCY_WINDOW
+#define LATENCY_WINDOW 256 // frames the percentiles are taken over
+#endif
+
+typedef enum
+{
+    LAT_CAPTURE = 0,  // exposure start to readout done
+    LAT_READOUT,      // capture minus the exposure time
+    LAT_ENCODE,       // readout done to encoded: analysis, queueing, downscale and encode
+    LAT_PUBLISH,      // encoded to published
+    LAT_SEND_QUEUE,   // published to first byte sent
+    LAT_NETWORK,      // first byte sent to received (wall clocks)
+    LAT_DECODE,       // received to decoded and uploaded
+    LAT_DISPLAY,      // decoded to on screen
+    LAT_TOTAL,        // exposure start to on screen (wall clocks)
+    LAT_NUM_STAGES
+} latency_stage;
+
+static const char *const latency_stage_names[LAT_NUM_STAGES] = {
+    "exposure + readout",
+    "readout overhead",
+    "analysis + encode",
+    "publish",
+    "send queue",
+    "network",
+    "decode",
+    "display",
+    "glass to glass",
+};
+
+class frame_latency
+{
+private:
+    double samples[LAT_NUM_STAGES][LATENCY_WINDOW]; // ms
+    unsigned count[LAT_NUM_STAGES];
+    unsigned head[LAT_NUM_STAGES];
+
+    void add_sample(int stage, double ms)
+    {
+        samples[stage][head[stage]] = ms;
+        head[stage] = (head[stage] + 1) % LATENCY_WINDOW;
+        if (count[stage] < LATENCY_WINDOW)
+            count[stage]++;
+    }
+
+public:
+    /**
+     * @brief Frames added
+     *
+     */
+    unsigned long long frames;
+
+    frame_latency()
+    {
+        reset();
+    }
+    void reset()
+    {
+        memset(count, 0x0, sizeof(count));
+        memset(head, 0x0, sizeof(head));
+        frames = 0;
+    }
+    /**
+     * @brief Add a displayed frame. Stages whose stamps are missing (0) are
+     * left out.
+     *
+     * @param meta Metadata of the frame
+     * @param t_receive Client CLOCK_MONOTONIC when the frame was received, ns
+     * @param t_receive_real Client CLOCK_REALTIME at the same time, ns
+     * @param t_decode Client CLOCK_MONOTONIC when the frame was decoded, ns
+     * @param t_display Client CLOCK_MONOTONIC when the frame was on screen, ns
+     */
+    void add(const net_meta *meta, uint64_t t_receive, uint64_t t_receive_real, uint64_t t_decode, uint64_t t_display)
+    {
+        const net_stamps *st = &meta->stamps;
+        if (st->exposure && st->readout)
+        {
+            double capture = (int64_t)(st->readout - st->exposure) * 1e-6;
+            add_sample(LAT_CAPTURE, capture);
+            add_sample(LAT_READOUT, capture - meta->exposure * 1e3);
+        }
+        if (st->readout && st->encode)
+            add_sample(LAT_ENCODE, (int64_t)(st->encode - st->readout) * 1e-6);
+        if (st->encode && st->enqueue)
+            add_sample(LAT_PUBLISH, (int64_t)(st->enqueue - st->encode) * 1e-6);
+        if (st->enqueue && st->send)
+            add_sample(LAT_SEND_QUEUE, (int64_t)(st->send - st->enqueue) * 1e-6);
+        if (st->send)
+            add_sample(LAT_NETWORK, (int64_t)(t_receive_real - (st->send + meta->clock_offset)) * 1e-6);
+        add_sample(LAT_DECODE, (int64_t)(t_decode - t_receive) * 1e-6);
+        add_sample(LAT_DISPLAY, (int64_t)(t_display - t_decode) * 1e-6);
+        if (st->exposure)
+        {
+            uint64_t display_real = t_receive_real + (t_display - t_receive);
+            add_sample(LAT_TOTAL, (int64_t)(display_real - (st->exposure + meta->clock_offset)) * 1e-6);
+        }
+        frames++;
+    }
+    /**
+     * @brief Percentiles of a stage over the window, in ms
+     *
+     * @return false No samples for the stage
+     */
+    bool percentiles(int stage, double *p50, double *p90, double *p99, double *max) const
+    {
+        unsigned n = count[stage];
+        if (n == 0)
+            return false;
+        double tmp[LATENCY_WINDOW];
+        memcpy(tmp, samples[stage], n * sizeof(double));
+        std::sort(tmp, tmp + n);
+        *p50 = tmp[(n - 1) * 50 / 100];
+        *p90 = tmp[(n - 1) * 90 / 100];
+        *p99 = tmp[(n - 1) * 99 / 100];
+        *max = tmp[n - 1];
+        return true;
+    }
+};
+
+#endif // FRAME_LATENCY_H_
@@ -0,0 +1,454 @@
+/**
+ * @file frame_parser.h
+ * @brief Incremental parser for the frame stream sent by the camera server
+ *
+ * The parser reads the "SIZE" int32 header, then receives exactly the rest
+ * of the frame straight into one of three frame buffers (triple buffering
+ * between the receive thread and the display thread), validates the
+ * "FBEGIN"/"FEND" markers and the payload size, and on a corrupt frame
+ * scans forward for the next "SIZE" header. The bytes of a corrupt frame
+ * from there on are parsed again by commit() before it returns, out of a
+ * buffer swapped with the frame's, so a resync neither allocates nor
+ * recurses. Command acknowledgements (net_cmd_ack) between frames are
+ * queued for pop_ack().
+ *
+ */
+#ifndef FRAME_PARSER_H_
+#define FRAME_PARSER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <atomic>
+
+#include <comic_net.h>
+#include <net_cmd.h>
+
+#ifndef NET_FRAME_MAX_SIZE
+#define NET_FRAME_MAX_SIZE (64 * 1024 * 1024) // largest frame accepted on the wire
+#endif
+
+#ifndef NET_ACK_QUEUE
+#define NET_ACK_QUEUE 1024 // acknowledgements kept until pop_ack(), older ones are dropped
+#endif
+
+/**
+ * @brief A received frame: everything after the SIZE header, i.e.
+ * "FBEGIN" net_meta payload "FEND"
+ *
+ */
+class rx_frame
+{
+public:
+    unsigned char *buf;
+    size_t alloc;
+    size_t len;
+    /**
+     * @brief Metadata, fields the sender did not know left 0
+     *
+     */
+    net_meta meta;
+    /**
+     * @brief Length of the metadata on the wire
+     *
+     */
+    size_t meta_len;
+    /**
+     * @brief Sequence number of the frame in the stream (counted by the parser)
+     *
+     */
+    uint64_t seq;
+    /**
+     * @brief Local CLOCK_MONOTONIC and CLOCK_REALTIME when the last byte
+     * came in, in ns
+     *
+     */
+    uint64_t t_receive;
+    uint64_t t_receive_real;
+
+    rx_frame()
+    {
+        buf = NULL;
+        alloc = 0;
+        len = 0;
+        memset(&meta, 0x0, sizeof(meta));
+        meta_len = sizeof(net_meta);
+        seq = 0;
+        t_receive = 0;
+        t_receive_real = 0;
+    }
+    ~rx_frame()
+    {
+        free(buf);
+    }
+    rx_frame(const rx_frame &) = delete;
+    rx_frame &operator=(const rx_frame &) = delete;
+    /**
+     * @brief Make room for a frame body, keeping the buffer when it is large
+     * enough already
+     *
+     */
+    bool reserve(size_t size)
+    {
+        if (size <= alloc)
+            return true;
+        unsigned char *tmp = (unsigned char *)realloc(buf, size);
+        if (tmp == NULL)
+            return false;
+        buf = tmp;
+        alloc = size;
+        return true;
+    }
+    /**
+     * @brief Encoded image
+     *
+     */
+    const unsigned char *payload() const
+    {
+        return buf + 6 + meta_len;
+    }
+};
+
+class frame_parser
+{
+private:
+    enum
+    {
+        PARSE_HEADER,
+        PARSE_BODY,
+        PARSE_ACK
+    } state;
+    unsigned char hdr[8];
+    size_t hdr_len;
+    size_t body_len; // bytes of the body expected
+    size_t body_got;
+    rx_frame frames[3];
+    int filling, ready, held; // triple buffer indices, ready < 0 when empty
+    uint64_t seq;
+    pthread_mutex_t lock;
+    net_cmd_ack ack;   // being received
+    size_t ack_got;    // bytes of it
+    net_cmd_ack acks[NET_ACK_QUEUE]; // received, under lock
+    unsigned ack_head, ack_count;
+    unsigned char *pend; // bytes of a corrupt frame left to parse again
+    size_t pend_alloc;
+    size_t pend_off; // next of them
+    size_t pend_len;
+
+    /**
+     * @brief Check the 8 header bytes, on failure drop bytes up to the next
+     * possible start of "SIZE"
+     *
+     */
+    void parse_header()
+    {
+        int32_t out_sz;
+        memcpy(&out_sz, hdr + 4, sizeof(out_sz));
+        if (memcmp(hdr, NET_ACK_MAGIC, 4) == 0)
+        {
+            memcpy(&ack, hdr, sizeof(hdr));
+            ack_got = sizeof(hdr);
+            state = PARSE_ACK;
+            return;
+        }
+        if (memcmp(hdr, NET_FRAME_HDR, 4) == 0 && out_sz >= (int32_t)(NET_META_MIN_LEN + NET_FRAME_OVERHEAD) && out_sz <= NET_FRAME_MAX_SIZE && frames[filling].reserve(out_sz - 8))
+        {
+            body_len = out_sz - 8;
+            body_got = 0;
+            state = PARSE_BODY;
+            return;
+        }
+        resyncs++;
+        size_t skip = 1;
+        while (skip < hdr_len && hdr[skip] != NET_FRAME_HDR[0] && hdr[skip] != NET_ACK_MAGIC[0])
+            skip++;
+        bytes_skipped += skip;
+        memmove(hdr, hdr + skip, hdr_len - skip);
+        hdr_len -= skip;
+    }
+
+    void parse_ack()
+    {
+        state = PARSE_HEADER;
+        hdr_len = 0;
+        pthread_mutex_lock(&lock);
+        if (ack_count == NET_ACK_QUEUE)
+        {
+            ack_head = (ack_head + 1) % NET_ACK_QUEUE;
+            ack_count--;
+            acks_dropped++;
+        }
+        acks[(ack_head + ack_count++) % NET_ACK_QUEUE] = ack;
+        pthread_mutex_unlock(&lock);
+        acks_received++;
+    }
+
+    /**
+     * @brief Validate a complete body and hand it to the display side
+     *
+     */
+    void parse_body()
+    {
+        rx_frame *frame = &frames[filling];
+        state = PARSE_HEADER;
+        hdr_len = 0;
+        net_meta meta;
+        memset(&meta, 0x0, sizeof(net_meta));
+        uint16_t meta_len = 0;
+        if (body_len >= 10 + NET_META_MIN_LEN)
+        {
+            memcpy(&meta_len, frame->buf + 6 + offsetof(net_meta, meta_len), sizeof(meta_len));
+            if (meta_len >= NET_META_MIN_LEN && (size_t)meta_len + 10 <= body_len) // from the wire, may be anything
+                memcpy(&meta, frame->buf + 6, meta_len < sizeof(net_meta) ? meta_len : sizeof(net_meta));
+            else
+                meta_len = 0;
+        }
+        if (memcmp(frame->buf, NET_FRAME_BEGIN, 6) != 0 || memcmp(frame->buf + body_len - 4, NET_FRAME_END, 4) != 0 || meta_len < NET_META_MIN_LEN || meta.size < 0 || (size_t)meta.size + meta_len + 10 != body_len)
+        {
+            // the header was bogus or bytes were lost, the next frame may
+            // start anywhere inside what we took for this body, or an
+            // acknowledgement
+            resyncs++;
+            unsigned char *next = (unsigned char *)memmem(frame->buf + 1, body_len - 1, NET_FRAME_HDR, 4);
+            unsigned char *ack = (unsigned char *)memmem(frame->buf + 1, (next != NULL ? next - frame->buf : body_len) - 1, NET_ACK_MAGIC, 4);
+            if (ack != NULL) // an acknowledgement before the next frame
+                next = ack;
+            size_t skip = next == NULL ? body_len : next - frame->buf;
+            bytes_skipped += skip + 8;
+            if (next == NULL)
+                return;
+            if (pend_off < pend_len)
+            {
+                // commit() was still draining: the body is the bytes just
+                // before pend_off, step back to the rest of it
+                pend_off -= body_len - skip;
+                return;
+            }
+            // the body becomes the pending bytes, the frame takes the old buffer
+            unsigned char *buf = pend;
+            size_t alloc = pend_alloc;
+            pend = frame->buf;
+            pend_alloc = frame->alloc;
+            frame->buf = buf;
+            frame->alloc = alloc;
+            pend_off = skip;
+            pend_len = body_len;
+            return;
+        }
+        frame->len = body_len;
+        frame->meta = meta;
+        frame->meta_len = meta_len;
+        frame->t_receive = net_clock_ns(CLOCK_MONOTONIC);
+        frame->t_receive_real = net_clock_ns(CLOCK_REALTIME);
+        frame->seq = ++seq;
+        frames_ok++;
+        bytes_ok += body_len + 8;
+        pthread_mutex_lock(&lock);
+        int tmp = filling;
+        if (ready >= 0)
+        {
+            filling = ready; // the display never saw it
+            frames_dropped++;
+        }
+        else
+            filling = 3 - tmp - held; // the index that is neither ready nor held
+        ready = tmp;
+        pthread_mutex_unlock(&lock);
+    }
+
+    /* n bytes in at the location given by want() */
+    void advance(size_t n)
+    {
+        if (state == PARSE_HEADER)
+        {
+            hdr_len += n;
+            while (state == PARSE_HEADER && hdr_len == sizeof(hdr))
+                parse_header();
+        }
+        else if (state == PARSE_ACK)
+        {
+            ack_got += n;
+            if (ack_got == sizeof(ack))
+                parse_ack();
+        }
+        else
+        {
+            body_got += n;
+            if (body_got == body_len)
+                parse_body();
+        }
+    }
+
+public:
+    /**
+     * @brief Frames received intact
+     *
+     */
+    std::atomic<unsigned long long> frames_ok;
+    /**
+     * @brief Frames replaced by a newer one before the display took them
+     *
+     */
+    std::atomic<unsigned long long> frames_dropped;
+    /**
+     * @brief Times the parser lost framing and had to search for a header
+     *
+     */
+    std::atomic<unsigned long long> resyncs;
+    std::atomic<unsigned long long> bytes_ok;
+    std::atomic<unsigned long long> bytes_skipped;
+    /**
+     * @brief Command acknowledgements received, and dropped unread
+     *
+     */
+    std::atomic<unsigned long long> acks_received;
+    std::atomic<unsigned long long> acks_dropped;
+
+    frame_parser()
+    {
+        pthread_mutex_init(&lock, NULL);
+        filling = 0;
+        ready = -1;
+        held = 1;
+        seq = 0;
+        frames_ok = 0;
+        frames_dropped = 0;
+        resyncs = 0;
+        bytes_ok = 0;
+        bytes_skipped = 0;
+        acks_received = 0;
+        acks_dropped = 0;
+        ack_head = ack_count = 0;
+        pend = NULL;
+        pend_alloc = 0;
+        reset();
+    }
+    ~frame_parser()
+    {
+        free(pend);
+        pthread_mutex_destroy(&lock);
+    }
+    frame_parser(const frame_parser &) = delete;
+    frame_parser &operator=(const frame_parser &) = delete;
+    /**
+     * @brief Forget any partial frame, e.g. after reconnecting
+     *
+     */
+    void reset()
+    {
+        state = PARSE_HEADER;
+        hdr_len = 0;
+        body_len = 0;
+        body_got = 0;
+        ack_got = 0;
+        pend_off = pend_len = 0;
+    }
+    /**
+     * @brief Where to receive the next bytes, and how many the parser wants
+     * (never more than the rest of the current header or frame)
+     *
+     * @param ptr Receive buffer
+     * @return size_t Number of bytes wanted
+     */
+    size_t want(unsigned char **ptr)
+    {
+        if (state == PARSE_HEADER)
+        {
+            *ptr = hdr + hdr_len;
+            return sizeof(hdr) - hdr_len;
+        }
+        if (state == PARSE_ACK)
+        {
+            *ptr = (unsigned char *)&ack + ack_got;
+            return sizeof(ack) - ack_got;
+        }
+        *ptr = frames[filling].buf + body_got;
+        return body_len - body_got;
+    }
+    /**
+     * @brief Account for n bytes received at the location given by want().
+     * If they complete a corrupt frame, its bytes from the next possible
+     * header on are parsed again before this returns.
+     *
+     * @param n Bytes received
+     */
+    void commit(size_t n)
+    {
+        advance(n);
+        while (pend_off < pend_len)
+        {
+            unsigned char *ptr;
+            size_t k = want(&ptr);
+            if (k > pend_len - pend_off)
+                k = pend_len - pend_off;
+            memcpy(ptr, pend + pend_off, k);
+            pend_off += k;
+            advance(k);
+        }
+    }
+    /**
+     * @brief Parse bytes from a buffer
+     *
+     * @param data Stream bytes
+     * @param len Number of bytes
+     */
+    void feed(const unsigned char *data, size_t len)
+    {
+        while (len > 0)
+        {
+            unsigned char *ptr;
+            size_t n = want(&ptr);
+            if (n > len)
+                n = len;
+            memcpy(ptr, data, n);
+            commit(n);
+            data += n;
+            len -= n;
+        }
+    }
+    /**
+     * @brief Oldest acknowledgement not returned yet (any thread)
+     *
+     * @return false None
+     */
+    bool pop_ack(net_cmd_ack *out)
+    {
+        pthread_mutex_lock(&lock);
+        bool ok = ack_count > 0;
+        if (ok)
+        {
+            *out = acks[ack_head];
+            ack_head = (ack_head + 1) % NET_ACK_QUEUE;
+            ack_count--;
+        }
+        pthread_mutex_unlock(&lock);
+        return ok;
+    }
+    /**
+     * @brief Latest complete frame, for the display thread. The frame stays
+     * valid until the next call.
+     *
+     * @param is_new Set to true if the frame was not returned before
+     * @return rx_frame* Latest frame, NULL if none received yet
+     */
+    rx_frame *latest(bool *is_new = NULL)
+    {
+        bool fresh = false;
+        pthread_mutex_lock(&lock);
+        if (ready >= 0)
+        {
+            held = ready; // the old held buffer becomes the spare
+            ready = -1;
+            fresh = true;
+        }
+        rx_frame *frame = frames[held].seq > 0 ? &frames[held] : NULL;
+        pthread_mutex_unlock(&lock);
+        if (is_new != NULL)
+            *is_new = fresh;
+        return frame;
+    }
+};
+
+#endif // FRAME_PARSER_H_
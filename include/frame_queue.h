@@ -0,0 +1,229 @@
+/**
+ * @file frame_queue.h
+ * @brief Bounded single-producer/single-consumer queue connecting the
+ * acquisition pipeline stages, with occupancy and drop counters
+ *
+ */
+#ifndef FRAME_QUEUE_H_
+#define FRAME_QUEUE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <atomic>
+
+/**
+ * @brief Bounded lock-free ring for exactly one producer thread and one
+ * consumer thread. push() never blocks: a full queue is counted as a drop
+ * and the caller keeps the item. The consumer can sleep in pop_wait() until
+ * an item arrives.
+ *
+ * @tparam T Item type (usually a pointer to a preallocated frame slot)
+ */
+template <typename T>
+class spsc_queue
+{
+private:
+    T *ring;
+    unsigned cap;
+    std::atomic<unsigned long long> head; // next item to pop, written by consumer
+    std::atomic<unsigned long long> tail; // next free position, written by producer
+    std::atomic<bool> waiting;            // consumer is asleep in pop_wait()
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+public:
+    /**
+     * @brief Number of items pushed successfully
+     *
+     */
+    std::atomic<unsigned long long> pushed;
+    /**
+     * @brief Number of items rejected because the queue was full
+     *
+     */
+    std::atomic<unsigned long long> dropped;
+    /**
+     * @brief Sum of queue depth sampled at every push, for average occupancy
+     *
+     */
+    std::atomic<unsigned long long> depth_sum;
+    /**
+     * @brief Deepest the queue has been
+     *
+     */
+    std::atomic<unsigned> depth_max;
+
+    spsc_queue(unsigned capacity)
+    {
+        if (capacity == 0)
+            capacity = 1;
+        cap = capacity;
+        ring = new T[cap];
+        head = 0;
+        tail = 0;
+        waiting = false;
+        pushed = 0;
+        dropped = 0;
+        depth_sum = 0;
+        depth_max = 0;
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+    ~spsc_queue()
+    {
+        delete[] ring;
+        pthread_mutex_destroy(&lock);
+        pthread_cond_destroy(&cond);
+    }
+    spsc_queue(const spsc_queue &) = delete;
+    spsc_queue &operator=(const spsc_queue &) = delete;
+    /**
+     * @brief Capacity of the queue
+     *
+     */
+    unsigned capacity() const
+    {
+        return cap;
+    }
+    /**
+     * @brief Number of items currently in the queue
+     *
+     */
+    unsigned size() const
+    {
+        return (unsigned)(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+    }
+    /**
+     * @brief Enqueue an item (producer only)
+     *
+     * @param item Item to enqueue
+     * @return true Item enqueued
+     * @return false Queue full, item was not enqueued and a drop was counted
+     */
+    bool push(const T &item)
+    {
+        unsigned long long t = tail.load(std::memory_order_relaxed);
+        unsigned depth = (unsigned)(t - head.load(std::memory_order_acquire));
+        if (depth >= cap)
+        {
+            dropped++;
+            return false;
+        }
+        ring[t % cap] = item;
+        tail.store(t + 1, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in pop_wait()
+        pushed++;
+        depth_sum += depth + 1;
+        if (depth + 1 > depth_max)
+            depth_max = depth + 1;
+        if (waiting.load())
+        {
+            pthread_mutex_lock(&lock);
+            pthread_cond_signal(&cond);
+            pthread_mutex_unlock(&lock);
+        }
+        return true;
+    }
+    /**
+     * @brief Dequeue an item without blocking (consumer only)
+     *
+     * @param item Dequeued item
+     * @return true An item was dequeued
+     * @return false Queue empty
+     */
+    bool pop(T &item)
+    {
+        unsigned long long h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = ring[h % cap];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    /**
+     * @brief Dequeue an item, sleeping up to timeout_us for one to arrive
+     * (consumer only)
+     *
+     * @param item Dequeued item
+     * @param timeout_us Maximum time to wait in microseconds
+     * @return true An item was dequeued
+     * @return false Timed out with the queue empty
+     */
+    bool pop_wait(T &item, long timeout_us)
+    {
+        if (pop(item))
+            return true;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_us / 1000000;
+        ts.tv_nsec += (timeout_us % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        bool ret;
+        pthread_mutex_lock(&lock);
+        waiting = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst); // producer either sees waiting or we see the item
+        while (!(ret = pop(item)))
+        {
+            if (pthread_cond_timedwait(&cond, &lock, &ts) == ETIMEDOUT)
+            {
+                ret = pop(item);
+                break;
+            }
+        }
+        waiting = false;
+        pthread_mutex_unlock(&lock);
+        return ret;
+    }
+    /**
+     * @brief Average depth of the queue seen by the producer
+     *
+     */
+    double avg_depth() const
+    {
+        unsigned long long n = pushed.load();
+        return n ? (double)depth_sum.load() / n : 0;
+    }
+};
+
+/**
+ * @brief Work counters of one pipeline stage
+ *
+ */
+class stage_stats
+{
+public:
+    /**
+     * @brief Frames processed by the stage
+     *
+     */
+    std::atomic<unsigned long long> frames;
+    /**
+     * @brief Time spent processing frames, in microseconds
+     *
+     */
+    std::atomic<unsigned long long> busy_us;
+    stage_stats()
+    {
+        frames = 0;
+        busy_us = 0;
+    }
+    /**
+     * @brief Account for one processed frame
+     *
+     * @param us Time spent on the frame in microseconds
+     */
+    void add(unsigned long long us)
+    {
+        frames++;
+        busy_us += us;
+    }
+};
+
+#endif // FRAME_QUEUE_H_
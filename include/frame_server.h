@@ -0,0 +1,1093 @@
+/**
+ * @file frame_server.h
+ * @brief Event driven (epoll) frame streaming server: accepts any number of
+ * viewers, reads their commands and pushes every new frame to each of them
+ * as soon as it is published, without blocking on the others
+ *
+ * A frame can be published at several preview scales at once, and as crops
+ * of the regions of interest clients asked for, each either as JPEG or as
+ * lossless 16 bit data (NET_FORMAT_RAW16); every client is sent its region
+ * if it has one, otherwise the scale it asked for, or the raw frame. The
+ * publisher only needs to encode the streams in wanted_scales() and the
+ * regions in wanted_rois().
+ *
+ * Commands are read on the same event loop as frames are sent: binary ones
+ * (net_cmd.h) from a reassembly buffer, each applied once complete and
+ * acknowledged between two frames, text ones from older clients as they
+ * come.
+ *
+ */
+#ifndef FRAME_SERVER_H_
+#define FRAME_SERVER_H_
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+
+#include <comic_net.h>
+#include <net_cmd.h>
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+#ifndef NET_MAX_CLIENTS
+#define NET_MAX_CLIENTS 64
+#endif
+
+/**
+ * @brief Connection state of one viewer
+ *
+ */
+class net_client
+{
+public:
+    int fd;
+    struct sockaddr_in addr;
+    /**
+     * @brief Frame being sent, NULL when idle. Holds a reference.
+     *
+     */
+    encoded_frame *frame;
+    /**
+     * @brief Bytes of frame already sent
+     *
+     */
+    size_t offset;
+    /**
+     * @brief Waiting for EPOLLOUT to finish the frame
+     *
+     */
+    bool want_write;
+    /**
+     * @brief Sequence number of the last frame sent (or being sent)
+     *
+     */
+    uint64_t last_seq;
+    /**
+     * @brief Preview scale the client wants, see net_scale_factor()
+     *
+     */
+    unsigned scale;
+    /**
+     * @brief Preview width the client asked for, 0 if it set a scale. The
+     * scale is picked again for it when the frame width changes.
+     *
+     */
+    unsigned preview_width;
+    /**
+     * @brief Region of interest the client wants, none if width is 0
+     *
+     */
+    net_roi roi;
+    /**
+     * @brief Payload type the client wants, NET_FORMAT_*. Raw frames are
+     * always sent at full scale.
+     *
+     */
+    unsigned format;
+    /**
+     * @brief Command bytes received and not parsed yet
+     *
+     */
+    unsigned char rcv_buf[4 * (sizeof(net_cmd_hdr) + NET_CMD_MAX_PAYLOAD)];
+    size_t rcv_len;
+    /**
+     * @brief Sent a binary command: everything from it is parsed as such,
+     * never as text
+     *
+     */
+    bool binary;
+    /**
+     * @brief Acknowledgements waiting for the end of the frame being sent
+     *
+     */
+    net_cmd_ack acks[NET_CMD_MAX_ACKS];
+    size_t ack_len;  // bytes
+    size_t ack_sent; // bytes
+    /**
+     * @brief Waiting for EPOLLIN, off while acks is full
+     *
+     */
+    bool want_read;
+    unsigned long long cmds;
+    unsigned long long frames_sent;
+    /**
+     * @brief Frames never sent to this client because a newer one was
+     * published while it was still receiving
+     *
+     */
+    unsigned long long frames_skipped;
+    unsigned long long bytes_sent;
+    /**
+     * @brief Next disconnected client waiting to be freed
+     *
+     */
+    net_client *next_closed;
+
+    net_client(int fd, struct sockaddr_in *addr)
+    {
+        next_closed = NULL;
+        this->fd = fd;
+        this->addr = *addr;
+        frame = NULL;
+        offset = 0;
+        want_write = false;
+        last_seq = 0;
+        scale = 0;
+        preview_width = 0;
+        format = NET_FORMAT_JPEG;
+        memset(&roi, 0x0, sizeof(roi));
+        rcv_len = 0;
+        binary = false;
+        ack_len = ack_sent = 0;
+        want_read = true;
+        cmds = 0;
+        frames_sent = 0;
+        frames_skipped = 0;
+        bytes_sent = 0;
+    }
+    ~net_client()
+    {
+        if (frame != NULL)
+            frame->release();
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+class frame_server;
+
+/**
+ * @brief Called from the server thread for every chunk of text command
+ * bytes a client sends
+ *
+ */
+typedef void (*frame_server_cmd_fcn)(frame_server *server, net_client *client, char *buf, ssize_t len);
+
+/**
+ * @brief Called from the server thread for every binary command a client
+ * sends, see net_cmd.h
+ *
+ * @param payload hdr->len bytes, unaligned
+ * @return int Status of the acknowledgement, NET_ACK_*
+ */
+typedef int (*frame_server_bin_cmd_fcn)(frame_server *server, net_client *client, const net_cmd_hdr *hdr, const void *payload);
+
+/**
+ * @brief Streams the latest published frame to every connected client. All
+ * sockets are non-blocking and multiplexed on one epoll instance; run() is
+ * the event loop and is meant to have a thread of its own.
+ *
+ */
+class frame_server
+{
+private:
+    int server_fd;
+    int epoll_fd;
+    int frame_fd; // eventfd, signalled by publish()
+    int wake_fd;
+    volatile bool running;
+    pthread_mutex_t lock;
+    encoded_frame *latest[NET_NUM_STREAMS]; // one reference held on each while published
+    typedef struct
+    {
+        net_roi roi;
+        unsigned format;
+        encoded_frame *latest;
+    } roi_stream;
+    roi_stream roi_streams[NET_MAX_ROIS]; // distinct regions wanted by clients, under lock
+    unsigned nroi_streams;
+    net_client *clients[NET_MAX_CLIENTS];
+    unsigned nclients;
+    net_client *closed; // freed after the current batch of events
+    uint64_t seq;       // last sequence number handed out, under lock
+
+    void set_nonblocking(int fd)
+    {
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    void watch(net_client *client, bool read, bool write)
+    {
+        if (client->want_read == read && client->want_write == write)
+            return;
+        struct epoll_event ev;
+        ev.events = (read ? EPOLLIN : 0) | EPOLLRDHUP | (write ? EPOLLOUT : 0);
+        ev.data.ptr = client;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+        client->want_read = read;
+        client->want_write = write;
+    }
+
+    void watch_write(net_client *client, bool enable)
+    {
+        watch(client, client->want_read, enable);
+    }
+
+    void accept_clients()
+    {
+        while (true)
+        {
+            struct sockaddr_in addr;
+            socklen_t addrlen = sizeof(addr);
+            int fd = accept(server_fd, (struct sockaddr *)&addr, &addrlen);
+            if (fd < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("accept");
+                return;
+            }
+            if (nclients >= NET_MAX_CLIENTS)
+            {
+                fprintf(stderr, "%s: Rejecting %s, %u clients connected\n", __func__, inet_ntoa(addr.sin_addr), nclients);
+                close(fd);
+                continue;
+            }
+            set_nonblocking(fd);
+            int opt = 1; // acknowledgements are small writes, not to be held back
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            net_client *client = new net_client(fd, &addr);
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.ptr = client;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            {
+                perror("epoll_ctl");
+                delete client;
+                continue;
+            }
+            clients[nclients++] = client;
+            update_streams();
+            fprintf(stderr, "%s: Client %s:%d connected, %u clients\n", __func__, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), nclients);
+            if (next_frame(client)) // show the newest frame right away
+                write_client(client);
+        }
+    }
+
+    void drop_client(net_client *client)
+    {
+        if (client->fd < 0)
+            return;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        for (unsigned i = 0; i < nclients; i++)
+        {
+            if (clients[i] == client)
+            {
+                clients[i] = clients[--nclients];
+                break;
+            }
+        }
+        update_streams();
+        fprintf(stderr, "%s: Client %s:%d disconnected, sent %llu frames (%llu skipped), %llu bytes\n", __func__, inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port), client->frames_sent, client->frames_skipped, client->bytes_sent);
+        close(client->fd);
+        client->fd = -1; // events still pending for it are ignored
+        client->next_closed = closed;
+        closed = client;
+    }
+
+    /**
+     * @brief Index of the region stream serving a client, -1 if the client
+     * has no region or its region did not fit in NET_MAX_ROIS (under lock)
+     *
+     */
+    int find_roi_stream(const net_roi *roi, unsigned format)
+    {
+        if (!net_roi_valid(roi))
+            return -1;
+        for (unsigned i = 0; i < nroi_streams; i++)
+            if (roi_streams[i].format == format && net_roi_equal(&roi_streams[i].roi, roi))
+                return i;
+        return -1;
+    }
+
+    /**
+     * @brief Smallest preview at least preview_width wide, for frames width
+     * pixels wide
+     *
+     */
+    static unsigned scale_for_width(unsigned preview_width, unsigned width)
+    {
+        unsigned scale = 0;
+        while (preview_width > 0 && scale + 1 < NET_NUM_SCALES && width / net_scale_factor(scale + 1) >= preview_width)
+            scale++;
+        return scale;
+    }
+
+    /**
+     * @brief Index in latest[] of the whole frame stream serving a client
+     *
+     */
+    static unsigned client_stream(const net_client *client)
+    {
+        return client->format == NET_FORMAT_RAW16 ? NET_STREAM_RAW : client->scale;
+    }
+
+    /**
+     * @brief Recompute the scales and regions clients want. With no clients
+     * the full frame stays wanted, so a new viewer gets a picture right away.
+     *
+     */
+    void update_streams()
+    {
+        unsigned mask = nclients == 0 ? 1 : 0;
+        roi_stream streams[NET_MAX_ROIS];
+        unsigned nstreams = 0;
+        for (unsigned i = 0; i < nclients; i++)
+        {
+            net_roi *roi = &clients[i]->roi;
+            unsigned format = clients[i]->format;
+            if (net_roi_valid(roi))
+            {
+                unsigned j = 0;
+                while (j < nstreams && !(streams[j].format == format && net_roi_equal(&streams[j].roi, roi)))
+                    j++;
+                if (j < nstreams)
+                    continue;
+                if (nstreams < NET_MAX_ROIS)
+                {
+                    streams[nstreams].roi = *roi;
+                    streams[nstreams].format = format;
+                    streams[nstreams++].latest = NULL;
+                    continue;
+                }
+            }
+            mask |= 1u << client_stream(clients[i]); // no region, or too many of them
+        }
+        encoded_frame *old[NET_MAX_ROIS];
+        unsigned nold = 0;
+        pthread_mutex_lock(&lock);
+        for (unsigned i = 0; i < nroi_streams; i++)
+        {
+            unsigned j = 0;
+            while (j < nstreams && !(streams[j].format == roi_streams[i].format && net_roi_equal(&streams[j].roi, &roi_streams[i].roi)))
+                j++;
+            if (j < nstreams) // region still wanted, keep its frame
+                streams[j].latest = roi_streams[i].latest;
+            else if (roi_streams[i].latest != NULL)
+                old[nold++] = roi_streams[i].latest;
+        }
+        memcpy(roi_streams, streams, nstreams * sizeof(roi_stream));
+        nroi_streams = nstreams;
+        pthread_mutex_unlock(&lock);
+        for (unsigned i = 0; i < nold; i++)
+            old[i]->release();
+        scale_mask = mask;
+    }
+
+    void free_closed()
+    {
+        while (closed != NULL)
+        {
+            net_client *next = closed->next_closed;
+            delete closed;
+            closed = next;
+        }
+    }
+
+    /**
+     * @brief Push as much of the client's acknowledgements and frame as the
+     * socket takes
+     *
+     * @return false Client is gone and was dropped
+     */
+    bool write_client(net_client *client)
+    {
+        while (true)
+        {
+            // acknowledgements go out between two frames, never inside one
+            if (client->ack_sent < client->ack_len && (client->frame == NULL || client->offset == 0))
+            {
+                ssize_t sz = send(client->fd, (char *)client->acks + client->ack_sent, client->ack_len - client->ack_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (sz < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        watch_write(client, true);
+                        return true;
+                    }
+                    drop_client(client);
+                    return false;
+                }
+                client->ack_sent += sz;
+                client->bytes_sent += sz;
+                if (client->ack_sent == client->ack_len)
+                {
+                    client->ack_len = client->ack_sent = 0;
+                    if (client->rcv_len > 0 && !parse_commands(client)) // held back while acks was full
+                        return false;
+                }
+                continue;
+            }
+            if (client->frame == NULL)
+                break;
+            net_meta *meta = client->frame->meta();
+            if (meta->stamps.send == 0) // only this thread writes it, before any client sent a byte of the frame
+                meta->stamps.send = monotonic_ns();
+            ssize_t sz = client->frame->send(client->fd, client->offset, MSG_DONTWAIT);
+            if (sz < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    watch_write(client, true);
+                    return true;
+                }
+                drop_client(client);
+                return false;
+            }
+            client->offset += sz;
+            client->bytes_sent += sz;
+            if (client->offset >= client->frame->wire_size())
+            {
+                scale_frames[client->frame->scale]++; // NET_NUM_STREAMS counts regions
+                scale_bytes[client->frame->scale] += client->frame->wire_size();
+                uint64_t latency = monotonic_ns() - client->frame->t_publish;
+                latency_sum_ns += latency;
+                latency_n++;
+                if (latency > latency_max_ns)
+                    latency_max_ns = latency;
+                client->frame->release();
+                client->frame = NULL;
+                client->offset = 0;
+                client->frames_sent++;
+                frames_sent++;
+                next_frame(client); // a newer frame may have arrived meanwhile
+            }
+        }
+        watch_write(client, false);
+        return true;
+    }
+
+    /**
+     * @brief Apply the complete commands in the client's buffer and queue
+     * their acknowledgements. Text is handed to cmd_fcn as it came. While
+     * the acknowledgements are full the rest waits, and so does the client.
+     *
+     * @return false Malformed command, the client was dropped
+     */
+    bool parse_commands(net_client *client)
+    {
+        if (!client->binary)
+        {
+            size_t n = client->rcv_len < 4 ? client->rcv_len : 4;
+            if (memcmp(client->rcv_buf, NET_CMD_MAGIC, n) != 0)
+            {
+                client->rcv_buf[client->rcv_len] = '\0';
+                if (cmd_fcn != NULL)
+                    cmd_fcn(this, client, (char *)client->rcv_buf, client->rcv_len);
+                client->rcv_len = 0;
+                return true;
+            }
+            client->binary = n == 4; // otherwise wait for the rest of the magic
+        }
+        size_t pos = 0;
+        bool full = false;
+        while (client->binary && client->rcv_len - pos >= sizeof(net_cmd_hdr))
+        {
+            net_cmd_hdr hdr;
+            memcpy(&hdr, client->rcv_buf + pos, sizeof(hdr));
+            if (memcmp(hdr.magic, NET_CMD_MAGIC, 4) != 0 || hdr.len > NET_CMD_MAX_PAYLOAD)
+            {
+                fprintf(stderr, "%s: Malformed command from %s:%d\n", __func__, inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+                drop_client(client);
+                return false;
+            }
+            if (client->rcv_len - pos < sizeof(hdr) + hdr.len)
+                break;
+            if (client->ack_len == sizeof(client->acks))
+            {
+                full = true;
+                break;
+            }
+            net_cmd_ack ack;
+            memcpy(ack.magic, NET_ACK_MAGIC, 4);
+            ack.id = hdr.id;
+            ack.type = hdr.type;
+            ack.status = bin_cmd_fcn != NULL ? bin_cmd_fcn(this, client, &hdr, client->rcv_buf + pos + sizeof(hdr)) : NET_ACK_UNKNOWN;
+            memcpy((char *)client->acks + client->ack_len, &ack, sizeof(ack));
+            client->ack_len += sizeof(ack);
+            client->cmds++;
+            commands++;
+            pos += sizeof(hdr) + hdr.len;
+        }
+        memmove(client->rcv_buf, client->rcv_buf + pos, client->rcv_len - pos);
+        client->rcv_len -= pos;
+        watch(client, !full, client->want_write);
+        return true;
+    }
+
+    void read_client(net_client *client)
+    {
+        if (client->rcv_len + 1 >= sizeof(client->rcv_buf)) // full until the acknowledgements are out
+            return;
+        ssize_t sz = recv(client->fd, client->rcv_buf + client->rcv_len, sizeof(client->rcv_buf) - 1 - client->rcv_len, MSG_DONTWAIT);
+        if (sz == 0 || (sz < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            drop_client(client);
+            return;
+        }
+        if (sz < 0)
+            return;
+        client->rcv_len += sz;
+        if (parse_commands(client) && client->ack_len > client->ack_sent)
+            write_client(client); // right away, unless a frame is half sent
+    }
+
+    /**
+     * @brief Queue the latest frame on an idle client, unless the client
+     * already has it
+     *
+     * @return true A frame was queued
+     */
+    bool next_frame(net_client *client)
+    {
+        if (client->frame != NULL)
+            return false;
+        encoded_frame *frame = NULL;
+        pthread_mutex_lock(&lock);
+        int stream = find_roi_stream(&client->roi, client->format);
+        frame = stream < 0 ? latest[client_stream(client)] : roi_streams[stream].latest;
+        if (frame != NULL)
+            frame->acquire();
+        pthread_mutex_unlock(&lock);
+        if (frame == NULL)
+            return false;
+        if (frame->seq <= client->last_seq) // already sent
+        {
+            frame->release();
+            return false;
+        }
+        if (client->last_seq > 0)
+        {
+            client->frames_skipped += frame->seq - client->last_seq - 1;
+            frames_skipped += frame->seq - client->last_seq - 1;
+        }
+        client->last_seq = frame->seq;
+        client->frame = frame;
+        client->offset = 0;
+        return true;
+    }
+
+    /**
+     * @brief Start sending a newly published frame to every idle client.
+     * Busy clients pick it up when they finish their current frame.
+     *
+     */
+    void send_new()
+    {
+        unsigned width = frame_width;
+        if (width != resolved_width) // e.g. the binning changed, previews keep their width
+        {
+            resolved_width = width;
+            for (unsigned i = 0; i < nclients; i++)
+                if (clients[i]->preview_width > 0)
+                    clients[i]->scale = scale_for_width(clients[i]->preview_width, width);
+            update_streams();
+        }
+        for (unsigned i = 0; i < nclients;)
+        {
+            net_client *client = clients[i];
+            if (next_frame(client) && !write_client(client))
+                continue; // client was dropped and its slot refilled
+            i++;
+        }
+    }
+
+public:
+    /**
+     * @brief Called for text commands received from clients, may be NULL
+     *
+     */
+    frame_server_cmd_fcn cmd_fcn;
+    /**
+     * @brief Called for binary commands, may be NULL (all are answered
+     * NET_ACK_UNKNOWN)
+     *
+     */
+    frame_server_bin_cmd_fcn bin_cmd_fcn;
+    /**
+     * @brief User data for cmd_fcn
+     *
+     */
+    void *user;
+    /**
+     * @brief Frames published
+     *
+     */
+    std::atomic<unsigned long long> frames_published;
+    /**
+     * @brief Frames written out completely, summed over clients
+     *
+     */
+    std::atomic<unsigned long long> frames_sent;
+    /**
+     * @brief Frames superseded before a busy client could be sent them,
+     * summed over clients
+     *
+     */
+    std::atomic<unsigned long long> frames_skipped;
+    /**
+     * @brief Binary commands applied, summed over clients
+     *
+     */
+    std::atomic<unsigned long long> commands;
+    /**
+     * @brief Publish to last byte handed to the kernel, summed over sends
+     *
+     */
+    std::atomic<unsigned long long> latency_sum_ns;
+    std::atomic<unsigned long long> latency_n;
+    std::atomic<unsigned long long> latency_max_ns;
+    /**
+     * @brief Frames and bytes written out at each preview scale and raw,
+     * the last entry counts regions of interest
+     *
+     */
+    std::atomic<unsigned long long> scale_frames[NET_NUM_STREAMS + 1];
+    std::atomic<unsigned long long> scale_bytes[NET_NUM_STREAMS + 1];
+    /**
+     * @brief Bit mask of the whole frame streams wanted by clients
+     *
+     */
+    std::atomic<unsigned> scale_mask;
+    /**
+     * @brief Full scale width of the whole frames published last, and the
+     * one the clients' preview scales were picked for (server thread)
+     *
+     */
+    std::atomic<unsigned> frame_width;
+    unsigned resolved_width;
+
+    frame_server()
+    {
+        server_fd = -1;
+        epoll_fd = -1;
+        frame_fd = -1;
+        wake_fd = -1;
+        running = false;
+        pthread_mutex_init(&lock, NULL);
+        for (unsigned i = 0; i < NET_NUM_STREAMS; i++)
+            latest[i] = NULL;
+        for (unsigned i = 0; i <= NET_NUM_STREAMS; i++)
+        {
+            scale_frames[i] = 0;
+            scale_bytes[i] = 0;
+        }
+        nroi_streams = 0;
+        scale_mask = 1;
+        frame_width = 0;
+        resolved_width = 0;
+        nclients = 0;
+        closed = NULL;
+        seq = 0;
+        cmd_fcn = NULL;
+        bin_cmd_fcn = NULL;
+        user = NULL;
+        commands = 0;
+        frames_published = 0;
+        frames_sent = 0;
+        frames_skipped = 0;
+        latency_sum_ns = 0;
+        latency_n = 0;
+        latency_max_ns = 0;
+    }
+    ~frame_server()
+    {
+        while (nclients > 0)
+            drop_client(clients[nclients - 1]);
+        free_closed();
+        for (unsigned i = 0; i < NET_NUM_STREAMS; i++)
+            if (latest[i] != NULL)
+                latest[i]->release();
+        for (unsigned i = 0; i < nroi_streams; i++)
+            if (roi_streams[i].latest != NULL)
+                roi_streams[i].latest->release();
+        if (server_fd >= 0)
+            close(server_fd);
+        if (epoll_fd >= 0)
+            close(epoll_fd);
+        if (frame_fd >= 0)
+            close(frame_fd);
+        if (wake_fd >= 0)
+            close(wake_fd);
+        pthread_mutex_destroy(&lock);
+    }
+    frame_server(const frame_server &) = delete;
+    frame_server &operator=(const frame_server &) = delete;
+    /**
+     * @brief Bind and listen on a port
+     *
+     * @param port TCP port
+     * @return true Server is ready to run
+     * @return false Error, reported with perror
+     */
+    bool open(int port)
+    {
+        int opt = 1;
+        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        {
+            perror("socket failed");
+            return false;
+        }
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+        {
+            perror("setsockopt");
+            return false;
+        }
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+        {
+            perror("setsockopt");
+            return false;
+        }
+        set_nonblocking(server_fd);
+        struct sockaddr_in address;
+        memset(&address, 0x0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+        {
+            perror("bind failed");
+            return false;
+        }
+        if (listen(server_fd, NET_MAX_CLIENTS) < 0)
+        {
+            perror("listen");
+            return false;
+        }
+        if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        {
+            perror("epoll_create1");
+            return false;
+        }
+        if ((frame_fd = eventfd(0, EFD_NONBLOCK)) < 0 || (wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+        {
+            perror("eventfd");
+            return false;
+        }
+        int *fds[3] = {&server_fd, &frame_fd, &wake_fd}; // data.ptr tells the descriptor apart from clients
+        for (int i = 0; i < 3; i++)
+        {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = fds[i];
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *fds[i], &ev) < 0)
+            {
+                perror("epoll_ctl");
+                return false;
+            }
+        }
+        return true;
+    }
+    /**
+     * @brief Event loop, returns after stop()
+     *
+     */
+    void run()
+    {
+        struct epoll_event events[NET_MAX_CLIENTS + 3];
+        running = true;
+        while (running)
+        {
+            int nev = epoll_wait(epoll_fd, events, NET_MAX_CLIENTS + 3, -1);
+            if (nev < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("epoll_wait");
+                break;
+            }
+            bool new_frame = false;
+            for (int i = 0; i < nev; i++)
+            {
+                uint64_t val;
+                if (events[i].data.ptr == &server_fd)
+                    accept_clients();
+                else if (events[i].data.ptr == &frame_fd)
+                    new_frame = read(frame_fd, &val, sizeof(val)) > 0;
+                else if (events[i].data.ptr == &wake_fd)
+                    (void)!read(wake_fd, &val, sizeof(val));
+                else
+                {
+                    net_client *client = (net_client *)events[i].data.ptr;
+                    if (client->fd < 0) // dropped earlier in this batch
+                        continue;
+                    if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                    {
+                        drop_client(client);
+                        continue;
+                    }
+                    if (events[i].events & EPOLLIN)
+                        read_client(client);
+                    if ((events[i].events & EPOLLOUT) && client->fd >= 0)
+                        write_client(client);
+                }
+            }
+            if (new_frame)
+                send_new();
+            free_closed();
+        }
+    }
+    /**
+     * @brief Make run() return, callable from any thread
+     *
+     */
+    void stop()
+    {
+        running = false;
+        uint64_t val = 1;
+        if (wake_fd >= 0)
+            (void)!write(wake_fd, &val, sizeof(val));
+    }
+    /**
+     * @brief Replace the published frame and have it sent to every client,
+     * takes over the caller's reference. Callable from any thread.
+     *
+     * @param frame New frame
+     * @return uint64_t Sequence number assigned to the frame
+     */
+    uint64_t publish(encoded_frame *frame)
+    {
+        encoded_frame *frames[NET_NUM_STREAMS] = {frame};
+        return publish(frames);
+    }
+    /**
+     * @brief Publish one frame encoded at several preview scales and as crops
+     * of regions of interest, under a single sequence number. Takes over the
+     * caller's references. Callable from any thread.
+     *
+     * @param frames One frame (or NULL) per scale and NET_STREAM_RAW,
+     * streams left NULL are withdrawn until a later frame provides them.
+     * NULL to leave the published streams as they are (e.g. for a hardware
+     * subframe).
+     * @param roi_frames Region frames, matched to the wanted regions by their
+     * roi and the format in their metadata. Frames for regions nobody wants
+     * any more are released.
+     * @param nroi Number of region frames, at most NET_MAX_ROIS
+     * @return uint64_t Sequence number assigned to the frames
+     */
+    uint64_t publish(encoded_frame **frames, encoded_frame **roi_frames = NULL, unsigned nroi = 0)
+    {
+        uint64_t now = monotonic_ns();
+        encoded_frame *old[NET_NUM_STREAMS + NET_MAX_ROIS];
+        unsigned nold = 0;
+        if (nroi > NET_MAX_ROIS)
+            nroi = NET_MAX_ROIS;
+        pthread_mutex_lock(&lock);
+        uint64_t frame_seq = ++seq;
+        unsigned width = 0;
+        for (unsigned i = 0; frames != NULL && i < NET_NUM_STREAMS; i++)
+        {
+            if (frames[i] != NULL)
+            {
+                if (width == 0)
+                    width = frames[i]->meta()->width * (i == NET_STREAM_RAW ? 1 : net_scale_factor(i));
+                frames[i]->t_publish = now;
+                frames[i]->seq = frame_seq;
+                frames[i]->scale = i;
+                frames[i]->meta()->seq = frame_seq;
+                frames[i]->meta()->stamps.enqueue = now;
+            }
+            if (latest[i] != NULL)
+                old[nold++] = latest[i];
+            latest[i] = frames[i];
+        }
+        for (unsigned i = 0; i < nroi; i++)
+        {
+            encoded_frame *frame = roi_frames[i];
+            if (frame == NULL)
+                continue;
+            net_meta *meta = frame->meta();
+            int stream = find_roi_stream(&frame->roi, meta->format);
+            if (stream < 0)
+            {
+                old[nold++] = frame;
+                continue;
+            }
+            frame->t_publish = now;
+            frame->seq = frame_seq;
+            frame->scale = NET_NUM_STREAMS;
+            meta->seq = frame_seq;
+            meta->stamps.enqueue = now;
+            if (roi_streams[stream].latest != NULL)
+                old[nold++] = roi_streams[stream].latest;
+            roi_streams[stream].latest = frame;
+        }
+        pthread_mutex_unlock(&lock);
+        if (width > 0)
+            frame_width = width;
+        frames_published++;
+        uint64_t val = 1;
+        if (frame_fd >= 0)
+            (void)!write(frame_fd, &val, sizeof(val));
+        for (unsigned i = 0; i < nold; i++)
+            old[i]->release();
+        return frame_seq;
+    }
+    /**
+     * @brief Get a reference to the published frame, release it when done
+     *
+     * @param scale Preview scale, or NET_STREAM_RAW
+     * @return encoded_frame* Published frame, NULL if none yet
+     */
+    encoded_frame *get_frame(unsigned scale = 0)
+    {
+        if (scale >= NET_NUM_STREAMS)
+            return NULL;
+        pthread_mutex_lock(&lock);
+        encoded_frame *frame = latest[scale];
+        if (frame != NULL)
+            frame->acquire();
+        pthread_mutex_unlock(&lock);
+        return frame;
+    }
+    /**
+     * @brief Preview scales clients currently want, as a bit mask (bit i for
+     * scale i, bit NET_STREAM_RAW for the raw frame). Callable from any
+     * thread.
+     *
+     */
+    unsigned wanted_scales() const
+    {
+        return scale_mask;
+    }
+    /**
+     * @brief Regions of interest clients currently want (at most
+     * NET_MAX_ROIS). Callable from any thread.
+     *
+     * @param rois Output, NET_MAX_ROIS entries
+     * @param formats Output, NET_MAX_ROIS entries: payload type wanted for
+     * each region (the same region can be wanted in both). May be NULL.
+     * @return unsigned Number of regions
+     */
+    unsigned wanted_rois(net_roi *rois, unsigned *formats = NULL)
+    {
+        pthread_mutex_lock(&lock);
+        unsigned n = nroi_streams;
+        for (unsigned i = 0; i < n; i++)
+        {
+            rois[i] = roi_streams[i].roi;
+            if (formats != NULL)
+                formats[i] = roi_streams[i].format;
+        }
+        pthread_mutex_unlock(&lock);
+        return n;
+    }
+    /**
+     * @brief Stream a region of interest to a client instead of the whole
+     * frame, from the next frame on (server thread only, e.g. from cmd_fcn)
+     *
+     * @param client Client
+     * @param roi Region, already clipped to the sensor; zero width or height
+     * to go back to the whole frame
+     */
+    void set_client_roi(net_client *client, const net_roi *roi)
+    {
+        client->roi = *roi;
+        update_streams();
+    }
+    /**
+     * @brief Change the preview scale sent to a client, from the next frame
+     * on (server thread only, e.g. from cmd_fcn)
+     *
+     * @param client Client
+     * @param scale Preview scale, clamped to the available ones
+     */
+    void set_client_scale(net_client *client, unsigned scale)
+    {
+        if (scale >= NET_NUM_SCALES)
+            scale = NET_NUM_SCALES - 1;
+        client->scale = scale;
+        client->preview_width = 0;
+        update_streams();
+    }
+    /**
+     * @brief Send a client the smallest preview at least width pixels wide,
+     * 0 for full resolution. The scale follows the width of the published
+     * frames, e.g. when the binning changes (server thread only).
+     *
+     * @return unsigned Preview scale for the frames published last
+     */
+    unsigned set_client_preview_width(net_client *client, unsigned width)
+    {
+        client->preview_width = width;
+        client->scale = scale_for_width(width, resolved_width);
+        update_streams();
+        return client->scale;
+    }
+    /**
+     * @brief Change the payload type sent to a client, from the next frame
+     * on (server thread only, e.g. from cmd_fcn)
+     *
+     * @param client Client
+     * @param format NET_FORMAT_JPEG or NET_FORMAT_RAW16
+     */
+    void set_client_format(net_client *client, unsigned format)
+    {
+        if (format >= NET_NUM_FORMATS)
+            format = NET_FORMAT_JPEG;
+        client->format = format;
+        update_streams();
+    }
+    /**
+     * @brief Print delivery statistics since the last report and reset the
+     * latency counters
+     *
+     * @param fp Output stream
+     */
+    void report(FILE *fp)
+    {
+        unsigned long long n = latency_n.exchange(0);
+        unsigned long long sum = latency_sum_ns.exchange(0);
+        unsigned long long max = latency_max_ns.exchange(0);
+        fprintf(fp, "network: %u clients, %llu published, %llu sent, %llu skipped | publish to wire: avg %.2f ms, max %.2f ms\n",
+                nclients, frames_published.load(), frames_sent.load(), frames_skipped.load(), n ? sum * 1e-6 / n : 0, max * 1e-6);
+        if (commands > 0)
+            fprintf(fp, "network: %llu commands acknowledged\n", commands.load());
+        for (unsigned i = 0; i <= NET_NUM_STREAMS; i++)
+        {
+            unsigned long long frames = scale_frames[i].load();
+            if (frames == 0)
+                continue;
+            if (i < NET_NUM_SCALES)
+                fprintf(fp, "network: scale 1/%u: %llu frames sent, %.1f kB/frame\n", net_scale_factor(i), frames, scale_bytes[i].load() * 1e-3 / frames);
+            else if (i == NET_STREAM_RAW)
+                fprintf(fp, "network: raw: %llu frames sent, %.1f kB/frame\n", frames, scale_bytes[i].load() * 1e-3 / frames);
+            else
+                fprintf(fp, "network: regions of interest: %llu frames sent, %.1f kB/frame\n", frames, scale_bytes[i].load() * 1e-3 / frames);
+        }
+    }
+    static uint64_t monotonic_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    /**
+     * @brief Number of connected clients (server thread only)
+     *
+     */
+    unsigned num_clients() const
+    {
+        return nclients;
+    }
+};
+
+#endif // FRAME_SERVER_H_
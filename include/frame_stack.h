@@ -0,0 +1,609 @@
+/**
+ * @file frame_stack.h
+ * @brief Live stacking: co-addition of frames into a 32 bit accumulator,
+ * cumulative or over a sliding window of the last N frames
+ *
+ * Every frame is added with one SSE2/NEON pass over the accumulator which,
+ * in a sliding window, also subtracts the frame leaving it. The stack keeps
+ * a copy of the frames in the window for that, in one block allocated with
+ * the accumulator, so the per frame cost (that pass and one copy) does not
+ * depend on N. The copies are limited to STACK_WINDOW_MB, max_window() is
+ * the longest window that fits at a frame size.
+ *
+ * Sigma clipping replaces pixels further than clip_sigma standard
+ * deviations from the mean of the stack by that mean, the deviation taken
+ * from the CCD noise model (shot noise over STACK_GAIN plus read noise).
+ * Clipping only starts once STACK_CLIP_MIN frames are in. In a sliding
+ * window the replaced values are logged in a fixed size ring of
+ * STACK_CLIP_POOL entries, so the frame can be subtracted exactly as it
+ * was added; a frame that finds the ring full is added unclipped from there
+ * on.
+ *
+ * The stacking mode is a process wide setting like the stretch, changed
+ * with set_config() and picked up by the stack on its next frame. Any
+ * change of mode, window, geometry or (by more than STACK_EXPOSURE_TOL)
+ * exposure restarts the stack.
+ *
+ */
+#ifndef FRAME_STACK_H_
+#define FRAME_STACK_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define FRAME_STACK_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FRAME_STACK_NEON 1
+#endif
+
+#ifndef STACK_MAX_FRAMES
+#define STACK_MAX_FRAMES 32768 // frames co-added at most, 32768 * 65535 < 2^31
+#endif
+#ifndef STACK_WINDOW_MB
+#define STACK_WINDOW_MB 1024 // MiB of frames kept for a sliding window
+#endif
+#ifndef STACK_CLIP_POOL
+#define STACK_CLIP_POOL (1 << 20) // clipped pixels remembered over a sliding window, 8 bytes each
+#endif
+#ifndef STACK_CLIP_MIN
+#define STACK_CLIP_MIN 4 // frames in the stack before clipping starts
+#endif
+#ifndef STACK_GAIN
+#define STACK_GAIN 0.4 // e-/ADU, for the shot noise of the clipping, typical of the Atik CCDs (and sim_camera.h)
+#endif
+#ifndef STACK_READ_NOISE
+#define STACK_READ_NOISE 17.5 // ADU, 7 e-
+#endif
+#ifndef STACK_OFFSET
+#define STACK_OFFSET 300.0 // ADU of a zero exposure, no shot noise below it
+#endif
+#ifndef STACK_EXPOSURE_TOL
+#define STACK_EXPOSURE_TOL 0.05 // relative exposure change that restarts the stack
+#endif
+
+typedef enum
+{
+    STACK_OFF = 0,
+    STACK_SLIDING,    // the last window frames
+    STACK_CUMULATIVE, // every frame since the stack started, up to STACK_MAX_FRAMES
+    STACK_MAX
+} stack_mode;
+
+/**
+ * @brief Stacking parameters
+ *
+ */
+typedef struct
+{
+    stack_mode mode;
+    unsigned window;  // frames in a sliding window
+    float clip_sigma; // sigma clipping threshold, 0 for none
+} stack_cfg;
+
+/**
+ * @brief A clipped pixel: index in the frame and original minus clipped value
+ *
+ */
+typedef struct
+{
+    uint32_t idx;
+    int32_t delta;
+} stack_clip;
+
+/**
+ * @brief Clipping model and the log the clipped pixels go to
+ *
+ */
+typedef struct
+{
+    float inv_n;     // 1 / frames in the stack
+    float k2;        // clip_sigma^2
+    float inv_gain;  // 1 / STACK_GAIN
+    float rn2;       // STACK_READ_NOISE^2
+    float offset;    // STACK_OFFSET
+    stack_clip *log; // ring of cap entries, NULL to clip without logging
+    size_t cap;
+    uint64_t head;  // next entry written
+    uint64_t limit; // head may not reach it
+    unsigned long long clipped;
+} stack_clip_ctx;
+
+/* sum += in - out (out may be NULL) */
+static inline void stack_add_scalar(uint32_t *sum, const unsigned short *in, const unsigned short *out, size_t n)
+{
+    if (out == NULL)
+        for (size_t i = 0; i < n; i++)
+            sum[i] += in[i];
+    else
+        for (size_t i = 0; i < n; i++)
+            sum[i] += (uint32_t)in[i] - out[i];
+}
+
+/* dst = sum * scale, rounded and clamped to 16 bits */
+static inline void stack_mean_scalar(const uint32_t *sum, size_t n, float scale, unsigned short *dst)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float v = sum[i] * scale + 0.5f;
+        dst[i] = v >= 65535.0f ? 65535 : (unsigned short)v;
+    }
+}
+
+/* clip one pixel against the stack, logging the change; false if it was kept */
+static inline bool stack_clip_pixel(const uint32_t *sum, size_t i, size_t base, unsigned short *x, stack_clip_ctx *c)
+{
+    float m = sum[i] * c->inv_n;
+    float d = *x - m;
+    float var = (m > c->offset ? (m - c->offset) * c->inv_gain : 0) + c->rn2;
+    if (d * d <= c->k2 * var)
+        return false;
+    if (c->log != NULL && c->head >= c->limit)
+        return false; // log full, add it as it is
+    unsigned short v = (unsigned short)(m + 0.5f);
+    if (c->log != NULL)
+    {
+        stack_clip *e = &c->log[c->head % c->cap];
+        e->idx = base + i;
+        e->delta = (int32_t)*x - v;
+        c->head++;
+    }
+    *x = v;
+    c->clipped++;
+    return true;
+}
+
+/* sum += clip(in) - out, clipping against the stack before the update */
+static inline void stack_clip_add_scalar(uint32_t *sum, const unsigned short *in, const unsigned short *out, size_t n, size_t base, stack_clip_ctx *c)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned short x = in[i];
+        stack_clip_pixel(sum, i, base, &x, c);
+        sum[i] += (uint32_t)x - (out != NULL ? out[i] : 0);
+    }
+}
+
+#ifdef FRAME_STACK_X86
+static inline void stack_add_sse2(uint32_t *sum, const unsigned short *in, const unsigned short *out, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i lo = _mm_unpacklo_epi16(v, zero), hi = _mm_unpackhi_epi16(v, zero);
+        if (out != NULL)
+        {
+            __m128i o = _mm_loadu_si128((const __m128i *)(out + i));
+            lo = _mm_sub_epi32(lo, _mm_unpacklo_epi16(o, zero));
+            hi = _mm_sub_epi32(hi, _mm_unpackhi_epi16(o, zero));
+        }
+        _mm_storeu_si128((__m128i *)(sum + i), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(sum + i)), lo));
+        _mm_storeu_si128((__m128i *)(sum + i + 4), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(sum + i + 4)), hi));
+    }
+    stack_add_scalar(sum + i, in + i, out != NULL ? out + i : NULL, n - i);
+}
+
+static inline void stack_mean_sse2(const uint32_t *sum, size_t n, float scale, unsigned short *dst)
+{
+    const __m128 s = _mm_set1_ps(scale);
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        // sums stay below 2^31, the signed conversion is exact enough
+        __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(sum + i))), s));
+        __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(sum + i + 4))), s));
+        // no unsigned 32 -> 16 pack in SSE2: bias, signed saturating pack, unbias
+        __m128i p = _mm_packs_epi32(_mm_sub_epi32(a, bias), _mm_sub_epi32(b, bias));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(p, flip));
+    }
+    stack_mean_scalar(sum + i, n - i, scale, dst + i);
+}
+
+static inline void stack_clip_add_sse2(uint32_t *sum, const unsigned short *in, const unsigned short *out, size_t n, size_t base, stack_clip_ctx *c)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 inv_n = _mm_set1_ps(c->inv_n), k2 = _mm_set1_ps(c->k2), inv_gain = _mm_set1_ps(c->inv_gain);
+    const __m128 rn2 = _mm_set1_ps(c->rn2), offset = _mm_set1_ps(c->offset), fzero = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i lo = _mm_unpacklo_epi16(v, zero), hi = _mm_unpackhi_epi16(v, zero);
+        __m128i s0 = _mm_loadu_si128((const __m128i *)(sum + i)), s1 = _mm_loadu_si128((const __m128i *)(sum + i + 4));
+        __m128 m0 = _mm_mul_ps(_mm_cvtepi32_ps(s0), inv_n), m1 = _mm_mul_ps(_mm_cvtepi32_ps(s1), inv_n);
+        __m128 d0 = _mm_sub_ps(_mm_cvtepi32_ps(lo), m0), d1 = _mm_sub_ps(_mm_cvtepi32_ps(hi), m1);
+        __m128 v0 = _mm_add_ps(_mm_mul_ps(_mm_max_ps(_mm_sub_ps(m0, offset), fzero), inv_gain), rn2);
+        __m128 v1 = _mm_add_ps(_mm_mul_ps(_mm_max_ps(_mm_sub_ps(m1, offset), fzero), inv_gain), rn2);
+        int mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(k2, v0))) | _mm_movemask_ps(_mm_cmpgt_ps(_mm_mul_ps(d1, d1), _mm_mul_ps(k2, v1)));
+        if (mask) // rare: outliers in this group, do it pixel by pixel
+        {
+            stack_clip_add_scalar(sum + i, in + i, out != NULL ? out + i : NULL, 8, base + i, c);
+            continue;
+        }
+        if (out != NULL)
+        {
+            __m128i o = _mm_loadu_si128((const __m128i *)(out + i));
+            lo = _mm_sub_epi32(lo, _mm_unpacklo_epi16(o, zero));
+            hi = _mm_sub_epi32(hi, _mm_unpackhi_epi16(o, zero));
+        }
+        _mm_storeu_si128((__m128i *)(sum + i), _mm_add_epi32(s0, lo));
+        _mm_storeu_si128((__m128i *)(sum + i + 4), _mm_add_epi32(s1, hi));
+    }
+    stack_clip_add_scalar(sum + i, in + i, out != NULL ? out + i : NULL, n - i, base + i, c);
+}
+#endif // FRAME_STACK_X86
+
+#ifdef FRAME_STACK_NEON
+static inline void stack_add_neon(uint32_t *sum, const unsigned short *in, const unsigned short *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(in + i);
+        uint32x4_t s0 = vaddw_u16(vld1q_u32(sum + i), vget_low_u16(v));
+        uint32x4_t s1 = vaddw_u16(vld1q_u32(sum + i + 4), vget_high_u16(v));
+        if (out != NULL)
+        {
+            uint16x8_t o = vld1q_u16(out + i);
+            s0 = vsubw_u16(s0, vget_low_u16(o));
+            s1 = vsubw_u16(s1, vget_high_u16(o));
+        }
+        vst1q_u32(sum + i, s0);
+        vst1q_u32(sum + i + 4, s1);
+    }
+    stack_add_scalar(sum + i, in + i, out != NULL ? out + i : NULL, n - i);
+}
+
+static inline void stack_mean_neon(const uint32_t *sum, size_t n, float scale, unsigned short *dst)
+{
+    const float32x4_t s = vdupq_n_f32(scale), half = vdupq_n_f32(0.5f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint32x4_t a = vcvtq_u32_f32(vaddq_f32(vmulq_f32(vcvtq_f32_u32(vld1q_u32(sum + i)), s), half));
+        uint32x4_t b = vcvtq_u32_f32(vaddq_f32(vmulq_f32(vcvtq_f32_u32(vld1q_u32(sum + i + 4)), s), half));
+        vst1q_u16(dst + i, vcombine_u16(vqmovn_u32(a), vqmovn_u32(b)));
+    }
+    stack_mean_scalar(sum + i, n - i, scale, dst + i);
+}
+
+static inline void stack_clip_add_neon(uint32_t *sum, const unsigned short *in, const unsigned short *out, size_t n, size_t base, stack_clip_ctx *c)
+{
+    const float32x4_t inv_n = vdupq_n_f32(c->inv_n), k2 = vdupq_n_f32(c->k2), inv_gain = vdupq_n_f32(c->inv_gain);
+    const float32x4_t rn2 = vdupq_n_f32(c->rn2), offset = vdupq_n_f32(c->offset), fzero = vdupq_n_f32(0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t v = vld1q_u16(in + i);
+        uint32x4_t s0 = vld1q_u32(sum + i), s1 = vld1q_u32(sum + i + 4);
+        float32x4_t m0 = vmulq_f32(vcvtq_f32_u32(s0), inv_n), m1 = vmulq_f32(vcvtq_f32_u32(s1), inv_n);
+        float32x4_t d0 = vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), m0);
+        float32x4_t d1 = vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))), m1);
+        float32x4_t v0 = vaddq_f32(vmulq_f32(vmaxq_f32(vsubq_f32(m0, offset), fzero), inv_gain), rn2);
+        float32x4_t v1 = vaddq_f32(vmulq_f32(vmaxq_f32(vsubq_f32(m1, offset), fzero), inv_gain), rn2);
+        uint32x4_t out0 = vcgtq_f32(vmulq_f32(d0, d0), vmulq_f32(k2, v0)), out1 = vcgtq_f32(vmulq_f32(d1, d1), vmulq_f32(k2, v1));
+        uint32x4_t any = vorrq_u32(out0, out1);
+        if (vgetq_lane_u32(any, 0) | vgetq_lane_u32(any, 1) | vgetq_lane_u32(any, 2) | vgetq_lane_u32(any, 3))
+        {
+            stack_clip_add_scalar(sum + i, in + i, out != NULL ? out + i : NULL, 8, base + i, c);
+            continue;
+        }
+        s0 = vaddw_u16(s0, vget_low_u16(v));
+        s1 = vaddw_u16(s1, vget_high_u16(v));
+        if (out != NULL)
+        {
+            uint16x8_t o = vld1q_u16(out + i);
+            s0 = vsubw_u16(s0, vget_low_u16(o));
+            s1 = vsubw_u16(s1, vget_high_u16(o));
+        }
+        vst1q_u32(sum + i, s0);
+        vst1q_u32(sum + i + 4, s1);
+    }
+    stack_clip_add_scalar(sum + i, in + i, out != NULL ? out + i : NULL, n - i, base + i, c);
+}
+#endif // FRAME_STACK_NEON
+
+static inline void stack_add(uint32_t *sum, const unsigned short *in, const unsigned short *out, size_t n, bool simd = true)
+{
+#if defined(FRAME_STACK_X86)
+    if (simd)
+        return stack_add_sse2(sum, in, out, n);
+#elif defined(FRAME_STACK_NEON)
+    if (simd)
+        return stack_add_neon(sum, in, out, n);
+#endif
+    stack_add_scalar(sum, in, out, n);
+}
+
+static inline void stack_mean(const uint32_t *sum, size_t n, float scale, unsigned short *dst, bool simd = true)
+{
+#if defined(FRAME_STACK_X86)
+    if (simd)
+        return stack_mean_sse2(sum, n, scale, dst);
+#elif defined(FRAME_STACK_NEON)
+    if (simd)
+        return stack_mean_neon(sum, n, scale, dst);
+#endif
+    stack_mean_scalar(sum, n, scale, dst);
+}
+
+static inline void stack_clip_add(uint32_t *sum, const unsigned short *in, const unsigned short *out, size_t n, stack_clip_ctx *c, bool simd = true)
+{
+#if defined(FRAME_STACK_X86)
+    if (simd)
+        return stack_clip_add_sse2(sum, in, out, n, 0, c);
+#elif defined(FRAME_STACK_NEON)
+    if (simd)
+        return stack_clip_add_neon(sum, in, out, n, 0, c);
+#endif
+    stack_clip_add_scalar(sum, in, out, n, 0, c);
+}
+
+class frame_stack
+{
+private:
+    typedef struct
+    {
+        uint64_t clip_start; // the frame's entries in the clip log
+        uint64_t clip_end;
+    } stack_entry;
+
+    stack_cfg cfg;
+    unsigned cfg_gen;
+    uint32_t *sum;
+    unsigned width, height;
+    unsigned n;     // frames in the stack
+    float exposure; // of the frames in the stack
+    stack_entry *win; // sliding window, cfg.window entries, oldest at win_tail
+    unsigned short *win_frames; // their pixels, entry k at k * width * height
+    unsigned win_tail;
+    stack_clip *clip_log;
+    uint64_t clip_tail; // oldest entry still needed
+    uint64_t clip_head; // next entry
+
+    static pthread_mutex_t *cfg_lock()
+    {
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        return &lock;
+    }
+    static stack_cfg *shared_cfg()
+    {
+        static stack_cfg cfg = {STACK_OFF, 16, 0};
+        return &cfg;
+    }
+    static std::atomic<unsigned> &shared_gen()
+    {
+        static std::atomic<unsigned> gen(1);
+        return gen;
+    }
+
+public:
+    /**
+     * @brief Frames added, frames refused (stack full, window too long for
+     * the frame size, out of memory), restarts and pixels clipped, since the process started
+     *
+     */
+    std::atomic<unsigned long long> added, skipped, restarts, clipped;
+
+    frame_stack()
+    {
+        memset(&cfg, 0x0, sizeof(cfg));
+        cfg_gen = 0;
+        sum = NULL;
+        width = height = 0;
+        n = 0;
+        exposure = 0;
+        win = NULL;
+        win_frames = NULL;
+        win_tail = 0;
+        clip_log = NULL;
+        clip_tail = clip_head = 0;
+        added = 0;
+        skipped = 0;
+        restarts = 0;
+        clipped = 0;
+    }
+    ~frame_stack()
+    {
+        free(sum);
+        free(win);
+        free(win_frames);
+        free(clip_log);
+    }
+    frame_stack(const frame_stack &) = delete;
+    frame_stack &operator=(const frame_stack &) = delete;
+    /**
+     * @brief Change the stacking of every frame_stack from its next frame on
+     *
+     * @param cfg Stacking parameters, the window is clamped to [1, STACK_MAX_FRAMES]
+     */
+    static void set_config(stack_cfg cfg)
+    {
+        if (cfg.mode < STACK_OFF || cfg.mode >= STACK_MAX)
+            cfg.mode = STACK_OFF;
+        cfg.window = cfg.window < 1 ? 1 : (cfg.window > STACK_MAX_FRAMES ? STACK_MAX_FRAMES : cfg.window);
+        if (!(cfg.clip_sigma > 0))
+            cfg.clip_sigma = 0;
+        pthread_mutex_lock(cfg_lock());
+        *shared_cfg() = cfg;
+        shared_gen()++;
+        pthread_mutex_unlock(cfg_lock());
+    }
+    static stack_cfg get_config()
+    {
+        pthread_mutex_lock(cfg_lock());
+        stack_cfg cfg = *shared_cfg();
+        pthread_mutex_unlock(cfg_lock());
+        return cfg;
+    }
+    /**
+     * @brief Longest sliding window of frames of that many pixels, the
+     * frames of longer windows are refused
+     *
+     */
+    static unsigned max_window(size_t pixels)
+    {
+        uint64_t frames = pixels > 0 ? ((uint64_t)STACK_WINDOW_MB << 20) / (pixels * sizeof(unsigned short)) : STACK_MAX_FRAMES;
+        return frames > STACK_MAX_FRAMES ? STACK_MAX_FRAMES : (unsigned)frames;
+    }
+    /**
+     * @brief Pick up the current configuration, call once per frame before add()
+     *
+     * @return true Stacking is on
+     */
+    bool update()
+    {
+        if (cfg_gen != shared_gen().load())
+        {
+            pthread_mutex_lock(cfg_lock());
+            cfg = *shared_cfg();
+            cfg_gen = shared_gen();
+            pthread_mutex_unlock(cfg_lock());
+            free(win);
+            free(win_frames);
+            win = NULL;
+            win_frames = NULL; // allocated by the next add(), at its frame size
+            if (cfg.mode == STACK_SLIDING)
+                win = (stack_entry *)calloc(cfg.window, sizeof(stack_entry));
+            if (cfg.mode == STACK_SLIDING && cfg.clip_sigma > 0 && clip_log == NULL)
+                clip_log = (stack_clip *)malloc(STACK_CLIP_POOL * sizeof(stack_clip));
+            if (win == NULL && cfg.mode == STACK_SLIDING)
+                cfg.mode = STACK_OFF;
+            reset();
+        }
+        return cfg.mode != STACK_OFF;
+    }
+    const stack_cfg *config() const
+    {
+        return &cfg;
+    }
+    /**
+     * @brief Empty the stack
+     *
+     */
+    void reset()
+    {
+        if (n > 0)
+            restarts++;
+        n = 0;
+        win_tail = 0;
+        clip_tail = clip_head = 0;
+    }
+    /**
+     * @brief Frames in the stack
+     *
+     */
+    unsigned frames() const
+    {
+        return n;
+    }
+    /**
+     * @brief Add a frame. The stack restarts first if the geometry or the
+     * exposure changed.
+     *
+     * @param data Frame
+     * @return false Frame not added: stack off or full, window longer than
+     * max_window() or out of memory
+     */
+    bool add(const unsigned short *data, unsigned width, unsigned height, float exposure, bool simd = true)
+    {
+        size_t npix = (size_t)width * height;
+        if (cfg.mode == STACK_OFF || (cfg.mode == STACK_CUMULATIVE && n >= STACK_MAX_FRAMES) || (cfg.mode == STACK_SLIDING && cfg.window > max_window(npix)))
+        {
+            skipped++;
+            return false;
+        }
+        if (width != this->width || height != this->height || sum == NULL)
+        {
+            free(sum);
+            free(win_frames);
+            win_frames = NULL;
+            sum = (uint32_t *)malloc(npix * sizeof(uint32_t));
+            this->width = sum == NULL ? 0 : width;
+            this->height = sum == NULL ? 0 : height;
+            reset();
+        }
+        if (cfg.mode == STACK_SLIDING && win_frames == NULL)
+            win_frames = (unsigned short *)malloc(cfg.window * npix * sizeof(unsigned short));
+        if (sum == NULL || (cfg.mode == STACK_SLIDING && win_frames == NULL))
+        {
+            skipped++;
+            return false;
+        }
+        if (n > 0 && fabs(exposure - this->exposure) > STACK_EXPOSURE_TOL * this->exposure)
+            reset();
+        if (n == 0)
+        {
+            memset(sum, 0x0, npix * sizeof(uint32_t));
+            this->exposure = exposure;
+        }
+        const unsigned short *out = cfg.mode == STACK_SLIDING && n == cfg.window ? win_frames + win_tail * npix : NULL;
+        uint64_t start = clip_head;
+        if (cfg.clip_sigma > 0 && n >= STACK_CLIP_MIN)
+        {
+            stack_clip_ctx c;
+            c.inv_n = 1.0f / n;
+            c.k2 = cfg.clip_sigma * cfg.clip_sigma;
+            c.inv_gain = 1.0f / STACK_GAIN;
+            c.rn2 = STACK_READ_NOISE * STACK_READ_NOISE;
+            c.offset = STACK_OFFSET;
+            c.log = cfg.mode == STACK_SLIDING ? clip_log : NULL;
+            c.cap = STACK_CLIP_POOL;
+            c.head = clip_head;
+            c.limit = clip_tail + STACK_CLIP_POOL; // the leaving frame's entries are still read below
+            c.clipped = 0;
+            stack_clip_add(sum, data, out, npix, &c, simd);
+            clip_head = c.head;
+            clipped += c.clipped;
+        }
+        else
+            stack_add(sum, data, out, npix, simd);
+        if (out != NULL)
+        {
+            // the leaving frame went in clipped: put back what was taken off it
+            stack_entry *e = &win[win_tail];
+            for (uint64_t k = e->clip_start; k < e->clip_end; k++)
+            {
+                const stack_clip *cl = &clip_log[k % STACK_CLIP_POOL];
+                sum[cl->idx] += cl->delta;
+            }
+            clip_tail = e->clip_end;
+            win_tail = (win_tail + 1) % cfg.window;
+            n--;
+        }
+        if (cfg.mode == STACK_SLIDING)
+        {
+            // the slot of the frame that just left, if the window was full
+            unsigned k = (win_tail + n) % cfg.window;
+            memcpy(win_frames + k * npix, data, npix * sizeof(unsigned short));
+            win[k].clip_start = start;
+            win[k].clip_end = clip_head;
+        }
+        n++;
+        added++;
+        return true;
+    }
+    /**
+     * @brief Mean of the stack, rounded to 16 bits
+     *
+     * @param dst width x height pixels
+     */
+    void mean(unsigned short *dst, bool simd = true) const
+    {
+        if (n > 0)
+            stack_mean(sum, (size_t)width * height, 1.0f / n, dst, simd);
+    }
+};
+
+#endif // FRAME_STACK_H_
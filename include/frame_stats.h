@@ -0,0 +1,295 @@
+/**
+ * @file frame_stats.h
+ * @brief Single pass statistics of a 16 bit frame: min, max, mean,
+ * variance, saturated and dark pixel counts and a coarse histogram
+ *
+ * The frame is processed in blocks small enough to stay in L1: a SSE2 or
+ * NEON pass over a block accumulates min/max, sum, sum of squares and the
+ * saturated/dark counts, then the histogram is counted from the same block
+ * while it is still in cache, so the frame is read from memory once. The
+ * histogram only needs to place percentiles to a bin, so like the preview
+ * stretch it counts every FRAME_STATS_HIST_STRIDE-th pixel: counting them
+ * all cost twice the SIMD pass.
+ * Computed once per frame by the analysis stage and reused by exposure
+ * control, the preview stretch and the telemetry sent to clients.
+ *
+ */
+#ifndef FRAME_STATS_H_
+#define FRAME_STATS_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define FRAME_STATS_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FRAME_STATS_NEON 1
+#endif
+
+#define FRAME_STATS_SATURATED 65535
+#ifndef FRAME_STATS_DARK
+#define FRAME_STATS_DARK 2000 // pixels below this are dark, as checkDark() counts them
+#endif
+#define FRAME_STATS_HIST_SHIFT 6 // histogram bins are 64 ADU wide
+#define FRAME_STATS_BINS (65536 >> FRAME_STATS_HIST_SHIFT)
+#define FRAME_STATS_BLOCK 4096 // pixels per block, 8 kB
+#ifndef FRAME_STATS_HIST_STRIDE
+#define FRAME_STATS_HIST_STRIDE 16 // pixels sampled for the histogram, divides FRAME_STATS_BLOCK
+#endif
+
+typedef struct
+{
+    unsigned long long n; // pixels
+    unsigned short min;
+    unsigned short max;
+    double mean;
+    double var;
+    unsigned long long saturated; // pixels at FRAME_STATS_SATURATED
+    unsigned long long dark;      // pixels below dark_threshold
+    unsigned short dark_threshold;
+    unsigned long long hist_n;       // pixels counted in hist
+    uint32_t hist[FRAME_STATS_BINS]; // pixel >> FRAME_STATS_HIST_SHIFT, every FRAME_STATS_HIST_STRIDE-th pixel
+} frame_stats;
+
+/**
+ * @brief Running sums of a frame. The SIMD kernels sum pixel - bias so that
+ * squares fit their lanes, the variance does not depend on it.
+ *
+ */
+typedef struct
+{
+    unsigned short min, max;
+    int64_t sum;    // of pixel - bias
+    uint64_t sumsq; // of (pixel - bias)^2
+    uint64_t saturated, dark;
+} frame_sums;
+
+static inline void frame_sums_scalar(const unsigned short *src, size_t n, unsigned short dark, frame_sums *s)
+{
+    uint64_t sum = 0, sumsq = 0, sat = 0, drk = 0;
+    unsigned short mn = s->min, mx = s->max;
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned v = src[i];
+        mn = v < mn ? v : mn;
+        mx = v > mx ? v : mx;
+        sum += v;
+        sumsq += (uint64_t)v * v;
+        sat += v == FRAME_STATS_SATURATED;
+        drk += v < dark;
+    }
+    s->min = mn;
+    s->max = mx;
+    s->sum += sum;
+    s->sumsq += sumsq;
+    s->saturated += sat;
+    s->dark += drk;
+}
+
+#ifdef FRAME_STATS_X86
+/* bias 32768: pixels become signed 16 bit, so signed min/max, compare and
+ * multiply-add apply, and a pair of squares is at most 2^31 */
+static inline void frame_sums_sse2(const unsigned short *src, size_t n, unsigned short dark, frame_sums *s)
+{
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i vsat = _mm_set1_epi16((short)(FRAME_STATS_SATURATED ^ 0x8000));
+    const __m128i vdark = _mm_set1_epi16((short)(dark ^ 0x8000));
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vmn = _mm_set1_epi16((short)((s->min) ^ 0x8000)), vmx = _mm_set1_epi16((short)((s->max) ^ 0x8000));
+    __m128i vsum = zero, vsq = zero, vcnt_sat = zero, vcnt_dark = zero;
+    size_t i = 0;
+    // 32 bit sums and 16 bit counts are safe for a block, see FRAME_STATS_BLOCK
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), bias);
+        vmn = _mm_min_epi16(vmn, a);
+        vmx = _mm_max_epi16(vmx, a);
+        vsum = _mm_add_epi32(vsum, _mm_madd_epi16(a, ones));
+        __m128i sq = _mm_madd_epi16(a, a); // unsigned 32 bit
+        vsq = _mm_add_epi64(vsq, _mm_add_epi64(_mm_unpacklo_epi32(sq, zero), _mm_unpackhi_epi32(sq, zero)));
+        vcnt_sat = _mm_sub_epi16(vcnt_sat, _mm_cmpeq_epi16(a, vsat));
+        vcnt_dark = _mm_sub_epi16(vcnt_dark, _mm_cmplt_epi16(a, vdark));
+    }
+    int32_t sums[4];
+    uint64_t sqs[2];
+    uint16_t tmn[8], tmx[8], csat[8], cdark[8];
+    _mm_storeu_si128((__m128i *)sums, vsum);
+    _mm_storeu_si128((__m128i *)sqs, vsq);
+    _mm_storeu_si128((__m128i *)tmn, _mm_xor_si128(vmn, bias));
+    _mm_storeu_si128((__m128i *)tmx, _mm_xor_si128(vmx, bias));
+    _mm_storeu_si128((__m128i *)csat, vcnt_sat);
+    _mm_storeu_si128((__m128i *)cdark, vcnt_dark);
+    for (int k = 0; k < 8; k++)
+    {
+        s->min = tmn[k] < s->min ? tmn[k] : s->min;
+        s->max = tmx[k] > s->max ? tmx[k] : s->max;
+        s->saturated += csat[k];
+        s->dark += cdark[k];
+    }
+    s->sum += (int64_t)sums[0] + sums[1] + sums[2] + sums[3];
+    s->sumsq += sqs[0] + sqs[1];
+    // tail, with the same bias
+    for (; i < n; i++)
+    {
+        unsigned v = src[i];
+        int b = (int)v - 32768;
+        s->min = v < s->min ? v : s->min;
+        s->max = v > s->max ? v : s->max;
+        s->sum += b;
+        s->sumsq += (uint64_t)((int64_t)b * b);
+        s->saturated += v == FRAME_STATS_SATURATED;
+        s->dark += v < dark;
+    }
+}
+#endif // FRAME_STATS_X86
+
+#ifdef FRAME_STATS_NEON
+static inline void frame_sums_neon(const unsigned short *src, size_t n, unsigned short dark, frame_sums *s)
+{
+    const uint16x8_t vdark = vdupq_n_u16(dark);
+    const uint16x8_t vsat = vdupq_n_u16(FRAME_STATS_SATURATED);
+    uint16x8_t vmn = vdupq_n_u16(s->min), vmx = vdupq_n_u16(s->max);
+    uint32x4_t vsum = vdupq_n_u32(0);
+    uint64x2_t vsq = vdupq_n_u64(0);
+    uint16x8_t vcnt_sat = vdupq_n_u16(0), vcnt_dark = vdupq_n_u16(0);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t a = vld1q_u16(src + i);
+        vmn = vminq_u16(vmn, a);
+        vmx = vmaxq_u16(vmx, a);
+        vsum = vpadalq_u16(vsum, a);
+        vsq = vpadalq_u32(vsq, vmull_u16(vget_low_u16(a), vget_low_u16(a)));
+        vsq = vpadalq_u32(vsq, vmull_u16(vget_high_u16(a), vget_high_u16(a)));
+        vcnt_sat = vsubq_u16(vcnt_sat, vceqq_u16(a, vsat));
+        vcnt_dark = vsubq_u16(vcnt_dark, vcltq_u16(a, vdark));
+    }
+    uint16_t tmn[8], tmx[8], csat[8], cdark[8];
+    vst1q_u16(tmn, vmn);
+    vst1q_u16(tmx, vmx);
+    vst1q_u16(csat, vcnt_sat);
+    vst1q_u16(cdark, vcnt_dark);
+    for (int k = 0; k < 8; k++)
+    {
+        s->min = tmn[k] < s->min ? tmn[k] : s->min;
+        s->max = tmx[k] > s->max ? tmx[k] : s->max;
+        s->saturated += csat[k];
+        s->dark += cdark[k];
+    }
+    s->sum += vgetq_lane_u32(vsum, 0) + (uint64_t)vgetq_lane_u32(vsum, 1) + vgetq_lane_u32(vsum, 2) + vgetq_lane_u32(vsum, 3);
+    s->sumsq += vgetq_lane_u64(vsq, 0) + vgetq_lane_u64(vsq, 1);
+    frame_sums_scalar(src + i, n - i, dark, s);
+}
+#endif // FRAME_STATS_NEON
+
+/**
+ * @brief Bias of the sums computed by the kernel in use
+ *
+ */
+static inline int frame_sums_bias(bool simd)
+{
+#ifdef FRAME_STATS_X86
+    return simd ? 32768 : 0;
+#else
+    (void)simd;
+    return 0;
+#endif
+}
+
+/**
+ * @brief Compute the statistics of a frame in one pass
+ *
+ * @param data 16 bit pixels
+ * @param n Number of pixels
+ * @param st Output
+ * @param dark Dark threshold
+ * @param simd Use the SSE2/NEON kernel when available
+ */
+static inline void frame_stats_compute(const unsigned short *data, size_t n, frame_stats *st, unsigned short dark = FRAME_STATS_DARK, bool simd = true)
+{
+    frame_sums s = {65535, 0, 0, 0, 0, 0};
+    memset(st->hist, 0x0, sizeof(st->hist));
+    for (size_t b = 0; b < n; b += FRAME_STATS_BLOCK)
+    {
+        const unsigned short *blk = data + b;
+        size_t len = n - b < FRAME_STATS_BLOCK ? n - b : FRAME_STATS_BLOCK;
+#if defined(FRAME_STATS_X86)
+        if (simd)
+            frame_sums_sse2(blk, len, dark, &s);
+        else
+            frame_sums_scalar(blk, len, dark, &s);
+#elif defined(FRAME_STATS_NEON)
+        if (simd)
+            frame_sums_neon(blk, len, dark, &s);
+        else
+            frame_sums_scalar(blk, len, dark, &s);
+#else
+        frame_sums_scalar(blk, len, dark, &s);
+#endif
+        for (size_t i = 0; i < len; i += FRAME_STATS_HIST_STRIDE) // the block is still in L1
+            st->hist[blk[i] >> FRAME_STATS_HIST_SHIFT]++;
+    }
+    st->n = n;
+    st->hist_n = (n + FRAME_STATS_HIST_STRIDE - 1) / FRAME_STATS_HIST_STRIDE;
+    st->min = n ? s.min : 0;
+    st->max = s.max;
+    st->saturated = s.saturated;
+    st->dark = s.dark;
+    st->dark_threshold = dark;
+    if (n > 0)
+    {
+        double m = (double)s.sum / n; // mean of pixel - bias
+        st->mean = m + frame_sums_bias(simd);
+        st->var = (double)s.sumsq / n - m * m;
+        if (st->var < 0)
+            st->var = 0;
+    }
+    else
+    {
+        st->mean = 0;
+        st->var = 0;
+    }
+}
+
+/**
+ * @brief Percentile from the coarse histogram, interpolated inside the bin
+ * and clamped to [min, max], using the same index convention as
+ * pixel_histogram::percentile(). Accurate to a bin (64 ADU) plus the
+ * sampling error of the counted pixels.
+ *
+ * @param st Statistics
+ * @param pct Percentile, 0 to 100
+ * @return double Pixel value
+ */
+static inline double frame_stats_percentile(const frame_stats *st, double pct)
+{
+    if (st->hist_n == 0)
+        return 0;
+    pct = pct < 0 ? 0 : (pct > 100 ? 100 : pct);
+    double k = floor(pct * (st->hist_n - 1) / 100.0);
+    unsigned long long cum = 0;
+    for (unsigned b = 0; b < FRAME_STATS_BINS; b++)
+    {
+        if (st->hist[b] == 0 || cum + st->hist[b] <= k)
+        {
+            cum += st->hist[b];
+            continue;
+        }
+        double v = ((double)b + (k - cum + 0.5) / st->hist[b]) * (1 << FRAME_STATS_HIST_SHIFT);
+        return v < st->min ? st->min : (v > st->max ? st->max : v);
+    }
+    return st->max;
+}
+
+static inline double frame_stats_stdev(const frame_stats *st)
+{
+    return sqrt(st->var);
+}
+
+#endif // FRAME_STATS_H_
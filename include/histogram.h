@@ -0,0 +1,181 @@
+/**
+ * @file histogram.h
+ * @brief Linear time percentile engine for 16-bit frames
+ *
+ */
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/**
+ * @brief 65536-bin histogram of a 16-bit frame, used to look up order
+ * statistics (median, percentiles) without sorting or modifying the frame.
+ *
+ * The histogram can be built from every pixel (exact), or from every
+ * stride-th pixel, in which case the percentile is estimated from the
+ * subsample and error_bound() reports how far off it can be.
+ *
+ */
+class pixel_histogram
+{
+public:
+    /**
+     * @brief Number of bins, one per 16-bit value
+     *
+     */
+    static const unsigned nbins = 65536;
+    /**
+     * @brief Confidence level of the reported error bound
+     *
+     */
+    static constexpr double confidence = 0.99;
+    /**
+     * @brief Bin counts
+     *
+     */
+    uint32_t *bins;
+    /**
+     * @brief Number of pixels in the frame the histogram was built from
+     *
+     */
+    unsigned long long size;
+    /**
+     * @brief Number of pixels actually counted (size / stride, rounded up)
+     *
+     */
+    unsigned long long count;
+    /**
+     * @brief Sampling stride used in the last call to compute()
+     *
+     */
+    unsigned stride;
+
+    pixel_histogram()
+    {
+        bins = (uint32_t *)calloc(nbins, sizeof(uint32_t));
+        size = 0;
+        count = 0;
+        stride = 1;
+    }
+    ~pixel_histogram()
+    {
+        free(bins);
+    }
+    pixel_histogram(const pixel_histogram &) = delete;
+    pixel_histogram &operator=(const pixel_histogram &) = delete;
+    /**
+     * @brief Build the histogram of a frame
+     *
+     * @param data 16-bit frame, not modified
+     * @param size Number of pixels in the frame
+     * @param stride Count every stride-th pixel only (1 = exact)
+     */
+    void compute(const unsigned short *data, unsigned long long size, unsigned stride = 1)
+    {
+        if (stride == 0)
+            stride = 1;
+        memset(bins, 0x0, nbins * sizeof(uint32_t));
+        unsigned long long i = 0;
+        if (stride == 1)
+        {
+            for (; i + 4 <= size; i += 4) // unrolled, independent increments
+            {
+                bins[data[i]]++;
+                bins[data[i + 1]]++;
+                bins[data[i + 2]]++;
+                bins[data[i + 3]]++;
+            }
+        }
+        for (; i < size; i += stride)
+            bins[data[i]]++;
+        this->size = size;
+        this->count = size ? (size + stride - 1) / stride : 0;
+        this->stride = stride;
+    }
+    /**
+     * @brief Value that would be at index k if the frame were sorted in
+     * ascending order (i.e. picdata[k] after qsort). For a subsampled
+     * histogram the index is rescaled to the subsample.
+     *
+     * @param k Index into the sorted frame, 0 <= k < size
+     * @return unsigned short Pixel value
+     */
+    unsigned short at(unsigned long long k) const
+    {
+        if (count == 0)
+            return 0;
+        if (k >= size)
+            k = size - 1;
+        if (stride > 1)
+            k = (unsigned long long)((double)k * count / size);
+        if (k >= count)
+            k = count - 1;
+        unsigned long long cum = 0;
+        for (unsigned v = 0; v < nbins; v++)
+        {
+            cum += bins[v];
+            if (cum > k)
+                return v;
+        }
+        return nbins - 1;
+    }
+    /**
+     * @brief Percentile of the frame, using the same index convention as the
+     * sorted-array lookup, floor(pct * (size - 1) / 100)
+     *
+     * @param pct Percentile, 0 to 100
+     * @return unsigned short Pixel value
+     */
+    unsigned short percentile(double pct) const
+    {
+        if (pct < 0)
+            pct = 0;
+        else if (pct > 100)
+            pct = 100;
+        return at((unsigned long long)floor(pct * (size - 1) / 100.0));
+    }
+    /**
+     * @brief Median of the frame
+     *
+     * @return double Median pixel value
+     */
+    double median() const
+    {
+        if (size & 0x01)
+            return at(size / 2);
+        return (at(size / 2 - 1) + at(size / 2)) * 0.5;
+    }
+    /**
+     * @brief Worst case rank error of a subsampled percentile, as a fraction
+     * of the frame (Dvoretzky-Kiefer-Wolfowitz bound at the confidence level).
+     * Zero when every pixel was counted.
+     *
+     * @return double Rank error, 0 to 1
+     */
+    double error_bound() const
+    {
+        if (stride <= 1 || count == 0)
+            return 0;
+        return sqrt(log(2.0 / (1.0 - confidence)) / (2.0 * count));
+    }
+    /**
+     * @brief Range of pixel values the true percentile lies in, given the
+     * sampling error. lo == hi for an exact histogram.
+     *
+     * @param pct Percentile, 0 to 100
+     * @param lo Lower bound of the percentile value
+     * @param hi Upper bound of the percentile value
+     */
+    void percentile_bounds(double pct, unsigned short *lo, unsigned short *hi) const
+    {
+        double eps = error_bound() * 100.0;
+        *lo = percentile(pct - eps);
+        *hi = percentile(pct + eps);
+    }
+};
+
+#endif // HISTOGRAM_H_
@@ -0,0 +1,257 @@
+/**
+ * @file jpeg_image.h
+ * @brief Session lifetime grayscale JPEG encoder for 16 bit camera frames
+ *
+ * Frames are mapped to 8 bits with the stretch selected in tone_map.h.
+ * The compressor, its parameters and the 8 bit scratch rows are kept
+ * between frames. The encoded stream is written straight into a caller
+ * owned malloc'd buffer (e.g. encoded_frame::data), which is grown with
+ * realloc only when a frame does not fit.
+ *
+ */
+#ifndef JPEG_IMAGE_H_
+#define JPEG_IMAGE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+
+#include <tone_map.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+#include <jpeglib.h>
+#include <jerror.h>
+#ifdef __cplusplus
+}
+#endif
+
+#ifndef JPEG_BATCH_ROWS
+#define JPEG_BATCH_ROWS 16 // scanlines converted and handed to libjpeg per call, two MCU rows
+#endif
+
+#define JPEG_MIN_OUT_SIZE (64 * 1024) // smallest output buffer handed to libjpeg
+
+class jpeg_image
+{
+private:
+    /**
+     * @brief libjpeg destination writing into a growable caller buffer
+     *
+     */
+    typedef struct
+    {
+        struct jpeg_destination_mgr pub;
+        unsigned char **buf;
+        size_t *alloc;
+        jpeg_image *self;
+    } grow_dest;
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    grow_dest dest;
+    unsigned char *rows; // JPEG_BATCH_ROWS rows of 8 bit data
+    size_t rows_alloc;
+    unsigned width, height;
+    int quality;
+
+    static void init_destination(j_compress_ptr cinfo)
+    {
+        grow_dest *dest = (grow_dest *)cinfo->dest;
+        dest->pub.next_output_byte = *dest->buf;
+        dest->pub.free_in_buffer = *dest->alloc;
+    }
+
+    static boolean empty_output_buffer(j_compress_ptr cinfo)
+    {
+        // libjpeg wants the whole buffer flushed, i.e. it is full
+        grow_dest *dest = (grow_dest *)cinfo->dest;
+        size_t used = *dest->alloc;
+        size_t size = used * 2;
+        unsigned char *tmp = (unsigned char *)realloc(*dest->buf, size);
+        if (tmp == NULL)
+            ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+        *dest->buf = tmp;
+        *dest->alloc = size;
+        dest->self->grows++;
+        dest->pub.next_output_byte = tmp + used;
+        dest->pub.free_in_buffer = size - used;
+        return TRUE;
+    }
+
+    static void term_destination(j_compress_ptr cinfo)
+    {
+    }
+
+    static std::atomic<int> &default_quality()
+    {
+        static std::atomic<int> q(70);
+        return q;
+    }
+
+public:
+    /**
+     * @brief 16 to 8 bit stretch applied to the frames
+     *
+     */
+    tone_map tmap;
+    /**
+     * @brief Number of times a buffer (output or scratch) had to be allocated
+     * or grown
+     *
+     */
+    unsigned long long grows;
+    /**
+     * @brief Frames encoded
+     *
+     */
+    unsigned long long frames;
+
+    jpeg_image()
+    {
+        cinfo.err = jpeg_std_error(&jerr);
+        jpeg_create_compress(&cinfo);
+        memset(&dest, 0x0, sizeof(dest));
+        dest.pub.init_destination = init_destination;
+        dest.pub.empty_output_buffer = empty_output_buffer;
+        dest.pub.term_destination = term_destination;
+        dest.self = this;
+        cinfo.dest = &dest.pub;
+        rows = NULL;
+        rows_alloc = 0;
+        width = 0;
+        height = 0;
+        quality = -1;
+        grows = 0;
+        frames = 0;
+    }
+    ~jpeg_image()
+    {
+        cinfo.dest = NULL; // not allocated by libjpeg
+        jpeg_destroy_compress(&cinfo);
+        free(rows);
+    }
+    jpeg_image(const jpeg_image &) = delete;
+    jpeg_image &operator=(const jpeg_image &) = delete;
+    /**
+     * @brief Stretch a 16 bit frame to 8 bits and encode it as a grayscale JPEG
+     *
+     * @param data 16 bit pixels, row major
+     * @param width Frame width
+     * @param height Frame height
+     * @param buf Output buffer allocated with malloc (may be NULL), reallocated if the image does not fit
+     * @param alloc Allocated size of the output buffer, updated when it grows
+     * @param st Statistics of the frame for the stretch, NULL to measure them
+     * @return int Size of the JPEG image in bytes, -1 on allocation failure
+     */
+    int encode(const unsigned short *data, unsigned width, unsigned height, unsigned char **buf, size_t *alloc, const frame_stats *st = NULL)
+    {
+        tmap.prepare(data, (unsigned long long)width * height, st);
+        int sz = encode(tmap, get_jpeg_quality(), data, width, height, buf, alloc);
+        dump_test_image(*buf, sz);
+        return sz;
+    }
+    /**
+     * @brief Encode with a stretch prepared elsewhere, e.g. one strip of a
+     * frame whose black/white points were measured on the whole frame
+     *
+     * @param map Prepared tone map
+     * @param quality JPEG quality
+     * @param data 16 bit pixels, row major
+     * @param width Frame width
+     * @param height Frame height
+     * @param buf Output buffer allocated with malloc (may be NULL), reallocated if the image does not fit
+     * @param alloc Allocated size of the output buffer, updated when it grows
+     * @return int Size of the JPEG image in bytes, -1 on allocation failure
+     */
+    int encode(const tone_map &map, int quality, const unsigned short *data, unsigned width, unsigned height, unsigned char **buf, size_t *alloc)
+    {
+        if (rows_alloc < (size_t)width * JPEG_BATCH_ROWS)
+        {
+            unsigned char *tmp = (unsigned char *)realloc(rows, (size_t)width * JPEG_BATCH_ROWS);
+            if (tmp == NULL)
+                return -1;
+            rows = tmp;
+            rows_alloc = (size_t)width * JPEG_BATCH_ROWS;
+            grows++;
+        }
+        if (*buf == NULL || *alloc < JPEG_MIN_OUT_SIZE)
+        {
+            unsigned char *tmp = (unsigned char *)realloc(*buf, JPEG_MIN_OUT_SIZE);
+            if (tmp == NULL)
+                return -1;
+            *buf = tmp;
+            *alloc = JPEG_MIN_OUT_SIZE;
+            grows++;
+        }
+        dest.buf = buf;
+        dest.alloc = alloc;
+        if (width != this->width || height != this->height || quality != this->quality)
+        {
+            cinfo.image_width = width;
+            cinfo.image_height = height;
+            cinfo.input_components = 1;
+            cinfo.in_color_space = JCS_GRAYSCALE;
+            jpeg_set_defaults(&cinfo);
+            jpeg_set_quality(&cinfo, quality, TRUE);
+            this->width = width;
+            this->height = height;
+            this->quality = quality;
+        }
+        jpeg_start_compress(&cinfo, TRUE);
+        JSAMPROW row_pointer[JPEG_BATCH_ROWS];
+        for (unsigned i = 0; i < JPEG_BATCH_ROWS; i++)
+            row_pointer[i] = rows + (size_t)i * width;
+        while (cinfo.next_scanline < height)
+        {
+            unsigned nrows = height - cinfo.next_scanline;
+            if (nrows > JPEG_BATCH_ROWS)
+                nrows = JPEG_BATCH_ROWS;
+            // convert to 8 bit grayscale only the rows about to be compressed, they stay in cache
+            map.apply(data + (size_t)cinfo.next_scanline * width, rows, (size_t)nrows * width);
+            (void)jpeg_write_scanlines(&cinfo, row_pointer, nrows);
+        }
+        jpeg_finish_compress(&cinfo);
+        frames++;
+        return (int)(*alloc - dest.pub.free_in_buffer);
+    }
+    /**
+     * @brief Save encoded frames to testimg/ when built with TEST_JPEG_IMG
+     *
+     */
+    static void dump_test_image(const unsigned char *buf, int sz)
+    {
+#ifdef TEST_JPEG_IMG
+        static int imgnum = 0;
+        char fname[30];
+        snprintf(fname, 30, "testimg/i%d.jpg", imgnum++);
+        unlink(fname);
+        FILE *fp = fopen(fname, "wb");
+        if (fp != NULL)
+        {
+            if (sz > 0)
+                fwrite(buf, 1, sz, fp);
+            fclose(fp);
+        }
+#endif //TEST_JPEG_IMG
+    }
+    static int get_jpeg_quality()
+    {
+        return default_quality();
+    }
+    static void set_jpeg_quality(int q)
+    {
+        if (q < 0)
+            q = 70;
+        else if (q > 100)
+            q = 100;
+        default_quality() = q;
+    }
+};
+
+#endif // JPEG_IMAGE_H_
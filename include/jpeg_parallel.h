@@ -0,0 +1,333 @@
+/**
+ * @file jpeg_parallel.h
+ * @brief Multithreaded JPEG encoding of a frame split in horizontal strips
+ *
+ * Every strip is a whole number of MCU rows and is encoded as a separate
+ * JPEG by one of the workers, with the tone map and quality of the whole
+ * frame. Since every strip starts with fresh DC predictions, its entropy
+ * coded data is exactly one restart interval of the full image: the strips
+ * are joined behind the header of the first one, with the frame height
+ * patched into SOF, a DRI marker and RSTn markers between strips. The
+ * result is a single baseline JPEG any decoder (libjpeg included) reads.
+ *
+ */
+#ifndef JPEG_PARALLEL_H_
+#define JPEG_PARALLEL_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+
+#include <jpeg_image.h>
+
+#ifndef JPEG_STRIPS_PER_THREAD
+#define JPEG_STRIPS_PER_THREAD 4 // strips handed to each worker on average, for load balance
+#endif
+
+#define JPEG_MCU_ROWS 8          // rows in an MCU of a grayscale image
+#define JPEG_MAX_RESTART 65535   // DRI is a 16 bit count of MCUs
+
+class jpeg_parallel
+{
+private:
+    typedef struct
+    {
+        unsigned char *buf;
+        size_t alloc;
+        int size;
+    } strip_buf;
+
+    unsigned nthreads;
+    jpeg_image *encoders;
+    pthread_t *threads;
+    strip_buf *strips;
+    unsigned strips_alloc;
+
+    // current job
+    const unsigned short *job_data;
+    unsigned job_width, job_height, job_rows, job_nstrips;
+    int job_quality;
+    std::atomic<unsigned> next_strip;
+    std::atomic<bool> job_failed;
+    unsigned long long job_gen;
+    unsigned active;
+    bool quit;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond, done_cond;
+
+    typedef struct
+    {
+        jpeg_parallel *self;
+        unsigned idx;
+    } worker_arg;
+    worker_arg *args;
+
+    void run_strips(unsigned worker)
+    {
+        unsigned s;
+        while ((s = next_strip++) < job_nstrips)
+        {
+            unsigned row = s * job_rows;
+            unsigned rows = job_height - row < job_rows ? job_height - row : job_rows;
+            strips[s].size = encoders[worker].encode(tmap, job_quality, job_data + (size_t)row * job_width, job_width, rows, &(strips[s].buf), &(strips[s].alloc));
+            if (strips[s].size < 0)
+                job_failed = true;
+        }
+    }
+
+    static void *worker_fcn(void *_arg)
+    {
+        worker_arg *arg = (worker_arg *)_arg;
+        jpeg_parallel *self = arg->self;
+        unsigned long long seen = 0;
+        while (true)
+        {
+            pthread_mutex_lock(&self->lock);
+            while (!self->quit && self->job_gen == seen)
+                pthread_cond_wait(&self->start_cond, &self->lock);
+            if (self->quit)
+            {
+                pthread_mutex_unlock(&self->lock);
+                break;
+            }
+            seen = self->job_gen;
+            pthread_mutex_unlock(&self->lock);
+            self->run_strips(arg->idx);
+            pthread_mutex_lock(&self->lock);
+            if (--self->active == 0)
+                pthread_cond_signal(&self->done_cond);
+            pthread_mutex_unlock(&self->lock);
+        }
+        return NULL;
+    }
+
+    /**
+     * @brief Locate the SOF0 and SOS segments of a JPEG produced by libjpeg
+     *
+     * @param buf JPEG
+     * @param size JPEG size
+     * @param sof Offset of the SOF0 marker
+     * @param sos Offset of the SOS marker
+     * @param data Offset of the entropy coded data following SOS
+     * @return true Both segments found
+     */
+    static bool find_segments(const unsigned char *buf, int size, int *sof, int *sos, int *data)
+    {
+        *sof = -1;
+        int pos = 2; // past SOI
+        while (pos + 4 <= size && buf[pos] == 0xff)
+        {
+            unsigned char marker = buf[pos + 1];
+            int len = (buf[pos + 2] << 8) | buf[pos + 3];
+            if (marker == 0xc0)
+                *sof = pos;
+            else if (marker == 0xda)
+            {
+                *sos = pos;
+                *data = pos + 2 + len;
+                return *sof >= 0 && *data <= size - 2;
+            }
+            pos += 2 + len;
+        }
+        return false;
+    }
+
+    static bool append(unsigned char **buf, size_t *alloc, size_t *pos, const void *data, size_t len)
+    {
+        if (*pos + len > *alloc)
+        {
+            size_t size = *alloc > 0 ? *alloc : JPEG_MIN_OUT_SIZE;
+            while (size < *pos + len)
+                size *= 2;
+            unsigned char *tmp = (unsigned char *)realloc(*buf, size);
+            if (tmp == NULL)
+                return false;
+            *buf = tmp;
+            *alloc = size;
+        }
+        memcpy(*buf + *pos, data, len);
+        *pos += len;
+        return true;
+    }
+
+    /**
+     * @brief Join the encoded strips into one JPEG with restart markers
+     *
+     */
+    int join(unsigned char **buf, size_t *alloc)
+    {
+        int sof, sos, data;
+        if (!find_segments(strips[0].buf, strips[0].size, &sof, &sos, &data))
+            return -1;
+        size_t pos = 0;
+        // header of the first strip, up to SOS
+        if (!append(buf, alloc, &pos, strips[0].buf, sos))
+            return -1;
+        (*buf)[sof + 5] = job_height >> 8; // SOF: FF C0 len(2) precision(1) height(2) width(2)
+        (*buf)[sof + 6] = job_height & 0xff;
+        unsigned restart = (job_rows / JPEG_MCU_ROWS) * ((job_width + 7) / 8);
+        unsigned char dri[] = {0xff, 0xdd, 0x00, 0x04, (unsigned char)(restart >> 8), (unsigned char)(restart & 0xff)};
+        if (!append(buf, alloc, &pos, dri, sizeof(dri)))
+            return -1;
+        if (!append(buf, alloc, &pos, strips[0].buf + sos, data - sos))
+            return -1;
+        for (unsigned s = 0; s < job_nstrips; s++)
+        {
+            int ssof, ssos, sdata;
+            if (!find_segments(strips[s].buf, strips[s].size, &ssof, &ssos, &sdata))
+                return -1;
+            // entropy coded data, without the EOI marker
+            if (!append(buf, alloc, &pos, strips[s].buf + sdata, strips[s].size - 2 - sdata))
+                return -1;
+            unsigned char rst[] = {0xff, (unsigned char)(s + 1 < job_nstrips ? 0xd0 + (s & 7) : 0xd9)};
+            if (!append(buf, alloc, &pos, rst, sizeof(rst)))
+                return -1;
+        }
+        return (int)pos;
+    }
+
+public:
+    /**
+     * @brief Stretch shared by all strips of a frame
+     *
+     */
+    tone_map tmap;
+
+    /**
+     * @brief Construct a new parallel encoder
+     *
+     * @param nthreads Number of threads encoding strips, including the calling one (0: one per online CPU)
+     */
+    jpeg_parallel(unsigned nthreads = 0)
+    {
+        if (nthreads == 0)
+        {
+            long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+            nthreads = ncpu > 0 ? ncpu : 1;
+        }
+        this->nthreads = nthreads;
+        encoders = new jpeg_image[nthreads];
+        strips = NULL;
+        strips_alloc = 0;
+        job_gen = 0;
+        active = 0;
+        quit = false;
+        job_failed = false;
+        next_strip = 0;
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&start_cond, NULL);
+        pthread_cond_init(&done_cond, NULL);
+        threads = new pthread_t[nthreads];
+        args = new worker_arg[nthreads];
+        // worker 0 is the thread calling encode()
+        for (unsigned i = 1; i < nthreads; i++)
+        {
+            args[i].self = this;
+            args[i].idx = i;
+            if (pthread_create(&threads[i], NULL, worker_fcn, &args[i]) != 0)
+            {
+                this->nthreads = i; // run with the workers we have
+                break;
+            }
+        }
+    }
+    ~jpeg_parallel()
+    {
+        pthread_mutex_lock(&lock);
+        quit = true;
+        pthread_cond_broadcast(&start_cond);
+        pthread_mutex_unlock(&lock);
+        for (unsigned i = 1; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+        for (unsigned s = 0; s < strips_alloc; s++)
+            free(strips[s].buf);
+        free(strips);
+        delete[] encoders;
+        delete[] threads;
+        delete[] args;
+        pthread_mutex_destroy(&lock);
+        pthread_cond_destroy(&start_cond);
+        pthread_cond_destroy(&done_cond);
+    }
+    jpeg_parallel(const jpeg_parallel &) = delete;
+    jpeg_parallel &operator=(const jpeg_parallel &) = delete;
+    unsigned threads_used() const
+    {
+        return nthreads;
+    }
+    /**
+     * @brief Stretch a 16 bit frame to 8 bits and encode it as a grayscale
+     * JPEG, splitting the work between the threads. Same interface as
+     * jpeg_image::encode().
+     *
+     * @param data 16 bit pixels, row major
+     * @param width Frame width
+     * @param height Frame height
+     * @param buf Output buffer allocated with malloc (may be NULL), reallocated if the image does not fit
+     * @param alloc Allocated size of the output buffer, updated when it grows
+     * @param st Statistics of the frame for the stretch, NULL to measure them
+     * @return int Size of the JPEG image in bytes, -1 on failure
+     */
+    int encode(const unsigned short *data, unsigned width, unsigned height, unsigned char **buf, size_t *alloc, const frame_stats *st = NULL)
+    {
+        tmap.prepare(data, (unsigned long long)width * height, st);
+        int quality = jpeg_image::get_jpeg_quality();
+        if (nthreads == 1 || width == 0 || height == 0)
+        {
+            int sz = encoders[0].encode(tmap, quality, data, width, height, buf, alloc);
+            jpeg_image::dump_test_image(*buf, sz);
+            return sz;
+        }
+        // strips of whole MCU rows, one restart interval each
+        unsigned blocks_per_row = (width + 7) / 8;
+        unsigned max_rows = (JPEG_MAX_RESTART / blocks_per_row) * JPEG_MCU_ROWS;
+        unsigned rows = (height + nthreads * JPEG_STRIPS_PER_THREAD - 1) / (nthreads * JPEG_STRIPS_PER_THREAD);
+        rows = (rows + JPEG_MCU_ROWS - 1) / JPEG_MCU_ROWS * JPEG_MCU_ROWS;
+        if (rows > max_rows)
+            rows = max_rows;
+        if (rows < JPEG_MCU_ROWS) // a single MCU row exceeds DRI, encode in one piece
+        {
+            int sz = encoders[0].encode(tmap, quality, data, width, height, buf, alloc);
+            jpeg_image::dump_test_image(*buf, sz);
+            return sz;
+        }
+        unsigned nstrips = (height + rows - 1) / rows;
+        if (nstrips > strips_alloc)
+        {
+            strip_buf *tmp = (strip_buf *)realloc(strips, nstrips * sizeof(strip_buf));
+            if (tmp == NULL)
+                return -1;
+            strips = tmp;
+            memset(strips + strips_alloc, 0x0, (nstrips - strips_alloc) * sizeof(strip_buf));
+            strips_alloc = nstrips;
+        }
+        job_data = data;
+        job_width = width;
+        job_height = height;
+        job_rows = rows;
+        job_nstrips = nstrips;
+        job_quality = quality;
+        job_failed = false;
+        next_strip = 0;
+        pthread_mutex_lock(&lock);
+        active = nthreads - 1;
+        job_gen++;
+        pthread_cond_broadcast(&start_cond);
+        pthread_mutex_unlock(&lock);
+        run_strips(0);
+        pthread_mutex_lock(&lock);
+        while (active > 0)
+            pthread_cond_wait(&done_cond, &lock);
+        pthread_mutex_unlock(&lock);
+        if (job_failed)
+            return -1;
+        int sz = join(buf, alloc);
+        jpeg_image::dump_test_image(*buf, sz);
+        return sz;
+    }
+};
+
+#endif // JPEG_PARALLEL_H_
@@ -0,0 +1,151 @@
+/**
+ * @file net_cmd.h
+ * @brief Binary command protocol from the clients to the camera server, and
+ * the acknowledgements sent back
+ *
+ * A command on the wire is
+ *   "CMDB" uint32 len uint32 id uint16 type uint16 flags payload[len]
+ * (net_cmd_hdr, then a packed payload struct of the type). The server parses
+ * commands from a reassembly buffer on its event loop, so commands split
+ * over several reads or merged into one are handled alike, applies each one
+ * as soon as it is complete and answers it with
+ *   "CACK" uint32 id uint16 type int16 status
+ * (net_cmd_ack) in the frame stream, between two frames. The id is chosen by
+ * the client and only echoed. When a client has NET_CMD_MAX_ACKS
+ * acknowledgements waiting, the server stops reading its commands until
+ * they are out: bursts are slowed down by TCP, never dropped.
+ *
+ * Clients that never send "CMDB" keep the old text commands, which are not
+ * acknowledged.
+ *
+ */
+#ifndef NET_CMD_H_
+#define NET_CMD_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define NET_CMD_MAGIC "CMDB"
+#define NET_ACK_MAGIC "CACK"
+
+#ifndef NET_CMD_MAX_PAYLOAD
+#define NET_CMD_MAX_PAYLOAD 256 // largest command payload, longer ones end the connection
+#endif
+#ifndef NET_CMD_MAX_ACKS
+#define NET_CMD_MAX_ACKS 256 // acknowledgements waiting for a client before its commands wait too
+#endif
+
+typedef struct __attribute__((packed))
+{
+    char magic[4]; // NET_CMD_MAGIC
+    uint32_t len;  // payload bytes
+    uint32_t id;   // echoed in the acknowledgement
+    uint16_t type; // NET_CMD_*
+    uint16_t flags; // 0
+} net_cmd_hdr;
+
+typedef struct __attribute__((packed))
+{
+    char magic[4]; // NET_ACK_MAGIC
+    uint32_t id;
+    uint16_t type;
+    int16_t status; // NET_ACK_*
+} net_cmd_ack;
+
+enum
+{
+    NET_CMD_PING = 0,            // no payload, acknowledged and nothing else
+    NET_CMD_JPEG_QUALITY = 1,    // int32 quality, 0 to 100
+    NET_CMD_STRETCH = 2,         // net_cmd_stretch
+    NET_CMD_PREVIEW_WIDTH = 3,   // int32 pixels, 0 for full resolution
+    NET_CMD_SET_ROI = 4,         // net_roi, sensor pixels, 0 size for the whole frame
+    NET_CMD_SAVE_FITS = 5,       // uint32 frames
+    NET_CMD_RECORDER_EXPORT = 6, // no payload
+    NET_CMD_SET_FORMAT = 7,      // uint32 NET_FORMAT_*
+    NET_CMD_STACK = 8,           // net_cmd_stack
+    NET_CMD_CALIB = 9,           // int32 calib_mode
+    NET_CMD_BIN = 10,            // net_cmd_bin
+    NET_NUM_CMDS
+};
+
+enum
+{
+    NET_ACK_OK = 0,
+    NET_ACK_UNKNOWN = -1,     // type not handled
+    NET_ACK_INVALID = -2,     // wrong payload length or value out of range
+    NET_ACK_BUSY = -3,        // already running
+    NET_ACK_UNAVAILABLE = -4, // disabled on this server
+};
+
+typedef struct __attribute__((packed))
+{
+    int32_t mode; // stretch_mode
+    float lo_pct;
+    float hi_pct;
+    float param; // gamma or asinh softening
+} net_cmd_stretch;
+
+typedef struct __attribute__((packed))
+{
+    int32_t mode; // stack_mode
+    uint32_t window;
+    float clip_sigma;
+} net_cmd_stack;
+
+typedef struct __attribute__((packed))
+{
+    int32_t mode; // bin_mode
+    float value;  // binning, frames per second or ms
+} net_cmd_bin;
+
+/**
+ * @brief Write a command into buf
+ *
+ * @return size_t Bytes of the command, 0 if it does not fit
+ */
+static inline size_t net_cmd_pack(void *buf, size_t size, uint16_t type, uint32_t id, const void *payload, uint32_t len)
+{
+    if (len > NET_CMD_MAX_PAYLOAD || size < sizeof(net_cmd_hdr) + len)
+        return 0;
+    net_cmd_hdr hdr;
+    memcpy(hdr.magic, NET_CMD_MAGIC, 4);
+    hdr.len = len;
+    hdr.id = id;
+    hdr.type = type;
+    hdr.flags = 0;
+    memcpy(buf, &hdr, sizeof(hdr));
+    if (len > 0)
+        memcpy((char *)buf + sizeof(hdr), payload, len);
+    return sizeof(hdr) + len;
+}
+
+/**
+ * @brief Send a command on a blocking socket
+ *
+ * @return false Not sent, see errno
+ */
+static inline bool net_cmd_send(int sock, uint16_t type, uint32_t id, const void *payload = NULL, uint32_t len = 0)
+{
+    char buf[sizeof(net_cmd_hdr) + NET_CMD_MAX_PAYLOAD];
+    size_t n = net_cmd_pack(buf, sizeof(buf), type, id, payload, len), sent = 0;
+    if (n == 0)
+    {
+        errno = EMSGSIZE;
+        return false;
+    }
+    while (sent < n)
+    {
+        ssize_t sz = send(sock, buf + sent, n - sent, MSG_NOSIGNAL);
+        if (sz < 0 && errno == EINTR)
+            continue;
+        if (sz <= 0)
+            return false;
+        sent += sz;
+    }
+    return true;
+}
+
+#endif // NET_CMD_H_
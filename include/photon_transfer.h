@@ -0,0 +1,269 @@
+/**
+ * @file photon_transfer.h
+ * @brief Photon transfer curve of an exposure sweep, built on the fly from
+ * the frames as they are read out
+ *
+ * Every frame adds its mean and spatial variance (frame_stats) to the
+ * point of its binning and exposure, and the half variance of its
+ * difference with the previous frame of the same point, which is the
+ * temporal noise without the fixed pattern (PRNU, hot pixels). Only the
+ * previous frame is kept.
+ *
+ * The fit of a binning takes the bias level from its two shortest
+ * exposures, extrapolated to zero (flats have signal even in the shortest
+ * one), and then
+ *
+ *   noise^2 = signal / gain + read_noise^2   (ADU, gain in e-/ADU)
+ *
+ * least squares over the points below PTC_LINEAR_MAX of the full well,
+ * which is the signal where the noise peaks (the curve rolls over as
+ * pixels saturate), or the largest signal if it never does. The read
+ * noise is that of the shortest exposure less its shot noise.
+ *
+ */
+#ifndef PHOTON_TRANSFER_H_
+#define PHOTON_TRANSFER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#include <frame_stats.h>
+
+#ifndef PTC_LINEAR_MAX
+#define PTC_LINEAR_MAX 0.7 // fraction of the full well the gain is fitted below
+#endif
+#ifndef PTC_MAX_SATURATED
+#define PTC_MAX_SATURATED 1e-4 // fraction of saturated pixels of a point used in the fit
+#endif
+
+typedef struct
+{
+    unsigned bin;
+    float exposure;   // s
+    unsigned frames;  // added
+    unsigned pairs;   // differences taken
+    double mean;      // ADU, over the frames
+    double var;       // ADU^2, spatial variance of a frame, averaged
+    double noise_var; // ADU^2, temporal: half the variance of a pair difference, averaged
+    double saturated; // fraction of the pixels, averaged
+} ptc_point;
+
+typedef struct
+{
+    unsigned bin;
+    unsigned points;      // in the fit
+    double offset;        // ADU, bias level
+    double gain;          // e-/ADU
+    double read_noise;    // e-
+    double full_well;     // e-
+    double full_well_adu; // ADU above the bias
+    bool rolled_over;     // the full well is the peak of the curve, not the last point
+} ptc_fit;
+
+/* sums of a - b and (a - b)^2 over the pixels unsaturated in both frames */
+static inline unsigned long long ptc_pair_sums(const unsigned short *a, const unsigned short *b, size_t n, int64_t *sum, uint64_t *sumsq)
+{
+    int64_t s = 0;
+    uint64_t s2 = 0;
+    unsigned long long m = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (a[i] == FRAME_STATS_SATURATED || b[i] == FRAME_STATS_SATURATED)
+            continue;
+        int64_t d = (int)a[i] - (int)b[i];
+        s += d;
+        s2 += d * d;
+        m++;
+    }
+    *sum = s;
+    *sumsq = s2;
+    return m;
+}
+
+class photon_transfer
+{
+private:
+    std::vector<ptc_point> pts;
+    std::vector<unsigned short> prev; // last frame, the pair of the next one
+    unsigned prev_bin;
+    float prev_exposure;
+
+    ptc_point *find(unsigned bin, float exposure)
+    {
+        for (size_t i = 0; i < pts.size(); i++)
+            if (pts[i].bin == bin && pts[i].exposure == exposure)
+                return &pts[i];
+        ptc_point p;
+        memset(&p, 0x0, sizeof(p));
+        p.bin = bin;
+        p.exposure = exposure;
+        pts.push_back(p);
+        return &pts.back();
+    }
+
+public:
+    photon_transfer()
+    {
+        prev_bin = 0;
+        prev_exposure = -1;
+    }
+    /**
+     * @brief Add a frame (one thread only)
+     *
+     * @param st Its statistics, frame_stats_compute()
+     * @return const ptc_point* Point of the frame, updated
+     */
+    const ptc_point *add(const unsigned short *data, size_t n, unsigned bin, float exposure, const frame_stats *st)
+    {
+        ptc_point *p = find(bin, exposure);
+        double k = 1.0 / (p->frames + 1);
+        p->mean += (st->mean - p->mean) * k;
+        p->var += (st->var - p->var) * k;
+        p->saturated += ((double)st->saturated / (st->n ? st->n : 1) - p->saturated) * k;
+        p->frames++;
+        if (prev_bin == bin && prev_exposure == exposure && prev.size() == n)
+        {
+            int64_t sum;
+            uint64_t sumsq;
+            unsigned long long m = ptc_pair_sums(data, prev.data(), n, &sum, &sumsq);
+            if (m > 1)
+            {
+                double mean = (double)sum / m;
+                double noise = 0.5 * ((double)sumsq / m - mean * mean);
+                p->noise_var += (noise - p->noise_var) / (p->pairs + 1);
+                p->pairs++;
+            }
+        }
+        prev.assign(data, data + n);
+        prev_bin = bin;
+        prev_exposure = exposure;
+        return p;
+    }
+    size_t size() const
+    {
+        return pts.size();
+    }
+    const ptc_point *point(size_t i) const
+    {
+        return &pts[i];
+    }
+    /**
+     * @brief Fit the curve of a binning, see the file description
+     *
+     * @return false Not enough points: two unsaturated exposures for the bias
+     * and three in the linear range
+     */
+    bool fit(unsigned bin, ptc_fit *out) const
+    {
+        memset(out, 0x0, sizeof(ptc_fit));
+        out->bin = bin;
+        const ptc_point *bias = NULL, *next = NULL, *peak = NULL; // two shortest exposures
+        double max_signal = 0;
+        for (size_t i = 0; i < pts.size(); i++)
+        {
+            const ptc_point *p = &pts[i];
+            if (p->bin != bin || p->pairs == 0 || p->saturated > PTC_MAX_SATURATED)
+                continue;
+            if (bias == NULL || p->exposure < bias->exposure)
+            {
+                next = bias;
+                bias = p;
+            }
+            else if (next == NULL || p->exposure < next->exposure)
+                next = p;
+        }
+        if (next == NULL)
+            return false;
+        out->offset = bias->mean - (next->mean - bias->mean) * bias->exposure / (next->exposure - bias->exposure);
+        for (size_t i = 0; i < pts.size(); i++)
+        {
+            const ptc_point *p = &pts[i];
+            if (p->bin != bin || p->pairs == 0)
+                continue;
+            if (peak == NULL || p->noise_var > peak->noise_var)
+                peak = p;
+            if (p->mean - out->offset > max_signal)
+                max_signal = p->mean - out->offset;
+        }
+        out->full_well_adu = peak->mean - out->offset;
+        out->rolled_over = out->full_well_adu < max_signal;
+        if (!out->rolled_over)
+            out->full_well_adu = max_signal;
+        // noise_var = a + b * signal
+        double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+        for (size_t i = 0; i < pts.size(); i++)
+        {
+            const ptc_point *p = &pts[i];
+            double s = p->mean - out->offset;
+            if (p->bin != bin || p->pairs == 0 || p->saturated > PTC_MAX_SATURATED || s < 0 || s > PTC_LINEAR_MAX * out->full_well_adu)
+                continue;
+            n++;
+            sx += s;
+            sy += p->noise_var;
+            sxx += s * s;
+            sxy += s * p->noise_var;
+        }
+        out->points = n;
+        double det = n * sxx - sx * sx;
+        if (n < 3 || det <= 0)
+            return false;
+        double b = (n * sxy - sx * sy) / det;
+        if (b <= 0)
+            return false;
+        out->gain = 1 / b;
+        double rn2 = bias->noise_var - (bias->mean - out->offset) * b;
+        out->read_noise = sqrt(rn2 > 0 ? rn2 : 0) * out->gain;
+        out->full_well = out->full_well_adu * out->gain;
+        return true;
+    }
+    /**
+     * @brief Print the points and the fit of every binning
+     *
+     */
+    void report(FILE *fp) const
+    {
+        fprintf(fp, "%4s %12s %7s %12s %14s %14s %10s\n", "bin", "exposure (s)", "frames", "mean (ADU)", "spatial var", "temporal var", "saturated");
+        for (size_t i = 0; i < pts.size(); i++)
+        {
+            const ptc_point *p = &pts[i];
+            fprintf(fp, "%4u %12.3f %7u %12.1f %14.1f %14.1f %9.2f%%\n", p->bin, p->exposure, p->frames, p->mean, p->var, p->noise_var, p->saturated * 100);
+        }
+        for (size_t i = 0; i < pts.size(); i++)
+        {
+            bool first = true;
+            for (size_t j = 0; j < i; j++)
+                first &= pts[j].bin != pts[i].bin;
+            if (!first)
+                continue;
+            ptc_fit f;
+            if (fit(pts[i].bin, &f))
+                fprintf(fp, "bin %u: gain %.3f e-/ADU, read noise %.2f e- (%.2f ADU), full well %.0f e- (%.0f ADU above a bias of %.1f%s), %u points\n",
+                        f.bin, f.gain, f.read_noise, f.read_noise / f.gain, f.full_well, f.full_well_adu, f.offset, f.rolled_over ? "" : ", not reached", f.points);
+            else
+                fprintf(fp, "bin %u: not enough points for a fit (%u)\n", f.bin, f.points);
+        }
+    }
+    /**
+     * @brief Write the points as CSV
+     *
+     */
+    bool write_csv(const char *fname) const
+    {
+        FILE *fp = fopen(fname, "w");
+        if (fp == NULL)
+            return false;
+        fprintf(fp, "bin,exposure_s,frames,pairs,mean_adu,spatial_var,temporal_var,saturated\n");
+        for (size_t i = 0; i < pts.size(); i++)
+        {
+            const ptc_point *p = &pts[i];
+            fprintf(fp, "%u,%.4f,%u,%u,%.3f,%.3f,%.3f,%.6f\n", p->bin, p->exposure, p->frames, p->pairs, p->mean, p->var, p->noise_var, p->saturated);
+        }
+        fclose(fp);
+        return true;
+    }
+};
+
+#endif // PHOTON_TRANSFER_H_
@@ -0,0 +1,330 @@
+/**
+ * @file raw_codec.h
+ * @brief Fast lossless compression of 16 bit frames for the raw stream
+ *
+ * Every pixel is predicted from its left neighbour (the first pixel of a
+ * row from the pixel above), the residual is zigzag coded so that small
+ * negative and positive values both become small, and the residuals are
+ * bit packed in blocks of RAW16_BLOCK values with the width of the largest
+ * one in the block (a one byte header per block). Noise limited sky frames
+ * need only a few bits per pixel. Prediction and zigzag coding, and their
+ * inverse (a prefix sum), use SSE2 or NEON.
+ *
+ * Stream: "RD16" uint32 width uint32 height, then blocks of
+ * uint8 bits + RAW16_BLOCK * bits / 8 bytes (the last block may be short).
+ *
+ */
+#ifndef RAW_CODEC_H_
+#define RAW_CODEC_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define RAW16_SSE2 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RAW16_NEON 1
+#endif
+
+#define RAW16_MAGIC "RD16"
+#define RAW16_HDR_SIZE 12
+#define RAW16_BLOCK 32 // residuals per block, a block of b bit values is 4 * b bytes
+
+/**
+ * @brief Largest stream raw16_codec::encode() can produce for a frame
+ *
+ */
+static inline size_t raw16_max_size(unsigned width, unsigned height)
+{
+    size_t n = (size_t)width * height;
+    return RAW16_HDR_SIZE + (n + RAW16_BLOCK - 1) / RAW16_BLOCK * (1 + RAW16_BLOCK * 2);
+}
+
+/* Residuals of one row: zigzag(x[i] - x[i - 1]), zigzag(x[0] - above[0]) */
+static inline void raw16_residuals_scalar(const unsigned short *row, const unsigned short *above, unsigned short *res, unsigned width, unsigned start)
+{
+    for (unsigned i = start; i < width; i++)
+    {
+        uint16_t pred = i > 0 ? row[i - 1] : (above != NULL ? above[0] : 0);
+        int16_t d = (int16_t)(uint16_t)(row[i] - pred);
+        res[i] = (uint16_t)((d << 1) ^ (d >> 15));
+    }
+}
+
+static inline void raw16_residuals(const unsigned short *row, const unsigned short *above, unsigned short *res, unsigned width, bool simd = true)
+{
+    if (width == 0)
+        return;
+    raw16_residuals_scalar(row, above, res, 1, 0);
+    unsigned i = 1;
+    if (simd)
+    {
+#if defined(RAW16_SSE2)
+        for (; i + 8 <= width; i += 8)
+        {
+            __m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(row + i)), _mm_loadu_si128((const __m128i *)(row + i - 1)));
+            _mm_storeu_si128((__m128i *)(res + i), _mm_xor_si128(_mm_slli_epi16(d, 1), _mm_srai_epi16(d, 15)));
+        }
+#elif defined(RAW16_NEON)
+        for (; i + 8 <= width; i += 8)
+        {
+            int16x8_t d = vreinterpretq_s16_u16(vsubq_u16(vld1q_u16(row + i), vld1q_u16(row + i - 1)));
+            vst1q_u16(res + i, vreinterpretq_u16_s16(veorq_s16(vshlq_n_s16(d, 1), vshrq_n_s16(d, 15))));
+        }
+#endif
+    }
+    raw16_residuals_scalar(row, above, res, width, i);
+}
+
+/* Inverse of raw16_residuals: zigzag decode and prefix sum, in place */
+static inline void raw16_reconstruct(unsigned short *row, const unsigned short *above, unsigned width, bool simd = true)
+{
+    if (width == 0)
+        return;
+    uint16_t r0 = row[0];
+    row[0] = (uint16_t)(((r0 >> 1) ^ -(r0 & 1)) + (above != NULL ? above[0] : 0));
+    unsigned i = 1;
+    if (simd)
+    {
+#if defined(RAW16_SSE2)
+        __m128i carry = _mm_set1_epi16((short)row[0]);
+        const __m128i one = _mm_set1_epi16(1);
+        for (; i + 8 <= width; i += 8)
+        {
+            __m128i z = _mm_loadu_si128((const __m128i *)(row + i));
+            __m128i v = _mm_xor_si128(_mm_srli_epi16(z, 1), _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(z, one)));
+            v = _mm_add_epi16(v, _mm_slli_si128(v, 2));
+            v = _mm_add_epi16(v, _mm_slli_si128(v, 4));
+            v = _mm_add_epi16(v, _mm_slli_si128(v, 8));
+            v = _mm_add_epi16(v, carry);
+            _mm_storeu_si128((__m128i *)(row + i), v);
+            carry = _mm_set1_epi16((short)_mm_extract_epi16(v, 7));
+        }
+#elif defined(RAW16_NEON)
+        uint16x8_t carry = vdupq_n_u16(row[0]);
+        const uint16x8_t zero = vdupq_n_u16(0);
+        for (; i + 8 <= width; i += 8)
+        {
+            uint16x8_t z = vld1q_u16(row + i);
+            uint16x8_t v = veorq_u16(vshrq_n_u16(z, 1), vsubq_u16(zero, vandq_u16(z, vdupq_n_u16(1))));
+            v = vaddq_u16(v, vextq_u16(zero, v, 7));
+            v = vaddq_u16(v, vextq_u16(zero, v, 6));
+            v = vaddq_u16(v, vextq_u16(zero, v, 4));
+            v = vaddq_u16(v, carry);
+            vst1q_u16(row + i, v);
+            carry = vdupq_n_u16(vgetq_lane_u16(v, 7));
+        }
+#endif
+    }
+    for (; i < width; i++)
+    {
+        uint16_t z = row[i];
+        row[i] = (uint16_t)(row[i - 1] + ((z >> 1) ^ -(z & 1)));
+    }
+}
+
+static inline unsigned raw16_bits(const unsigned short *res, unsigned n)
+{
+    unsigned m = 0;
+    for (unsigned i = 0; i < n; i++)
+        m |= res[i];
+    return m == 0 ? 0 : 32 - __builtin_clz(m);
+}
+
+/* Pack n b-bit values, returns bytes written */
+static inline size_t raw16_pack(const unsigned short *res, unsigned n, unsigned b, unsigned char *out)
+{
+    uint64_t acc = 0;
+    unsigned nbits = 0;
+    unsigned char *start = out;
+    for (unsigned i = 0; i < n; i++)
+    {
+        acc |= (uint64_t)res[i] << nbits;
+        nbits += b;
+        if (nbits >= 32)
+        {
+            uint32_t word = (uint32_t)acc;
+            memcpy(out, &word, 4);
+            out += 4;
+            acc >>= 32;
+            nbits -= 32;
+        }
+    }
+    while (nbits > 0)
+    {
+        *out++ = (unsigned char)acc;
+        acc >>= 8;
+        nbits = nbits > 8 ? nbits - 8 : 0;
+    }
+    return out - start;
+}
+
+static inline void raw16_unpack(const unsigned char *in, unsigned n, unsigned b, unsigned short *res)
+{
+    const uint64_t mask = (1ULL << b) - 1;
+    size_t len = ((size_t)n * b + 7) / 8;
+    unsigned i = 0;
+    if (b == 0)
+    {
+        memset(res, 0x0, n * sizeof(unsigned short));
+        return;
+    }
+    // whole 64 bit loads while they stay inside the block
+    for (; i < n && ((size_t)i * b >> 3) + 8 <= len; i++)
+    {
+        size_t bit = (size_t)i * b;
+        uint64_t word;
+        memcpy(&word, in + (bit >> 3), 8);
+        res[i] = (unsigned short)((word >> (bit & 7)) & mask);
+    }
+    for (; i < n; i++)
+    {
+        size_t bit = (size_t)i * b, byte = bit >> 3;
+        uint64_t word = 0;
+        memcpy(&word, in + byte, len - byte);
+        res[i] = (unsigned short)((word >> (bit & 7)) & mask);
+    }
+}
+
+/**
+ * @brief Raw stream encoder/decoder with its scratch row kept between frames
+ *
+ */
+class raw16_codec
+{
+private:
+    unsigned short *res; // residuals of a row plus the partial block left from the previous one
+    size_t res_alloc;
+
+public:
+    raw16_codec()
+    {
+        res = NULL;
+        res_alloc = 0;
+    }
+    ~raw16_codec()
+    {
+        free(res);
+    }
+    raw16_codec(const raw16_codec &) = delete;
+    raw16_codec &operator=(const raw16_codec &) = delete;
+    /**
+     * @brief Compress a frame
+     *
+     * @param data 16 bit pixels, row major
+     * @param width Frame width
+     * @param height Frame height
+     * @param buf Output buffer allocated with malloc (may be NULL), reallocated to raw16_max_size() if smaller
+     * @param alloc Allocated size of the output buffer, updated when it grows
+     * @param simd Use the vector kernels when available
+     * @return int Size of the stream in bytes, -1 on allocation failure
+     */
+    int encode(const unsigned short *data, unsigned width, unsigned height, unsigned char **buf, size_t *alloc, bool simd = true)
+    {
+        size_t max_size = raw16_max_size(width, height);
+        if (*buf == NULL || *alloc < max_size)
+        {
+            unsigned char *tmp = (unsigned char *)realloc(*buf, max_size);
+            if (tmp == NULL)
+                return -1;
+            *buf = tmp;
+            *alloc = max_size;
+        }
+        if (res_alloc < (size_t)width + RAW16_BLOCK)
+        {
+            unsigned short *tmp = (unsigned short *)realloc(res, (width + RAW16_BLOCK) * sizeof(unsigned short));
+            if (tmp == NULL)
+                return -1;
+            res = tmp;
+            res_alloc = width + RAW16_BLOCK;
+        }
+        unsigned char *out = *buf;
+        memcpy(out, RAW16_MAGIC, 4);
+        uint32_t dims[2] = {width, height};
+        memcpy(out + 4, dims, sizeof(dims));
+        out += RAW16_HDR_SIZE;
+        unsigned pending = 0; // residuals carried over to the next row
+        for (unsigned y = 0; y < height; y++)
+        {
+            const unsigned short *row = data + (size_t)y * width;
+            raw16_residuals(row, y > 0 ? row - width : NULL, res + pending, width, simd);
+            unsigned n = pending + width, i = 0;
+            for (; i + RAW16_BLOCK <= n; i += RAW16_BLOCK)
+            {
+                unsigned b = raw16_bits(res + i, RAW16_BLOCK);
+                *out++ = b;
+                out += raw16_pack(res + i, RAW16_BLOCK, b, out);
+            }
+            pending = n - i;
+            memmove(res, res + i, pending * sizeof(unsigned short));
+        }
+        if (pending > 0)
+        {
+            unsigned b = raw16_bits(res, pending);
+            *out++ = b;
+            out += raw16_pack(res, pending, b, out);
+        }
+        return (int)(out - *buf);
+    }
+    /**
+     * @brief Read the frame size from a stream
+     *
+     * @return true Stream header is valid
+     */
+    static bool dimensions(const unsigned char *in, size_t len, unsigned *width, unsigned *height)
+    {
+        if (len < RAW16_HDR_SIZE || memcmp(in, RAW16_MAGIC, 4) != 0)
+            return false;
+        uint32_t dims[2];
+        memcpy(dims, in + 4, sizeof(dims));
+        *width = dims[0];
+        *height = dims[1];
+        return true;
+    }
+    /**
+     * @brief Decompress a stream
+     *
+     * @param in Stream
+     * @param len Stream size
+     * @param out Frame, row major
+     * @param max_pixels Size of the output buffer in pixels
+     * @param width Frame width
+     * @param height Frame height
+     * @param simd Use the vector kernels when available
+     * @return true Frame decoded
+     * @return false Stream invalid or truncated, or the frame does not fit
+     */
+    static bool decode(const unsigned char *in, size_t len, unsigned short *out, size_t max_pixels, unsigned *width, unsigned *height, bool simd = true)
+    {
+        if (!dimensions(in, len, width, height))
+            return false;
+        size_t n = (size_t)*width * *height;
+        if (n > max_pixels)
+            return false;
+        const unsigned char *ptr = in + RAW16_HDR_SIZE, *end = in + len;
+        for (size_t i = 0; i < n; i += RAW16_BLOCK)
+        {
+            unsigned cnt = n - i < RAW16_BLOCK ? n - i : RAW16_BLOCK;
+            if (ptr >= end || *ptr > 16)
+                return false;
+            unsigned b = *ptr++;
+            size_t bytes = ((size_t)cnt * b + 7) / 8;
+            if ((size_t)(end - ptr) < bytes)
+                return false;
+            raw16_unpack(ptr, cnt, b, out + i);
+            ptr += bytes;
+        }
+        for (unsigned y = 0; y < *height; y++)
+        {
+            unsigned short *row = out + (size_t)y * *width;
+            raw16_reconstruct(row, y > 0 ? row - *width : NULL, *width, simd);
+        }
+        return true;
+    }
+};
+
+#endif // RAW_CODEC_H_
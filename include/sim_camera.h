@@ -0,0 +1,485 @@
+/**
+ * @file sim_camera.h
+ * @brief Simulated AtikCamera: synthetic star fields or replay of a
+ * directory of FITS frames, so the server and the calibration tools run
+ * (and can be profiled) without a camera
+ *
+ * Selected at startup with the COMIC_CAMERA environment variable, read by
+ * camera_list() in place of AtikCamera::list():
+ *   COMIC_CAMERA=sim[:WIDTHxHEIGHT]  synthetic sky (default 3326x2504)
+ *   COMIC_CAMERA=replay:DIRECTORY    FITS frames of DIRECTORY in name order, looped
+ *   COMIC_SIM_READOUT_MS=ms          full frame readout time (default 200),
+ *                                    scaled by the pixels read out
+ *   COMIC_SIM_SEED=n                 star field seed
+ *   COMIC_SIM_SKY=e/s                sky background per pixel (default 20); the
+ *                                    server exposes for 40000 ADU, raise this
+ *                                    (e.g. 100000) to run it at short exposures
+ *
+ * The synthetic sky is a fixed star field plus sky background, in
+ * electrons per second per pixel. A frame integrates it over the exposure,
+ * adds dark current (doubling every 6 C of sensor temperature) and shot
+ * and read noise, and converts to ADU with an offset, saturating at 65535.
+ * Subframes and binning (charge summed over the bin) are honoured for both
+ * sources. The sensor temperature follows the cooler set point with a
+ * first order lag.
+ *
+ */
+#ifndef SIM_CAMERA_H_
+#define SIM_CAMERA_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <fitsio.h>
+#include <atikccdusb.h>
+
+#define SIM_WIDTH 3326
+#define SIM_HEIGHT 2504
+#define SIM_READOUT_MS 200
+#define SIM_MAX_BIN 4
+#define SIM_STARS 400
+#define SIM_AMBIENT 20.0f  // C
+#define SIM_COOL_TAU 60.0  // s, time constant of the sensor temperature
+#define SIM_GAIN 0.4f      // e-/ADU
+#define SIM_OFFSET 300.0f  // ADU
+#define SIM_READ_NOISE 7.0f // e-
+#define SIM_SKY 20.0f      // e-/s/pixel
+#define SIM_DARK_0C 0.1f   // e-/s/pixel at 0 C
+#define SIM_REPLAY_MAX_FRAMES 64 // frames of a replay directory loaded in memory
+
+class SimCamera : public AtikCamera
+{
+private:
+    char name[64];
+    char last_error[128];
+    unsigned width, height;
+    double readout_ms;
+    float sky;
+    bool replay;
+    std::vector<float> rate; // synthetic sky, e-/s/pixel
+    std::vector<std::vector<unsigned short>> frames; // replayed frames, sensor sized
+    size_t next_frame;
+    uint32_t rng;
+
+    // readout being served by getImage()
+    std::vector<unsigned short> image;
+    unsigned image_width, image_height;
+    bool image_ready;
+    double exposure_start;
+
+    // cooling
+    COOLING_STATE cooling_state;
+    float target, temp;
+    double temp_time;
+
+    static double now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+
+    uint32_t next_rand()
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        return rng;
+    }
+
+    /* Approximately normal deviate: Irwin-Hall sum of four uniforms */
+    float gauss()
+    {
+        uint32_t a = next_rand(), b = next_rand();
+        float s = (a & 0xffff) + (a >> 16) + (b & 0xffff) + (b >> 16);
+        return (s * (1.0f / 65536.0f) - 2.0f) * 1.7320508f;
+    }
+
+    void update_temp()
+    {
+        double t = now();
+        float goal = cooling_state == COOLING_INACTIVE ? SIM_AMBIENT : target;
+        temp = goal + (temp - goal) * exp(-(t - temp_time) / SIM_COOL_TAU);
+        temp_time = t;
+        if (cooling_state == WARMING_UP && fabsf(temp - SIM_AMBIENT) < 0.5f)
+            cooling_state = COOLING_INACTIVE;
+    }
+
+    void make_sky(unsigned seed)
+    {
+        rate.assign((size_t)width * height, sky);
+        rng = seed * 2654435761u + 1;
+        for (unsigned i = 0; i < SIM_STARS; i++)
+        {
+            float cx = next_rand() % width, cy = next_rand() % height;
+            float flux = 1e3f * powf(1e3f, (next_rand() & 0xffff) / 65536.0f); // 1e3 to 1e6 e-/s
+            const float sigma = 1.5f;
+            int r = 5 * sigma;
+            for (int dy = -r; dy <= r; dy++)
+                for (int dx = -r; dx <= r; dx++)
+                {
+                    int x = cx + dx, y = cy + dy;
+                    if (x < 0 || y < 0 || x >= (int)width || y >= (int)height)
+                        continue;
+                    rate[(size_t)y * width + x] += flux / (2 * M_PI * sigma * sigma) * expf(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+                }
+        }
+        rng = seed + 0x9e3779b9u;
+    }
+
+    bool load_fits(const char *fname, std::vector<unsigned short> &out)
+    {
+        fitsfile *fptr;
+        int status = 0, naxis = 0;
+        long naxes[2] = {0, 0};
+        if (fits_open_file(&fptr, fname, READONLY, &status))
+            return false;
+        fits_get_img_dim(fptr, &naxis, &status);
+        fits_get_img_size(fptr, 2, naxes, &status);
+        bool ok = status == 0 && naxis == 2 && naxes[0] == (long)width && naxes[1] == (long)height;
+        if (ok)
+        {
+            out.resize((size_t)width * height);
+            long fpixel[] = {1, 1};
+            fits_read_pix(fptr, TUSHORT, fpixel, (long long)width * height, NULL, out.data(), NULL, &status);
+            ok = status == 0;
+        }
+        fits_close_file(fptr, &status);
+        return ok;
+    }
+
+    bool load_replay(const char *dir)
+    {
+        std::vector<std::string> names;
+        DIR *d = opendir(dir);
+        if (d == NULL)
+            return false;
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL)
+        {
+            const char *ext = strrchr(ent->d_name, '.');
+            if (ext != NULL && (strcmp(ext, ".fit") == 0 || strcmp(ext, ".fits") == 0))
+                names.push_back(std::string(dir) + "/" + ent->d_name);
+        }
+        closedir(d);
+        std::sort(names.begin(), names.end());
+        for (size_t i = 0; i < names.size() && frames.size() < SIM_REPLAY_MAX_FRAMES; i++)
+        {
+            if (frames.empty()) // the first frame sets the sensor size
+            {
+                fitsfile *fptr;
+                int status = 0;
+                long naxes[2] = {0, 0};
+                if (fits_open_file(&fptr, names[i].c_str(), READONLY, &status))
+                    continue;
+                fits_get_img_size(fptr, 2, naxes, &status);
+                fits_close_file(fptr, &status);
+                width = naxes[0];
+                height = naxes[1];
+            }
+            std::vector<unsigned short> frame;
+            if (load_fits(names[i].c_str(), frame))
+                frames.push_back(frame);
+        }
+        return !frames.empty();
+    }
+
+    /**
+     * @brief Render a readout: integrate the sky (or take the replayed frame)
+     * over the region, summing charge over bin x bin blocks
+     *
+     */
+    void render(unsigned x0, unsigned y0, unsigned w, unsigned h, unsigned bin, double exposure)
+    {
+        image_width = w / bin;
+        image_height = h / bin;
+        image.resize((size_t)image_width * image_height);
+        update_temp();
+        const std::vector<unsigned short> *src = NULL;
+        if (replay)
+        {
+            src = &frames[next_frame];
+            next_frame = (next_frame + 1) % frames.size();
+        }
+        float dark = SIM_DARK_0C * powf(2.0f, temp / 6.0f) * exposure;
+        for (unsigned y = 0; y < image_height; y++)
+        {
+            for (unsigned x = 0; x < image_width; x++)
+            {
+                float sum = 0;
+                for (unsigned j = 0; j < bin; j++)
+                {
+                    size_t row = (size_t)(y0 + y * bin + j) * width + x0 + x * bin;
+                    for (unsigned i = 0; i < bin; i++)
+                        sum += replay ? (*src)[row + i] : rate[row + i];
+                }
+                float adu;
+                if (replay)
+                    adu = sum;
+                else
+                {
+                    float e = sum * exposure + dark * bin * bin;
+                    adu = SIM_OFFSET + (e + gauss() * sqrtf(e + SIM_READ_NOISE * SIM_READ_NOISE)) / SIM_GAIN;
+                }
+                image[(size_t)y * image_width + x] = adu < 0 ? 0 : (adu > 65535 ? 65535 : adu);
+            }
+        }
+        image_ready = true;
+    }
+
+    bool read(unsigned startX, unsigned startY, unsigned sizeX, unsigned sizeY, unsigned binX, unsigned binY, double exposure)
+    {
+        unsigned bin = binX > binY ? binX : binY;
+        if (bin < 1 || bin > SIM_MAX_BIN || binX != binY)
+        {
+            snprintf(last_error, sizeof(last_error), "unsupported binning %ux%u", binX, binY);
+            return false;
+        }
+        if (startX >= width || startY >= height || sizeX == 0 || sizeY == 0)
+        {
+            snprintf(last_error, sizeof(last_error), "empty subframe");
+            return false;
+        }
+        if (sizeX > width - startX)
+            sizeX = width - startX;
+        if (sizeY > height - startY)
+            sizeY = height - startY;
+        double t0 = now();
+        render(startX, startY, sizeX, sizeY, bin, exposure);
+        // readout time: 10% fixed, the rest proportional to the pixels digitized
+        double readout = readout_ms * 1e-3 * (0.1 + 0.9 * (double)image_width * image_height / ((double)width * height));
+        double left = readout - (now() - t0);
+        if (left > 0)
+            usleep(left * 1e6);
+        return true;
+    }
+
+public:
+    SimCamera(const char *spec)
+    {
+        width = SIM_WIDTH;
+        height = SIM_HEIGHT;
+        replay = false;
+        next_frame = 0;
+        image_width = image_height = 0;
+        image_ready = false;
+        exposure_start = 0;
+        cooling_state = COOLING_INACTIVE;
+        target = temp = SIM_AMBIENT;
+        temp_time = now();
+        last_error[0] = '\0';
+        const char *env = getenv("COMIC_SIM_READOUT_MS");
+        readout_ms = env != NULL ? atof(env) : SIM_READOUT_MS;
+        env = getenv("COMIC_SIM_SEED");
+        unsigned seed = env != NULL ? strtoul(env, NULL, 10) : 1;
+        env = getenv("COMIC_SIM_SKY");
+        sky = env != NULL ? atof(env) : SIM_SKY;
+        if (strncmp(spec, "replay:", 7) == 0)
+        {
+            replay = true;
+            snprintf(name, sizeof(name), "Replay %.50s", spec + 7);
+            if (!load_replay(spec + 7))
+            {
+                fprintf(stderr, "%s: no %ux%u FITS frames in %s, simulating instead\n", __func__, width, height, spec + 7);
+                replay = false;
+                width = SIM_WIDTH;
+                height = SIM_HEIGHT;
+            }
+        }
+        else
+        {
+            unsigned w, h;
+            if (sscanf(spec, "sim:%ux%u", &w, &h) == 2 && w > 0 && h > 0)
+            {
+                width = w;
+                height = h;
+            }
+        }
+        if (!replay)
+        {
+            snprintf(name, sizeof(name), "Simulator %ux%u", width, height);
+            make_sky(seed);
+        }
+    }
+    const char *getName() { return name; }
+    bool open() { return true; }
+    void close() {}
+    bool setParam(PARAM_TYPE code, long value) { return true; }
+    long getParam(PARAM_TYPE code) { return 0; }
+    bool getCapabilities(const char **name, CAMERA_TYPE *type, bool *hasShutter, bool *hasGuidePort, bool *has8BitMode, bool *hasFilterWheel, unsigned *lineCount, unsigned *pixelCountX, unsigned *pixelCountY, double *pixelSizeX, double *pixelSizeY, unsigned *maxBinX, unsigned *maxBinY, unsigned *tempSensorCount, COOLER_TYPE *cooler, COLOUR_TYPE *colour, int *offsetX, int *offsetY, bool *supportsLongExposure, double *minShortExposure, double *maxShortExposure)
+    {
+        AtikCapabilities cap;
+        getCapabilities(name, type, &cap);
+        *hasShutter = cap.hasShutter;
+        *hasGuidePort = cap.hasGuidePort;
+        *has8BitMode = cap.has8BitMode;
+        *hasFilterWheel = cap.hasFilterWheel;
+        *lineCount = cap.lineCount;
+        *pixelCountX = cap.pixelCountX;
+        *pixelCountY = cap.pixelCountY;
+        *pixelSizeX = cap.pixelSizeX;
+        *pixelSizeY = cap.pixelSizeY;
+        *maxBinX = cap.maxBinX;
+        *maxBinY = cap.maxBinY;
+        *tempSensorCount = cap.tempSensorCount;
+        *cooler = cap.cooler;
+        *colour = cap.colour;
+        *offsetX = cap.offsetX;
+        *offsetY = cap.offsetY;
+        *supportsLongExposure = cap.supportsLongExposure;
+        *minShortExposure = cap.minShortExposure;
+        *maxShortExposure = cap.maxShortExposure;
+        return true;
+    }
+    bool getCapabilities(const char **name, CAMERA_TYPE *type, AtikCapabilities *cap)
+    {
+        *name = this->name;
+        *type = SONY_SCI;
+        memset(cap, 0x0, sizeof(AtikCapabilities));
+        cap->hasShutter = true;
+        cap->lineCount = height;
+        cap->pixelCountX = width;
+        cap->pixelCountY = height;
+        cap->pixelSizeX = cap->pixelSizeY = 5.4;
+        cap->maxBinX = cap->maxBinY = SIM_MAX_BIN;
+        cap->tempSensorCount = 1;
+        cap->cooler = COOLER_SETPOINT;
+        cap->colour = COLOUR_NONE;
+        cap->supportsLongExposure = true;
+        cap->minShortExposure = 0.001;
+        cap->maxShortExposure = 0.2;
+        return true;
+    }
+    bool getTemperatureSensorStatus(unsigned sensor, float *currentTemp)
+    {
+        update_temp();
+        *currentTemp = temp;
+        return sensor == 1;
+    }
+    bool getCoolingStatus(COOLING_STATE *state, float *targetTemp, float *power)
+    {
+        update_temp();
+        *state = cooling_state;
+        *targetTemp = target;
+        float p = (SIM_AMBIENT - temp) / 40.0f; // full power holds 40 C below ambient
+        *power = cooling_state == COOLING_INACTIVE ? 0 : (p < 0 ? 0 : (p > 1 ? 1 : p));
+        return true;
+    }
+    bool setCooling(float targetTemp)
+    {
+        update_temp();
+        target = targetTemp;
+        cooling_state = COOLING_SETPOINT;
+        return true;
+    }
+    bool initiateWarmUp()
+    {
+        update_temp();
+        target = SIM_AMBIENT;
+        cooling_state = WARMING_UP;
+        return true;
+    }
+    bool getFilterWheelStatus(unsigned *filterCount, bool *moving, unsigned *current, unsigned *target)
+    {
+        *filterCount = 0;
+        *moving = false;
+        *current = *target = 0;
+        return false;
+    }
+    bool setFilter(unsigned index) { return false; }
+    bool setPreviewMode(bool useMode) { return true; }
+    bool set8BitMode(bool useMode) { return !useMode; }
+    bool setDarkFrameMode(bool useMode) { return true; }
+    bool startExposure(bool amp)
+    {
+        exposure_start = now();
+        image_ready = false;
+        return true;
+    }
+    bool abortExposure()
+    {
+        exposure_start = 0;
+        return true;
+    }
+    /* Long exposure: integrates from startExposure() to now */
+    bool readCCD(unsigned startX, unsigned startY, unsigned sizeX, unsigned sizeY, unsigned binX, unsigned binY)
+    {
+        if (exposure_start == 0)
+        {
+            snprintf(last_error, sizeof(last_error), "no exposure started");
+            return false;
+        }
+        double exposure = now() - exposure_start;
+        exposure_start = 0;
+        return read(startX, startY, sizeX, sizeY, binX, binY, exposure);
+    }
+    /* Short exposure of delay seconds, then readout */
+    bool readCCD(unsigned startX, unsigned startY, unsigned sizeX, unsigned sizeY, unsigned binX, unsigned binY, double delay)
+    {
+        if (delay > 0)
+            usleep(delay * 1e6);
+        return read(startX, startY, sizeX, sizeY, binX, binY, delay);
+    }
+    bool getImage(unsigned short *imgBuf, unsigned imgSize)
+    {
+        if (!image_ready)
+        {
+            snprintf(last_error, sizeof(last_error), "no image read out");
+            return false;
+        }
+        size_t n = (size_t)image_width * image_height;
+        memcpy(imgBuf, image.data(), (imgSize < n ? imgSize : n) * sizeof(unsigned short));
+        image_ready = false;
+        return true;
+    }
+    bool setShutter(bool open) { return true; }
+    bool setGuideRelays(unsigned short mask) { return true; }
+    bool setGPIODirection(unsigned short mask) { return true; }
+    bool getGPIO(unsigned short *mask)
+    {
+        *mask = 0;
+        return true;
+    }
+    bool setGPIO(unsigned short mask) { return true; }
+    bool getGain(int *gain, int *offset)
+    {
+        *gain = SIM_GAIN * 100;
+        *offset = SIM_OFFSET;
+        return true;
+    }
+    bool setGain(int gain, int offset) { return false; }
+    unsigned delay(double delay) { return delay * 1e6; }
+    unsigned imageWidth(unsigned width, unsigned binX) { return width / (binX ? binX : 1); }
+    unsigned imageHeight(unsigned height, unsigned binY) { return height / (binY ? binY : 1); }
+    unsigned getSerialNumber() { return 0; }
+    unsigned getVersionMajor() { return 0; }
+    unsigned getVersionMinor() { return 0; }
+    const char *getLastError() { return last_error; }
+};
+
+/**
+ * @brief AtikCamera::list(), or a simulated camera when COMIC_CAMERA is set
+ *
+ */
+static inline int camera_list(AtikCamera **cameras, int max)
+{
+    const char *spec = getenv("COMIC_CAMERA");
+    if (spec == NULL || spec[0] == '\0')
+        return AtikCamera::list(cameras, max);
+    if (max < 1)
+        return 0;
+    cameras[0] = new SimCamera(spec);
+    fprintf(stderr, "%s: using %s\n", __func__, cameras[0]->getName());
+    return 1;
+}
+
+#endif // SIM_CAMERA_H_
@@ -0,0 +1,435 @@
+/**
+ * @file tone_map.h
+ * @brief 16 to 8 bit tone mapping of camera frames for the preview stream
+ *
+ * Linear stretches (none, min/max, percentile clip) are computed with
+ * SSE2/AVX2/NEON arithmetic. Gamma and asinh stretches go through a 64K
+ * entry lookup table rebuilt only when the black/white points change.
+ * The stretch is a process wide setting, changed with set_stretch() (e.g.
+ * from the command channel) and picked up by every tone_map on its next
+ * frame.
+ *
+ */
+#ifndef TONE_MAP_H_
+#define TONE_MAP_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TONE_MAP_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TONE_MAP_NEON 1
+#endif
+
+#include <histogram.h>
+#include <frame_stats.h>
+
+#ifndef TONE_HIST_STRIDE
+#define TONE_HIST_STRIDE 16 // pixels sampled for the percentile black/white points
+#endif
+
+typedef enum
+{
+    STRETCH_NONE = 0,   // x / 256, as the server always did
+    STRETCH_LINEAR,     // frame minimum to maximum
+    STRETCH_PERCENTILE, // lo to hi percentile, clipped
+    STRETCH_GAMMA,      // percentile clip, then t^(1 / param)
+    STRETCH_ASINH,      // percentile clip, then asinh(param * t) / asinh(param)
+    STRETCH_MAX
+} stretch_mode;
+
+/**
+ * @brief Stretch parameters
+ *
+ */
+typedef struct
+{
+    stretch_mode mode;
+    float lo_pct; // black point percentile
+    float hi_pct; // white point percentile
+    float param;  // gamma, or asinh softening
+} stretch_cfg;
+
+/**
+ * @brief Coefficients of a linear map, out = ((min(x -sat lo, range) << shift) * mul) >> 16
+ *
+ */
+typedef struct
+{
+    uint16_t lo;
+    uint16_t range;
+    uint16_t shift;
+    uint16_t mul;
+} tone_linear;
+
+/* Scalar reference of the linear kernel */
+static inline void tone_linear_scalar(const unsigned short *src, unsigned char *dst, size_t n, const tone_linear *c)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned d = src[i] > c->lo ? src[i] - c->lo : 0;
+        if (d > c->range)
+            d = c->range;
+        dst[i] = (unsigned char)(((d << c->shift) * c->mul) >> 16);
+    }
+}
+
+#ifdef TONE_MAP_X86
+static inline void tone_linear_sse2(const unsigned short *src, unsigned char *dst, size_t n, const tone_linear *c)
+{
+    const __m128i lo = _mm_set1_epi16((short)c->lo);
+    const __m128i range = _mm_set1_epi16((short)c->range);
+    const __m128i mul = _mm_set1_epi16((short)c->mul);
+    const __m128i shift = _mm_cvtsi32_si128(c->shift);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        a = _mm_subs_epu16(a, lo);
+        b = _mm_subs_epu16(b, lo);
+        a = _mm_sub_epi16(a, _mm_subs_epu16(a, range)); // min(a, range), SSE2 has no unsigned min
+        b = _mm_sub_epi16(b, _mm_subs_epu16(b, range));
+        a = _mm_mulhi_epu16(_mm_sll_epi16(a, shift), mul);
+        b = _mm_mulhi_epu16(_mm_sll_epi16(b, shift), mul);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+    }
+    tone_linear_scalar(src + i, dst + i, n - i, c);
+}
+
+__attribute__((target("avx2"))) static inline void tone_linear_avx2(const unsigned short *src, unsigned char *dst, size_t n, const tone_linear *c)
+{
+    const __m256i lo = _mm256_set1_epi16((short)c->lo);
+    const __m256i range = _mm256_set1_epi16((short)c->range);
+    const __m256i mul = _mm256_set1_epi16((short)c->mul);
+    const __m128i shift = _mm_cvtsi32_si128(c->shift);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+        a = _mm256_min_epu16(_mm256_subs_epu16(a, lo), range);
+        b = _mm256_min_epu16(_mm256_subs_epu16(b, lo), range);
+        a = _mm256_mulhi_epu16(_mm256_sll_epi16(a, shift), mul);
+        b = _mm256_mulhi_epu16(_mm256_sll_epi16(b, shift), mul);
+        // packus works per 128 bit lane, put the quadwords back in order
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst + i), p);
+    }
+    tone_linear_sse2(src + i, dst + i, n - i, c);
+}
+#endif // TONE_MAP_X86
+
+#ifdef TONE_MAP_NEON
+static inline void tone_linear_neon(const unsigned short *src, unsigned char *dst, size_t n, const tone_linear *c)
+{
+    const uint16x8_t lo = vdupq_n_u16(c->lo);
+    const uint16x8_t range = vdupq_n_u16(c->range);
+    const uint16x4_t mul = vdup_n_u16(c->mul);
+    const int16x8_t shift = vdupq_n_s16(c->shift);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint16x8_t a = vld1q_u16(src + i);
+        uint16x8_t b = vld1q_u16(src + i + 8);
+        a = vshlq_u16(vminq_u16(vqsubq_u16(a, lo), range), shift);
+        b = vshlq_u16(vminq_u16(vqsubq_u16(b, lo), range), shift);
+        // high half of the 16 x 16 bit products
+        uint16x8_t ma = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(a), mul), 16), vshrn_n_u32(vmull_u16(vget_high_u16(a), mul), 16));
+        uint16x8_t mb = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(b), mul), 16), vshrn_n_u32(vmull_u16(vget_high_u16(b), mul), 16));
+        vst1q_u8(dst + i, vcombine_u8(vqmovn_u16(ma), vqmovn_u16(mb)));
+    }
+    tone_linear_scalar(src + i, dst + i, n - i, c);
+}
+#endif // TONE_MAP_NEON
+
+typedef void (*tone_linear_fcn)(const unsigned short *, unsigned char *, size_t, const tone_linear *);
+
+/**
+ * @brief Fastest linear kernel the CPU supports
+ *
+ */
+static inline tone_linear_fcn tone_linear_best()
+{
+#ifdef TONE_MAP_X86
+    if (__builtin_cpu_supports("avx2"))
+        return tone_linear_avx2;
+    return tone_linear_sse2;
+#elif defined(TONE_MAP_NEON)
+    return tone_linear_neon;
+#else
+    return tone_linear_scalar;
+#endif
+}
+
+/**
+ * @brief Minimum and maximum of a frame
+ *
+ */
+static inline void tone_minmax(const unsigned short *src, size_t n, unsigned short *min, unsigned short *max)
+{
+    unsigned short mn = 65535, mx = 0;
+    size_t i = 0;
+#ifdef TONE_MAP_X86
+    // SSE2 only has signed 16 bit min/max, flip the sign bit around them
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    __m128i vmn = _mm_set1_epi16(0x7fff), vmx = _mm_set1_epi16((short)0x8000);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), bias);
+        vmn = _mm_min_epi16(vmn, a);
+        vmx = _mm_max_epi16(vmx, a);
+    }
+    unsigned short tmn[8], tmx[8];
+    _mm_storeu_si128((__m128i *)tmn, _mm_xor_si128(vmn, bias));
+    _mm_storeu_si128((__m128i *)tmx, _mm_xor_si128(vmx, bias));
+    for (int k = 0; k < 8 && i > 0; k++)
+    {
+        mn = tmn[k] < mn ? tmn[k] : mn;
+        mx = tmx[k] > mx ? tmx[k] : mx;
+    }
+#elif defined(TONE_MAP_NEON)
+    uint16x8_t vmn = vdupq_n_u16(65535), vmx = vdupq_n_u16(0);
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t a = vld1q_u16(src + i);
+        vmn = vminq_u16(vmn, a);
+        vmx = vmaxq_u16(vmx, a);
+    }
+    unsigned short tmn[8], tmx[8];
+    vst1q_u16(tmn, vmn);
+    vst1q_u16(tmx, vmx);
+    for (int k = 0; k < 8 && i > 0; k++)
+    {
+        mn = tmn[k] < mn ? tmn[k] : mn;
+        mx = tmx[k] > mx ? tmx[k] : mx;
+    }
+#endif
+    for (; i < n; i++)
+    {
+        mn = src[i] < mn ? src[i] : mn;
+        mx = src[i] > mx ? src[i] : mx;
+    }
+    *min = mn;
+    *max = mx;
+}
+
+/**
+ * @brief Per-encoder tone mapping state: black/white points of the current
+ * frame, the linear coefficients and the lookup table of nonlinear curves
+ *
+ */
+class tone_map
+{
+private:
+    stretch_cfg cfg;
+    unsigned cfg_gen;
+    tone_linear lin;
+    tone_linear_fcn linear_fcn;
+    unsigned char *lut;
+    bool lut_valid;
+    stretch_mode lut_mode;
+    float lut_param;
+    unsigned short lut_lo, lut_hi;
+    pixel_histogram *hist;
+
+    static pthread_mutex_t *cfg_lock()
+    {
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        return &lock;
+    }
+    static stretch_cfg *shared_cfg()
+    {
+        static stretch_cfg cfg = {STRETCH_NONE, 0.5f, 99.5f, 2.2f};
+        return &cfg;
+    }
+    static std::atomic<unsigned> &shared_gen()
+    {
+        static std::atomic<unsigned> gen(1);
+        return gen;
+    }
+
+    void set_linear(unsigned short lo, unsigned short hi)
+    {
+        unsigned range = hi > lo ? hi - lo : 1;
+        unsigned shift = 0;
+        while ((range << (shift + 1)) <= 65535)
+            shift++;
+        lin.lo = lo;
+        lin.range = range;
+        lin.shift = shift;
+        // largest multiplier that keeps range << shift mapped to 255
+        lin.mul = (uint16_t)(255.999 * 65536.0 / (range << shift));
+    }
+
+    void build_lut(unsigned short lo, unsigned short hi)
+    {
+        if (lut_valid && lut_mode == cfg.mode && lut_param == cfg.param && lut_lo == lo && lut_hi == hi)
+            return;
+        if (lut == NULL)
+            lut = (unsigned char *)malloc(65536);
+        unsigned range = hi > lo ? hi - lo : 1;
+        float param = cfg.param > 0 ? cfg.param : 1;
+        memset(lut, 0, lo);
+        for (unsigned x = lo; x <= hi; x++)
+        {
+            double t = (double)(x - lo) / range, v;
+            if (cfg.mode == STRETCH_GAMMA)
+                v = pow(t, 1.0 / param);
+            else
+                v = asinh(param * t) / asinh(param);
+            lut[x] = (unsigned char)(v * 255.0 + 0.5);
+        }
+        memset(lut + hi + 1, 255, 65535 - hi);
+        lut_valid = true;
+        lut_mode = cfg.mode;
+        lut_param = cfg.param;
+        lut_lo = lo;
+        lut_hi = hi;
+    }
+
+public:
+    /**
+     * @brief Black and white points used for the last frame
+     *
+     */
+    unsigned short black, white;
+
+    tone_map()
+    {
+        cfg_gen = 0;
+        lut = NULL;
+        lut_valid = false;
+        lut_mode = STRETCH_NONE;
+        lut_param = 0;
+        lut_lo = lut_hi = 0;
+        hist = NULL;
+        black = 0;
+        white = 65535;
+        linear_fcn = tone_linear_best();
+        set_linear(0, 65535);
+        memset(&cfg, 0x0, sizeof(cfg));
+    }
+    ~tone_map()
+    {
+        free(lut);
+        delete hist;
+    }
+    tone_map(const tone_map &) = delete;
+    tone_map &operator=(const tone_map &) = delete;
+    /**
+     * @brief Change the stretch used by every tone_map from its next frame on
+     *
+     * @param cfg Stretch parameters, percentiles are clamped to [0, 100]
+     */
+    static void set_stretch(stretch_cfg cfg)
+    {
+        if (cfg.mode < STRETCH_NONE || cfg.mode >= STRETCH_MAX)
+            cfg.mode = STRETCH_NONE;
+        cfg.lo_pct = !(cfg.lo_pct >= 0) ? 0 : (cfg.lo_pct > 100 ? 100 : cfg.lo_pct); // NaN too
+        cfg.hi_pct = !(cfg.hi_pct >= cfg.lo_pct) ? cfg.lo_pct : (cfg.hi_pct > 100 ? 100 : cfg.hi_pct);
+        if (!(cfg.param > 0) || isinf(cfg.param))
+            cfg.param = 1;
+        pthread_mutex_lock(cfg_lock());
+        *shared_cfg() = cfg;
+        shared_gen()++;
+        pthread_mutex_unlock(cfg_lock());
+    }
+    static stretch_cfg get_stretch()
+    {
+        pthread_mutex_lock(cfg_lock());
+        stretch_cfg cfg = *shared_cfg();
+        pthread_mutex_unlock(cfg_lock());
+        return cfg;
+    }
+    /**
+     * @brief Force a kernel, e.g. the scalar one for comparison
+     *
+     */
+    void set_kernel(tone_linear_fcn fcn)
+    {
+        linear_fcn = fcn;
+    }
+    /**
+     * @brief Pick up the current stretch and measure the black/white points
+     * of a frame, call once per frame before apply()
+     *
+     * @param data Frame
+     * @param size Number of pixels
+     * @param st Statistics of the frame (or of the frame it was downscaled
+     * from) if already computed, the black/white points are then taken from
+     * them instead of measured again
+     */
+    void prepare(const unsigned short *data, unsigned long long size, const frame_stats *st = NULL)
+    {
+        if (cfg_gen != shared_gen().load())
+        {
+            pthread_mutex_lock(cfg_lock());
+            cfg = *shared_cfg();
+            cfg_gen = shared_gen();
+            pthread_mutex_unlock(cfg_lock());
+        }
+        unsigned short lo = 0, hi = 65535;
+        if (st != NULL && cfg.mode == STRETCH_LINEAR)
+        {
+            lo = st->min;
+            hi = st->max;
+        }
+        else if (st != NULL && cfg.mode != STRETCH_NONE)
+        {
+            lo = frame_stats_percentile(st, cfg.lo_pct);
+            hi = frame_stats_percentile(st, cfg.hi_pct);
+        }
+        else if (cfg.mode == STRETCH_LINEAR)
+            tone_minmax(data, size, &lo, &hi);
+        else if (cfg.mode != STRETCH_NONE)
+        {
+            if (hist == NULL)
+                hist = new pixel_histogram;
+            hist->compute(data, size, size > 65536 ? TONE_HIST_STRIDE : 1);
+            lo = hist->percentile(cfg.lo_pct);
+            hi = hist->percentile(cfg.hi_pct);
+        }
+        black = lo;
+        white = hi;
+        if (cfg.mode == STRETCH_GAMMA || cfg.mode == STRETCH_ASINH)
+            build_lut(lo, hi);
+        else
+            set_linear(lo, hi);
+    }
+    /**
+     * @brief Map pixels to 8 bits with the stretch measured by prepare()
+     *
+     * @param src 16 bit pixels
+     * @param dst 8 bit output
+     * @param n Number of pixels
+     */
+    void apply(const unsigned short *src, unsigned char *dst, size_t n) const
+    {
+        if (cfg.mode == STRETCH_GAMMA || cfg.mode == STRETCH_ASINH)
+        {
+            size_t n4 = n & ~(size_t)3, i;
+            for (i = 0; i < n4; i += 4)
+            {
+                dst[i] = lut[src[i]];
+                dst[i + 1] = lut[src[i + 1]];
+                dst[i + 2] = lut[src[i + 2]];
+                dst[i + 3] = lut[src[i + 3]];
+            }
+            for (; i < n; i++)
+                dst[i] = lut[src[i]];
+        }
+        else
+            linear_fcn(src, dst, n, &lin);
+    }
+};
+
+#endif // TONE_MAP_H_